@@ -0,0 +1,151 @@
+#include "lib/barcode.h"
+
+#include <cstring>
+#include "lib/kfsimd.h"
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define BC_X86 1
+#else
+#    define BC_X86 0
+#endif
+
+#define BC_VECTOR_MAX 64 // Longest barcode checked with vector compares; longer ones use the scalar test.
+
+namespace bmf {
+
+namespace {
+
+int homing_find_scalar(const char *seq, int seq_len, const char *homing, int homing_len, int start, int last)
+{
+    if(last > seq_len - homing_len) last = seq_len - homing_len;
+    for(int i(start); i <= last; ++i)
+        if(memcmp(seq + i, homing, homing_len) == 0)
+            return i;
+    return -1;
+}
+
+int hp_pass_scalar(const char *barcode, int len, int threshold)
+{
+    int run(0);
+    char last('\0');
+    for(int i(0); i < len; ++i) {
+        if(barcode[i] == 'N') return 0;
+        if(barcode[i] == last) {
+            if(++run == threshold) return 0;
+        } else last = barcode[i], run = 0;
+    }
+    return 1;
+}
+
+/*
+ * Given bit i set for each i where barcode[i] == barcode[i - 1] and bit i set for each N,
+ * fails the barcode as test_hp would: on any N, or a run of threshold matching neighbours.
+ */
+inline int hp_pass_masks(uint64_t repeats, uint64_t ns, int len, int threshold)
+{
+    const uint64_t valid(len == 64 ? ~(uint64_t)0: ((uint64_t)1 << len) - 1);
+    if(ns & valid) return 0;
+    if(!threshold) return 1;
+    repeats &= valid;
+    for(int i(1); i < threshold && repeats; ++i) repeats &= repeats >> 1;
+    return repeats == 0;
+}
+
+#if BC_X86
+
+__attribute__((target("sse4.1")))
+int homing_find_sse41(const char *seq, int seq_len, const char *homing, int homing_len, int start, int last)
+{
+    if(last > seq_len - homing_len) last = seq_len - homing_len;
+    int i(start);
+    // Bit k of hits is set while the homing sequence can still start at i + k.
+    for(; i <= last && i + homing_len + 15 <= seq_len; i += 16) {
+        uint32_t hits(0xFFFFu);
+        for(int j(0); j < homing_len && hits; ++j)
+            hits &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(seq + i + j)),
+                                                     _mm_set1_epi8(homing[j])));
+        if(last - i < 15) hits &= (2u << (last - i)) - 1;
+        if(hits) return i + __builtin_ctz(hits);
+    }
+    return homing_find_scalar(seq, seq_len, homing, homing_len, i, last);
+}
+
+__attribute__((target("sse4.1")))
+int hp_pass_sse41(const char *barcode, int len, int threshold)
+{
+    if(len > BC_VECTOR_MAX) return hp_pass_scalar(barcode, len, threshold);
+    // tmp[0] stands in for test_hp's initial '\0', which never matches a barcode character.
+    char tmp[BC_VECTOR_MAX + 16]{};
+    memcpy(tmp + 1, barcode, len);
+    uint64_t repeats(0), ns(0);
+    const __m128i n(_mm_set1_epi8('N'));
+    for(int i(0); i < len; i += 16) {
+        const __m128i prev(_mm_loadu_si128((const __m128i *)(tmp + i)));
+        const __m128i cur(_mm_loadu_si128((const __m128i *)(tmp + i + 1)));
+        repeats |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(prev, cur)) << i;
+        ns |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(cur, n)) << i;
+    }
+    return hp_pass_masks(repeats, ns, len, threshold);
+}
+
+__attribute__((target("avx2")))
+int homing_find_avx2(const char *seq, int seq_len, const char *homing, int homing_len, int start, int last)
+{
+    if(last > seq_len - homing_len) last = seq_len - homing_len;
+    int i(start);
+    for(; i <= last && i + homing_len + 31 <= seq_len; i += 32) {
+        uint32_t hits(0xFFFFFFFFu);
+        for(int j(0); j < homing_len && hits; ++j)
+            hits &= _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(seq + i + j)),
+                                                           _mm256_set1_epi8(homing[j])));
+        if(last - i < 31) hits &= (2u << (last - i)) - 1;
+        if(hits) return i + __builtin_ctz(hits);
+    }
+    return homing_find_scalar(seq, seq_len, homing, homing_len, i, last);
+}
+
+__attribute__((target("avx2")))
+int hp_pass_avx2(const char *barcode, int len, int threshold)
+{
+    if(len > BC_VECTOR_MAX) return hp_pass_scalar(barcode, len, threshold);
+    char tmp[BC_VECTOR_MAX + 32]{};
+    memcpy(tmp + 1, barcode, len);
+    uint64_t repeats(0), ns(0);
+    const __m256i n(_mm256_set1_epi8('N'));
+    for(int i(0); i < len; i += 32) {
+        const __m256i prev(_mm256_loadu_si256((const __m256i *)(tmp + i)));
+        const __m256i cur(_mm256_loadu_si256((const __m256i *)(tmp + i + 1)));
+        repeats |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(prev, cur)) << i;
+        ns |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, n)) << i;
+    }
+    return hp_pass_masks(repeats, ns, len, threshold);
+}
+
+#endif /* BC_X86 */
+
+} /* anonymous namespace */
+
+int homing_find(const char *seq, int seq_len, const char *homing, int homing_len, int start, int last)
+{
+    if(!homing_len) return start <= last ? start: -1;
+    switch(kf_get_simd()) {
+#if BC_X86
+        case KF_AVX2: return homing_find_avx2(seq, seq_len, homing, homing_len, start, last);
+        case KF_SSE41: return homing_find_sse41(seq, seq_len, homing, homing_len, start, last);
+#endif
+        default: return homing_find_scalar(seq, seq_len, homing, homing_len, start, last);
+    }
+}
+
+int barcode_hp_pass(const char *barcode, int len, int threshold)
+{
+    switch(kf_get_simd()) {
+#if BC_X86
+        case KF_AVX2: return hp_pass_avx2(barcode, len, threshold);
+        case KF_SSE41: return hp_pass_sse41(barcode, len, threshold);
+#endif
+        default: return hp_pass_scalar(barcode, len, threshold);
+    }
+}
+
+} /* namespace bmf */
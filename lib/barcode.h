@@ -0,0 +1,56 @@
+#ifndef BARCODE_H
+#define BARCODE_H
+#include <cstdint>
+#include "lib/binner.h"
+
+namespace bmf {
+
+/*
+ * Per-read barcode kernels for the split stage: the homing sequence search and the barcode checks.
+ * Like the column kernels in lib/kfsimd.h, they use the best instruction set the CPU supports,
+ * and follow kf_set_simd.
+ */
+
+/*
+ * @func homing_find
+ * Finds the first offset in [start, last] at which homing occurs in seq,
+ * comparing every candidate offset in one vector pass.
+ * :param: seq [const char *] Read sequence.
+ * :param: seq_len [int] Read length. The homing sequence must lie within the read.
+ * :param: homing [const char *] Homing sequence.
+ * :param: homing_len [int] Length of the homing sequence.
+ * :param: start [int] First offset to test.
+ * :param: last [int] Last offset to test.
+ * :returns: [int] Offset of the homing sequence, or -1 if it is not found.
+ */
+int homing_find(const char *seq, int seq_len, const char *homing, int homing_len, int start, int last);
+
+/*
+ * @func barcode_hp_pass
+ * test_hp for a barcode of known length: 0 if the barcode contains an N
+ * or more than threshold consecutive copies of one character, 1 otherwise.
+ * :param: barcode [const char *] Barcode. Need not be null-terminated, but must not contain a null.
+ * :param: len [int] Barcode length.
+ * :param: threshold [int] Homopolymer threshold. 0 disables the homopolymer test.
+ */
+int barcode_hp_pass(const char *barcode, int len, int threshold);
+
+/*
+ * @func barcode_scan
+ * Checks a barcode and bins it to its shard.
+ * :param: barcode [const char *] Barcode, as for barcode_hp_pass.
+ * :param: len [int] Barcode length.
+ * :param: threshold [int] Homopolymer threshold.
+ * :param: n_nucs [int] Number of leading nucleotides used for the bin.
+ * :param: bin [uint64_t *] Set to get_binner(barcode, n_nucs).
+ * :returns: [int] barcode_hp_pass(barcode, len, threshold).
+ */
+static inline int barcode_scan(const char *barcode, int len, int threshold, int n_nucs, uint64_t *bin)
+{
+    *bin = get_binner_type(const_cast<char *>(barcode), n_nucs, uint64_t);
+    return barcode_hp_pass(barcode, len, threshold);
+}
+
+} /* namespace bmf */
+
+#endif /* BARCODE_H */
@@ -0,0 +1,60 @@
+#include "lib/bgzfwriter.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+static hts_tpool *write_pool(nullptr);
+static int write_pool_qsize(0);
+
+void set_write_threads(int n_threads)
+{
+    destroy_write_pool();
+    if(n_threads <= 1) return;
+    if((write_pool = hts_tpool_init(n_threads)) == nullptr)
+        LOG_EXIT("Could not start %i compression threads. Abort!\n", n_threads);
+    write_pool_qsize = n_threads * 2;
+}
+
+void destroy_write_pool()
+{
+    if(write_pool) hts_tpool_destroy(write_pool), write_pool = nullptr;
+}
+
+int zmode_level(const char *mode)
+{
+    if(strchr(mode, 'T')) return -1;
+    for(; *mode; ++mode) if(*mode >= '0' && *mode <= '9') return *mode - '0';
+    return 6; // zlib's default level.
+}
+
+BgzfWriter::BgzfWriter(const char *path, int level, int pooled):
+    fp(nullptr),
+    ks{0, 0, nullptr}
+{
+    char mode[4] = "wu";
+    if(level >= 0) sprintf(mode, "w%i", level > 9 ? 9: level);
+    if((fp = bgzf_open(path, mode)) == nullptr)
+        LOG_EXIT("Could not open %s for writing. Abort!\n", path);
+    if(pooled && level >= 0 && write_pool && bgzf_thread_pool(fp, write_pool, write_pool_qsize))
+        LOG_WARNING("Could not attach compression threads to %s. Compressing on the calling thread.\n", path);
+}
+
+void BgzfWriter::write_direct(const char *s, size_t l)
+{
+    if(bgzf_write(fp, s, l) != (ssize_t)l) LOG_EXIT("Failed to write %lu bytes. Abort!\n", l);
+}
+
+void BgzfWriter::close()
+{
+    if(!fp) return;
+    flush();
+    if(bgzf_close(fp)) LOG_EXIT("Failed to close output. Abort!\n");
+    fp = nullptr;
+    free(ks.s);
+    ks = kstring_t{0, 0, nullptr};
+}
+
+} /* namespace bmf */
@@ -0,0 +1,77 @@
+#ifndef BGZFWRITER_H
+#define BGZFWRITER_H
+#include <cstring>
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+#include "htslib/thread_pool.h"
+
+#define BGZF_WRITER_BUFSIZE (1 << 16) // Records are buffered until one BGZF block's worth is ready.
+
+namespace bmf {
+
+/*
+ * @func set_write_threads
+ * Starts a pool of n_threads compression workers shared by every pooled BgzfWriter opened afterwards.
+ * Until this is called (or with n_threads <= 1), writers compress on the calling thread.
+ * htslib's BGZF uses libdeflate for these blocks when htslib was configured with it.
+ */
+void set_write_threads(int n_threads);
+
+/*
+ * @func destroy_write_pool
+ * Stops the shared compression pool. All writers using it must be closed first.
+ */
+void destroy_write_pool();
+
+/*
+ * @func zmode_level
+ * :param: mode [const char *] zlib mode string, e.g., "wT" or "wb6".
+ * :returns: [int] The equivalent BgzfWriter level: -1 for transparent (uncompressed) output.
+ */
+int zmode_level(const char *mode);
+
+/*
+ * Buffered fastq output. Records are formatted into a per-writer kstring, and each 64 KiB
+ * is handed to htslib's BGZF, whose blocks are compressed by the shared write pool for pooled writers.
+ * Each pooled writer also gets its own htslib I/O thread, so only the few long-lived outputs are pooled,
+ * not the hundreds of temporary shards a splitter holds open.
+ * BGZF output is valid multi-member gzip, so anything that reads gzip reads it,
+ * and shards concatenate with fq_cat without recompression.
+ * A writer must only be used from one thread at a time.
+ */
+class BgzfWriter {
+    BGZF *fp;
+    kstring_t ks;
+public:
+    /*
+     * :param: path [const char *] Output path, or "-" for stdout.
+     * :param: level [int] Compression level, or -1 for uncompressed text.
+     * :param: pooled [int] Compress on the shared write pool, if one is running.
+     */
+    BgzfWriter(const char *path, int level, int pooled=0);
+    BgzfWriter(const BgzfWriter &other) = delete;
+    ~BgzfWriter() {close();}
+    /*
+     * @func buf
+     * :returns: [kstring_t *] Buffer to append records to. Call check() afterwards.
+     */
+    kstring_t *buf() {return &ks;}
+    void check() {if(ks.l >= BGZF_WRITER_BUFSIZE) flush();}
+    void write(const char *s, size_t l) {
+        if(l >= BGZF_WRITER_BUFSIZE) {
+            flush();
+            write_direct(s, l);
+        } else kputsn(s, l, &ks), check();
+    }
+    void puts(const char *s) {write(s, strlen(s));}
+    void flush() {
+        if(ks.l) write_direct(ks.s, ks.l);
+        ks.l = 0;
+    }
+    void write_direct(const char *s, size_t l);
+    void close();
+};
+
+} /* namespace bmf */
+
+#endif /* BGZFWRITER_H */
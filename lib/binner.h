@@ -1,7 +1,9 @@
 #ifndef BINNER_H
 #define BINNER_H
+#include <cstddef>
 #include <cstdint>
 #include "dlib/compiler_util.h"
+#include "dlib/cstr_util.h"
 #include "dlib/math_util.h"
 
 namespace bmf {
@@ -17,8 +19,7 @@ namespace bmf {
 #define DECLARE_BINNER(type_t) \
     CONST static inline type_t get_binner_##type_t(char *barcode, size_t length) {\
         type_t bin(0);\
-        barcode += length;\
-        while(length--) bin += dlib::ipow(4, length) * nuc2num_acgt(*--barcode);\
+        for(size_t i(0); i < length; ++i) bin |= (type_t)nuc2num_acgt(barcode[i]) << (i << 1);\
         return bin;\
     }
 
@@ -0,0 +1,229 @@
+#include "lib/famtable.h"
+
+#include <algorithm>
+
+namespace bmf {
+
+kingfisher_t *kf_init(void *mem, int readlen)
+{
+    const size_t r5(readlen * 5);
+    // Layout: struct, phred_sums, nuc_counts, max_phreds. Largest alignment first.
+    const size_t struct_size((sizeof(kingfisher_t) + 7) & ~(size_t)7);
+    char *data((char *)mem);
+    kingfisher_t *ret((kingfisher_t *)data);
+    data += struct_size;
+    ret->phred_sums = (uint32_t *)data;
+    memset(data, 0, r5 * (sizeof(uint32_t) + sizeof(uint16_t)));
+    data += r5 * sizeof(uint32_t);
+    ret->nuc_counts = (uint16_t *)data;
+    data += r5 * sizeof(uint16_t);
+    ret->max_phreds = data;
+    memset(ret->max_phreds, '#', r5);
+    ret->length = 0;
+    ret->readlen = readlen;
+    ret->barcode[0] = '\0';
+    ret->pass_fail = '1';
+    return ret;
+}
+
+kingfisher_t *KfArena::new_kf(int readlen)
+{
+    return kf_init(alloc(kf_size(readlen)), readlen);
+}
+
+singleton_t *KfArena::new_singleton(const char *seq, const char *qual, int l, char pass_fail,
+                                    const char *barcode, int blen)
+{
+    singleton_t *ret((singleton_t *)alloc(sizeof(singleton_t) + 2 * l + blen));
+    ret->data = (char *)(ret + 1);
+    memcpy(ret->data, seq, l);
+    memcpy(ret->data + l, qual, l);
+    memcpy(ret->data + 2 * l, barcode, blen);
+    ret->l = l;
+    ret->blen = blen;
+    ret->pass_fail = pass_fail;
+    return ret;
+}
+
+FamilyTable::FamilyTable(int readlen, size_t initial_size): readlen(readlen)
+{
+    size_t size(8);
+    while(size < initial_size) size <<= 1;
+    slots.resize(size, slot_t{0, 0});
+    mask = size - 1;
+    entries.reserve(size >> 1);
+}
+
+void FamilyTable::grow()
+{
+    const size_t new_size(slots.size() << 1);
+    std::vector<slot_t> new_slots(new_size, slot_t{0, 0});
+    const uint64_t new_mask(new_size - 1);
+    for(const slot_t &slot: slots) {
+        if(!slot.idx) continue;
+        uint64_t pos(bc_hash(entries[slot.idx - 1].key) & new_mask);
+        while(new_slots[pos].idx) pos = (pos + 1) & new_mask;
+        new_slots[pos] = slot;
+    }
+    slots.swap(new_slots);
+    mask = new_mask;
+}
+
+family_entry_t *FamilyTable::find(const bc_key_t &key)
+{
+    const uint64_t hash(bc_hash(key));
+    const uint32_t tag(hash >> 32);
+    for(uint64_t pos(hash & mask);; pos = (pos + 1) & mask) {
+        const slot_t &slot(slots[pos]);
+        if(!slot.idx) return nullptr;
+        if(slot.tag == tag && bc_key_eq(entries[slot.idx - 1].key, key))
+            return &entries[slot.idx - 1];
+    }
+}
+
+family_t &FamilyTable::family(const bc_key_t &key, int is_rev)
+{
+    // Keep load factor <= 0.7
+    if(UNLIKELY((entries.size() + 1) * 10 > slots.size() * 7)) grow();
+    const uint64_t hash(bc_hash(key));
+    const uint32_t tag(hash >> 32);
+    uint64_t pos(hash & mask);
+    family_entry_t *entry(nullptr);
+    for(;; pos = (pos + 1) & mask) {
+        slot_t &slot(slots[pos]);
+        if(!slot.idx) {
+            entries.push_back(family_entry_t{key, family_t{nullptr, nullptr}, family_t{nullptr, nullptr}});
+            slot.idx = entries.size();
+            slot.tag = tag;
+            entry = &entries.back();
+            break;
+        }
+        if(slot.tag == tag && bc_key_eq(entries[slot.idx - 1].key, key)) {
+            entry = &entries[slot.idx - 1];
+            break;
+        }
+    }
+    family_t &ret(is_rev ? entry->rev: entry->fwd);
+    // Callers add a read to every family they look up, so an empty family is a new one.
+    if(!ret) (is_rev ? rev_order: fwd_order).push_back(entry - entries.data());
+    return ret;
+}
+
+kingfisher_t *FamilyTable::promote(family_t &fam)
+{
+    if(!fam.kf) {
+        if(fam.one) {
+            const singleton_t *const one(fam.one);
+            fam.kf = arena.new_kf(family_readlen(fam));
+            pushback_raw(fam.kf, one->data, one->data + one->l, one->l, one->pass_fail,
+                         one->data + 2 * one->l, one->blen);
+            fam.one = nullptr; // Its bytes stay in the arena until the table is destroyed.
+        } else fam.kf = arena.new_kf(readlen);
+    }
+    return fam.kf;
+}
+
+kingfisher_t *FamilyTable::expand(const family_t &fam, int which)
+{
+    if(fam.kf) return fam.kf;
+    const singleton_t *const one(fam.one);
+    const int rl(family_readlen(fam));
+    std::vector<uint64_t> &buf(scratch[which]);
+    buf.resize((kf_size(rl) + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    kingfisher_t *const ret(kf_init(buf.data(), rl));
+    pushback_raw(ret, one->data, one->data + one->l, one->l, one->pass_fail, one->data + 2 * one->l, one->blen);
+    return ret;
+}
+
+/*
+ * Moves src's reads into dst and empties src.
+ */
+void FamilyTable::merge(family_t &dst, family_t &src)
+{
+    if(src.one) {
+        const singleton_t *const one(src.one);
+        add(dst, one->data, one->data + one->l, one->l, one->pass_fail, one->data + 2 * one->l, one->blen);
+    } else kf_merge(promote(dst), src.kf);
+    src = family_t{nullptr, nullptr};
+}
+
+uint64_t FamilyTable::merge_neighbors()
+{
+    uint64_t n_merged(0);
+    std::vector<int> counts;
+    std::vector<uint32_t> order;
+    for(int is_rev(0); is_rev < 2; ++is_rev) {
+        const std::vector<uint32_t> &created(is_rev ? rev_order: fwd_order);
+        // Sizes before any merging, so that the result does not depend on visiting order within a size.
+        counts.assign(entries.size(), 0);
+        for(const uint32_t idx: created) {
+            const family_t &fam(is_rev ? entries[idx].rev: entries[idx].fwd);
+            if(fam.pass_fail() == '1' && !entries[idx].key.nmask) counts[idx] = fam.length();
+        }
+        order = created;
+        std::stable_sort(order.begin(), order.end(), [&counts](uint32_t a, uint32_t b) {
+            return counts[a] < counts[b];
+        });
+        for(const uint32_t idx: order) {
+            const int n(counts[idx]);
+            if(!n) continue;
+            const int threshold(std::max(n + 1, 2 * n - 1));
+            const bc_key_t key(entries[idx].key);
+            family_t &src(is_rev ? entries[idx].rev: entries[idx].fwd);
+            const int readlen(family_readlen(src));
+            // The largest neighbor of the same read length with at least threshold reads, lowest index on ties.
+            uint32_t best(UINT32_MAX);
+            int best_n(0);
+            for(uint32_t shift(0); shift < key.len * 2; shift += 2) {
+                for(uint64_t sub(1); sub < 4; ++sub) {
+                    const family_entry_t *const neighbor(find(bc_key_t{key.packed ^ (sub << shift), 0, key.len}));
+                    if(!neighbor) continue;
+                    const uint32_t nidx(neighbor - entries.data());
+                    if(counts[nidx] < threshold) continue;
+                    if(!(counts[nidx] > best_n || (counts[nidx] == best_n && nidx < best))) continue;
+                    if(family_readlen(is_rev ? neighbor->rev: neighbor->fwd) != readlen) continue;
+                    best = nidx, best_n = counts[nidx];
+                }
+            }
+            if(best == UINT32_MAX) continue;
+            merge(is_rev ? entries[best].rev: entries[best].fwd, src);
+            ++n_merged;
+        }
+    }
+    return n_merged;
+}
+
+static int merging_enabled(0);
+
+void set_neighbor_merging(int enabled) {merging_enabled = enabled;}
+int neighbor_merging() {return merging_enabled;}
+
+template<typename Flush>
+static void write_families(FamilyTable &table, kstring_t *ks, tmpbuffers_t *bufs, const Flush &flush)
+{
+    for(const uint32_t idx: table.forward_order()) {
+        const family_entry_t &entry(table.entry(idx));
+        if(!entry.fwd) continue; // Merged into a neighbor.
+        if(entry.rev) table.write_duplex(entry, ks, bufs);
+        else table.write(entry.fwd, ks, bufs, 0);
+        flush();
+    }
+    for(const uint32_t idx: table.reverse_order()) {
+        const family_entry_t &entry(table.entry(idx));
+        if(entry.fwd || !entry.rev) continue;
+        table.write(entry.rev, ks, bufs, 1);
+        flush();
+    }
+}
+
+void write_stranded_families(FamilyTable &table, kstring_t *ks, tmpbuffers_t *bufs)
+{
+    write_families(table, ks, bufs, []() {});
+}
+
+void write_stranded_families(FamilyTable &table, BgzfWriter *handle, tmpbuffers_t *bufs)
+{
+    write_families(table, handle->buf(), bufs, [handle]() {handle->check();});
+}
+
+} /* namespace bmf */
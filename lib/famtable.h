@@ -0,0 +1,282 @@
+#ifndef FAMTABLE_H
+#define FAMTABLE_H
+#include <cstdint>
+#include <vector>
+#include "lib/bgzfwriter.h"
+#include "lib/kingfisher.h"
+
+namespace bmf {
+
+/*
+ * Fixed-width key for a molecular barcode.
+ * Each nucleotide occupies 2 bits of packed, first base in the most significant position.
+ * Non-ACGT characters are encoded as 'A' in packed and flagged in nmask,
+ * so that a barcode with an N never collides with its all-ACGT neighbor.
+ */
+struct bc_key_t {
+    uint64_t packed;
+    uint32_t nmask;
+    uint32_t len;
+};
+
+#define MAX_PACKED_BARCODE_LENGTH 32
+
+CONST static inline bool bc_key_eq(const bc_key_t &a, const bc_key_t &b)
+{
+    return a.packed == b.packed && a.nmask == b.nmask && a.len == b.len;
+}
+
+/*
+ * @func bc_pack
+ * Packs a barcode terminated by '|' or '\0' into a bc_key_t.
+ * :param: bc [const char *] Barcode string, *without* the leading F/R/Z strand character.
+ * :param: key [bc_key_t *] Key to fill.
+ * :returns: [int] 0 on success, -1 if the barcode is too long to pack.
+ */
+static inline int bc_pack(const char *bc, bc_key_t *key)
+{
+    uint64_t packed(0);
+    uint32_t nmask(0), len(0);
+    for(;;++bc, ++len) {
+        switch(*bc) {
+            case 'A': packed <<= 2; break;
+            case 'C': packed = (packed << 2) | 1; break;
+            case 'G': packed = (packed << 2) | 2; break;
+            case 'T': packed = (packed << 2) | 3; break;
+            case '|': case '\0':
+                key->packed = packed, key->nmask = nmask, key->len = len;
+                return 0;
+            default: packed <<= 2; nmask |= 1u << (len & 31); break;
+        }
+        if(UNLIKELY(len == MAX_PACKED_BARCODE_LENGTH)) return -1;
+    }
+}
+
+CONST static inline uint64_t bc_hash(const bc_key_t &key)
+{
+    // Murmur3 finalizer over the packed word, salted by the N mask and length.
+    uint64_t h(key.packed ^ ((uint64_t)key.nmask << 32 | key.len) * 0x9E3779B97F4A7C15uLL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccduLL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53uLL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * Bump allocator for families.
+ * Every singleton's read, and every promoted family's struct, nuc_counts, phred_sums and max_phreds,
+ * are carved from large slabs and released all at once when the arena is destroyed.
+ */
+class KfArena {
+    std::vector<char *> slabs;
+    char *cur;
+    size_t left;
+    size_t slab_size;
+    size_t used_bytes;
+public:
+    KfArena(size_t slab_size=(1uL << 22)): cur(nullptr), left(0), slab_size(slab_size), used_bytes(0) {}
+    ~KfArena() {
+        for(auto slab: slabs) free(slab);
+    }
+    KfArena(const KfArena &) = delete;
+    KfArena &operator=(const KfArena &) = delete;
+    void *alloc(size_t size) {
+        size = (size + 7) & ~(size_t)7;
+        if(UNLIKELY(size > left)) {
+            const size_t to_alloc(size > slab_size ? size: slab_size);
+            if((cur = (char *)malloc(to_alloc)) == nullptr)
+                LOG_EXIT("Could not allocate %lu bytes for family arena. Abort!\n", to_alloc);
+            slabs.push_back(cur);
+            left = to_alloc;
+        }
+        void *ret(cur);
+        cur += size, left -= size, used_bytes += size;
+        return ret;
+    }
+    kingfisher_t *new_kf(int readlen);
+    singleton_t *new_singleton(const char *seq, const char *qual, int l, char pass_fail,
+                               const char *barcode, int blen);
+    size_t bytes() const {return used_bytes;}
+};
+
+/*
+ * @func kf_size
+ * :returns: [size_t] Bytes needed for a kingfisher_t and its accumulators for reads of length readlen.
+ */
+CONST static inline size_t kf_size(int readlen)
+{
+    return ((sizeof(kingfisher_t) + 7) & ~(size_t)7) +
+           (size_t)readlen * 5 * (sizeof(uint32_t) + sizeof(uint16_t) + sizeof(char));
+}
+
+/*
+ * @func kf_init
+ * Lays out and zeroes an empty family in data, which must hold kf_size(readlen) bytes.
+ */
+kingfisher_t *kf_init(void *data, int readlen);
+
+/*
+ * One strand of a family: a singleton until its second read arrives, when it is promoted to a kingfisher_t.
+ * At most one of kf and one is set.
+ */
+struct family_t {
+    kingfisher_t *kf;
+    singleton_t *one;
+    explicit operator bool() const {return kf || one;}
+    int length() const {return kf ? kf->length: one != nullptr;}
+    char pass_fail() const {return kf ? kf->pass_fail: one->pass_fail;}
+};
+
+/*
+ * Forward and reverse families for a single barcode, kept side by side
+ * so that duplex pairing needs no second lookup.
+ */
+struct family_entry_t {
+    bc_key_t key;
+    family_t fwd;
+    family_t rev;
+};
+
+/*
+ * Open-addressing (linear probing) hash table from packed barcodes to families.
+ * Slots hold entry indices and a hash tag, so probing rarely touches the entries themselves.
+ * Entries are stored densely, and the order in which each strand's families were created
+ * is recorded so that output order matches first-observation order.
+ * A family's first read is only copied into the arena. Accumulators are allocated when a second read arrives,
+ * and singletons are written directly from the read with singleton_process_write.
+ */
+class FamilyTable {
+    struct slot_t {
+        uint32_t idx; // 1-based index into entries. 0 for empty.
+        uint32_t tag; // High bits of the hash.
+    };
+    std::vector<slot_t> slots;
+    std::vector<family_entry_t> entries;
+    std::vector<uint32_t> fwd_order;
+    std::vector<uint32_t> rev_order;
+    KfArena arena;
+    std::vector<uint64_t> scratch[2]; // Duplex singletons are expanded here to be written.
+    uint64_t mask;
+    int readlen; // 0 to take each family's read length from its first read.
+    void grow();
+    int family_readlen(const family_t &fam) const {return readlen ? readlen: fam.kf ? fam.kf->readlen: fam.one->l;}
+    void merge(family_t &dst, family_t &src);
+public:
+    FamilyTable(int readlen, size_t initial_size=1 << 12);
+    /*
+     * @func find
+     * :returns: [family_entry_t *] entry for key or nullptr if absent.
+     * The pointer is invalidated by subsequent insertions.
+     */
+    family_entry_t *find(const bc_key_t &key);
+    /*
+     * @func family
+     * :param: is_rev [int] Whether to return the reverse-strand family.
+     * :returns: [family_t &] the family for this barcode and strand, created empty if absent.
+     * The reference is invalidated by subsequent insertions.
+     */
+    family_t &family(const bc_key_t &key, int is_rev);
+    /*
+     * @func add
+     * Adds a read to fam, as pushback_raw would.
+     * :param: barcode [const char *] Strand character followed by the barcode.
+     * :param: blen [int] Length of barcode, including the strand character.
+     */
+    void add(family_t &fam, const char *seq, const char *qual, int l, char pass_fail,
+             const char *barcode, int blen) {
+        if(fam.kf) pushback_raw(fam.kf, seq, qual, l, pass_fail, barcode, blen);
+        else if(!fam.one) fam.one = arena.new_singleton(seq, qual, l, pass_fail, barcode, blen);
+        else pushback_raw(promote(fam), seq, qual, l, pass_fail, barcode, blen);
+    }
+    void add(const bc_key_t &key, int is_rev, const char *seq, const char *qual, int l, char pass_fail,
+             const char *barcode, int blen) {
+        add(family(key, is_rev), seq, qual, l, pass_fail, barcode, blen);
+    }
+    /*
+     * @func promote
+     * :returns: [kingfisher_t *] fam's accumulator, allocated (and filled from its singleton) if needed.
+     */
+    kingfisher_t *promote(family_t &fam);
+    /*
+     * @func create
+     * Gives an empty family an accumulator of its own read length, for the caller to fill.
+     * :returns: [kingfisher_t *] the new accumulator.
+     */
+    kingfisher_t *create(family_t &fam, int family_readlen) {return fam.kf = arena.new_kf(family_readlen);}
+    /*
+     * @func get
+     * :returns: [kingfisher_t *] the accumulator for this barcode and strand, created if absent.
+     */
+    kingfisher_t *get(const bc_key_t &key, int is_rev) {return promote(family(key, is_rev));}
+    /*
+     * @func expand
+     * :param: which [int] Scratch space to use (0 or 1), for a singleton.
+     * :returns: [kingfisher_t *] fam's accumulator, or, for a singleton, a temporary one
+     * valid until the next call with the same which.
+     */
+    kingfisher_t *expand(const family_t &fam, int which);
+    /*
+     * @func write
+     * Writes the consensus for one strand's family, as dmp_process_write.
+     */
+    void write(const family_t &fam, kstring_t *ks, tmpbuffers_t *bufs, int is_rev) {
+        if(fam.kf) dmp_process_write(fam.kf, ks, bufs, is_rev);
+        else singleton_process_write(fam.one, family_readlen(fam), ks, bufs, is_rev);
+    }
+    /*
+     * @func write_duplex
+     * Writes the combined consensus for a barcode observed on both strands, as zstranded_process_write.
+     */
+    void write_duplex(const family_entry_t &entry, kstring_t *ks, tmpbuffers_t *bufs) {
+        zstranded_process_write(expand(entry.fwd, 0), expand(entry.rev, 1), ks, bufs);
+    }
+    /*
+     * @func merge_neighbors
+     * Directional-adjacency barcode error correction, applied to each strand separately.
+     * Each family is folded into the largest family whose barcode differs from it by one substitution
+     * and which held at least max(n + 1, 2n - 1) reads before merging, where n is its own size.
+     * Families are visited smallest first, so chains of errors collapse into their root.
+     * Neighbors are found by probing the table with each of the 3 * blen substituted packed keys.
+     * Barcodes with Ns, QC-failed families and families of differing read lengths are left alone.
+     * Emptied families are skipped when writing, and the survivor keeps its own barcode.
+     * Decisions depend only on barcodes, strands, sizes and pass/fail, which both mates of a pair share,
+     * so the read 1 and read 2 shards of a pair merge identically and stay in step.
+     * :returns: [uint64_t] Number of families merged away.
+     */
+    uint64_t merge_neighbors();
+    size_t size() const {return entries.size();}
+    size_t bytes() const {
+        return arena.bytes() + slots.capacity() * sizeof(slot_t) + entries.capacity() * sizeof(family_entry_t) +
+               (fwd_order.capacity() + rev_order.capacity()) * sizeof(uint32_t);
+    }
+    family_entry_t &entry(uint32_t idx) {return entries[idx];}
+    const std::vector<uint32_t> &forward_order() const {return fwd_order;}
+    const std::vector<uint32_t> &reverse_order() const {return rev_order;}
+};
+
+/*
+ * @func set_neighbor_merging
+ * Sets whether the collapse cores call FamilyTable::merge_neighbors on each shard before writing.
+ * Off by default.
+ */
+void set_neighbor_merging(int enabled);
+int neighbor_merging();
+
+/*
+ * @func write_stranded_families
+ * Writes the consensus of every family in table to ks, pairing forward and reverse
+ * families into duplex observations. Forward-strand families are written first,
+ * followed by reverse-only families, each in order of first observation.
+ */
+void write_stranded_families(FamilyTable &table, kstring_t *ks, tmpbuffers_t *bufs);
+/*
+ * @func write_stranded_families
+ * As above, but writing to handle, flushing as its buffer fills.
+ */
+void write_stranded_families(FamilyTable &table, BgzfWriter *handle, tmpbuffers_t *bufs);
+
+} /* namespace bmf */
+
+#endif /* FAMTABLE_H */
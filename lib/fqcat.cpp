@@ -0,0 +1,211 @@
+#include "lib/fqcat.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#    include <sys/sendfile.h>
+#    if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#        define FQCAT_COPY_FILE_RANGE 1
+#    endif
+#endif
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+static const char BGZF_EOF[] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+static const size_t BGZF_EOF_LEN = sizeof(BGZF_EOF) - 1;
+
+static int ends_with_bgzf_eof(int fd, off_t size)
+{
+    char tail[BGZF_EOF_LEN];
+    return size >= (off_t)BGZF_EOF_LEN &&
+           pread(fd, tail, BGZF_EOF_LEN, size - BGZF_EOF_LEN) == (ssize_t)BGZF_EOF_LEN &&
+           memcmp(tail, BGZF_EOF, BGZF_EOF_LEN) == 0;
+}
+
+/*
+ * Copies len bytes from in's file offset to out's, trying the in-kernel copies first.
+ * Each falls through to the next if unsupported (e.g., EXDEV, ENOSYS or EINVAL),
+ * continuing from wherever the previous one stopped.
+ */
+static int copy_range(int in, int out, off_t len, char *buf)
+{
+    ssize_t n;
+#if FQCAT_COPY_FILE_RANGE
+    while(len > 0 && (n = copy_file_range(in, nullptr, out, nullptr, len, 0)) > 0) len -= n;
+#endif
+#ifdef __linux__
+    while(len > 0 && (n = sendfile(out, in, nullptr, len)) > 0) len -= n;
+#endif
+    while(len > 0) {
+        if((n = read(in, buf, len < FQCAT_BUFSIZE ? len: FQCAT_BUFSIZE)) <= 0) {
+            if(n < 0 && errno == EINTR) continue;
+            if(!n) errno = EIO; // Input shrank underneath us.
+            return -1;
+        }
+        len -= n;
+        for(ssize_t written(0), w; written < n; written += w)
+            if((w = write(out, buf + written, n - written)) < 0) {
+                if(errno != EINTR) return -1;
+                w = 0;
+            }
+    }
+    return 0;
+}
+
+int fq_cat(const char *out_path, char *const *in_paths, int n)
+{
+    const int out(open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    if(out < 0) return -1;
+    void *buf;
+    if(posix_memalign(&buf, 4096, FQCAT_BUFSIZE)) {
+        close(out);
+        return -1;
+    }
+    int ret(0);
+    struct stat st;
+    for(int i(0); i < n && !ret; ++i) {
+        const int in(open(in_paths[i], O_RDONLY));
+        if(in < 0) {
+            ret = -1;
+            break;
+        }
+        if(fstat(in, &st)) ret = -1;
+        else {
+            off_t len(st.st_size);
+            if(i + 1 < n && ends_with_bgzf_eof(in, len)) len -= BGZF_EOF_LEN;
+            ret = copy_range(in, out, len, (char *)buf);
+        }
+        close(in);
+    }
+    free(buf);
+    if(close(out)) ret = -1;
+    return ret;
+}
+
+FqRecordReader::FqRecordReader(const char *path):
+    fp(gzopen(path, "r")),
+    buf((char *)malloc(FQCAT_BUFSIZE)),
+    size(FQCAT_BUFSIZE),
+    start(0),
+    end(0),
+    eof(0)
+{
+    if(!fp) LOG_EXIT("Could not open %s for reading. Abort!\n", path);
+    gzbuffer(fp, 1 << 17);
+}
+
+FqRecordReader::~FqRecordReader()
+{
+    gzclose(fp);
+    free(buf);
+}
+
+int FqRecordReader::next(const char **rec, size_t *len)
+{
+    const char *p(buf + start), *const stop(buf + end);
+    for(int line(0); line < 4; ++line) {
+        if((p = (const char *)memchr(p, '\n', stop - p)) == nullptr) {
+            if(!eof) return -1;
+            if(start != end) LOG_EXIT("Truncated fastq record at end of input. Abort!\n");
+            return 0;
+        }
+        ++p;
+    }
+    *rec = buf + start;
+    *len = p - *rec;
+    start = p - buf;
+    return 1;
+}
+
+void FqRecordReader::fill()
+{
+    if(start) {
+        memmove(buf, buf + start, end - start);
+        end -= start;
+        start = 0;
+    }
+    if(end == size) buf = (char *)realloc(buf, size <<= 1); // A single record larger than the buffer.
+    const int n(gzread(fp, buf + end, size - end));
+    if(n < 0) LOG_EXIT("Failed reading gzipped input. Abort!\n");
+    if(n == 0) eof = 1;
+    end += n;
+}
+
+namespace {
+
+class IovWriter {
+    int fd;
+    int n;
+    struct iovec iov[512];
+public:
+    IovWriter(int fd): fd(fd), n(0) {}
+    ~IovWriter() {flush();}
+    void flush() {
+        struct iovec *v(iov);
+        while(n) {
+            ssize_t w(writev(fd, v, n));
+            if(w < 0) {
+                if(errno == EINTR) continue;
+                LOG_EXIT("Failed to write output: %s. Abort!\n", strerror(errno));
+            }
+            for(; n && (size_t)w >= v->iov_len; --n, ++v) w -= v->iov_len;
+            if(n) v->iov_base = (char *)v->iov_base + w, v->iov_len -= w;
+        }
+    }
+    void add(const char *rec, size_t len) {
+        if(n == (int)(sizeof(iov) / sizeof(*iov))) flush();
+        iov[n].iov_base = (void *)rec;
+        iov[n++].iov_len = len;
+    }
+};
+
+/*
+ * Gets the next record, flushing queued views before a refill can invalidate them.
+ */
+int next_record(FqRecordReader &reader, IovWriter &writer, const char **rec, size_t *len)
+{
+    int ret;
+    while((ret = reader.next(rec, len)) < 0) {
+        writer.flush();
+        reader.fill();
+    }
+    return ret;
+}
+
+} /* anonymous namespace */
+
+void fq_interleave(FILE *fp, char *const *r1_paths, char *const *r2_paths, int n)
+{
+    fflush(fp);
+    IovWriter writer(fileno(fp));
+    const char *rec;
+    size_t len;
+    for(int i(0); i < n; ++i) {
+        FqRecordReader r1(r1_paths[i]);
+        if(!r2_paths) {
+            while(next_record(r1, writer, &rec, &len)) writer.add(rec, len);
+            writer.flush();
+            continue;
+        }
+        FqRecordReader r2(r2_paths[i]);
+        for(;;) {
+            const int ret1(next_record(r1, writer, &rec, &len));
+            if(ret1) writer.add(rec, len);
+            const int ret2(next_record(r2, writer, &rec, &len));
+            if(ret1 != ret2)
+                LOG_EXIT("Read 1 and read 2 shards have different numbers of records ('%s', '%s'). Abort!\n",
+                         r1_paths[i], r2_paths[i]);
+            if(!ret2) break;
+            writer.add(rec, len);
+        }
+        writer.flush(); // The readers' buffers go away with them.
+    }
+}
+
+} /* namespace bmf */
@@ -0,0 +1,65 @@
+#ifndef FQCAT_H
+#define FQCAT_H
+#include <cstdio>
+#include <zlib.h>
+
+#define FQCAT_BUFSIZE (1 << 20)
+
+namespace bmf {
+
+/*
+ * @func fq_cat
+ * Concatenates files in order into out_path, in-process, without decompressing them.
+ * Uses copy_file_range or sendfile where the kernel supports them, and aligned read/write otherwise.
+ * gzip members concatenate into a valid multi-member gzip file, so compressed shards are never recompressed.
+ * An input ending in the BGZF EOF marker has that marker dropped unless it is the last input,
+ * so that BGZF inputs concatenate into a valid BGZF file.
+ * :param: out_path [const char *] Output path. Truncated if it exists.
+ * :param: in_paths [char *const *] Paths to concatenate.
+ * :param: n [int] Number of paths.
+ * :returns: [int] 0 on success, -1 on failure (with errno set).
+ */
+int fq_cat(const char *out_path, char *const *in_paths, int n);
+
+/*
+ * Streams whole fastq records out of a (possibly gzipped) file.
+ * Each record is returned as a view into the read buffer; nothing is parsed or copied per line.
+ * Views stay valid until the next call to fill().
+ */
+class FqRecordReader {
+    gzFile fp;
+    char *buf;
+    size_t size, start, end;
+    int eof;
+public:
+    FqRecordReader(const char *path);
+    ~FqRecordReader();
+    /*
+     * @func next
+     * :param: rec [const char **] Set to the start of the next record.
+     * :param: len [size_t *] Set to the record's length, including its final newline.
+     * :returns: [int] 1 if a record was returned, 0 at end of file,
+     * -1 if no complete record is buffered and fill() must be called.
+     */
+    int next(const char **rec, size_t *len);
+    /*
+     * @func fill
+     * Moves any partial record to the front of the buffer and reads more input, invalidating earlier views.
+     */
+    void fill();
+};
+
+/*
+ * @func fq_interleave
+ * Writes shards' records to fp in order, alternating read 1 and read 2 records within each shard.
+ * Records are handed to the kernel straight from the read buffers with writev.
+ * :param: fp [FILE *] Output handle.
+ * :param: r1_paths [char *const *] Read 1 shard paths.
+ * :param: r2_paths [char *const *] Read 2 shard paths. If nullptr, read 1 records are streamed alone.
+ * :param: n [int] Number of shards.
+ */
+void fq_interleave(FILE *fp, char *const *r1_paths, char *const *r2_paths, int n);
+
+} /* namespace bmf */
+
+#endif /* FQCAT_H */
@@ -0,0 +1,266 @@
+#include "lib/fqreader.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "dlib/compiler_util.h"
+#include "dlib/logging_util.h"
+
+#define BGZF_HEADER_SIZE 18 // Header of a block with only the BC extra subfield.
+#define BGZF_MAX_BLOCK_SIZE (1 << 16)
+#define FQ_QUEUE_DEPTH (1 << 4) // Chunks or batches in flight per queue.
+
+namespace bmf {
+
+namespace {
+
+inline uint16_t le16(const uint8_t *p) {return p[0] | p[1] << 8;}
+inline uint32_t le32(const uint8_t *p) {return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;}
+
+// Reads until l bytes are read or the input ends. Returns the number of bytes read.
+size_t read_full(int fd, void *buf, size_t l, const char *path)
+{
+    size_t ret(0);
+    while(ret < l) {
+        const ssize_t n(read(fd, (char *)buf + ret, l - ret));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            LOG_EXIT("Failed to read %s: %s. Abort!\n", path, strerror(errno));
+        }
+        if(n == 0) break;
+        ret += n;
+    }
+    return ret;
+}
+
+inline void wait_done(const fq_chunk_t *chunk)
+{
+    for(unsigned tries(0); !chunk->done.load(std::memory_order_acquire);)
+        if(++tries < 64) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+// Length of a line which may end with "\r\n".
+inline uint32_t line_len(const char *start, const char *nl)
+{
+    return nl - start - (nl > start && nl[-1] == '\r');
+}
+
+} /* anonymous namespace */
+
+uint32_t bgzf_block_size(const uint8_t *buf, size_t l)
+{
+    if(l < 12 || buf[0] != 31 || buf[1] != 139 || buf[2] != 8 || !(buf[3] & 4)) return 0;
+    const uint8_t *p(buf + 12), *const end(p + le16(buf + 10));
+    if(end > buf + l) return 0;
+    for(; p + 4 <= end; p += 4 + le16(p + 2))
+        if(p[0] == 'B' && p[1] == 'C' && le16(p + 2) == 2 && p + 6 <= end)
+            return le16(p + 4) + 1u;
+    return 0;
+}
+
+FqReader::FqReader(const char *path, int n_threads):
+    path(path),
+    chunks(FQ_QUEUE_DEPTH),
+    batches(FQ_QUEUE_DEPTH),
+    stop(0)
+{
+    const int fd(strcmp(path, "-") ? open(path, O_RDONLY): STDIN_FILENO);
+    if(fd < 0) LOG_EXIT("Could not open %s for reading: %s. Abort!\n", path, strerror(errno));
+    // Pipes can't be peeked at, so they are always read by zlib.
+    uint8_t header[BGZF_HEADER_SIZE];
+    const ssize_t l(pread(fd, header, sizeof(header), 0));
+    if(n_threads > 1 && l > 0 && bgzf_block_size(header, l)) {
+        LOG_DEBUG("Inflating BGZF input %s with %i threads.\n", path, n_threads);
+        for(int i(0); i < n_threads; ++i) jobs.push_back(new SpscQueue<fq_chunk_t *>(FQ_QUEUE_DEPTH));
+        for(auto queue: jobs) threads.emplace_back(&FqReader::inflate_chunks, this, queue);
+        threads.emplace_back(&FqReader::read_bgzf, this, fd);
+    } else threads.emplace_back(&FqReader::read_gz, this, fd);
+    threads.emplace_back(&FqReader::parse, this);
+}
+
+FqReader::~FqReader()
+{
+    // If the caller stopped early, tell the threads to stop and drain what they have already queued.
+    stop.store(1, std::memory_order_relaxed);
+    fq_batch_t *batch;
+    while(batches.pop(batch)) delete batch;
+    for(auto &thread: threads) thread.join();
+    for(auto queue: jobs) delete queue;
+}
+
+/*
+ * Splits the input into whole BGZF blocks without inflating them,
+ * handing each chunk of blocks to the next worker and to the parser.
+ */
+void FqReader::read_bgzf(int fd)
+{
+    fq_chunk_t *chunk(new fq_chunk_t);
+    uint64_t n_chunks(0), offset(0);
+    auto dispatch([&]() {
+        chunks.push(chunk);
+        jobs[n_chunks++ % jobs.size()]->push(chunk);
+    });
+    while(!stop.load(std::memory_order_relaxed)) {
+        kstring_t *in(&chunk->in);
+        ks_resize(in, in->l + BGZF_MAX_BLOCK_SIZE);
+        uint8_t *const block((uint8_t *)in->s + in->l);
+        size_t l(read_full(fd, block, 12, path));
+        if(!l) break;
+        const size_t xlen(l == 12 ? le16(block + 10): 0);
+        if(l < 12 || (l += read_full(fd, block + 12, xlen, path)) < 12 + xlen)
+            LOG_EXIT("Truncated BGZF block at offset %lu in %s. Abort!\n", offset, path);
+        const uint32_t bsize(bgzf_block_size(block, l));
+        if(!bsize) LOG_EXIT("Gzip member at offset %lu in %s is not a BGZF block. Abort!\n", offset, path);
+        if(bsize < l + 8 || read_full(fd, block + l, bsize - l, path) != bsize - l)
+            LOG_EXIT("Truncated BGZF block at offset %lu in %s. Abort!\n", offset, path);
+        in->l += bsize, offset += bsize;
+        if(in->l >= FQ_CHUNK_BYTES) dispatch(), chunk = new fq_chunk_t;
+    }
+    if(chunk->in.l) dispatch();
+    else delete chunk;
+    for(auto queue: jobs) queue->close();
+    chunks.close();
+    if(fd != STDIN_FILENO) close(fd);
+}
+
+void FqReader::inflate_chunks(SpscQueue<fq_chunk_t *> *queue)
+{
+    z_stream zs{};
+    if(inflateInit2(&zs, -15) != Z_OK) LOG_EXIT("Could not initialize zlib. Abort!\n");
+    fq_chunk_t *chunk;
+    while(queue->pop(chunk)) {
+        const uint8_t *const start((uint8_t *)chunk->in.s), *const end(start + chunk->in.l), *p;
+        size_t total(0);
+        for(p = start; p < end; p += bgzf_block_size(p, end - p)) total += le32(p + bgzf_block_size(p, end - p) - 4);
+        kstring_t *out(&chunk->out);
+        ks_resize(out, total + 1);
+        for(p = start; p < end;) {
+            const uint32_t bsize(bgzf_block_size(p, end - p)), cstart(12 + le16(p + 10)), isize(le32(p + bsize - 4));
+            inflateReset(&zs);
+            zs.next_in = (Bytef *)p + cstart, zs.avail_in = bsize - cstart - 8;
+            zs.next_out = (Bytef *)out->s + out->l, zs.avail_out = isize;
+            if(inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out)
+                LOG_EXIT("Corrupt BGZF block in %s. Abort!\n", path);
+            if(crc32(crc32(0L, Z_NULL, 0), (Bytef *)out->s + out->l, isize) != le32(p + bsize - 8))
+                LOG_EXIT("CRC mismatch in BGZF block in %s. Abort!\n", path);
+            out->l += isize, p += bsize;
+        }
+        chunk->done.store(1, std::memory_order_release);
+    }
+    inflateEnd(&zs);
+}
+
+void FqReader::read_gz(int fd)
+{
+    gzFile fp(gzdopen(fd, "r"));
+    if(!fp) LOG_EXIT("Could not open %s for reading. Abort!\n", path);
+    gzbuffer(fp, 1 << 17);
+    while(!stop.load(std::memory_order_relaxed)) {
+        fq_chunk_t *chunk(new fq_chunk_t);
+        ks_resize(&chunk->out, FQ_CHUNK_BYTES);
+        const int n(gzread(fp, chunk->out.s, FQ_CHUNK_BYTES));
+        if(n <= 0) {
+            delete chunk;
+            if(n < 0) {
+                int err;
+                LOG_EXIT("Failed to read %s: %s. Abort!\n", path, gzerror(fp, &err));
+            }
+            break;
+        }
+        chunk->out.l = n;
+        chunk->done.store(1, std::memory_order_release);
+        chunks.push(chunk);
+    }
+    chunks.close();
+    gzclose(fp);
+}
+
+/*
+ * Parses every complete record in [p, end) into batches, skipping blank lines between records.
+ * :returns: [const char *] Start of the first incomplete record.
+ */
+const char *FqReader::parse_records(const char *p, const char *end, fq_batch_t *&batch)
+{
+    const char *nl[4];
+    while(p < end) {
+        if(*p == '\n' || *p == '\r') {
+            ++p;
+            continue;
+        }
+        const char *q(p);
+        for(int i(0); i < 4; ++i) {
+            if((nl[i] = (const char *)memchr(q, '\n', end - q)) == nullptr) return p;
+            q = nl[i] + 1;
+        }
+        if(UNLIKELY(*p != '@'))
+            LOG_EXIT("Expected '@' at the start of a fastq record in %s, found '%c'. Abort!\n", path, *p);
+        if(UNLIKELY(nl[1][1] != '+'))
+            LOG_EXIT("Expected '+' on the third line of a fastq record in %s. Multi-line fastqs are not supported. "
+                     "Abort!\n", path);
+        const char *name(p + 1), *const seq(nl[0] + 1), *const qual(nl[2] + 1);
+        uint32_t name_l(0);
+        const uint32_t line1_l(line_len(name, nl[0]));
+        while(name_l < line1_l && name[name_l] != ' ' && name[name_l] != '\t') ++name_l;
+        const uint32_t seq_l(line_len(seq, nl[1])), qual_l(line_len(qual, nl[3]));
+        if(UNLIKELY(seq_l != qual_l))
+            LOG_EXIT("Sequence and quality lengths differ (%u, %u) for read %.*s in %s. Abort!\n",
+                     seq_l, qual_l, (int)name_l, name, path);
+        batch->add(name, name_l, seq, seq_l, qual, qual_l);
+        if(batch->size() == FQ_BATCH_RECORDS) batches.push(batch), batch = new fq_batch_t;
+        p = q;
+    }
+    return p;
+}
+
+void FqReader::parse()
+{
+    kstring_t carry{0, 0, nullptr}; // A record split across chunks.
+    fq_batch_t *batch(new fq_batch_t);
+    fq_chunk_t *chunk;
+    while(chunks.pop(chunk)) {
+        wait_done(chunk);
+        if(stop.load(std::memory_order_relaxed)) {
+            delete chunk;
+            continue;
+        }
+        const char *p(chunk->out.s), *const end(p + chunk->out.l);
+        if(carry.l) {
+            // Complete the carried record from the start of this chunk, then parse the rest in place.
+            int lines(0);
+            for(const char *c(carry.s); (c = (const char *)memchr(c, '\n', carry.s + carry.l - c)); ++c) ++lines;
+            const char *split(p);
+            while(lines < 4 && split < end) {
+                const char *const nl((const char *)memchr(split, '\n', end - split));
+                split = nl ? nl + 1: end;
+                ++lines;
+            }
+            kputsn(p, split - p, &carry);
+            const char *const rest(parse_records(carry.s, carry.s + carry.l, batch));
+            if(rest != carry.s + carry.l) {
+                // Still incomplete: this chunk was entirely used.
+                memmove(carry.s, rest, carry.s + carry.l - rest);
+                carry.l = carry.s + carry.l - rest;
+                delete chunk;
+                continue;
+            }
+            carry.l = 0;
+            p = split;
+        }
+        p = parse_records(p, end, batch);
+        kputsn(p, end - p, &carry);
+        delete chunk;
+    }
+    if(carry.l && !stop.load(std::memory_order_relaxed)) {
+        if(carry.s[carry.l - 1] != '\n') kputc('\n', &carry);
+        if(parse_records(carry.s, carry.s + carry.l, batch) != carry.s + carry.l)
+            LOG_EXIT("Truncated fastq record at the end of %s. Abort!\n", path);
+    }
+    free(carry.s);
+    if(batch->size()) batches.push(batch);
+    else delete batch;
+    batches.close();
+}
+
+} /* namespace bmf */
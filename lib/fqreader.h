@@ -0,0 +1,120 @@
+#ifndef FQREADER_H
+#define FQREADER_H
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include "htslib/kseq.h"
+#include "htslib/kstring.h"
+#include "lib/spsc_queue.h"
+
+#ifndef KSEQ_DEC_GZ
+#define KSEQ_DEC_GZ
+KSEQ_INIT(gzFile, gzread)
+#endif
+
+#define FQ_BATCH_RECORDS (1 << 12) // Records per batch.
+#define FQ_CHUNK_BYTES (1 << 20) // Compressed (BGZF) or decompressed (otherwise) bytes read per chunk.
+
+namespace bmf {
+
+/*
+ * A batch of fastq records, parsed by an FqReader.
+ * Each record's name, sequence and quality are stored null-terminated in data.
+ */
+struct fq_batch_t {
+    struct rec_t {
+        uint32_t name, seq, qual; // Offsets into data.
+        uint32_t name_l, seq_l, qual_l;
+    };
+    kstring_t data;
+    std::vector<rec_t> recs;
+    fq_batch_t(): data{0, 0, nullptr} {recs.reserve(FQ_BATCH_RECORDS);}
+    fq_batch_t(const fq_batch_t &other) = delete;
+    ~fq_batch_t() {free(data.s);}
+    size_t size() const {return recs.size();}
+    void add(const char *name, uint32_t name_l, const char *seq, uint32_t seq_l, const char *qual, uint32_t qual_l) {
+        rec_t rec{(uint32_t)data.l, 0, 0, name_l, seq_l, qual_l};
+        ks_resize(&data, data.l + name_l + seq_l + qual_l + 3);
+        kputsn(name, name_l, &data), kputc('\0', &data);
+        rec.seq = data.l;
+        kputsn(seq, seq_l, &data), kputc('\0', &data);
+        rec.qual = data.l;
+        kputsn(qual, qual_l, &data), kputc('\0', &data);
+        recs.push_back(rec);
+    }
+    /*
+     * @func view
+     * Points the strings of a kseq_t at record i so that the kseq-based marking helpers can be reused.
+     * The comment is left empty.
+     */
+    void view(size_t i, kseq_t *seq) const {
+        const rec_t &rec(recs[i]);
+        seq->name.s = data.s + rec.name, seq->name.l = rec.name_l;
+        seq->seq.s = data.s + rec.seq, seq->seq.l = rec.seq_l;
+        seq->qual.s = data.s + rec.qual, seq->qual.l = rec.qual_l;
+    }
+};
+
+/*
+ * Decompressed input, in file order. For BGZF input, in holds the compressed blocks
+ * and done is set once a worker has inflated them into out.
+ */
+struct fq_chunk_t {
+    kstring_t in;
+    kstring_t out;
+    std::atomic<int> done;
+    fq_chunk_t(): in{0, 0, nullptr}, out{0, 0, nullptr}, done(0) {}
+    ~fq_chunk_t() {free(in.s), free(out.s);}
+};
+
+/*
+ * Reads a (possibly gzipped) 4-line fastq on background threads, handing out records in batches of FQ_BATCH_RECORDS.
+ * BGZF input (as written by bgzip or BgzfWriter) is split at block boundaries and inflated by a pool of threads;
+ * anything else zlib reads (plain or multi-member gzip, or uncompressed text) is decompressed by one dedicated thread.
+ * Either way, records are parsed on a further thread, so the caller only ever sees parsed batches, in file order.
+ */
+class FqReader {
+    const char *path;
+    std::vector<SpscQueue<fq_chunk_t *> *> jobs; // One per inflate worker. Chunk i goes to worker i % n.
+    SpscQueue<fq_chunk_t *> chunks; // Every chunk, in file order.
+    SpscQueue<fq_batch_t *> batches;
+    std::vector<std::thread> threads;
+    std::atomic<int> stop;
+
+    void read_bgzf(int fd);
+    void read_gz(int fd);
+    void inflate_chunks(SpscQueue<fq_chunk_t *> *queue);
+    void parse();
+    const char *parse_records(const char *p, const char *end, fq_batch_t *&batch);
+public:
+    /*
+     * :param: path [const char *] Path to fastq, or "-" for stdin.
+     * :param: n_threads [int] Number of threads with which to inflate BGZF input.
+     */
+    FqReader(const char *path, int n_threads=1);
+    FqReader(const FqReader &other) = delete;
+    ~FqReader();
+    /*
+     * @func next
+     * :returns: [fq_batch_t *] Next batch of records, to be deleted by the caller, or nullptr at end of file.
+     * Only the last batch holds fewer than FQ_BATCH_RECORDS records.
+     */
+    fq_batch_t *next() {
+        fq_batch_t *ret;
+        return batches.pop(ret) ? ret: nullptr;
+    }
+};
+
+/*
+ * @func bgzf_block_size
+ * :param: buf [const uint8_t *] Start of a gzip member.
+ * :param: l [size_t] Number of bytes available, which must cover the header's extra field.
+ * :returns: [uint32_t] The BGZF block's total size if buf starts with a BGZF block header, otherwise 0.
+ */
+uint32_t bgzf_block_size(const uint8_t *buf, size_t l);
+
+} /* namespace bmf */
+
+#endif /* FQREADER_H */
@@ -1,13 +1,24 @@
 #include <cassert>
+#include <getopt.h>
+#include <memory>
+#include <string>
+#include <vector>
 #include "src/bmf_collapse.h"
 #include "dlib/io_util.h"
+#include "lib/barcode.h"
+#include "lib/bgzfwriter.h"
+#include "lib/binner.h"
 #include "lib/mseq.h"
+#include "lib/famtable.h"
+#include "lib/fqreader.h"
+#include "lib/shardfmt.h"
 
 
 namespace bmf {
 void hash_inmem_inline_core(char *in1, char *in2, char *out1, char *out2,
                             char *homing, int blen, int threshold, int level=0, int mask=0,
-                            int max_blen=-1);
+                            int max_blen=-1, uint64_t max_mem=0, int n_nucs=DEFAULT_N_NUCS,
+                            const char *tmp_prefix=nullptr, int n_threads=1);
 
 
 void hashdmp_usage()
@@ -21,16 +32,16 @@ void hashdmp_usage()
                     "Flags:\n"
                     "-s\tPerform secondary index consolidation rather than Loeb-like inline consolidation.\n"
                     "-o\tOutput filename.\n"
+                    "-e\tMerge families into larger families whose barcodes differ by one substitution before consensus.\n"
                     "If output file is unset, defaults to stdout. If input filename is not set, defaults to stdin.\n"
             );
 }
 void inmem_usage()
 {
     fprintf(stderr,
-                    "Molecularly demultiplexes marked temporary fastqs into final unique observation records.\n"
-                    "bmftools hashdmp does so in one large hashmap. This may require huge amounts of memory.\n"
-                    "For samples which can't fit into memory, use bmftools dmp or sdmp, which subsets the sample,"
-                    " reducing memory requirements while keeping the constant-time hashmap collapsing.\n"
+                    "Marks and molecularly demultiplexes a pair of raw fastqs into final unique observation records.\n"
+                    "bmftools inmem does so in memory. With --max-mem, partitions of barcodes which don't fit"
+                    " are spilled to temporary files and collapsed one at a time at the end.\n"
                     "Usage: bmftools inmem <opts> -1 <out.r1.fastq> -2 <out.r2.fastq> <r1.fastq> <r2.fastq>.\n"
                     "Flags:\n"
                     "-s:\tHoming sequence -- REQUIRED.\n"
@@ -42,7 +53,14 @@ void inmem_usage()
                     "-v:\tMaximum barcode length. (Set only if using variable-length barcodes.)\n"
                     "-m:\tSkip the first <INT> bases from each inline barcode. Default: 0\n"
                     "-L:\tOutput fastq compression level (Default: plain text).\n"
-                    "If output file is unset, defaults to stdout. If input filename is not set, defaults to stdin.\n"
+                    "-x/--max-mem:\tMemory budget for families, with optional K/M/G suffix. Once exceeded, "
+                    "the largest barcode-prefix partitions are spilled to temporary files and collapsed at the end. "
+                    "Output is identical either way. Default: 0 (unlimited).\n"
+                    "-n:\tNumber of barcode nucleotides to partition by with --max-mem. Default: %i.\n"
+                    "-o:\tPrefix for temporary files with --max-mem. Default: path to output read 1.\n"
+                    "-p:\tNumber of threads with which to decompress each BGZF input fastq. Default: %i.\n"
+                    "If output file is unset, defaults to stdout. If input filename is not set, defaults to stdin.\n",
+                    DEFAULT_N_NUCS, DEFAULT_N_THREADS
             );
 }
 
@@ -68,8 +86,9 @@ int hashcollapse_main(int argc, char *argv[])
     int c;
     int stranded_analysis(1);
     int level(-1);
-    while ((c = getopt(argc, argv, "l:o:sh?")) >= 0) {
+    while ((c = getopt(argc, argv, "l:o:esh?")) >= 0) {
         switch(c) {
+            case 'e': set_neighbor_merging(1); break;
             case 'l': level = atoi(optarg)%10; break;
             case 'o': outfname = optarg; break;
             case 's': stranded_analysis = 0; break;
@@ -102,8 +121,20 @@ int hashdmp_inmem_main(int argc, char *argv[])
     int mask(0);
     int threshold(10);
     int level(0); // uncompressed
-    while ((c = getopt(argc, argv, "1:2:v:l:L:l:m:s:t:h?")) >= 0) {
+    int n_nucs(DEFAULT_N_NUCS);
+    uint64_t max_mem(0);
+    char *tmp_prefix(nullptr);
+    int n_threads(DEFAULT_N_THREADS);
+    static const struct option lopts[] = {
+        {"max-mem", required_argument, nullptr, 'x'},
+        {0, 0, 0, 0}
+    };
+    while ((c = getopt_long(argc, argv, "1:2:v:l:L:l:m:n:o:p:s:t:x:h?", lopts, nullptr)) >= 0) {
         switch(c) {
+            case 'n': n_nucs = atoi(optarg); break;
+            case 'o': tmp_prefix = optarg; break;
+            case 'p': n_threads = atoi(optarg); break;
+            case 'x': max_mem = parse_mem_size(optarg); break;
             case '1': outfname1 = optarg; break;
             case '2': outfname2 = optarg; break;
             case 'm': mask = atoi(optarg); break;
@@ -129,9 +160,11 @@ int hashdmp_inmem_main(int argc, char *argv[])
     if(!homing) LOG_EXIT("Homing sequence required.\n");
     if(strcmp(outfname1, outfname2) == 0) LOG_EXIT("read 1 and read 2 must be separate files. Abort!\n");
 
+    if(n_nucs < 0 || n_nucs > 8) LOG_EXIT("Number of partition nucleotides must be between 0 and 8. Abort!\n");
+
     hash_inmem_inline_core(argv[optind], argv[optind + 1], outfname1, outfname2,
                            homing, blen, threshold, level, mask,
-                           max_blen);
+                           max_blen, max_mem, n_nucs, tmp_prefix, n_threads);
     LOG_INFO("Successfully complete bmftools hashdmp!\n");
     return EXIT_SUCCESS;
 }
@@ -145,25 +178,249 @@ namespace {
     };
 }
 
-inline int get_blen(char *seq, char *homing, int homing_len, int blen, int max_blen, int mask) {
-    for(int i(blen); i <= max_blen; ++i)
-        if(memcmp(seq + i, homing, homing_len) == 0)
-            return i - mask;
-    return -1;
+inline int get_blen(const kseq_t *seq, char *homing, int homing_len, int blen, int max_blen, int mask) {
+    const int i(homing_find(seq->seq.s, seq->seq.l, homing, homing_len, blen, max_blen));
+    return i < 0 ? -1: i - mask;
+}
+
+/*
+ * Packs an inmem barcode, and copies it into bs after a placeholder strand character.
+ */
+static inline void inmem_key(const kstring_t &barcode, char *bs, bc_key_t *key)
+{
+    if(UNLIKELY(barcode.l >= MAX_BARCODE_LENGTH || bc_pack(barcode.s, key)))
+        LOG_EXIT("Barcode %s is longer than the maximum of %i. Abort!\n", barcode.s, MAX_BARCODE_LENGTH - 1);
+    memcpy(bs + 1, barcode.s, barcode.l + 1);
+}
+
+/*
+ * Adds a read to an inmem family. The first read is kept as a singleton,
+ * and later reads are added with pushback_inmem's handling of reads whose length disagrees with the family's.
+ */
+static inline void inmem_add(FamilyTable &table, family_t &fam, kseq_t *seq, int offset, int pass,
+                             const char *bs, int bs_len)
+{
+    if(!fam) table.add(fam, seq->seq.s + offset, seq->qual.s + offset, seq->seq.l - offset, pass + '0', bs, bs_len);
+    else pushback_inmem(table.promote(fam), seq, offset, pass);
+}
+
+/*
+ * Spilled inmem partitions hold, in order, every family the partition had in memory
+ * (singletons as reads with offset 0, forward strand first), then every read routed to it afterwards.
+ * Each record is an inmem_spill_hdr_t, the barcode (blen bytes), and then either
+ * a read's l bases and l quality characters
+ * or a family's phred_sums, nuc_counts and max_phreds (5 * l of each).
+ */
+struct inmem_spill_hdr_t {
+    uint32_t l; // Read: length, including the part skipped by offset. Family: read length.
+    int32_t n; // Read: offset for pushback_inmem. Family: number of reads.
+    uint8_t blen; // Barcode length, without the strand character.
+    uint8_t flags; // INMEM_SPILL_* flags
+    char pass_fail;
+    uint8_t pad;
+};
+static_assert(sizeof(inmem_spill_hdr_t) == 12, "inmem_spill_hdr_t must be packed into 12 bytes.");
+
+#define INMEM_SPILL_REV 1
+#define INMEM_SPILL_MATE2 2
+#define INMEM_SPILL_FAMILY 4
+
+/*
+ * inmem's read 1 and read 2 families, partitioned by barcode prefix.
+ * Once the families in memory exceed a budget, the largest partitions are written to temporary files
+ * and later reads for them go straight to those files. At the end, each spilled partition is read back
+ * and collapsed on its own, so output is identical to that of a run which never spilled.
+ */
+class InmemPartitions {
+    struct partition_t {
+        std::unique_ptr<FamilyTable> tables[2]; // Families for read 1 and read 2. Null once spilled.
+        std::unique_ptr<BgzfWriter> spill;
+        std::string path;
+    };
+    std::vector<partition_t> parts;
+    std::string tmp_prefix;
+    uint64_t max_mem;
+    uint64_t mem_used; // Bytes held by in-memory partitions' tables.
+    int n_nucs;
+    int n_spilled;
+    void new_tables(partition_t &part);
+    void spill_largest();
+    void spill_read(partition_t &part, const char *bs, int blen, int flags, kseq_t *seq, int offset, char pass_fail);
+    void spill_family(partition_t &part, const family_t &fam, int flags);
+    void load_spill(partition_t &part);
+public:
+    /*
+     * :param: n_nucs [int] Number of barcode nucleotides to partition by. 0 for a single partition.
+     * :param: max_mem [uint64_t] Budget for families held in memory. 0 for unlimited.
+     * :param: tmp_prefix [const char *] Prefix for spilled partitions' temporary files.
+     */
+    InmemPartitions(int n_nucs, uint64_t max_mem, const char *tmp_prefix);
+    /*
+     * @func add
+     * Adds one read pair. Read 1's family receives seq1 (from offset1), and read 2's seq2.
+     * :param: bs [char *] Placeholder strand character followed by the barcode.
+     * :returns: [int] 1 if this barcode and strand was new, 0 otherwise or if the partition has been spilled.
+     */
+    int add(char *bs, int bs_len, const bc_key_t &key, int is_rev,
+            kseq_t *seq1, int offset1, kseq_t *seq2, int offset2, int pass);
+    void write(BgzfWriter *out1, BgzfWriter *out2);
+};
+
+InmemPartitions::InmemPartitions(int n_nucs, uint64_t max_mem, const char *tmp_prefix):
+    parts((size_t)1 << (2 * n_nucs)), tmp_prefix(tmp_prefix), max_mem(max_mem), mem_used(0), n_nucs(n_nucs), n_spilled(0)
+{
+    for(partition_t &part: parts) {
+        new_tables(part);
+        mem_used += part.tables[0]->bytes() + part.tables[1]->bytes();
+    }
+}
+
+void InmemPartitions::new_tables(partition_t &part)
+{
+    // Keep many partitions from reserving more than a few KiB each before they receive any reads.
+    const size_t initial_size(parts.size() > 1 ? 1 << 6: 1 << 12);
+    part.tables[0].reset(new FamilyTable(0, initial_size));
+    part.tables[1].reset(new FamilyTable(0, initial_size));
+}
+
+int InmemPartitions::add(char *bs, int bs_len, const bc_key_t &key, int is_rev,
+                         kseq_t *seq1, int offset1, kseq_t *seq2, int offset2, int pass)
+{
+    partition_t &part(parts[get_binner_type(bs + 1, n_nucs, uint64_t)]);
+    if(part.spill) {
+        spill_read(part, bs, bs_len - 1, is_rev, seq1, offset1, pass + '0');
+        spill_read(part, bs, bs_len - 1, is_rev | INMEM_SPILL_MATE2, seq2, offset2, pass + '0');
+        return 0;
+    }
+    const uint64_t before(part.tables[0]->bytes() + part.tables[1]->bytes());
+    family_t &fam1(part.tables[0]->family(key, is_rev)), &fam2(part.tables[1]->family(key, is_rev));
+    const int ret(!fam1);
+    inmem_add(*part.tables[0], fam1, seq1, offset1, pass, bs, bs_len);
+    inmem_add(*part.tables[1], fam2, seq2, offset2, pass, bs, bs_len);
+    mem_used += part.tables[0]->bytes() + part.tables[1]->bytes() - before;
+    if(max_mem) while(mem_used > max_mem && n_spilled < (int)parts.size()) spill_largest();
+    return ret;
+}
+
+void InmemPartitions::spill_read(partition_t &part, const char *bs, int blen, int flags,
+                                 kseq_t *seq, int offset, char pass_fail)
+{
+    const inmem_spill_hdr_t hdr{(uint32_t)seq->seq.l, offset, (uint8_t)blen, (uint8_t)flags, pass_fail, 0};
+    kstring_t *const ks(part.spill->buf());
+    kputsn((const char *)&hdr, sizeof(hdr), ks);
+    kputsn(bs + 1, blen, ks);
+    kputsn(seq->seq.s, seq->seq.l, ks);
+    kputsn(seq->qual.s, seq->seq.l, ks);
+    part.spill->check();
+}
+
+void InmemPartitions::spill_family(partition_t &part, const family_t &fam, int flags)
+{
+    kstring_t *const ks(part.spill->buf());
+    if(fam.one) {
+        const singleton_t *const one(fam.one);
+        const inmem_spill_hdr_t hdr{one->l, 0, (uint8_t)(one->blen - 1), (uint8_t)flags, one->pass_fail, 0};
+        kputsn((const char *)&hdr, sizeof(hdr), ks);
+        kputsn(one->data + 2 * one->l + 1, one->blen - 1, ks); // Barcode, without the strand character
+        kputsn(one->data, 2 * one->l, ks);
+    } else {
+        const kingfisher_t *const kf(fam.kf);
+        const size_t r5(kf->readlen * 5);
+        const int blen(strlen(kf->barcode + 1));
+        const inmem_spill_hdr_t hdr{(uint32_t)kf->readlen, kf->length, (uint8_t)blen,
+                                    (uint8_t)(flags | INMEM_SPILL_FAMILY), kf->pass_fail, 0};
+        kputsn((const char *)&hdr, sizeof(hdr), ks);
+        kputsn(kf->barcode + 1, blen, ks);
+        kputsn((const char *)kf->phred_sums, r5 * sizeof(uint32_t), ks);
+        kputsn((const char *)kf->nuc_counts, r5 * sizeof(uint16_t), ks);
+        kputsn(kf->max_phreds, r5, ks);
+    }
+    part.spill->check();
+}
+
+void InmemPartitions::spill_largest()
+{
+    size_t idx(parts.size());
+    uint64_t largest(0);
+    for(size_t i(0); i < parts.size(); ++i) {
+        if(parts[i].spill) continue;
+        const uint64_t bytes(parts[i].tables[0]->bytes() + parts[i].tables[1]->bytes());
+        if(idx == parts.size() || bytes > largest) idx = i, largest = bytes;
+    }
+    partition_t &part(parts[idx]);
+    part.path = tmp_prefix + ".inmem." + std::to_string(idx) + ".tmp";
+    part.spill.reset(new BgzfWriter(part.path.c_str(), 1));
+    LOG_INFO("Memory budget of %lu bytes exceeded. Spilling partition %lu (%lu bytes) to %s.\n",
+             max_mem, idx, largest, part.path.c_str());
+    for(int mate(0); mate < 2; ++mate) {
+        FamilyTable &table(*part.tables[mate]);
+        const int flags(mate ? INMEM_SPILL_MATE2: 0);
+        for(const uint32_t i: table.forward_order()) spill_family(part, table.entry(i).fwd, flags);
+        for(const uint32_t i: table.reverse_order()) spill_family(part, table.entry(i).rev, flags | INMEM_SPILL_REV);
+        part.tables[mate].reset();
+    }
+    mem_used -= largest;
+    ++n_spilled;
+}
+
+void InmemPartitions::load_spill(partition_t &part)
+{
+    part.spill.reset(); // Flushes and closes.
+    new_tables(part);
+    gzFile fp(gzopen(part.path.c_str(), "r"));
+    if(!fp) LOG_EXIT("Could not open %s for reading. Abort mission!\n", part.path.c_str());
+    inmem_spill_hdr_t hdr;
+    char bs[MAX_BARCODE_LENGTH + 1]{'@'};
+    kstring_t data{0, 0, nullptr};
+    kseq_t view{};
+    bc_key_t key;
+    int n;
+    while((n = gzread(fp, &hdr, sizeof(hdr))) > 0) {
+        const size_t size(hdr.flags & INMEM_SPILL_FAMILY ? hdr.l * 5uL * (sizeof(uint32_t) + sizeof(uint16_t) + 1)
+                                                         : 2uL * hdr.l);
+        ks_resize(&data, size + 1);
+        if(n != (int)sizeof(hdr) || hdr.blen >= MAX_BARCODE_LENGTH || gzread(fp, bs + 1, hdr.blen) != hdr.blen ||
+           gzread(fp, data.s, size) != (int)size)
+            LOG_EXIT("Truncated record in %s. Abort!\n", part.path.c_str());
+        bs[hdr.blen + 1] = '\0';
+        bc_pack(bs + 1, &key);
+        FamilyTable &table(*part.tables[hdr.flags & INMEM_SPILL_MATE2 ? 1: 0]);
+        family_t &fam(table.family(key, hdr.flags & INMEM_SPILL_REV));
+        if(hdr.flags & INMEM_SPILL_FAMILY) {
+            kingfisher_t *const kf(table.create(fam, hdr.l));
+            const size_t r5(hdr.l * 5uL);
+            memcpy(kf->phred_sums, data.s, r5 * sizeof(uint32_t));
+            memcpy(kf->nuc_counts, data.s + r5 * sizeof(uint32_t), r5 * sizeof(uint16_t));
+            memcpy(kf->max_phreds, data.s + r5 * (sizeof(uint32_t) + sizeof(uint16_t)), r5);
+            kf->length = hdr.n;
+            kf->pass_fail = hdr.pass_fail;
+            memcpy(kf->barcode, bs, hdr.blen + 2);
+        } else {
+            view.seq.s = data.s, view.seq.l = hdr.l;
+            view.qual.s = data.s + hdr.l, view.qual.l = hdr.l;
+            inmem_add(table, fam, &view, hdr.n, hdr.pass_fail - '0', bs, hdr.blen + 1);
+        }
+    }
+    free(data.s);
+    gzclose(fp);
+    if(remove(part.path.c_str())) LOG_WARNING("Could not remove temporary file %s.\n", part.path.c_str());
+}
+
+void InmemPartitions::write(BgzfWriter *out1, BgzfWriter *out2)
+{
+    tmpbuffers_t tmp;
+    for(partition_t &part: parts) {
+        if(part.spill) load_spill(part);
+        write_stranded_families(*part.tables[0], out1, &tmp);
+        write_stranded_families(*part.tables[1], out2, &tmp);
+        part.tables[0].reset(), part.tables[1].reset();
+    }
 }
 
 void hash_inmem_inline_core(char *in1, char *in2, char *out1, char *out2,
                             char *homing, int blen, int threshold, int level, int mask,
-                            int max_blen) {
+                            int max_blen, uint64_t max_mem, int n_nucs, const char *tmp_prefix, int n_threads) {
     if(max_blen < 0) max_blen = blen;
-    char mode[4];
-#if ZLIB_VER_MAJOR <= 1 && ZLIB_VER_MINOR <= 2 && ZLIB_VER_REVISION < 5
-#pragma message("Note: zlib version < 1.2.5 doesn't support transparent file writing. Writing uncompressed temporary gzip files by default.")
-// If not set, zlib compresses all our files enormously.
-sprintf(mode, level > 0 ? "wb%i": "wb0", level % 10);
-#else
-sprintf(mode, level > 0 ? "wb%i": "wT", level % 10);
-#endif
     if(level > 0) {
         if(strcmp(out1, "-") && strcmp(strrchr(out1, '\0') - 3, ".gz") != 0) {
             LOG_WARNING("Output gzip compressed but filename not terminated with .gz. FYI\n");
@@ -177,44 +434,35 @@ sprintf(mode, level > 0 ? "wb%i": "wT", level % 10);
             LOG_WARNING("Output filename stats with .gz but output is not compressed. FYI\n");
         }
     }
-    FILE *in_handle1(dlib::open_ifp(in1));
-    FILE *in_handle2(dlib::open_ifp(in2));
-    gzFile out_handle1(dlib::open_gzfile(out1, mode));
-    gzFile out_handle2(dlib::open_gzfile(out2, mode));
+    BgzfWriter out_handle1(out1, level > 0 ? level: -1, 1);
+    BgzfWriter out_handle2(out2, level > 0 ? level: -1, 1);
     const int homing_len(strlen(homing));
-    if(!in_handle1) {
-        if(dlib::isfile(in1)) {
-            LOG_DEBUG("%s a file, but it's empty....\n", in1);
-            gzclose(out_handle1);
-            return;
-        }
-        LOG_EXIT("Could not open %s for reading. Abort mission!\n", in1);
-    }
-    if(!in_handle2) {
-         if(dlib::isfile(in2)) {
-             LOG_DEBUG("%s a file, but it's empty....\n", in2);
-             gzclose(out_handle2);
-             return;
-         }
-         LOG_EXIT("Could not open %s for reading. Abort mission!\n", in2);
-     }
-    gzFile fp1(gzdopen(fileno(in_handle1), "r"));
-    gzFile fp2(gzdopen(fileno(in_handle2), "r"));
-    kseq_t *seq1(kseq_init(fp1));
-    kseq_t *seq2(kseq_init(fp2));
-    kingfisher_hash_t *hash1f(nullptr), *hash2f(nullptr), *hash1r(nullptr), *hash2r(nullptr);
-    kingfisher_hash_t *ce1((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t)));
-    kingfisher_hash_t *ce2((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t)));
-    kingfisher_hash_t *tmp_hk1 = ce1, *tmp_hk2 = ce2; // Save the pointer location for later comparison.
+    FqReader reader1(in1, n_threads), reader2(in2, n_threads);
+    fq_batch_t *b1(nullptr), *b2(nullptr);
+    size_t i1(0), i2(0);
+    kseq_t v1{}, v2{};
+    kseq_t *const seq1(&v1), *const seq2(&v2);
+    InmemPartitions parts(max_mem ? n_nucs: 0, max_mem, tmp_prefix ? tmp_prefix: strcmp(out1, "-") ? out1: "inmem");
     kstring_t barcode{0, 32, (char *)malloc(32uL * sizeof(char))};
+    bc_key_t key;
     unsigned blen1, blen2;
     unsigned offset1, offset2;
     char pass;
+    char bs[MAX_BARCODE_LENGTH + 1]{'@'};
     size_t barcode_count{0};
-    while(LIKELY(kseq_read(seq1) >= 0 && kseq_read(seq2) >= 0)) {
+    for(;;) {
+        if(!b1 || i1 == b1->size()) {
+            delete b1, i1 = 0;
+            if((b1 = reader1.next()) == nullptr) break;
+        }
+        if(!b2 || i2 == b2->size()) {
+            delete b2, i2 = 0;
+            if((b2 = reader2.next()) == nullptr) break;
+        }
+        b1->view(i1++, seq1), b2->view(i2++, seq2);
         pass = 1;
-        blen1 = get_blen(seq1->seq.s, homing, homing_len, blen, max_blen, mask);
-        blen2 = get_blen(seq2->seq.s, homing, homing_len, blen, max_blen, mask);
+        blen1 = get_blen(seq1, homing, homing_len, blen, max_blen, mask);
+        blen2 = get_blen(seq2, homing, homing_len, blen, max_blen, mask);
         if(switch_test(seq1, seq2, mask)) {
             if(blen2 != (unsigned)-1) memcpy(barcode.s, seq2->seq.s + mask, blen2);
             else {
@@ -237,38 +485,13 @@ sprintf(mode, level > 0 ? "wb%i": "wT", level % 10);
             }
             barcode.l = barcode.l + blen1;
             barcode.s[barcode.l] = '\0';
-            //LOG_DEBUG("Looking for barcode %s.\n", barcode.s);
-            HASH_FIND_STR(hash1r, barcode.s, tmp_hk1);
-            HASH_FIND_STR(hash2r, barcode.s, tmp_hk2);
-            pass &= test_hp(barcode.s, threshold);
-            assert(!tmp_hk1 == !tmp_hk2); // Make sure that both have the same keyset.
+            inmem_key(barcode, bs, &key);
+            pass &= barcode_hp_pass(barcode.s, strnlen(barcode.s, barcode.l), threshold);
             offset1 = blen1 + homing_len + mask;
             offset2 = blen2 + homing_len + mask;
-            if(tmp_hk1) {
-                pushback_inmem(tmp_hk2->value, seq1, offset1, pass);
-                pushback_inmem(tmp_hk1->value, seq2, offset2, pass);
-            } else {
-                if(UNLIKELY(++barcode_count % 1000000 == 0))
-                    LOG_INFO("Number of unique barcodes loaded: %lu\n", barcode_count);
-                tmp_hk1 = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hk2 = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hk1->value = init_kfp(seq2->seq.l - offset2);
-                tmp_hk2->value = init_kfp(seq1->seq.l - offset1);
-                memcpy(tmp_hk1->id, barcode.s, barcode.l);
-                memcpy(tmp_hk2->id, barcode.s, barcode.l);
-                tmp_hk1->id[barcode.l] = '\0';
-                tmp_hk2->id[barcode.l] = '\0';
-                memcpy(tmp_hk1->value->barcode + 1, barcode.s, barcode.l);
-                tmp_hk1->value->barcode[0] = '@';
-                tmp_hk1->value->barcode[barcode.l + 1] = '\0';
-                memcpy(tmp_hk2->value->barcode + 1, barcode.s, barcode.l);
-                tmp_hk2->value->barcode[0] = '@';
-                tmp_hk2->value->barcode[barcode.l + 1] = '\0';
-                pushback_inmem(tmp_hk2->value, seq1, offset1, pass);
-                pushback_inmem(tmp_hk1->value, seq2, offset2, pass);
-                HASH_ADD_STR(hash1r, id, tmp_hk1);
-                HASH_ADD_STR(hash2r, id, tmp_hk2);
-            }
+            if(parts.add(bs, barcode.l + 1, key, 1, seq2, offset2, seq1, offset1, pass) &&
+               UNLIKELY(++barcode_count % 1000000 == 0))
+                LOG_INFO("Number of unique barcodes loaded: %lu\n", barcode_count);
         } else {
             if(blen1 != (unsigned)-1) memcpy(barcode.s, seq1->seq.s + mask, blen1);
             else { // Fail!
@@ -291,181 +514,67 @@ sprintf(mode, level > 0 ? "wb%i": "wT", level % 10);
             }
             barcode.l = barcode.l + blen2;
             barcode.s[barcode.l] = '\0';
-            pass &= test_hp(barcode.s, threshold);
+            inmem_key(barcode, bs, &key);
+            pass &= barcode_hp_pass(barcode.s, strnlen(barcode.s, barcode.l), threshold);
             offset1 = blen1 + homing_len + mask;
             offset2 = blen2 + homing_len + mask;
-            HASH_FIND_STR(hash1f, barcode.s, tmp_hk1);
-            if(tmp_hk1) {
-                HASH_FIND_STR(hash2f, barcode.s, tmp_hk2);
-                pushback_inmem(tmp_hk1->value, seq1, offset1, pass);
-                pushback_inmem(tmp_hk2->value, seq2, offset2, pass);
-            } else {
-                if(UNLIKELY(++barcode_count % 1000000 == 0))
-                    LOG_INFO("Number of unique barcodes loaded: %lu\n", barcode_count);
-                // Create
-                tmp_hk1 = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hk2 = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hk1->value = init_kfp(seq1->seq.l - offset1);
-                tmp_hk2->value = init_kfp(seq2->seq.l - offset2);
-                memcpy(tmp_hk1->id, barcode.s, barcode.l);
-                memcpy(tmp_hk2->id, barcode.s, barcode.l);
-                tmp_hk1->id[barcode.l] = '\0';
-                tmp_hk2->id[barcode.l] = '\0';
-                memcpy(tmp_hk1->value->barcode + 1, barcode.s, barcode.l);
-                tmp_hk1->value->barcode[barcode.l + 1] = '\0';
-                tmp_hk1->value->barcode[0] = '@';
-                memcpy(tmp_hk2->value->barcode + 1, barcode.s, barcode.l);
-                tmp_hk2->value->barcode[barcode.l + 1] = '\0';
-                tmp_hk2->value->barcode[0] = '@';
-                HASH_ADD_STR(hash1f, id, tmp_hk1);
-                HASH_ADD_STR(hash2f, id, tmp_hk2);
-                pushback_inmem(tmp_hk1->value, seq1, offset1, pass);
-                pushback_inmem(tmp_hk2->value, seq2, offset2, pass);
-            }
+            if(parts.add(bs, barcode.l + 1, key, 0, seq1, offset1, seq2, offset2, pass) &&
+               UNLIKELY(++barcode_count % 1000000 == 0))
+                LOG_INFO("Number of unique barcodes loaded: %lu\n", barcode_count);
         }
     }
     free(barcode.s);
-    fclose(in_handle1), in_handle1 = nullptr;
-    fclose(in_handle2), in_handle1 = nullptr;
-    gzclose(fp1), fp1 = nullptr;
-    gzclose(fp2), fp2 = nullptr;
-    kseq_destroy(seq1), seq1 = nullptr;
-    kseq_destroy(seq2), seq2 = nullptr;
+    delete b1, delete b2;
     LOG_DEBUG("Loaded all records into memory.\n");
-
-    kstring_t ks1{0, 0, nullptr};
-    kstring_t ks2{0, 0, nullptr};
-    tmpbuffers_t tmp;
-    kingfisher_hash_t *t2(nullptr);
-    HASH_ITER(hh, hash1f, ce1, tmp_hk1) {
-        HASH_FIND_STR(hash1r, ce1->id, t2);
-        HASH_FIND_STR(hash2f, ce1->id, ce2);
-        if(t2) {
-            assert(ce2);
-            HASH_FIND_STR(hash2r, ce1->id, tmp_hk2);
-            assert(tmp_hk2);
-            zstranded_process_write(ce1->value, t2->value, &ks1, &tmp);
-            destroy_kf(t2->value);
-            HASH_DEL(hash1r, t2);
-            zstranded_process_write(ce2->value, tmp_hk2->value, &ks2, &tmp);
-            destroy_kf(tmp_hk2->value);
-            HASH_DEL(hash2r, tmp_hk2);
-        } else {
-            dmp_process_write(ce1->value, &ks1, &tmp, 0);
-            dmp_process_write(ce2->value, &ks2, &tmp, 0);
-        }
-        destroy_kf(ce1->value);
-        HASH_DEL(hash1f, ce1);
-        destroy_kf(ce2->value);
-        HASH_DEL(hash2f, ce2);
-        gzputs(out_handle1, const_cast<const char *>(ks1.s));
-        ks1.l = 0;
-        gzputs(out_handle2, const_cast<const char *>(ks2.s));
-        ks2.l = 0;
-    }
-    HASH_ITER(hh, hash1r, ce1, tmp_hk1) {
-        HASH_FIND_STR(hash2r, ce1->id, ce2);
-        dmp_process_write(ce1->value, &ks1, &tmp, 1);
-        HASH_DEL(hash1r, ce1);
-        gzputs(out_handle1, const_cast<const char *>(ks1.s));
-        ks1.l = 0;
-        destroy_kf(ce1->value);
-        dmp_process_write(ce2->value, &ks2, &tmp, 1);
-        gzputs(out_handle2, const_cast<const char *>(ks2.s));
-        ks2.l = 0;
-        destroy_kf(ce2->value);
-        HASH_DEL(hash2r, ce2);
-    }
-    gzclose(out_handle1);
-    gzclose(out_handle2);
-    free(ks1.s);
-    free(ks2.s);
+    parts.write(&out_handle1, &out_handle2);
+    out_handle1.close();
+    out_handle2.close();
 }
 
 void hash_dmp_core(char *infname, char *outfname, int level)
 {
-    char mode[4];
-#if ZLIB_VER_MAJOR <= 1 && ZLIB_VER_MINOR <= 2 && ZLIB_VER_REVISION < 5
-#pragma message("Note: zlib version < 1.2.5 doesn't support transparent file writing. Writing uncompressed temporary gzip files by default.")
-// If not set, zlib compresses all our files enormously.
-    sprintf(mode, level > 0 ? "wb%i": "wb0", level % 10);
-#else
-    sprintf(mode, level > 0 ? "wb%i": "wT", level % 10);
-#endif
-    LOG_DEBUG("zlib write mode: %s.\n", mode);
-    FILE *in_handle(dlib::open_ifp(infname));
-    gzFile out_handle(gzopen(outfname, mode));
-    if(!in_handle) {
-        if(dlib::isfile(infname)) {
-            LOG_DEBUG("It's a file, but it's empty....\n");
-            gzclose(out_handle);
-            return;
-        }
-        LOG_EXIT("Could not open %s for reading. Abort mission!\n", infname);
-    }
-    gzFile fp(gzdopen(fileno(in_handle), "r"));
-    kseq_t *seq(kseq_init(fp));
-    // Initialized kseq
-    int l(kseq_read(seq));
-    if(l < 0) {
-        gzclose(fp);
-        fclose(in_handle);
-        gzclose(out_handle);
-        kseq_destroy(seq);
+    ShardReader reader(infname);
+    hash_dmp_core(reader, infname, outfname, level);
+}
+
+void hash_dmp_core(ShardReader &reader, const char *infname, char *outfname, int level)
+{
+    LOG_DEBUG("Output compression level: %i.\n", level > 0 ? level: -1);
+    BgzfWriter out_handle(outfname, level > 0 ? level: -1, 1);
+    const shard_rec_t &rec(reader.rec);
+    if(!reader.next()) {
+        LOG_DEBUG("%s is empty....\n", ifn_stream(infname));
         return;
     }
-    char *bs_ptr(barcode_mem_view(seq));
-    const int blen(infer_barcode_length(bs_ptr));
+    const int blen(rec.bs_len);
     LOG_DEBUG("Barcode length (inferred): %i.\n", blen);
-    tmpvars_t *tmp(init_tmpvars_p(bs_ptr, blen, seq->seq.l));
-    memcpy(tmp->key, bs_ptr, blen);
-    tmp->key[blen] = '\0';
+    tmpvars_t *tmp(init_tmpvars_p(const_cast<char *>(rec.bs), blen, rec.l));
     // Start hash table
-    kingfisher_hash_t *hash(nullptr);
-    kingfisher_hash_t *current_entry((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t)));
-    kingfisher_hash_t *tmp_hk(current_entry); // Save the pointer location for later comparison.
-    cp_view2buf(bs_ptr + 1, current_entry->id);
-    current_entry->value = init_kfp(tmp->readlen);
-    HASH_ADD_STR(hash, id, current_entry);
-    pushback_kseq(current_entry->value, seq, blen);
-
+    FamilyTable table(tmp->readlen);
     uint64_t count(0);
     // Add barcodes to the hash table
-    while(LIKELY((l = kseq_read(seq)) >= 0)) {
+    do {
         if(UNLIKELY(++count % 1000000 == 0))
             fprintf(stderr, "[%s::%s] Number of records read: %lu.\n", __func__,
                     strcmp("-", infname) == 0 ? "stdin": infname,count);
-        cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp->key);
-        HASH_FIND_STR(hash, tmp->key, tmp_hk);
-        if(tmp_hk) pushback_kseq(tmp_hk->value, seq, blen);
-        else {
-            tmp_hk = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-            tmp_hk->value = init_kfp(tmp->readlen);
-            cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp_hk->id);
-            pushback_kseq(tmp_hk->value, seq, blen);
-            HASH_ADD_STR(hash, id, tmp_hk);
-        }
+        table.add(rec.key, 0, rec.seq, rec.qual, rec.l, rec.pass_fail, rec.bs, blen);
+    } while(LIKELY(reader.next()));
+    if(neighbor_merging()) {
+        const uint64_t n_merged(table.merge_neighbors());
+        LOG_DEBUG("Merged %lu families into 1-mismatch neighbors.\n", n_merged);
     }
     LOG_DEBUG("Loaded all records into memory. Writing out to %s!\n", ifn_stream(outfname));
-    count = 0;
-    kstring_t ks{0, 0, nullptr};
-    HASH_ITER(hh, hash, current_entry, tmp_hk) {
-        ++count;
-        dmp_process_write(current_entry->value, &ks, tmp->buffers, -1);
-        gzputs(out_handle, (const char *)ks.s);
-        ks.l = 0;
-        destroy_kf(current_entry->value);
-        HASH_DEL(hash, current_entry);
-        free(current_entry);
-    }
     // Demultiplex and write out.
+    for(const uint32_t idx: table.forward_order()) {
+        if(!table.entry(idx).fwd) continue; // Merged into a neighbor.
+        table.write(table.entry(idx).fwd, out_handle.buf(), tmp->buffers, -1);
+        out_handle.check();
+    }
+    count = table.size();
 #if !NDEBUG
     fprintf(stderr, "[D:%s::%s] Total number of collapsed observations: %lu.\n", __func__, ifn_stream(infname), count);
 #endif
-    free(ks.s);
-    gzclose(fp);
-    gzclose(out_handle);
-    kseq_destroy(seq);
+    out_handle.close();
     tmpvars_destroy(tmp);
 }
 #if !NDEBUG
@@ -473,61 +582,30 @@ KHASH_MAP_INIT_INT(hd, uint64_t)
 #endif
 
 void stranded_hash_dmp_core(char *infname, char *outfname, int level)
+{
+    ShardReader reader(infname);
+    stranded_hash_dmp_core(reader, infname, outfname, level);
+}
+
+void stranded_hash_dmp_core(ShardReader &reader, const char *infname, char *outfname, int level)
 {
 #if !NDEBUG
     khash_t(hd) *hds = kh_init(hd);
 #endif
-    char mode[4] = "wT"; // Defaults to uncompressed "transparent" gzip output.
-    if(level > 0) sprintf(mode, "wb%i", level % 10);
-    LOG_DEBUG("Writing stranded hash dmp information with mode: '%s'.\n", mode);
-    gzFile out_handle(gzopen(outfname, mode));
-    gzFile fp(gzopen((infname && *infname) ? infname: "-", "r"));
-    if(!fp) {
-        LOG_EXIT("Could not open %s for reading. Abort mission!\n", infname);
-    }
-    if(!out_handle) {
-        LOG_EXIT("Could not open %s for reading. Abort mission!\n", outfname);
-    }
-    kseq_t *seq(kseq_init(fp));
-    // Initialized kseq
-    int l(kseq_read(seq));
-    if(l < 0) {
-        gzclose(out_handle);
-        gzclose(fp);
-        kseq_destroy(seq);
-        return;
-    }
-    char *bs_ptr = barcode_mem_view(seq);
-    int blen = infer_barcode_length(bs_ptr);
-    LOG_DEBUG("Barcode length (inferred): %i. First barcode: %s.\n", blen, bs_ptr);
-    tmpvars_t *tmp = init_tmpvars_p(bs_ptr, blen, seq->seq.l);
-    memcpy(tmp->key, bs_ptr, blen);
-    tmp->key[blen] = '\0';
+    LOG_DEBUG("Writing stranded hash dmp information with compression level %i.\n", level > 0 ? level: -1);
+    BgzfWriter out_handle(outfname, level > 0 ? level: -1, 1); // Defaults to uncompressed output.
+    const shard_rec_t &rec(reader.rec);
+    if(!reader.next()) return;
+    const int blen(rec.bs_len);
+    LOG_DEBUG("Barcode length (inferred): %i. First barcode: %s.\n", blen, rec.bs);
+    tmpvars_t *tmp = init_tmpvars_p(const_cast<char *>(rec.bs), blen, rec.l);
     // Start hash table
-    kingfisher_hash_t *hfor(nullptr), *hrev(nullptr); // Hash forward, hash reverse
-    kingfisher_hash_t *crev((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t))); // Current reverse, current forward
-    kingfisher_hash_t *cfor((kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t)));
-    kingfisher_hash_t *tmp_hkr(crev), *tmp_hkf(cfor);
-    uint64_t count(1), fcount(0);
-    /* Handle first record.
-     * We read in a record from the fastq to get the length of the reads
+    FamilyTable table(tmp->readlen);
+    uint64_t count(0), fcount(0);
+    /* The first record was read above to get the length of the reads
      * and the barcodes.
     */
-    if(*bs_ptr == 'F') {
-        ++fcount;
-        cp_view2buf(bs_ptr + 1, cfor->id);
-        cfor->value = init_kfp(tmp->readlen);
-        HASH_ADD_STR(hfor, id, cfor);
-        pushback_kseq(cfor->value, seq, blen);
-    } else {
-        cp_view2buf(bs_ptr + 1, crev->id);
-        crev->value = init_kfp(tmp->readlen);
-        HASH_ADD_STR(hrev, id, crev);
-        pushback_kseq(hrev->value, seq, blen);
-    }
-
-    // Add reads to the hash
-    while(LIKELY((l = kseq_read(seq)) >= 0)) {
+    do {
 #if !NDEBUG
         if(UNLIKELY(++count % 1000000 == 0))
             fprintf(stderr, "[%s::%s] Number of records processed: %lu.\n", __func__,
@@ -535,30 +613,14 @@ void stranded_hash_dmp_core(char *infname, char *outfname, int level)
 #else
         ++count;
 #endif
-        if(seq->comment.s[HASH_DMP_OFFSET] == 'F') {
+        if(rec.bs[0] == 'F') {
             ++fcount;
-            cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp->key);
-            HASH_FIND_STR(hfor, tmp->key, tmp_hkf);
-            if(tmp_hkf) pushback_kseq(tmp_hkf->value, seq, blen);
-            else {
-                tmp_hkf = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hkf->value = init_kfp(tmp->readlen);
-                cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp_hkf->id);
-                pushback_kseq(tmp_hkf->value, seq, blen);
-                HASH_ADD_STR(hfor, id, tmp_hkf);
-            }
-        } else {
-            cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp->key);
-            HASH_FIND_STR(hrev, tmp->key, tmp_hkr);
-            if(tmp_hkr) pushback_kseq(tmp_hkr->value, seq, blen);
-            else {
-                tmp_hkr = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
-                tmp_hkr->value = init_kfp(tmp->readlen);
-                cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, tmp_hkr->id);
-                pushback_kseq(tmp_hkr->value, seq, blen);
-                HASH_ADD_STR(hrev, id, tmp_hkr);
-            }
-        }
+            table.add(rec.key, 0, rec.seq, rec.qual, rec.l, rec.pass_fail, rec.bs, blen);
+        } else table.add(rec.key, 1, rec.seq, rec.qual, rec.l, rec.pass_fail, rec.bs, blen);
+    } while(LIKELY(reader.next()));
+    if(neighbor_merging()) {
+        const uint64_t n_merged(table.merge_neighbors());
+        LOG_DEBUG("Merged %lu families into 1-mismatch neighbors.\n", n_merged);
     }
 #if !NDEBUG
     const uint64_t rcount(count - fcount);
@@ -567,39 +629,31 @@ void stranded_hash_dmp_core(char *infname, char *outfname, int level)
     LOG_DEBUG("Loaded all records into memory. Writing out to %s!\n", ifn_stream(outfname));
     // Write out all unmatched in forward and handle all barcodes handled from both strands.
     uint64_t duplex(0), non_duplex(0), non_duplex_fm(0);
-    kstring_t ks{0, 0, nullptr};
+    kstring_t *const ks(out_handle.buf());
     // Demultiplex and empty the hash.
 #if !NDEBUG
     khiter_t ki;
     int hamming_distance, khr;
 #endif
-    HASH_ITER(hh, hfor, cfor, tmp_hkf) {
-        HASH_FIND_STR(hrev, cfor->id, crev);
-        if(crev) {
+    for(const uint32_t idx: table.forward_order()) {
+        family_entry_t &entry(table.entry(idx));
+        if(!entry.fwd) continue; // Merged into a neighbor.
+        if(entry.rev) {
 #if !NDEBUG
-            hamming_distance = kf_hamming(cfor->value, crev->value);
+            hamming_distance = kf_hamming(table.expand(entry.fwd, 0), table.expand(entry.rev, 1));
             if((ki = kh_get(hd, hds, hamming_distance)) == kh_end(hds)) {
                 ki = kh_put(hd, hds, hamming_distance, &khr);
                 kh_val(hds, ki) = 1;
             } else ++kh_val(hds, ki);
 #endif
             ++duplex;
-            zstranded_process_write(cfor->value, crev->value, &ks, tmp->buffers); // Found from both strands!
-            destroy_kf(cfor->value); destroy_kf(crev->value);
-            HASH_DEL(hrev, crev); HASH_DEL(hfor, cfor);
-            if(crev) free(crev), crev = nullptr;
-            if(cfor) free(cfor), cfor = nullptr;
-
+            table.write_duplex(entry, ks, tmp->buffers); // Found from both strands!
         } else {
             ++non_duplex;
-            if(cfor->value->length > 1) ++non_duplex_fm;
-            dmp_process_write(cfor->value, &ks, tmp->buffers, 0); // No reverse strand found. \='{
-            destroy_kf(cfor->value);
-            gzputs(out_handle, (const char *)ks.s);
-            ks.l = 0;
-            HASH_DEL(hfor, cfor);
-            free(cfor);
+            if(entry.fwd.length() > 1) ++non_duplex_fm;
+            table.write(entry.fwd, ks, tmp->buffers, 0); // No reverse strand found. \='{
         }
+        out_handle.check();
     }
 #if !NDEBUG
     fprintf(stderr, "#HD\tCount\n");
@@ -609,23 +663,19 @@ void stranded_hash_dmp_core(char *infname, char *outfname, int level)
     kh_destroy(hd, hds);
 #endif
     LOG_DEBUG("Before handling reverse only counts for non_duplex: %lu.\n", non_duplex);
-    HASH_ITER(hh, hrev, crev, tmp_hkr) {
+    for(const uint32_t idx: table.reverse_order()) {
+        family_entry_t &entry(table.entry(idx));
+        if(entry.fwd || !entry.rev) continue; // Already written as a duplex family, or merged into a neighbor.
         ++non_duplex;
-        if(crev->value->length > 1) ++non_duplex_fm;
-        dmp_process_write(crev->value, &ks, tmp->buffers, 1); // Only reverse strand found. \='{
-        destroy_kf(crev->value);
-        gzputs(out_handle, (const char *)ks.s);
-        ks.l = 0;
-        HASH_DEL(hrev, crev);
-        free(crev);
+        if(entry.rev.length() > 1) ++non_duplex_fm;
+        table.write(entry.rev, ks, tmp->buffers, 1); // Only reverse strand found. \='{
+        out_handle.check();
     }
     LOG_DEBUG("Number of duplex observations: %lu.\t"
               "Number of non-duplex observations: %lu.\t"
               "Non-duplex families: %lu\n",
               duplex, non_duplex, non_duplex_fm);
-    free(ks.s);
-    gzclose(fp); gzclose(out_handle);
-    kseq_destroy(seq);
+    out_handle.close();
     tmpvars_destroy(tmp);
 }
 
@@ -13,10 +13,18 @@ extern "C" {
 
 namespace bmf {
 
+class ShardReader;
+
 //KHASH_MAP_INIT_STR(dmp, kingfisher_t *)
 void hash_dmp_core(char *infname, char *outfname, int level);
 int hashcollapse_main(int argc, char *argv[]);
 void stranded_hash_dmp_core(char *infname, char *outfname, int level);
+/*
+ * As above, but collapsing shards from an open reader, such as a ShardStore bucket.
+ * infname is only used to label log messages.
+ */
+void hash_dmp_core(ShardReader &reader, const char *infname, char *outfname, int level);
+void stranded_hash_dmp_core(ShardReader &reader, const char *infname, char *outfname, int level);
 tmpvars_t *init_tmpvars_p(char *bs_ptr, int blen, int readlen);
 
 struct kingfisher_hash_t {
@@ -0,0 +1,82 @@
+#ifndef INTFMT_H
+#define INTFMT_H
+#include <cstdint>
+#include <cstring>
+#include "htslib/kstring.h"
+#include "dlib/compiler_util.h"
+
+namespace bmf {
+
+/*
+ * Decimal formatting of unsigned integers without printf, for the FA/PV B:I arrays,
+ * which are written one value per base. Two digits are produced per division from DIGIT_PAIRS.
+ */
+static const char DIGIT_PAIRS[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+#define U32_STR_MAX 10 // Digits in UINT32_MAX
+
+CONST static inline int u32_ndigits(uint32_t val)
+{
+    return val < 10 ? 1: val < 100 ? 2: val < 1000 ? 3: val < 10000 ? 4: val < 100000 ? 5:
+           val < 1000000 ? 6: val < 10000000 ? 7: val < 100000000 ? 8: val < 1000000000 ? 9: 10;
+}
+
+/*
+ * @func u32_to_str
+ * Writes val in decimal, as "%u" would, without a terminating null.
+ * :param: val [uint32_t] Value to format.
+ * :param: buf [char *] Output, with room for at least U32_STR_MAX characters.
+ * :returns: [int] Number of characters written.
+ */
+static inline int u32_to_str(uint32_t val, char *buf)
+{
+    const int n(u32_ndigits(val));
+    char *p(buf + n);
+    while(val >= 100) {
+        const uint32_t r((val % 100) << 1);
+        val /= 100;
+        p -= 2;
+        memcpy(p, DIGIT_PAIRS + r, 2);
+    }
+    if(val >= 10) memcpy(p - 2, DIGIT_PAIRS + (val << 1), 2);
+    else *--p = '0' + val;
+    return n;
+}
+
+/*
+ * @func kput_u32_array
+ * Appends ",%u" for each element of arr to ks, as in the values of a B:I tag,
+ * growing ks once for the worst case rather than per value.
+ * :param: arr [const T *] Unsigned values, no wider than 32 bits.
+ * :param: n [int] Number of values.
+ * :param: ks [kstring_t *] Output.
+ * :returns: [int] 0 on success, EOF if ks could not be grown.
+ */
+template<typename T>
+static inline int kput_u32_array(const T *arr, int n, kstring_t *ks)
+{
+    static_assert(sizeof(T) <= sizeof(uint32_t), "kput_u32_array formats at most 32-bit values.");
+    if(ks_resize(ks, ks->l + (size_t)n * (U32_STR_MAX + 1) + 1) < 0) return EOF;
+    char *p(ks->s + ks->l);
+    for(int i(0); i < n; ++i) {
+        *p++ = ',';
+        p += u32_to_str(arr[i], p);
+    }
+    ks->l = p - ks->s;
+    ks->s[ks->l] = '\0';
+    return 0;
+}
+
+} /* namespace bmf */
+
+#endif /* INTFMT_H */
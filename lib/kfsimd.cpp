@@ -0,0 +1,213 @@
+#include "lib/kfsimd.h"
+
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define KF_X86 1
+#else
+#    define KF_X86 0
+#endif
+
+namespace bmf {
+
+namespace {
+
+typedef void (*argmax_fn)(const uint32_t *, int, uint8_t *);
+typedef uint64_t (*agree_fn)(const uint16_t *, const uint8_t *, int, uint16_t *);
+
+struct kernels_t {
+    kf_simd_t level;
+    argmax_fn argmax;
+    agree_fn agree;
+};
+
+/*
+ * Scalar versions. These also handle the tails left over by the vector kernels, starting at position start.
+ * Ties move to the later nucleotide, matching arr_max_u32's comparison tree.
+ */
+void argmax_scalar_from(const uint32_t *sums, int readlen, uint8_t *argmax, int start)
+{
+    for(int i(start); i < readlen; ++i) {
+        int best(0);
+        uint32_t bestval(sums[i]);
+        for(int n(1); n < 5; ++n)
+            if(sums[n * readlen + i] >= bestval) best = n, bestval = sums[n * readlen + i];
+        argmax[i] = best;
+    }
+}
+
+uint64_t agree_scalar_from(const uint16_t *counts, const uint8_t *argmax, int readlen, uint16_t *agrees, int start)
+{
+    uint64_t ret(0);
+    for(int i(start); i < readlen; ++i) {
+        agrees[i] = counts[argmax[i] * readlen + i];
+        ret += agrees[i];
+        if(argmax[i] != 4) ret += counts[4 * readlen + i];
+    }
+    return ret;
+}
+
+void argmax_scalar(const uint32_t *sums, int readlen, uint8_t *argmax)
+{
+    argmax_scalar_from(sums, readlen, argmax, 0);
+}
+
+uint64_t agree_scalar(const uint16_t *counts, const uint8_t *argmax, int readlen, uint16_t *agrees)
+{
+    return agree_scalar_from(counts, argmax, readlen, agrees, 0);
+}
+
+#if KF_X86
+
+__attribute__((target("sse4.1")))
+void argmax_sse41(const uint32_t *sums, int readlen, uint8_t *argmax)
+{
+    int i(0);
+    for(; i + 4 <= readlen; i += 4) {
+        __m128i v[5];
+        for(int n(0); n < 5; ++n) v[n] = _mm_loadu_si128((const __m128i *)(sums + n * readlen + i));
+        const __m128i max(_mm_max_epu32(_mm_max_epu32(_mm_max_epu32(v[0], v[1]), _mm_max_epu32(v[2], v[3])), v[4]));
+        // Later nucleotides overwrite earlier ones so that ties go to the last maximum.
+        __m128i idx(_mm_setzero_si128());
+        for(int n(1); n < 5; ++n) idx = _mm_blendv_epi8(idx, _mm_set1_epi32(n), _mm_cmpeq_epi32(v[n], max));
+        idx = _mm_packus_epi16(_mm_packus_epi32(idx, idx), idx);
+        const int packed(_mm_cvtsi128_si32(idx));
+        memcpy(argmax + i, &packed, sizeof(packed));
+    }
+    argmax_scalar_from(sums, readlen, argmax, i);
+}
+
+__attribute__((target("sse4.1")))
+uint64_t agree_sse41(const uint16_t *counts, const uint8_t *argmax, int readlen, uint16_t *agrees)
+{
+    const __m128i zero(_mm_setzero_si128()), four(_mm_set1_epi16(4));
+    __m128i acc(zero);
+    int i(0);
+    for(; i + 8 <= readlen; i += 8) {
+        const __m128i am(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(argmax + i))));
+        __m128i agree(_mm_loadu_si128((const __m128i *)(counts + i))), c;
+        for(int n(1); n < 5; ++n) {
+            c = _mm_loadu_si128((const __m128i *)(counts + n * readlen + i));
+            agree = _mm_blendv_epi8(agree, c, _mm_cmpeq_epi16(am, _mm_set1_epi16(n)));
+        }
+        _mm_storeu_si128((__m128i *)(agrees + i), agree);
+        // c holds the N counts, which count as agreeing wherever the consensus isn't N.
+        const __m128i extra(_mm_andnot_si128(_mm_cmpeq_epi16(am, four), c));
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(agree, zero), _mm_unpackhi_epi16(agree, zero)));
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(extra, zero), _mm_unpackhi_epi16(extra, zero)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] + agree_scalar_from(counts, argmax, readlen, agrees, i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i argmax8_avx2(const uint32_t *sums, int readlen)
+{
+    __m256i v[5];
+    for(int n(0); n < 5; ++n) v[n] = _mm256_loadu_si256((const __m256i *)(sums + n * readlen));
+    const __m256i max(_mm256_max_epu32(_mm256_max_epu32(_mm256_max_epu32(v[0], v[1]), _mm256_max_epu32(v[2], v[3])), v[4]));
+    __m256i idx(_mm256_setzero_si256());
+    for(int n(1); n < 5; ++n) idx = _mm256_blendv_epi8(idx, _mm256_set1_epi32(n), _mm256_cmpeq_epi32(v[n], max));
+    return idx;
+}
+
+__attribute__((target("avx2")))
+void argmax_avx2(const uint32_t *sums, int readlen, uint8_t *argmax)
+{
+    int i(0);
+    for(; i + 16 <= readlen; i += 16) {
+        // packus works within 128-bit lanes, so restore position order before narrowing to bytes.
+        const __m256i packed(_mm256_permute4x64_epi64(_mm256_packus_epi32(argmax8_avx2(sums + i, readlen),
+                                                                          argmax8_avx2(sums + i + 8, readlen)), 0xD8));
+        _mm_storeu_si128((__m128i *)(argmax + i), _mm_packus_epi16(_mm256_castsi256_si128(packed),
+                                                                   _mm256_extracti128_si256(packed, 1)));
+    }
+    argmax_scalar_from(sums, readlen, argmax, i);
+}
+
+__attribute__((target("avx2")))
+uint64_t agree_avx2(const uint16_t *counts, const uint8_t *argmax, int readlen, uint16_t *agrees)
+{
+    const __m256i zero(_mm256_setzero_si256()), four(_mm256_set1_epi16(4));
+    __m256i acc(zero);
+    int i(0);
+    for(; i + 16 <= readlen; i += 16) {
+        const __m256i am(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(argmax + i))));
+        __m256i agree(_mm256_loadu_si256((const __m256i *)(counts + i))), c;
+        for(int n(1); n < 5; ++n) {
+            c = _mm256_loadu_si256((const __m256i *)(counts + n * readlen + i));
+            agree = _mm256_blendv_epi8(agree, c, _mm256_cmpeq_epi16(am, _mm256_set1_epi16(n)));
+        }
+        _mm256_storeu_si256((__m256i *)(agrees + i), agree);
+        const __m256i extra(_mm256_andnot_si256(_mm256_cmpeq_epi16(am, four), c));
+        acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_unpacklo_epi16(agree, zero), _mm256_unpackhi_epi16(agree, zero)));
+        acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_unpacklo_epi16(extra, zero), _mm256_unpackhi_epi16(extra, zero)));
+    }
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    uint64_t ret(agree_scalar_from(counts, argmax, readlen, agrees, i));
+    for(const uint32_t lane: lanes) ret += lane;
+    return ret;
+}
+
+#endif /* KF_X86 */
+
+int cpu_supports(kf_simd_t level)
+{
+#if KF_X86
+    __builtin_cpu_init();
+    switch(level) {
+        case KF_AVX2: return __builtin_cpu_supports("avx2");
+        case KF_SSE41: return __builtin_cpu_supports("sse4.1");
+        default: return 1;
+    }
+#else
+    return level == KF_SCALAR;
+#endif
+}
+
+kernels_t make_kernels(kf_simd_t level)
+{
+    switch(level) {
+#if KF_X86
+        case KF_AVX2: return kernels_t{KF_AVX2, &argmax_avx2, &agree_avx2};
+        case KF_SSE41: return kernels_t{KF_SSE41, &argmax_sse41, &agree_sse41};
+#endif
+        default: return kernels_t{KF_SCALAR, &argmax_scalar, &agree_scalar};
+    }
+}
+
+kernels_t &kernels()
+{
+    static kernels_t ret(make_kernels(cpu_supports(KF_AVX2) ? KF_AVX2
+                                      : cpu_supports(KF_SSE41) ? KF_SSE41
+                                                               : KF_SCALAR));
+    return ret;
+}
+
+} /* anonymous namespace */
+
+void kf_argmax_cols(const uint32_t *phred_sums, int readlen, uint8_t *argmax)
+{
+    kernels().argmax(phred_sums, readlen, argmax);
+}
+
+uint64_t kf_agree_cols(const uint16_t *nuc_counts, const uint8_t *argmax, int readlen, uint16_t *agrees)
+{
+    return kernels().agree(nuc_counts, argmax, readlen, agrees);
+}
+
+int kf_set_simd(kf_simd_t level)
+{
+    if(!cpu_supports(level)) return -1;
+    kernels() = make_kernels(level);
+    return 0;
+}
+
+kf_simd_t kf_get_simd()
+{
+    return kernels().level;
+}
+
+} /* namespace bmf */
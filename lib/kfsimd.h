@@ -0,0 +1,50 @@
+#ifndef KFSIMD_H
+#define KFSIMD_H
+#include <cstdint>
+
+namespace bmf {
+
+/*
+ * Column kernels over a family's nucleotide-major (SoA) arrays,
+ * where the value for nucleotide n at read position i is stored at [n * readlen + i].
+ * The best implementation supported by the running CPU is chosen on first use.
+ */
+enum kf_simd_t {
+    KF_SCALAR,
+    KF_SSE41,
+    KF_AVX2
+};
+
+/*
+ * @func kf_argmax_cols
+ * Vectorized arr_max_u32 over every position in a read.
+ * Ties resolve to the later nucleotide, exactly as arr_max_u32 does.
+ * :param: phred_sums [const uint32_t *] SoA phred sums, 5 * readlen.
+ * :param: readlen [int] Read length.
+ * :param: argmax [uint8_t *] Output, readlen nucleotide numbers (0-4).
+ */
+void kf_argmax_cols(const uint32_t *phred_sums, int readlen, uint8_t *argmax);
+
+/*
+ * @func kf_agree_cols
+ * Gathers the count of reads agreeing with the consensus nucleotide at every position.
+ * :param: nuc_counts [const uint16_t *] SoA nucleotide counts, 5 * readlen.
+ * :param: argmax [const uint8_t *] Consensus nucleotides, as from kf_argmax_cols.
+ * :param: readlen [int] Read length.
+ * :param: agrees [uint16_t *] Output, readlen agreement counts.
+ * :returns: [uint64_t] Number of observations which are not counted as differences from the consensus:
+ * all agreeing observations, plus Ns at positions whose consensus is not N.
+ */
+uint64_t kf_agree_cols(const uint16_t *nuc_counts, const uint8_t *argmax, int readlen, uint16_t *agrees);
+
+/*
+ * @func kf_set_simd
+ * Overrides the kernel selection. Primarily for testing and benchmarking.
+ * :returns: [int] 0 on success, -1 if the CPU does not support level.
+ */
+int kf_set_simd(kf_simd_t level);
+kf_simd_t kf_get_simd();
+
+} /* namespace bmf */
+
+#endif /* KFSIMD_H */
@@ -1,16 +1,16 @@
 #include "kingfisher.h"
+#include "lib/kfsimd.h"
+#include "lib/pvtable.h"
 
 #include "dlib/bam_util.h"
 #include "dlib/io_util.h"
 
 namespace bmf {
 
-#define dmp_pos(kfp, bufs, argmaxret, i, index, diffcount)\
+// Quality and N-masking for a position whose agreement count is already in bufs->agrees[i].
+#define dmp_call(kfp, bufs, pvt, argmaxret, i, index)\
     do {\
-        bufs->cons_quals[i] = pvalue_to_phred(igamc_pvalues(kfp->length, LOG10_TO_CHI2((kfp->phred_sums[index]))));\
-        bufs->agrees[i] = kfp->nuc_counts[index];\
-        diffcount -= bufs->agrees[i];\
-        if(argmaxret != 4) diffcount -= kfp->nuc_counts[i * 5 + 4]; /*(Skip Ns in counting diffs) */\
+        bufs->cons_quals[i] = pvt.consensus(kfp->length, kfp->phred_sums[index]);\
         if(bufs->cons_quals[i] > 2 && (double)bufs->agrees[i] / kfp->length > MIN_FRAC_AGREED) {\
             bufs->cons_seq_buffer[i] = num2nuc(argmaxret);\
         } else {\
@@ -19,14 +19,24 @@ namespace bmf {
         }\
     } while(0)
 
+#define dmp_pos(kfp, bufs, pvt, argmaxret, i, index, diffcount)\
+    do {\
+        bufs->agrees[i] = kfp->nuc_counts[index];\
+        diffcount -= bufs->agrees[i];\
+        if(argmaxret != 4) diffcount -= kfp->nuc_counts[4 * kfp->readlen + i]; /*(Skip Ns in counting diffs) */\
+        dmp_call(kfp, bufs, pvt, argmaxret, i, index);\
+    } while(0)
+
 void dmp_process_write(kingfisher_t *kfp, kstring_t *ks, tmpbuffers_t *bufs, int is_rev)
 {
-    int i, diffs(kfp->length * kfp->readlen);
-    for(i = 0; i < kfp->readlen; ++i) {
-        const int argmaxret(kfp_argmax(kfp, i));
-        const int index(argmaxret + i * 5);
-        dmp_pos(kfp, bufs, argmaxret, i, index, diffs);
-    }
+    int i;
+    PvTable &pvt(pv_table());
+    // Consensus calls and agreement counts are gathered a column at a time; see lib/kfsimd.h.
+    kf_argmax_cols(kfp->phred_sums, kfp->readlen, bufs->argmax);
+    const int64_t diffs((int64_t)kfp->length * kfp->readlen -
+                        (int64_t)kf_agree_cols(kfp->nuc_counts, bufs->argmax, kfp->readlen, bufs->agrees));
+    for(i = 0; i < kfp->readlen; ++i)
+        dmp_call(kfp, bufs, pvt, bufs->argmax[i], i, bufs->argmax[i] * kfp->readlen + i);
     ksprintf(ks, "@%s ", kfp->barcode + 1);
     kfill_both(kfp->readlen, bufs->agrees, bufs->cons_quals, ks);
     bufs->cons_seq_buffer[kfp->readlen] = '\0';
@@ -41,7 +51,55 @@ void dmp_process_write(kingfisher_t *kfp, kstring_t *ks, tmpbuffers_t *bufs, int
     kputc('\n', ks);
     kputsn(bufs->cons_seq_buffer, kfp->readlen, ks);
     kputsnl("\n+\n", ks);
-    for(i = 0; i < kfp->readlen; ++i) kputc(kfp->max_phreds[nuc2num(bufs->cons_seq_buffer[i]) + 5 * i], ks);
+    for(i = 0; i < kfp->readlen; ++i) kputc(kfp->max_phreds[nuc2num(bufs->cons_seq_buffer[i]) * kfp->readlen + i], ks);
+    kputc('\n', ks);
+}
+
+void singleton_process_write(const singleton_t *one, int readlen, kstring_t *ks, tmpbuffers_t *bufs, int is_rev)
+{
+    int i, agreed(0);
+    PvTable &pvt(pv_table());
+    const char *const seq(one->data), *const qual(seq + one->l), *const barcode(qual + one->l);
+    const int l((int)one->l < readlen ? (int)one->l: readlen);
+    for(i = 0; i < l; ++i) {
+        // With a single read, every phred sum but the read's own base is 0,
+        // so arr_max_u32 picks that base unless its quality is 0 too, in which case it picks N.
+        const int nuc(nuc2num(seq[i]));
+        const uint32_t phred(qual[i] - 33);
+        const int argmaxret(phred ? nuc: 4);
+        agreed += (bufs->agrees[i] = argmaxret == nuc);
+        bufs->cons_quals[i] = pvt.consensus(1, bufs->agrees[i] ? phred: 0);
+        if(bufs->cons_quals[i] > 2 && bufs->agrees[i]) {
+            bufs->cons_seq_buffer[i] = num2nuc(argmaxret);
+        } else {
+            bufs->cons_quals[i] = 2;
+            bufs->cons_seq_buffer[i] = 'N';
+        }
+    }
+    // Positions past the end of a short read have no observations.
+    for(; i < readlen; ++i) bufs->agrees[i] = 0, bufs->cons_quals[i] = 2, bufs->cons_seq_buffer[i] = 'N';
+    kputc('@', ks);
+    kputsn(barcode + 1, strnlen(barcode + 1, one->blen - 1), ks); // Stop at a NUL, as "%s" would.
+    kputc(' ', ks);
+    kfill_both(readlen, bufs->agrees, bufs->cons_quals, ks);
+    kputsnl("\tFP:i:", ks);
+    kputc(one->pass_fail, ks);
+    kputsnl("\tFM:i:1", ks);
+    if(is_rev != -1) {
+        kputsnl("\tRV:i:", ks);
+        kputc(is_rev ? '1': '0', ks);
+        kputsnl("\tDR:i:0", ks);
+    }
+    // NF is an integer for a family of one.
+    kputsnl("\tNF:f:", ks);
+    kputw(readlen - agreed, ks);
+    kputsnl(".0000\n", ks);
+    kputsn(bufs->cons_seq_buffer, readlen, ks);
+    kputsnl("\n+\n", ks);
+    // The quality is the read's own (floored at '#', like max_phreds) wherever its base was called.
+    for(i = 0; i < l; ++i)
+        kputc(nuc2num(bufs->cons_seq_buffer[i]) == nuc2num(seq[i]) && qual[i] > '#' ? qual[i]: '#', ks);
+    for(; i < readlen; ++i) kputc('#', ks);
     kputc('\n', ks);
 }
 
@@ -93,26 +151,29 @@ void zstranded_process_write(kingfisher_t *kfpf, kingfisher_t *kfpr, kstring_t *
 {
     const int FM (kfpf->length + kfpr->length);
     int diffs(FM * kfpf->readlen), index, i;
+    PvTable &pvt(pv_table());
+    kf_argmax_cols(kfpf->phred_sums, kfpf->readlen, bufs->argmax);
+    kf_argmax_cols(kfpr->phred_sums, kfpr->readlen, bufs->argmax_rev);
     for(i = 0; i < kfpf->readlen; ++i) {
-        const int argmaxretf(kfp_argmax(kfpf, i)); // Forward consensus nucleotide
-        const int argmaxretr(kfp_argmax(kfpr, i)); // Reverse consensus nucleotide
+        const int argmaxretf(bufs->argmax[i]); // Forward consensus nucleotide
+        const int argmaxretr(bufs->argmax_rev[i]); // Reverse consensus nucleotide
         if(argmaxretf == argmaxretr) { // Both strands supported the same base call.
-            index = i * 5 + argmaxretf;
+            index = argmaxretf * kfpf->readlen + i;
             kfpf->phred_sums[index] += kfpr->phred_sums[index];
             kfpf->nuc_counts[index] += kfpr->nuc_counts[index];
-            dmp_pos(kfpf, bufs, argmaxretf, i, index, diffs);
+            dmp_pos(kfpf, bufs, pvt, argmaxretf, i, index, diffs);
             if(kfpr->max_phreds[index] > kfpf->max_phreds[index]) kfpf->max_phreds[index] = kfpr->max_phreds[index];
         } else if(argmaxretf == 4) { // Forward is N'd and reverse is not. Reverse call is probably right.
-            index = i * 5 + argmaxretr;
+            index = argmaxretr * kfpf->readlen + i;
             kfpf->phred_sums[index] += kfpr->phred_sums[index];
             kfpf->nuc_counts[index] += kfpr->nuc_counts[index];
-            dmp_pos(kfpf, bufs, argmaxretr, i, index, diffs);
+            dmp_pos(kfpf, bufs, pvt, argmaxretr, i, index, diffs);
             kfpf->max_phreds[index] = kfpr->max_phreds[index];
         } else if(argmaxretr == 4) { // Forward is N'd and reverse is not. Reverse call is probably right.
-            index = i * 5 + argmaxretf;
+            index = argmaxretf * kfpf->readlen + i;
             kfpf->phred_sums[index] += kfpr->phred_sums[index];
             kfpf->nuc_counts[index] += kfpr->nuc_counts[index];
-            dmp_pos(kfpf, bufs, argmaxretf, i, index, diffs);
+            dmp_pos(kfpf, bufs, pvt, argmaxretf, i, index, diffs);
             // Don't update max_phreds, since the max phred is already here.
         } else bufs->cons_quals[i] = 0, bufs->agrees[i] = 0, bufs->cons_seq_buffer[i] = 'N';
     }
@@ -124,7 +185,7 @@ void zstranded_process_write(kingfisher_t *kfpf, kingfisher_t *kfpr, kstring_t *
              FM, kfpr->length, (double) diffs / FM, kfpf->length && kfpr->length,
              bufs->cons_seq_buffer);
     for(i = 0; i < kfpf->readlen; ++i)
-        kputc(kfpf->max_phreds[nuc2num(bufs->cons_seq_buffer[i]) + 5 * i], ks);
+        kputc(kfpf->max_phreds[nuc2num(bufs->cons_seq_buffer[i]) * kfpf->readlen + i], ks);
     kputc('\n', ks);
     //const int ND = get_num_differ
     return;
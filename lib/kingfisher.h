@@ -8,6 +8,7 @@
 #include "htslib/kstring.h"
 #include "dlib/cstr_util.h"
 #include "include/igamc_cephes.h"
+#include "lib/intfmt.h"
 #include "lib/splitter.h"
 
 #ifndef MAX_PV
@@ -31,6 +32,8 @@ struct tmpbuffers_t {
     char cons_seq_buffer[SEQBUF_SIZE];
     uint32_t cons_quals[SEQBUF_SIZE];
     uint16_t agrees[SEQBUF_SIZE];
+    uint8_t argmax[SEQBUF_SIZE];
+    uint8_t argmax_rev[SEQBUF_SIZE];
 };
 
 
@@ -44,6 +47,11 @@ struct tmpvars_t {
 };
 
 
+/*
+ * Per-position accumulators are stored nucleotide-major (SoA):
+ * the value for nucleotide n (nuc2num) at read position i is at [n * readlen + i],
+ * so that each nucleotide is one contiguous lane for the column kernels in lib/kfsimd.h.
+ */
 struct kingfisher_t {
     uint16_t *nuc_counts; // Count of nucleotides of this form
     uint32_t *phred_sums; // Sums of -10log10(p-value)
@@ -55,21 +63,39 @@ struct kingfisher_t {
 };
 
 
+/*
+ * A family of a single read, stored verbatim until a second read arrives (see FamilyTable).
+ * Most families are singletons, and this costs 2 bytes per base instead of a kingfisher_t's 35.
+ */
+struct singleton_t {
+    char *data; // l bases, l quality characters, then the strand character and barcode (blen bytes).
+    uint32_t l; // Read length
+    uint8_t blen; // Barcode length, including the strand character
+    char pass_fail;
+};
+
+
 void zstranded_process_write(kingfisher_t *kfpf, kingfisher_t *kfpr, kstring_t *ks, tmpbuffers_t *bufs);
 void dmp_process_write(kingfisher_t *kfp, kstring_t *ks, tmpbuffers_t *bufs, int is_rev);
+/*
+ * @func singleton_process_write
+ * Writes exactly what dmp_process_write would for a family holding only this read,
+ * without building its accumulators or calling the consensus for each base.
+ * :param: readlen [int] Family read length. The read is truncated or padded with Ns to it.
+ */
+void singleton_process_write(const singleton_t *one, int readlen, kstring_t *ks, tmpbuffers_t *bufs, int is_rev);
 int kf_hamming(kingfisher_t *kf1, kingfisher_t *kf2);
 
 static inline void kfill_both(int readlen, uint16_t *agrees, uint32_t *quals, kstring_t *ks)
 {
-    int i;
     kputsnl("FA:B:I", ks);
-    for(i = 0; i < readlen; ++i) ksprintf(ks, ",%u", agrees[i]);
+    kput_u32_array(agrees, readlen, ks);
     kputsnl("\tPV:B:I", ks);
-    for(i = 0; i < readlen; ++i) ksprintf(ks, ",%u", quals[i]);
+    kput_u32_array(quals, readlen, ks);
 }
 
 static inline void pb_pos(kingfisher_t *kfp, kseq_t *seq, int i) {
-    const uint32_t posdata(nuc2num(seq->seq.s[i]) + i * 5);
+    const uint32_t posdata(nuc2num(seq->seq.s[i]) * kfp->readlen + i);
     ++kfp->nuc_counts[posdata];
     kfp->phred_sums[posdata] += seq->qual.s[i] - 33;
     if(seq->qual.s[i] > kfp->max_phreds[posdata]) kfp->max_phreds[posdata] = seq->qual.s[i];
@@ -86,8 +112,8 @@ static inline void pushback_inmem(kingfisher_t *kfp, kseq_t *seq, int offset, in
     }
     uint32_t posdata, i;
     for(i = offset; i < seq->seq.l; ++i) {
-        posdata = nuc2num(seq->seq.s[i]) + (i - offset) * 5;
-        assert(posdata < (unsigned)kfp->readlen * 5);
+        assert(i - offset < (unsigned)kfp->readlen);
+        posdata = nuc2num(seq->seq.s[i]) * kfp->readlen + (i - offset);
         ++kfp->nuc_counts[posdata];
         kfp->phred_sums[posdata] += seq->qual.s[i] - 33;
         if(seq->qual.s[i] > kfp->max_phreds[posdata])
@@ -102,34 +128,81 @@ static inline void pushback_kseq(kingfisher_t *kfp, kseq_t *seq, int blen)
         memcpy(kfp->barcode, seq->comment.s + HASH_DMP_OFFSET, blen);
         kfp->barcode[blen] = '\0';
     }
-    for(int i(0); i < kfp->readlen; ++i) pb_pos(kfp, seq, i);
+    // Reads shorter than the family (variable-length barcodes) only contribute the bases they have.
+    const int l(kfp->readlen < (int)seq->seq.l ? kfp->readlen: (int)seq->seq.l);
+    for(int i(0); i < l; ++i) pb_pos(kfp, seq, i);
+}
+
+/*
+ * @func pushback_raw
+ * Equivalent to pushback_kseq for a record held outside of a kseq_t.
+ * :param: barcode [const char *] Strand character followed by the barcode.
+ * :param: blen [int] Length of barcode, including the strand character.
+ * :param: l [int] Read length. Bases past the family's read length are ignored.
+ */
+static inline void pushback_raw(kingfisher_t *kfp, const char *seq, const char *qual, int l,
+                                char pass_fail, const char *barcode, int blen)
+{
+    if(!kfp->length++) {
+        kfp->pass_fail = pass_fail;
+        memcpy(kfp->barcode, barcode, blen);
+        kfp->barcode[blen] = '\0';
+    }
+    if(l > kfp->readlen) l = kfp->readlen;
+    for(int i(0); i < l; ++i) {
+        const uint32_t posdata(nuc2num(seq[i]) * kfp->readlen + i);
+        ++kfp->nuc_counts[posdata];
+        kfp->phred_sums[posdata] += qual[i] - 33;
+        if(qual[i] > kfp->max_phreds[posdata]) kfp->max_phreds[posdata] = qual[i];
+    }
+}
+
+/*
+ * @func kf_merge
+ * Adds src's reads to dst, as if each had been pushed back onto dst. The families must share a read length.
+ */
+static inline void kf_merge(kingfisher_t *dst, const kingfisher_t *src)
+{
+    assert(dst->readlen == src->readlen);
+    if(!dst->length) {
+        dst->pass_fail = src->pass_fail;
+        memcpy(dst->barcode, src->barcode, sizeof(dst->barcode));
+    }
+    dst->length += src->length;
+    for(int i(0), r5(dst->readlen * 5); i < r5; ++i) {
+        dst->nuc_counts[i] += src->nuc_counts[i];
+        dst->phred_sums[i] += src->phred_sums[i];
+        if(src->max_phreds[i] > dst->max_phreds[i]) dst->max_phreds[i] = src->max_phreds[i];
+    }
 }
 
 
 /*
  * @func arr_max_u32
- * :param: arr [uint32_t *] 2-d array of values. 5 * index + basecall is the index to use.
+ * :param: arr [uint32_t *] 2-d array of values. stride * basecall + index is the index to use.
  * :param: index [int] Base in read to find the maximum value for.
+ * :param: stride [int] Distance between nucleotide lanes (the read length).
  * :returns: [int] the nucleotide number for the maximum value at this index in the read.
  */
-CONST static inline int arr_max_u32(uint32_t *arr, int index)
+PURE static inline int arr_max_u32(const uint32_t *arr, int index, int stride)
 {
-    arr += index * 5;
-    return (arr[0] > arr[1]) ? ((arr[0] > arr[2]) ? ((arr[0] > arr[3]) ? (arr[0] > arr[4] ? 0: 4)
-                                                                       : (arr[3] > arr[4] ? 3: 4))
-                                                  : (arr[2] > arr[3])  ? (arr[2] > arr[4] ? 2: 4)
-                                                                       : (arr[3] > arr[4] ? 3: 4))
-                             : ((arr[1] > arr[2]) ? ((arr[1] > arr[3]) ? (arr[1] > arr[4] ? 1: 4)
-                                                                       : (arr[3] > arr[4] ? 3: 4))
-                                                  : ((arr[2] > arr[3]) ? (arr[2] > arr[4] ? 2: 4)
-                                                                       : (arr[3] > arr[4] ? 3: 4)));
+    const uint32_t a0(arr[index]), a1(arr[index + stride]), a2(arr[index + 2 * stride]),
+                   a3(arr[index + 3 * stride]), a4(arr[index + 4 * stride]);
+    return (a0 > a1) ? ((a0 > a2) ? ((a0 > a3) ? (a0 > a4 ? 0: 4)
+                                               : (a3 > a4 ? 3: 4))
+                                  : (a2 > a3)  ? (a2 > a4 ? 2: 4)
+                                               : (a3 > a4 ? 3: 4))
+                     : ((a1 > a2) ? ((a1 > a3) ? (a1 > a4 ? 1: 4)
+                                               : (a3 > a4 ? 3: 4))
+                                  : ((a2 > a3) ? (a2 > a4 ? 2: 4)
+                                               : (a3 > a4 ? 3: 4)));
 
 }
 
 
-CONST static inline int kfp_argmax(kingfisher_t *kfp, int index)
+PURE static inline int kfp_argmax(kingfisher_t *kfp, int index)
 {
-    return arr_max_u32(kfp->phred_sums, index);
+    return arr_max_u32(kfp->phred_sums, index, kfp->readlen);
 }
 
 std::vector<double> get_igamc_threshold(int family_size, int max_phred=MAX_PV, double delta=0.002);
@@ -0,0 +1,422 @@
+#include "lib/memshard.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "src/bmf_collapse.h"
+#include "dlib/io_util.h"
+#include "dlib/misc_util.h"
+#include "lib/bgzfwriter.h"
+#include "lib/binner.h"
+#include "lib/famtable.h"
+#include "lib/fqreader.h"
+#include "lib/hashdmp.h"
+#include "lib/mseq.h"
+#include "lib/shardfmt.h"
+#include "lib/spsc_queue.h"
+
+namespace bmf {
+
+namespace {
+
+const size_t SHARD_BATCH_BYTES = 1 << 16; // Packed bytes per shard batch before it is handed to a consumer.
+const size_t QUEUE_DEPTH = 1 << 6; // Batches in flight per queue.
+
+/*
+ * Packed shard records hold everything hashdmp reads from a marked temporary fastq record, minus the name:
+ * pass/fail character, strand character, barcode (blen bytes), then for each read in the pair,
+ * a uint32_t length followed by that many bases and that many quality scores.
+ */
+struct packed_read_t {
+    const char *seq;
+    const char *qual;
+    uint32_t l;
+};
+
+static inline void pack_read(const mseq_t *mvar, uint32_t l, kstring_t *ks)
+{
+    kputsn((const char *)&l, sizeof(l), ks);
+    kputsn(mvar->seq, l, ks);
+    kputsn(mvar->qual, l, ks);
+}
+
+static inline const char *unpack_read(const char *p, packed_read_t *read)
+{
+    memcpy(&read->l, p, sizeof(read->l));
+    read->seq = p + sizeof(read->l);
+    read->qual = read->seq + read->l;
+    return read->qual + read->l;
+}
+
+struct shard_batch_t {
+    size_t shard;
+    uint64_t n; // Number of records
+    kstring_t data;
+};
+
+struct shard_t {
+    kstring_t data; // Packed records in input order. Empty once spilled.
+    uint64_t n; // Number of records received
+    int spilled;
+    BgzfWriter *spill[2];
+    char *spill_path[2];
+    kstring_t out[2]; // Collapsed read 1 and read 2 output.
+    std::atomic<int> ready; // Set once out is complete.
+    shard_t(): data{0, 0, nullptr}, n(0), spilled(0), spill{nullptr, nullptr}, spill_path{nullptr, nullptr},
+               out{{0, 0, nullptr}, {0, 0, nullptr}}, ready(0) {}
+    ~shard_t() {
+        free(data.s);
+        delete spill[0], delete spill[1];
+        free(spill_path[0]), free(spill_path[1]);
+        free(out[0].s), free(out[1].s);
+    }
+};
+
+static const char *next_fq_record(const char *p)
+{
+    for(int i(0); i < 4; ++i) p = strchr(p, '\n') + 1;
+    return p;
+}
+
+/*
+ * Hands out an FqReader's records one at a time.
+ * The previous batch is kept until the current one runs out, so that both records
+ * of an interleaved pair stay valid when they straddle batches.
+ */
+class FqCursor {
+    FqReader reader;
+    fq_batch_t *batch, *prev;
+    size_t i;
+public:
+    FqCursor(const char *path, int n_threads): reader(path, n_threads), batch(nullptr), prev(nullptr), i(0) {}
+    ~FqCursor() {delete batch, delete prev;}
+    /*
+     * @func next
+     * :returns: [int] 1 if seq was pointed at the next record, 0 at end of file.
+     */
+    int next(kseq_t *seq) {
+        if(!batch || i == batch->size()) {
+            delete prev;
+            prev = batch, i = 0;
+            if((batch = reader.next()) == nullptr) return 0;
+        }
+        batch->view(i++, seq);
+        return 1;
+    }
+};
+
+class ShardCollapser {
+    marksplit_settings_t *settings;
+    std::vector<shard_t> shards;
+    std::vector<SpscQueue<shard_batch_t *> *> queues; // One per consumer. Shard i belongs to consumer i % n_consumers.
+    std::atomic<uint64_t> mem_used;
+    std::atomic<int> n_spilled;
+    const int n_consumers;
+    const int paired;
+    const int blen;
+
+    void route();
+    void consume(int id);
+    void spill_largest(int id);
+    uint64_t write_spill(shard_t &shard, const char *p, const char *end, uint64_t index);
+    void collapse_packed(shard_t &shard, int mate, tmpbuffers_t *bufs);
+    void collapse_spilled(shard_t &shard, int mate, tmpbuffers_t *bufs);
+    void write_output();
+public:
+    ShardCollapser(marksplit_settings_t *settings);
+    ~ShardCollapser() {
+        for(auto queue: queues) delete queue;
+    }
+    void run();
+};
+
+ShardCollapser::ShardCollapser(marksplit_settings_t *settings):
+    settings(settings),
+    shards(settings->n_handles),
+    mem_used(0),
+    n_spilled(0),
+    n_consumers(settings->threads > 0 ? settings->threads: 1),
+    paired(!settings->is_se),
+    blen(settings->blen)
+{
+    for(int i(0); i < n_consumers; ++i) queues.push_back(new SpscQueue<shard_batch_t *>(QUEUE_DEPTH));
+}
+
+/*
+ * Marks each read (or pair) exactly as pp_split_inline(_se) does
+ * and appends it to the batch for its shard.
+ */
+void ShardCollapser::route()
+{
+    const int two_files(paired && !settings->interleaved);
+    const int n_inflate(std::max(1, settings->threads / (1 + two_files)));
+    FqCursor cursor1(settings->input_r1_path, n_inflate);
+    std::unique_ptr<FqCursor> cursor2(two_files ? new FqCursor(settings->input_r2_path, n_inflate): nullptr);
+    FqCursor &mate2(two_files ? *cursor2: cursor1);
+    std::vector<shard_batch_t *> pending(shards.size(), nullptr);
+    const int default_nlen((paired ? settings->blen1_2: settings->blen) + settings->offset +
+                           settings->homing_sequence_length);
+    mseq_t rseq1{}, rseq2{};
+    kseq_t v1{}, v2{};
+    char barcode[MAX_BARCODE_LENGTH + 1]{0};
+    uint64_t count(0);
+    int pass_fail, n_len, switched(0);
+    for(;;) {
+        if(!cursor1.next(&v1)) break;
+        if(paired && !mate2.next(&v2)) {
+            if(settings->interleaved)
+                LOG_EXIT("Interleaved input %s ends with an unpaired record. Abort!\n", settings->input_r1_path);
+            break;
+        }
+        if(UNLIKELY(!count)) {
+            LOG_DEBUG("Read length (inferred): %lu.\n", v1.seq.l);
+            check_rescaler(settings, v1.seq.l);
+        }
+        if(UNLIKELY(++count % settings->notification_interval == 0))
+            LOG_INFO("Number of records processed: %lu.\n", count);
+        if(paired) {
+            n_len = nlen_homing_default(&v1, &v2, settings, default_nlen, &pass_fail);
+            update_mseq(&rseq1, &v1, settings->rescaler, nullptr, n_len, 0);
+            update_mseq(&rseq2, &v2, settings->rescaler, nullptr, n_len, 1);
+            switched = switch_test(&v1, &v2, settings->offset);
+            memcpy(barcode, (switched ? v2: v1).seq.s + settings->offset, settings->blen1_2);
+            memcpy(barcode + settings->blen1_2, (switched ? v1: v2).seq.s + settings->offset, settings->blen1_2);
+        } else {
+            n_len = nlen_homing_se(&v1, settings, default_nlen, &pass_fail);
+            update_mseq(&rseq1, &v1, settings->rescaler, nullptr, n_len, 0);
+            memcpy(barcode, v1.seq.s + settings->offset, blen);
+        }
+        uint64_t bin;
+        pass_fail &= barcode_scan(barcode, blen, settings->hp_threshold, settings->n_nucs, &bin);
+        assert(bin < shards.size());
+        shard_batch_t *&batch(pending[bin]);
+        if(!batch) batch = new shard_batch_t{bin, 0, {0, 0, nullptr}};
+        kputc(pass_fail + '0', &batch->data);
+        kputc(switched ? 'R': 'F', &batch->data);
+        kputsn(barcode, blen, &batch->data);
+        if(switched) {
+            pack_read(&rseq2, v2.seq.l - n_len, &batch->data);
+            pack_read(&rseq1, v1.seq.l - n_len, &batch->data);
+        } else {
+            pack_read(&rseq1, v1.seq.l - n_len, &batch->data);
+            if(paired) pack_read(&rseq2, v2.seq.l - n_len, &batch->data);
+        }
+        if(++batch->n, batch->data.l >= SHARD_BATCH_BYTES)
+            queues[bin % n_consumers]->push(batch), batch = nullptr;
+    }
+    // If one fastq ran out first, the other's reader is stopped when it is destroyed.
+    for(size_t i(0); i < pending.size(); ++i)
+        if(pending[i]) queues[i % n_consumers]->push(pending[i]);
+    for(auto queue: queues) queue->close();
+    LOG_INFO("Collapsing %lu initial read%s....\n", count, paired ? " pairs": "s");
+}
+
+uint64_t ShardCollapser::write_spill(shard_t &shard, const char *p, const char *end, uint64_t index)
+{
+    packed_read_t read;
+    const uint64_t start(index);
+    char bc[MAX_BARCODE_LENGTH + 1];
+    while(p < end) {
+        const char pass(p[0]), strand(p[1]);
+        memcpy(bc, p + 2, blen);
+        bc[blen] = '\0';
+        p += 2 + blen;
+        for(int mate(0); mate <= paired; ++mate) {
+            p = unpack_read(p, &read);
+            if(!settings->text_shards) {
+                shard_write(shard.spill[mate], read.seq, read.qual, read.l, pass == '1', bc, strand);
+                continue;
+            }
+            kstring_t *const ks(shard.spill[mate]->buf());
+            ksprintf(ks, "@%lu ~#!#~|FP=%c|BS=%c", index, pass, strand);
+            kputs(bc, ks);
+            kputc('\n', ks);
+            kputsn(read.seq, read.l, ks);
+            kputsnl("\n+\n", ks);
+            kputsn(read.qual, read.l, ks);
+            kputc('\n', ks);
+            shard.spill[mate]->check();
+        }
+        ++index;
+    }
+    return index - start;
+}
+
+/*
+ * Moves this consumer's largest in-memory shard to temporary files in the mark/split shard format.
+ * Only the owning consumer ever touches a shard, so no locking is required.
+ */
+void ShardCollapser::spill_largest(int id)
+{
+    size_t idx(shards.size());
+    for(size_t i(id); i < shards.size(); i += n_consumers)
+        if(!shards[i].spilled && shards[i].data.m && (idx == shards.size() || shards[i].data.m > shards[idx].data.m))
+            idx = i;
+    if(idx == shards.size()) return; // Nothing left in memory to spill.
+    shard_t &shard(shards[idx]);
+    kstring_t ks{0, 0, nullptr};
+    for(int mate(0); mate <= paired; ++mate) {
+        ks.l = 0;
+        if(paired) ksprintf(&ks, "%s.tmp.%lu.R%i.fastq", settings->tmp_basename, idx, mate + 1);
+        else ksprintf(&ks, "%s.tmp.%lu.fastq", settings->tmp_basename, idx);
+        shard.spill_path[mate] = dlib::kstrdup(&ks);
+        shard.spill[mate] = new BgzfWriter(ks.s, zmode_level(settings->mode));
+        if(!settings->text_shards) shard_write_header(shard.spill[mate]);
+    }
+    free(ks.s);
+    LOG_INFO("Memory budget of %lu bytes exceeded. Spilling shard %lu (%lu records) to %s.\n",
+             settings->max_mem, idx, shard.n, shard.spill_path[0]);
+    write_spill(shard, shard.data.s, shard.data.s + shard.data.l, 0);
+    mem_used -= shard.data.m;
+    free(shard.data.s);
+    shard.data = kstring_t{0, 0, nullptr};
+    shard.spilled = 1;
+    ++n_spilled;
+}
+
+void ShardCollapser::collapse_packed(shard_t &shard, int mate, tmpbuffers_t *bufs)
+{
+    if(!shard.data.l) return;
+    const char *p(shard.data.s), *const end(p + shard.data.l);
+    char bc[MAX_BARCODE_LENGTH + 1];
+    packed_read_t reads[2];
+    bc_key_t key;
+    // Like hashdmp, take the family read length from the first record.
+    unpack_read(p + 2 + blen, reads);
+    if(mate) unpack_read(reads[0].qual + reads[0].l, reads + 1);
+    FamilyTable table(reads[mate].l);
+    while(p < end) {
+        const char pass(p[0]);
+        const char *const bs(p + 1); // Strand character followed by barcode.
+        memcpy(bc, bs + 1, blen);
+        bc[blen] = '\0';
+        p = unpack_read(bs + 1 + blen, reads);
+        if(paired) p = unpack_read(p, reads + 1);
+        bc_pack(bc, &key);
+        table.add(key, *bs != 'F', reads[mate].seq, reads[mate].qual, reads[mate].l, pass, bs, blen + 1);
+    }
+    if(neighbor_merging()) table.merge_neighbors();
+    write_stranded_families(table, shard.out + mate, bufs);
+}
+
+void ShardCollapser::collapse_spilled(shard_t &shard, int mate, tmpbuffers_t *bufs)
+{
+    delete shard.spill[mate], shard.spill[mate] = nullptr;
+    {
+        ShardReader reader(shard.spill_path[mate]);
+        const shard_rec_t &rec(reader.rec);
+        if(reader.next()) {
+            FamilyTable table(rec.l);
+            do {
+                table.add(rec.key, rec.bs[0] != 'F', rec.seq, rec.qual, rec.l, rec.pass_fail, rec.bs, rec.bs_len);
+            } while(reader.next());
+            if(neighbor_merging()) table.merge_neighbors();
+            write_stranded_families(table, shard.out + mate, bufs);
+        }
+    }
+    if(settings->cleanup && remove(shard.spill_path[mate]))
+        LOG_WARNING("Could not remove temporary file %s.\n", shard.spill_path[mate]);
+}
+
+void ShardCollapser::consume(int id)
+{
+    SpscQueue<shard_batch_t *> &queue(*queues[id]);
+    shard_batch_t *batch;
+    while(queue.pop(batch)) {
+        shard_t &shard(shards[batch->shard]);
+        if(shard.spilled) {
+            write_spill(shard, batch->data.s, batch->data.s + batch->data.l, shard.n);
+        } else {
+            const size_t old_size(shard.data.m);
+            kputsn(batch->data.s, batch->data.l, &shard.data);
+            mem_used += shard.data.m - old_size;
+        }
+        shard.n += batch->n;
+        free(batch->data.s);
+        delete batch;
+        if(settings->max_mem && mem_used > settings->max_mem) spill_largest(id);
+    }
+    // All input routed. Collapse this consumer's shards in ascending order so the writer is never starved.
+    tmpbuffers_t *bufs((tmpbuffers_t *)malloc(sizeof(tmpbuffers_t)));
+    for(size_t i(id); i < shards.size(); i += n_consumers) {
+        shard_t &shard(shards[i]);
+        for(int mate(0); mate <= paired; ++mate)
+            shard.spilled ? collapse_spilled(shard, mate, bufs): collapse_packed(shard, mate, bufs);
+        mem_used -= shard.data.m;
+        free(shard.data.s);
+        shard.data = kstring_t{0, 0, nullptr};
+        shard.ready.store(1, std::memory_order_release);
+    }
+    free(bufs);
+}
+
+void ShardCollapser::write_output()
+{
+    BgzfWriter *out[2]{nullptr, nullptr};
+    if(!settings->to_stdout) {
+        const int level(settings->gzip_output ? (int)settings->gzip_compression % 10: -1);
+        kstring_t ks{0, 0, nullptr};
+        for(int mate(0); mate <= paired; ++mate) {
+            ks.l = 0;
+            ksprintf(&ks, "%s.R%i.fq%s", settings->ffq_prefix, mate + 1, settings->gzip_output ? ".gz": "");
+            out[mate] = new BgzfWriter(ks.s, level, 1);
+        }
+        free(ks.s);
+    }
+    for(shard_t &shard: shards) {
+        while(!shard.ready.load(std::memory_order_acquire))
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        if(settings->to_stdout) {
+            if(!paired) {
+                if(shard.out[0].l) fwrite(shard.out[0].s, 1, shard.out[0].l, stdout);
+            } else if(shard.out[0].l) {
+                // Both mates produce the same families in the same order, so records can be interleaved directly.
+                const char *p1(shard.out[0].s), *p2(shard.out[1].s), *const end(p1 + shard.out[0].l);
+                while(p1 < end) {
+                    const char *n1(next_fq_record(p1)), *n2(next_fq_record(p2));
+                    fwrite(p1, 1, n1 - p1, stdout);
+                    fwrite(p2, 1, n2 - p2, stdout);
+                    p1 = n1, p2 = n2;
+                }
+            }
+        } else {
+            for(int mate(0); mate <= paired; ++mate)
+                out[mate]->write(shard.out[mate].s, shard.out[mate].l);
+        }
+        free(shard.out[0].s), free(shard.out[1].s);
+        shard.out[0] = shard.out[1] = kstring_t{0, 0, nullptr};
+    }
+    for(int mate(0); mate <= paired; ++mate) delete out[mate];
+}
+
+void ShardCollapser::run()
+{
+    std::vector<std::thread> consumers;
+    for(int i(0); i < n_consumers; ++i) consumers.emplace_back(&ShardCollapser::consume, this, i);
+    route();
+    write_output();
+    for(auto &consumer: consumers) consumer.join();
+    if(n_spilled) LOG_INFO("%i of %lu shards were spilled to disk.\n", (int)n_spilled, shards.size());
+}
+
+} /* anonymous namespace */
+
+void memshard_collapse(marksplit_settings_t *settings)
+{
+    check_input_path(settings->input_r1_path);
+    const int two_files(!settings->is_se && !settings->interleaved);
+    if(two_files) check_input_path(settings->input_r2_path);
+    if(two_files && strcmp(settings->input_r1_path, settings->input_r2_path) == 0)
+        LOG_EXIT("Read 1 and read 2 paths are the same. Abort!\n");
+    if(settings->blen >= MAX_BARCODE_LENGTH)
+        LOG_EXIT("Barcode length %i is too long for in-memory shards (max: %i).\n",
+                 (int)settings->blen, MAX_BARCODE_LENGTH - 1);
+    if(settings->rescaler_path) settings->rescaler = new Rescaler(settings->rescaler_path);
+    ShardCollapser collapser(settings);
+    collapser.run();
+}
+
+} /* namespace bmf */
@@ -0,0 +1,24 @@
+#ifndef MEMSHARD_H
+#define MEMSHARD_H
+#include "lib/splitter.h"
+
+#define DEFAULT_SHARD_MEM (8uLL << 30)
+
+namespace bmf {
+
+/*
+ * @func memshard_collapse
+ * Single-pass replacement for pp_split_inline + parallel_hash_dmp_core + cat_fastqs.
+ * Reader threads parse the input fastqs, the calling thread marks each read and routes it
+ * by barcode prefix to one of settings->n_handles shards, and settings->threads consumer threads
+ * hold and collapse those shards in memory. Final fastqs are written in shard order in one pass,
+ * identical to the output of the split-file workflow.
+ * Shards only touch disk if the packed reads held in memory exceed settings->max_mem.
+ * The input is read once, front to back, so it may be stdin or FIFOs, and read pairs may be interleaved.
+ * :param: settings [marksplit_settings_t *] Settings, as prepared by idmp_main.
+ */
+void memshard_collapse(marksplit_settings_t *settings);
+
+} /* namespace bmf */
+
+#endif /* MEMSHARD_H */
@@ -16,13 +16,13 @@ void mseq_destroy(mseq_t *mvar)
 /*
  * :param: [kseq_t *] seq - kseq handle
  * :param: [mseq_t *] ret - initialized mseq_t pointer.
- * :param: [char ****] rescaler - pointer to a 3-dimensional array of rescaled phred scores.
+ * :param: [const Rescaler *] rescaler - compiled quality rescaler, or null to copy qualities unchanged.
  * :param: [tmp_mseq_t *] tmp - pointer to a tmp_mseq_t object
  * for holding information for conditional reverse complementing.
  * :param: [int] n_len - the number of bases to N at the beginning of each read.
  * :param: [int] is_read2 - true if the read is read2. Assumption: is_read2 is 0 or 1.
  */
-mseq_t *mseq_init(kseq_t *seq, char *rescaler, int is_read2)
+mseq_t *mseq_init(kseq_t *seq, const Rescaler *rescaler, int is_read2)
 {
     if(!seq) {
         fprintf(stderr, "kseq for initiating p7_mseq is null. Abort!\n");
@@ -35,20 +35,18 @@ mseq_t *mseq_init(kseq_t *seq, char *rescaler, int is_read2)
     strcpy(ret->qual, seq->qual.s);
 
     ret->l = seq->seq.l;
-    if(rescaler)
-        for(int i = 0; i < ret->l; i++)
-            ret->qual[i] = rescale_qscore(is_read2 , seq->qual.s[i], i, ret->seq[i], seq->seq.l, rescaler);
+    if(rescaler) rescaler->apply(ret->seq, seq->qual.s, 0, ret->l, is_read2, ret->qual);
     return ret;
 }
 
 /*
  * :param: [kseq_t *] seq - kseq handle
- * :param: [char *] rescaler - pointer to a 1-dimensional projection of a 4-dimensional array of rescaled phred scores.
+ * :param: [const Rescaler *] rescaler - compiled quality rescaler, or null to copy qualities unchanged.
  * :param: [tmp_mseq_t *] tmp - pointer to a tmp_mseq_t object
  * for holding information for conditional reverse complementing.
  * :param: [int] is_read2 - true if the read is read2.
  */
-mseq_t *mseq_rescale_init(kseq_t *seq, char *rescaler, tmp_mseq_t *tmp, int is_read2)
+mseq_t *mseq_rescale_init(kseq_t *seq, const Rescaler *rescaler, tmp_mseq_t *tmp, int is_read2)
 {
     mseq_t *ret(mseq_init(seq, rescaler, is_read2));
     //fprintf(stderr, "Pointer to ret: %p. To tmp: %p. Barcode: %s.\n", ret, tmp, ret->barcode);
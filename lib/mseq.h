@@ -5,6 +5,7 @@
 #include "htslib/kseq.h"
 #include "dlib/compiler_util.h"
 #include "dlib/cstr_util.h"
+#include "lib/bgzfwriter.h"
 #include "lib/rescaler.h"
 
 
@@ -120,41 +121,47 @@ static inline int set_barcode(kseq_t *seq1, kseq_t *seq2, char *barcode, uint32_
 #define mask_mseq(seqvar, n_len) mask_mseq_chars(seqvar, n_len, 'N', '#')
 
 void mseq_destroy(mseq_t *mvar);
-mseq_t *mseq_init(kseq_t *seq, char *rescaler, int is_read2);
-mseq_t *mseq_rescale_init(kseq_t *seq, char *rescaler, tmp_mseq_t *tmp, int is_read2);
-static inline void mseq2fq_stranded(gzFile handle, mseq_t *mvar, int pass_fail, char *barcode, char prefix)
+mseq_t *mseq_init(kseq_t *seq, const Rescaler *rescaler, int is_read2);
+mseq_t *mseq_rescale_init(kseq_t *seq, const Rescaler *rescaler, tmp_mseq_t *tmp, int is_read2);
+static inline void mseq2fq_stranded(kstring_t *ks, mseq_t *mvar, int pass_fail, char *barcode, char prefix)
 {
-    gzprintf(handle, "@%s ~#!#~|FP=%c|BS=%c%s\n%s\n+\n%s\n",
-             mvar->name, pass_fail + '0', prefix, barcode, mvar->seq, mvar->qual);
+    kputc('@', ks), kputs(mvar->name, ks);
+    kputsn(" ~#!#~|FP=", 10, ks), kputc(pass_fail + '0', ks);
+    kputsn("|BS=", 4, ks), kputc(prefix, ks), kputs(barcode, ks);
+    kputc('\n', ks), kputs(mvar->seq, ks);
+    kputsn("\n+\n", 3, ks), kputs(mvar->qual, ks), kputc('\n', ks);
 }
 
-static inline void mseq2fq(gzFile handle, mseq_t *mvar, int pass_fail, char *barcode)
+static inline void mseq2fq_stranded(BgzfWriter *handle, mseq_t *mvar, int pass_fail, char *barcode, char prefix)
 {
-    gzprintf(handle, "@%s ~#!#~|FP=%c|BS=Z%s\n%s\n+\n%s\n",
-             mvar->name, pass_fail + '0', barcode, mvar->seq, mvar->qual);
+    mseq2fq_stranded(handle->buf(), mvar, pass_fail, barcode, prefix);
+    handle->check();
+}
+
+static inline void mseq2fq(BgzfWriter *handle, mseq_t *mvar, int pass_fail, char *barcode)
+{
+    mseq2fq_stranded(handle, mvar, pass_fail, barcode, 'Z');
 }
 
 
 /*
  * :param: [kseq_t *] seq - kseq handle
  * :param: [mseq_t *] ret - initialized mseq_t pointer.
- * :param: [char *] rescaler - pointer to a 1-dimensional projection of a 4-dimensional array of rescaled phred scores.
+ * :param: [const Rescaler *] rescaler - compiled quality rescaler, or null to copy qualities unchanged.
  * :param: [tmp_mseq_t *] tmp - pointer to a tmp_mseq_t object
  * for holding information for conditional reverse complementing.
  * :param: [int] n_len - the number of bases to N at the beginning of each read.
  * :param: [int] is_read2 - true if the read is read2.
  */
-static inline void update_mseq(mseq_t *mvar, kseq_t *seq, char *rescaler, tmp_mseq_t *tmp, int n_len, int is_read2)
+static inline void update_mseq(mseq_t *mvar, kseq_t *seq, const Rescaler *rescaler, tmp_mseq_t *tmp, int n_len, int is_read2)
 {
     memcpy(mvar->name, seq->name.s, seq->name.l);
     mvar->name[seq->name.l] = '\0';
     memcpy(mvar->seq, seq->seq.s + n_len, seq->seq.l - n_len);
     mvar->seq[seq->seq.l - n_len] = '\0';
+    mvar->l = seq->seq.l - n_len;
     mvar->qual[seq->qual.l - n_len] = '\0';
-    if(rescaler)
-        for(unsigned i(n_len); i < seq->seq.l; ++i)
-            mvar->qual[i - n_len] = rescale_qscore(is_read2, seq->qual.s[i], i,
-                                                   seq->seq.s[i], seq->seq.l, rescaler);
+    if(rescaler) rescaler->apply(seq->seq.s, seq->qual.s, n_len, seq->seq.l, is_read2, mvar->qual);
     else memcpy(mvar->qual, seq->qual.s + n_len, seq->qual.l - n_len);
 }
 
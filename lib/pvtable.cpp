@@ -0,0 +1,123 @@
+#include "lib/pvtable.h"
+
+#include <cstdio>
+#include <cstring>
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+static const char PVTABLE_MAGIC[8] = {'B', 'M', 'F', 'P', 'V', 'T', '1', '\0'};
+static const int PVTABLE_N_CHECKS = 16; // Entries per row recomputed to validate a cache.
+
+static inline uint16_t pv_entry(uint32_t pv)
+{
+    return pv < PVTABLE_EXACT ? pv: PVTABLE_EXACT;
+}
+
+static inline uint64_t row_checksum(uint64_t hash, const uint16_t *row, uint32_t len)
+{
+    for(uint32_t i(0); i < len; ++i) hash = (hash ^ row[i]) * 0x100000001b3uLL; // FNV-1a over entries
+    return hash;
+}
+
+PvTable::PvTable():
+    rows(new std::atomic<uint16_t *>[PVTABLE_MAX_FM + 1]),
+    row_mem(PVTABLE_MAX_FM + 1),
+    agreed_table(PVTABLE_AGREED_SIZE)
+{
+    for(int i(0); i <= PVTABLE_MAX_FM; ++i) rows[i].store(nullptr, std::memory_order_relaxed);
+    for(uint32_t i(0); i < PVTABLE_AGREED_SIZE; ++i) agreed_table[i] = pv_entry(agreed_pvalues(i, 0));
+}
+
+uint16_t *PvTable::build_row(int fm)
+{
+    std::lock_guard<std::mutex> lock(build_lock);
+    uint16_t *ret(rows[fm].load(std::memory_order_relaxed));
+    if(ret) return ret; // Another thread built it first.
+    const uint32_t len((uint32_t)fm * PVTABLE_MAX_QUAL + 1);
+    row_mem[fm].reset(new uint16_t[len]);
+    ret = row_mem[fm].get();
+    for(uint32_t i(0); i < len; ++i) ret[i] = pv_entry(pv_consensus_exact(fm, i));
+    rows[fm].store(ret, std::memory_order_release);
+    return ret;
+}
+
+/*
+ * Cache layout: magic, uint32_t max_fm, uint32_t max_qual, then each row for fm in [1, max_fm],
+ * then a uint64_t checksum of the rows.
+ * Rows are also spot-checked against igamc on load, so a cache written by a build whose
+ * libm rounds differently is rejected rather than silently changing output.
+ */
+int PvTable::load(const char *path)
+{
+    FILE *fp(fopen(path, "rb"));
+    if(!fp) return -1;
+    char magic[sizeof(PVTABLE_MAGIC)];
+    uint32_t dims[2];
+    uint64_t checksum(0xcbf29ce484222325uLL), stored;
+    std::vector<std::unique_ptr<uint16_t[]>> tmp(PVTABLE_MAX_FM + 1);
+    int ret(-1);
+    if(fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, PVTABLE_MAGIC, sizeof(magic)) ||
+       fread(dims, sizeof(dims), 1, fp) != 1 || dims[0] != PVTABLE_MAX_FM || dims[1] != PVTABLE_MAX_QUAL)
+        goto done;
+    for(int fm(1); fm <= PVTABLE_MAX_FM; ++fm) {
+        const uint32_t len((uint32_t)fm * PVTABLE_MAX_QUAL + 1);
+        tmp[fm].reset(new uint16_t[len]);
+        if(fread(tmp[fm].get(), sizeof(uint16_t), len, fp) != len) goto done;
+        checksum = row_checksum(checksum, tmp[fm].get(), len);
+        for(uint32_t i(0); i < len; i += len / PVTABLE_N_CHECKS + 1)
+            if(tmp[fm][i] != pv_entry(pv_consensus_exact(fm, i))) goto done;
+        if(tmp[fm][len - 1] != pv_entry(pv_consensus_exact(fm, len - 1))) goto done;
+    }
+    if(fread(&stored, sizeof(stored), 1, fp) != 1 || stored != checksum || fgetc(fp) != EOF) goto done;
+    {
+        std::lock_guard<std::mutex> lock(build_lock);
+        for(int fm(1); fm <= PVTABLE_MAX_FM; ++fm) {
+            if(rows[fm].load(std::memory_order_relaxed)) continue;
+            row_mem[fm] = std::move(tmp[fm]);
+            rows[fm].store(row_mem[fm].get(), std::memory_order_release);
+        }
+    }
+    ret = 0;
+    done:
+    fclose(fp);
+    return ret;
+}
+
+int PvTable::save(const char *path)
+{
+    FILE *fp(fopen(path, "wb"));
+    if(!fp) return -1;
+    const uint32_t dims[2] {PVTABLE_MAX_FM, PVTABLE_MAX_QUAL};
+    uint64_t checksum(0xcbf29ce484222325uLL);
+    fwrite(PVTABLE_MAGIC, sizeof(PVTABLE_MAGIC), 1, fp);
+    fwrite(dims, sizeof(dims), 1, fp);
+    for(int fm(1); fm <= PVTABLE_MAX_FM; ++fm) {
+        const uint32_t len((uint32_t)fm * PVTABLE_MAX_QUAL + 1);
+        const uint16_t *row(rows[fm].load(std::memory_order_acquire));
+        if(!row) row = build_row(fm);
+        fwrite(row, sizeof(uint16_t), len, fp);
+        checksum = row_checksum(checksum, row, len);
+    }
+    fwrite(&checksum, sizeof(checksum), 1, fp);
+    return fclose(fp) ? -1: 0;
+}
+
+int PvTable::use_cache(const char *path)
+{
+    if(load(path) == 0) {
+        LOG_DEBUG("Loaded p-value tables from %s.\n", path);
+        return 0;
+    }
+    LOG_INFO("Building p-value table cache at %s.\n", path);
+    if(save(path)) LOG_WARNING("Could not write p-value table cache to %s.\n", path);
+    return 1;
+}
+
+PvTable &pv_table()
+{
+    static PvTable ret;
+    return ret;
+}
+
+} /* namespace bmf */
@@ -0,0 +1,87 @@
+#ifndef PVTABLE_H
+#define PVTABLE_H
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "include/igamc_cephes.h"
+
+#define PVTABLE_MAX_FM 256 // Largest family size given its own table.
+#define PVTABLE_MAX_QUAL 93 // Largest fastq quality ('~' - 33), which bounds a family's phred sum.
+#define PVTABLE_AGREED_SIZE (2 * MAX_PV + 2) // Table size for agreed_pvalues, indexed by pv1 + pv2.
+#define PVTABLE_EXACT 0xFFFFu // Entry marking a result which doesn't fit in 16 bits. It is recomputed exactly.
+
+namespace bmf {
+
+/*
+ * @func pv_consensus_exact
+ * The consensus quality for a family: Fisher's method over the family's phred scores.
+ * :param: fm [int] Family size.
+ * :param: phred_sum [uint32_t] Sum of the phred scores supporting the call.
+ * :returns: [uint32_t] Consensus phred.
+ */
+CONST static inline uint32_t pv_consensus_exact(int fm, uint32_t phred_sum)
+{
+    return pvalue_to_phred(igamc_pvalues(fm, LOG10_TO_CHI2(phred_sum)));
+}
+
+/*
+ * Lookup tables for the igamc -> phred conversions on the consensus and rsq/stack hot paths.
+ * Each entry is computed by the exact function it replaces, so every result is bit-identical.
+ * The row for a family size is indexed by phred sum and covers sums up to fm * PVTABLE_MAX_QUAL.
+ * Rows are built on first use, or all at once from a cache file.
+ * Family sizes above PVTABLE_MAX_FM and larger sums fall back to the exact igamc, as do the
+ * few entries (igamc's out-of-domain results for large families with tiny sums) which don't fit in a uint16_t.
+ */
+class PvTable {
+    std::unique_ptr<std::atomic<uint16_t *>[]> rows; // rows[fm], nullptr until built.
+    std::vector<std::unique_ptr<uint16_t[]>> row_mem;
+    std::vector<uint16_t> agreed_table;
+    std::mutex build_lock;
+    uint16_t *build_row(int fm);
+    int load(const char *path);
+    int save(const char *path);
+public:
+    PvTable();
+    PvTable(const PvTable &other) = delete;
+    /*
+     * @func consensus
+     * Table-backed pv_consensus_exact.
+     */
+    uint32_t consensus(int fm, uint32_t phred_sum) {
+        if(fm > 0 && fm <= PVTABLE_MAX_FM && phred_sum <= (uint32_t)fm * PVTABLE_MAX_QUAL) {
+            const uint16_t *row(rows[fm].load(std::memory_order_acquire));
+            const uint32_t ret((row ? row: build_row(fm))[phred_sum]);
+            if(ret != PVTABLE_EXACT) return ret;
+        }
+        return pv_consensus_exact(fm, phred_sum);
+    }
+    /*
+     * @func agreed
+     * Table-backed agreed_pvalues. The result depends only on pv1 + pv2.
+     */
+    uint32_t agreed(uint32_t pv1, uint32_t pv2) const {
+        const uint32_t sum(pv1 + pv2);
+        return sum < PVTABLE_AGREED_SIZE && agreed_table[sum] != PVTABLE_EXACT ? agreed_table[sum]
+                                                                               : agreed_pvalues(pv1, pv2);
+    }
+    /*
+     * @func use_cache
+     * Loads every row from a cache file. If it is missing or does not match this build,
+     * builds every row and (re)writes the cache.
+     * :param: path [const char *] Path to cache file.
+     * :returns: [int] 0 if loaded from the cache, 1 if rebuilt.
+     */
+    int use_cache(const char *path);
+};
+
+/*
+ * @func pv_table
+ * :returns: [PvTable &] The process-wide table.
+ */
+PvTable &pv_table();
+
+} /* namespace bmf */
+
+#endif /* PVTABLE_H */
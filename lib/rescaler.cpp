@@ -0,0 +1,137 @@
+#include "lib/rescaler.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+static const char RESCALER_MAGIC[8] = {'B', 'M', 'F', 'R', 'S', 'C', '1', '\0'};
+
+/*
+ * Cache layout: this header, then the table, 2 * readlen rows of RESCALER_ROW_SIZE.
+ * The text file's size and modification time are recorded so that a cache for an edited
+ * or replaced rescaler is rebuilt rather than used.
+ */
+struct rescaler_cache_hdr_t {
+    char magic[sizeof(RESCALER_MAGIC)];
+    uint32_t readlen;
+    uint32_t row_size;
+    uint64_t text_size;
+    int64_t text_mtime_sec;
+    int64_t text_mtime_nsec;
+};
+
+const uint16_t RESCALER_BASE_OFFSETS[256] = {
+#define R4(x) x, x, x, x
+#define R16(x) R4(x), R4(x), R4(x), R4(x)
+    R16(0), R16(0), R16(0), R16(0), // 0-63
+    0, 0, 0, 1 * RESCALER_ROW_QUALS, 0, 0, 0, 2 * RESCALER_ROW_QUALS, // @ A B C D E F G
+    0, 0, 0, 0, 0, 0, 4 * RESCALER_ROW_QUALS, 0, // H I J K L M N O
+    0, 0, 0, 0, 3 * RESCALER_ROW_QUALS, 0, 0, 0, // P Q R S T U V W
+    R4(0), R4(0), // X-_
+    R16(0), R16(0), // 96-127
+    R16(0), R16(0), R16(0), R16(0), R16(0), R16(0), R16(0), R16(0) // 128-255
+#undef R16
+#undef R4
+};
+
+Rescaler::Rescaler(const char *path):
+    table(nullptr), map(nullptr), map_size(0), readlen(0)
+{
+    const std::string cache_path(std::string(path) + ".bin");
+    if(load(cache_path.c_str(), path) == 0) {
+        LOG_DEBUG("Loaded compiled rescaler from %s.\n", cache_path.c_str());
+        return;
+    }
+    compile(path);
+    LOG_INFO("Writing compiled rescaler cache to %s.\n", cache_path.c_str());
+    if(save(cache_path.c_str(), path)) LOG_WARNING("Could not write rescaler cache to %s.\n", cache_path.c_str());
+}
+
+Rescaler::~Rescaler()
+{
+    if(map) munmap(map, map_size);
+}
+
+void Rescaler::compile(const char *text_path)
+{
+    char *const parsed(parse_1d_rescaler(const_cast<char *>(text_path)));
+    readlen = dlib::count_lines(text_path);
+    built.assign((size_t)2 * readlen * RESCALER_ROW_SIZE, '#');
+    // parse_1d_rescaler's layout matches the file's: [cycle][read][quality - 2][base].
+    for(uint32_t cycle(0); cycle < readlen; ++cycle) {
+        for(int readnum(0); readnum < 2; ++readnum) {
+            const char *const in(parsed + (cycle * 2 + readnum) * NQSCORES * 4);
+            char *const out(&built[((size_t)readnum * readlen + cycle) * RESCALER_ROW_SIZE]);
+            for(unsigned i(0); i < NQSCORES * 4; ++i)
+                if(in[i] <= 0) LOG_EXIT("Invalid value in rescaler %i at index %lu.\n", in[i], (unsigned long)(in - parsed + i));
+            for(int bnum(0); bnum < 4; ++bnum) {
+                for(int qc(0); qc < RESCALER_ROW_QUALS; ++qc) {
+                    const int qnum(qc < '#' ? 0: qc - '#' >= (int)NQSCORES ? NQSCORES - 1: qc - '#');
+                    out[bnum * RESCALER_ROW_QUALS + qc] = in[qnum * 4 + bnum] + 33;
+                }
+            }
+        }
+    }
+    free(parsed);
+    table = built.data();
+}
+
+int Rescaler::load(const char *path, const char *text_path)
+{
+    struct stat text_st, st;
+    rescaler_cache_hdr_t hdr;
+    int ret(-1);
+    const int fd(open(path, O_RDONLY));
+    if(fd < 0) return -1;
+    if(stat(text_path, &text_st) || fstat(fd, &st) ||
+       read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+       memcmp(hdr.magic, RESCALER_MAGIC, sizeof(RESCALER_MAGIC)) || hdr.row_size != RESCALER_ROW_SIZE ||
+       hdr.text_size != (uint64_t)text_st.st_size || hdr.text_mtime_sec != (int64_t)text_st.st_mtim.tv_sec ||
+       hdr.text_mtime_nsec != (int64_t)text_st.st_mtim.tv_nsec ||
+       (uint64_t)st.st_size != sizeof(hdr) + (uint64_t)2 * hdr.readlen * RESCALER_ROW_SIZE)
+        goto done;
+    map_size = st.st_size;
+    if((map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        map = nullptr;
+        goto done;
+    }
+    readlen = hdr.readlen;
+    table = (const char *)map + sizeof(hdr);
+    ret = 0;
+    done:
+    close(fd);
+    return ret;
+}
+
+int Rescaler::save(const char *path, const char *text_path) const
+{
+    struct stat text_st;
+    if(stat(text_path, &text_st)) return -1;
+    rescaler_cache_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RESCALER_MAGIC, sizeof(RESCALER_MAGIC));
+    hdr.readlen = readlen, hdr.row_size = RESCALER_ROW_SIZE;
+    hdr.text_size = text_st.st_size;
+    hdr.text_mtime_sec = text_st.st_mtim.tv_sec, hdr.text_mtime_nsec = text_st.st_mtim.tv_nsec;
+    // Write to a temporary file and rename it into place, so that concurrent runs never map a partial cache.
+    const std::string tmp_path(std::string(path) + "." + std::to_string(getpid()) + ".tmp");
+    FILE *fp(fopen(tmp_path.c_str(), "wb"));
+    if(!fp) return -1;
+    const size_t size((size_t)2 * readlen * RESCALER_ROW_SIZE);
+    const int failed((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) | (fwrite(table, 1, size, fp) != size) |
+                     (fclose(fp) != 0));
+    if(failed || rename(tmp_path.c_str(), path)) {
+        remove(tmp_path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+} /* namespace bmf */
@@ -1,37 +1,20 @@
 #ifndef ARRAY_PARSER_H
 #define ARRAY_PARSER_H
 #include <assert.h>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "dlib/compiler_util.h"
 #include "dlib/io_util.h"
+#include "dlib/logging_util.h"
 
 #define NQSCORES 39uL // Number of q scores in sequencing.
+#define RESCALER_ROW_BASES 5 // A, C, G, T, then N.
+#define RESCALER_ROW_QUALS 128 // Indexed directly by quality character.
+#define RESCALER_ROW_SIZE (RESCALER_ROW_BASES * RESCALER_ROW_QUALS)
 
 namespace bmf {
 
-/*
- * @func rescale_qscore
- * Returns a rescaled qscore using readnumber, qscore, cycle, base call, and an associated rescaling array.
- * :param: readnum [int] 0 if 1, 1 if read 2
- * :param: qscore [char] Character in quality string, with 33 offset. (e.g., '#' means 0.)
- * :param: cycle [int] Cycle number on the sequencer, 0-based.
- * :param: base [char] base call at position.
- * @discussion: Note - the rescaled q score in the flat text file has not been offset by 33.
- * This was done to make it more human-readable, though it does necessitate incrementing the quality score
- * by 33 each time a qscore is returned. Thoughts?
- *
- */
-CONST static inline char rescale_qscore(int readnum, char qscore, int cycle, char base, int readlen, char *rescaler)
-{
-    if(base == 'N') return '#';
-    int index(readnum);
-    int mult(2);
-    index += cycle * mult;
-    mult *= readlen;
-    index += (qscore - 35) * mult; // Subtract 35 - 33 to get to phred space, 2 to offset by 2.
-    mult *= NQSCORES;
-    index += mult * nuc2num_acgt(base);
-    return rescaler[index] + 33;
-}
-
 static void period_to_null(char *instr)
 {
     while(*instr) {
@@ -91,6 +74,74 @@ static inline char *parse_1d_rescaler(char *qual_rescale_fname)
     return ret;
 }
 
+/*
+ * Quality rescaling table, compiled from the text written by bmftools err
+ * (one line per cycle; for each read, for each quality from 2 to 40, one value per base in ACGT).
+ * Each read and cycle has one contiguous row of rescaled quality characters,
+ * indexed by [base][quality character], so that rescaling a read is a single gather.
+ * N rows are all '#', and quality characters outside of the table's range use its nearest entry.
+ * The compiled table is cached at <path>.bin, which is memory-mapped on later runs
+ * for as long as the text file's size and modification time are unchanged.
+ */
+class Rescaler {
+    const char *table; // [read][cycle][RESCALER_ROW_SIZE]
+    void *map; // Memory-mapped cache, if loaded from one.
+    size_t map_size;
+    std::vector<char> built; // Table, if compiled from text.
+    uint32_t readlen; // Number of cycles in the table.
+    int load(const char *path, const char *text_path);
+    int save(const char *path, const char *text_path) const;
+    void compile(const char *text_path);
+public:
+    /*
+     * :param: path [const char *] Path to the text rescaler.
+     */
+    Rescaler(const char *path);
+    Rescaler(const Rescaler &other) = delete;
+    ~Rescaler();
+    uint32_t cycles() const {return readlen;}
+    const char *row(int is_read2, uint32_t cycle) const {
+        return table + ((size_t)is_read2 * readlen + cycle) * RESCALER_ROW_SIZE;
+    }
+    /*
+     * @func rescale
+     * :param: is_read2 [int] 0 if read 1, 1 if read 2.
+     * :param: qscore [char] Character in quality string, with 33 offset. (e.g., '#' means 2.)
+     * :param: cycle [uint32_t] Cycle number on the sequencer, 0-based.
+     * :param: base [char] Base call at position.
+     * :returns: [char] Rescaled quality character.
+     */
+    char rescale(int is_read2, char qscore, uint32_t cycle, char base) const;
+    /*
+     * @func apply
+     * Rescales cycles [start, end) of a read into out[0, end - start).
+     * :param: seq [const char *] Bases.
+     * :param: qual [const char *] Quality characters.
+     */
+    void apply(const char *seq, const char *qual, uint32_t start, uint32_t end, int is_read2, char *out) const;
+};
+
+/*
+ * Row offsets for each base: ACGT in order, N to its '#' row and anything else to A,
+ * as the rescaler has always treated them.
+ */
+extern const uint16_t RESCALER_BASE_OFFSETS[256];
+
+inline char Rescaler::rescale(int is_read2, char qscore, uint32_t cycle, char base) const
+{
+    return row(is_read2, cycle)[RESCALER_BASE_OFFSETS[(uint8_t)base] + (qscore & (RESCALER_ROW_QUALS - 1))];
+}
+
+inline void Rescaler::apply(const char *seq, const char *qual, uint32_t start, uint32_t end,
+                            int is_read2, char *out) const
+{
+    if(UNLIKELY(end > readlen))
+        LOG_EXIT("Read length %u is longer than the rescaler's %u cycles. Abort!\n", end, readlen);
+    const char *r(row(is_read2, start));
+    for(uint32_t i(start); i < end; ++i, r += RESCALER_ROW_SIZE)
+        *out++ = r[RESCALER_BASE_OFFSETS[(uint8_t)seq[i]] + (qual[i] & (RESCALER_ROW_QUALS - 1))];
+}
+
 } /* namespace bmf */
 
 #endif // ARRAY_PARSER_H
@@ -0,0 +1,91 @@
+#include "lib/rsqindex.h"
+
+#include <cstring>
+
+namespace bmf {
+
+uint64_t RescueIndex::seg_key(int seg, const char *name) const
+{
+    // FNV-1a over the segment, salted by its position. Collisions only add candidates.
+    const unsigned start(seg * len / (mmlim + 1)), end((seg + 1) * len / (mmlim + 1));
+    uint64_t h(0xcbf29ce484222325uLL ^ (uint64_t)seg);
+    for(unsigned i(start); i < end; ++i) h = (h ^ (uint8_t)name[i]) * 0x100000001b3uLL;
+    return h;
+}
+
+void RescueIndex::pack(unsigned i)
+{
+    const char *name(names.data() + (size_t)i * len);
+    uint64_t *const words(packed.data() + (size_t)i * n_words);
+    memset(words, 0, n_words * sizeof(uint64_t));
+    regular[i] = 1;
+    for(unsigned k(0); k < len; ++k) {
+        uint64_t code;
+        switch(name[k]) {
+            case 'A': code = 0; break;
+            case 'C': code = 1; break;
+            case 'G': code = 2; break;
+            case 'T': code = 3; break;
+            default: regular[i] = 0; return;
+        }
+        words[k >> 5] |= code << ((k & 31) << 1);
+    }
+}
+
+void RescueIndex::insert_segments(unsigned i)
+{
+    const char *name(names.data() + (size_t)i * len);
+    for(int seg(0); seg <= mmlim; ++seg) {
+        std::vector<unsigned> &v(buckets[seg_key(seg, name)]);
+        auto it(std::lower_bound(v.begin(), v.end(), i));
+        if(it == v.end() || *it != i) v.insert(it, i);
+    }
+}
+
+void RescueIndex::reset(unsigned _len)
+{
+    len = _len;
+    n_words = (len + 31) >> 5;
+    names.clear(), packed.clear(), regular.clear();
+    buckets.clear();
+}
+
+unsigned RescueIndex::add(const char *name)
+{
+    const unsigned i(size());
+    names.insert(names.end(), name, name + len);
+    packed.resize(packed.size() + n_words);
+    regular.push_back(0);
+    pack(i);
+    // Adding in ascending order keeps every bucket sorted without searching.
+    for(int seg(0); seg <= mmlim; ++seg) buckets[seg_key(seg, name)].push_back(i);
+    return i;
+}
+
+void RescueIndex::rename(unsigned i, const char *name)
+{
+    char *const old(names.data() + (size_t)i * len);
+    if(memcmp(old, name, len) == 0) return;
+    memcpy(old, name, len);
+    pack(i);
+    // Entries under the old segments stay behind. They are harmless, as every candidate is verified.
+    insert_segments(i);
+}
+
+int RescueIndex::hamming(unsigned i, unsigned j) const
+{
+    int ret(0);
+    if(regular[i] && regular[j]) {
+        const uint64_t *a(packed.data() + (size_t)i * n_words), *b(packed.data() + (size_t)j * n_words);
+        for(unsigned k(0); k < n_words; ++k) {
+            const uint64_t x(a[k] ^ b[k]);
+            ret += __builtin_popcountll((x | (x >> 1)) & 0x5555555555555555uLL);
+        }
+    } else {
+        const char *a(names.data() + (size_t)i * len), *b(names.data() + (size_t)j * len);
+        for(unsigned k(0); k < len; ++k) ret += a[k] != b[k];
+    }
+    return ret;
+}
+
+} /* namespace bmf */
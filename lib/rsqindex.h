@@ -0,0 +1,83 @@
+#ifndef RSQINDEX_H
+#define RSQINDEX_H
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#define RSQ_INDEX_MIN_STACK 8 // Below this many equal-length names, the pairwise scan is cheaper than indexing.
+
+namespace bmf {
+
+/*
+ * Candidate index for positional rescue.
+ * Each name is cut into mmlim + 1 segments. Two names within mmlim mismatches must agree exactly
+ * on at least one segment (pigeonhole), so only names sharing a bucket with the query are compared.
+ * Names consisting only of ACGT are also packed at 2 bits per base and compared with popcount.
+ * All names in an index must have the same length.
+ */
+class RescueIndex {
+    int mmlim;
+    unsigned len, n_words;
+    std::vector<char> names; // Copies, as merging reallocates bam data.
+    std::vector<uint64_t> packed;
+    std::vector<uint8_t> regular; // 1 if the name is pure ACGT and packed is valid.
+    std::unordered_map<uint64_t, std::vector<unsigned>> buckets; // Ascending indices per segment key.
+
+    uint64_t seg_key(int seg, const char *name) const;
+    void pack(unsigned i);
+    void insert_segments(unsigned i);
+public:
+    RescueIndex(int mmlim): mmlim(mmlim), len(0), n_words(0) {}
+    /*
+     * @func reset
+     * Empties the index for names of length len.
+     */
+    void reset(unsigned len);
+    /*
+     * @func add
+     * :param: name [const char *] Name of length len. Copied.
+     * :returns: [unsigned] Index of the name, in order of addition.
+     */
+    unsigned add(const char *name);
+    /*
+     * @func rename
+     * Replaces name i after a merge, indexing any segments it did not previously have.
+     */
+    void rename(unsigned i, const char *name);
+    /*
+     * @func hamming
+     * :returns: [int] Number of mismatched characters between names i and j.
+     */
+    int hamming(unsigned i, unsigned j) const;
+    unsigned size() const {return len ? names.size() / len: 0;}
+    /*
+     * @func next_match
+     * Finds the lowest index after i within mmlim mismatches of name i which also satisfies accept.
+     * This is the first read the exhaustive forward scan from i would merge into.
+     * :param: i [unsigned] Query index.
+     * :param: accept [Pred] Additional requirement on candidate indices, e.g., equal read lengths.
+     * :returns: [unsigned] Matching index, or size() if none.
+     */
+    template<typename Pred>
+    unsigned next_match(unsigned i, Pred accept) const {
+        unsigned best(size());
+        const char *const name(names.data() + (size_t)i * len);
+        for(int seg(0); seg <= mmlim; ++seg) {
+            auto bucket(buckets.find(seg_key(seg, name)));
+            if(bucket == buckets.end()) continue;
+            const std::vector<unsigned> &v(bucket->second);
+            for(auto it(std::upper_bound(v.begin(), v.end(), i)); it != v.end() && *it < best; ++it) {
+                if(accept(*it) && hamming(i, *it) <= mmlim) {
+                    best = *it;
+                    break;
+                }
+            }
+        }
+        return best;
+    }
+};
+
+} /* namespace bmf */
+
+#endif /* RSQINDEX_H */
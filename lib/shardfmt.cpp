@@ -0,0 +1,109 @@
+#include "lib/shardfmt.h"
+
+#include <cstring>
+#include "dlib/logging_util.h"
+#include "lib/shardstore.h"
+
+namespace bmf {
+
+ShardReader::ShardReader(const char *path):
+    fp(gzopen((path && *path) ? path: "-", "r")),
+    bucket(nullptr),
+    seq(nullptr),
+    raw{0, 0, nullptr},
+    bases{0, 0, nullptr},
+    path((path && *path) ? path: "stdin"),
+    rec{}
+{
+    if(!fp) LOG_EXIT("Could not open %s for reading. Abort mission!\n", this->path);
+    const int c(gzgetc(fp));
+    if(c < 0) return; // Empty shard.
+    if(c == '@') {
+        gzungetc(c, fp);
+        seq = kseq_init(fp);
+        return;
+    }
+    check_header(c);
+}
+
+ShardReader::ShardReader(const ShardStore &store, uint32_t bucket):
+    fp(nullptr),
+    bucket(new ShardStoreReader(store, bucket)),
+    seq(nullptr),
+    raw{0, 0, nullptr},
+    bases{0, 0, nullptr},
+    path(store.path(bucket)),
+    rec{}
+{
+    unsigned char c;
+    if(this->bucket->read(&c, 1) == 1) check_header(c);
+}
+
+ShardReader::~ShardReader()
+{
+    if(seq) kseq_destroy(seq);
+    if(fp) gzclose(fp);
+    delete bucket;
+    free(raw.s), free(bases.s);
+}
+
+int ShardReader::read(void *buf, unsigned l)
+{
+    return fp ? gzread(fp, buf, l): (int)bucket->read(buf, l);
+}
+
+/*
+ * Checks the rest of a binary shard's header, given its first byte.
+ */
+void ShardReader::check_header(int c)
+{
+    char header[SHARD_HEADER_SIZE];
+    header[0] = c;
+    if(read(header + 1, SHARD_HEADER_SIZE - 1) != SHARD_HEADER_SIZE - 1 ||
+       memcmp(header, SHARD_MAGIC, sizeof(SHARD_MAGIC) - 1))
+        LOG_EXIT("%s is neither a binary nor a text shard. Abort!\n", path);
+    if(header[sizeof(SHARD_MAGIC) - 1] != SHARD_VERSION)
+        LOG_EXIT("%s has shard format version %i. Expected %i. Abort!\n",
+                 path, header[sizeof(SHARD_MAGIC) - 1], SHARD_VERSION);
+}
+
+int ShardReader::next_binary()
+{
+    shard_rec_hdr_t hdr;
+    const int n(read(&hdr, sizeof(hdr)));
+    if(n <= 0) return 0;
+    const size_t size(shard_payload_size(hdr.l));
+    ks_resize(&raw, size);
+    ks_resize(&bases, hdr.l + 1);
+    if(n != sizeof(hdr) || read(raw.s, size) != (int)size)
+        LOG_EXIT("Truncated record in shard %s. Abort!\n", path);
+    const uint8_t *const packed((uint8_t *)raw.s), *const mask(packed + ((hdr.l + 3) >> 2));
+    for(uint32_t i(0); i < hdr.l; ++i)
+        bases.s[i] = (mask[i >> 3] >> (i & 7)) & 1 ? 'N': "ACGT"[(packed[i >> 2] >> ((i & 3) << 1)) & 3];
+    bases.s[hdr.l] = '\0';
+    bs[0] = "FRZ"[(hdr.flags >> 1) & 3];
+    for(unsigned i(0); i < hdr.blen; ++i)
+        bs[i + 1] = hdr.nmask >> i & 1 ? 'N': "ACGT"[(hdr.packed >> ((hdr.blen - 1 - i) << 1)) & 3];
+    bs[hdr.blen + 1] = '\0';
+    rec.key = bc_key_t{hdr.packed, hdr.nmask, hdr.blen};
+    rec.bs = bs, rec.bs_len = hdr.blen + 1;
+    rec.pass_fail = '0' + (hdr.flags & 1);
+    rec.seq = bases.s, rec.qual = (char *)mask + ((hdr.l + 7) >> 3), rec.l = hdr.l;
+    return 1;
+}
+
+int ShardReader::next_text()
+{
+    if(kseq_read(seq) < 0) return 0;
+    char *const bs_ptr(seq->comment.s + HASH_DMP_OFFSET);
+    int bs_len(0);
+    while(bs_ptr[bs_len] && bs_ptr[bs_len] != '|') ++bs_len;
+    if(UNLIKELY(bc_pack(bs_ptr + 1, &rec.key)))
+        LOG_EXIT("Barcode in record %s is longer than the maximum of %i.\n", seq->name.s, MAX_PACKED_BARCODE_LENGTH);
+    rec.bs = bs_ptr, rec.bs_len = bs_len;
+    rec.pass_fail = seq->comment.s[FP_OFFSET];
+    rec.seq = seq->seq.s, rec.qual = seq->qual.s, rec.l = seq->seq.l;
+    return 1;
+}
+
+} /* namespace bmf */
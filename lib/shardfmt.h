@@ -0,0 +1,161 @@
+#ifndef SHARDFMT_H
+#define SHARDFMT_H
+#include <cstdint>
+#include <zlib.h>
+#include "htslib/kseq.h"
+#include "htslib/kstring.h"
+#include "lib/bgzfwriter.h"
+#include "lib/famtable.h"
+#include "lib/mseq.h"
+
+/*
+ * Binary format for the temporary shard files written by collapse's mark/split and read by hashdmp.
+ * A file starts with SHARD_MAGIC, a version byte and padding (SHARD_HEADER_SIZE bytes),
+ * followed by records, each of which is a shard_rec_hdr_t and then, for a read of length l:
+ *   (l + 3) / 4 bytes of bases packed 2 bits each (A=0, C=1, G=2, T=3), first base in the low bits,
+ *   (l + 7) / 8 bytes of N mask, one bit per base, set for any base other than ACGT,
+ *   l bytes of raw quality characters.
+ * Read names are not stored, as hashdmp never uses them.
+ * Records are written in native byte order; shards never leave the machine which wrote them.
+ * Text shards (the marked fastq format) are still read, and written with --text-shards.
+ */
+#define SHARD_MAGIC "BMFSHD"
+#define SHARD_VERSION 1
+#define SHARD_HEADER_SIZE 8
+
+namespace bmf {
+
+class ShardStore;
+class ShardStoreReader;
+
+struct shard_rec_hdr_t {
+    uint64_t packed; // Barcode, as in bc_key_t.
+    uint32_t nmask; // Barcode N mask, as in bc_key_t.
+    uint16_t l; // Read length
+    uint8_t blen; // Barcode length
+    uint8_t flags; // Bit 0: pass/fail. Bits 1-2: strand (0: F, 1: R, 2: Z).
+};
+static_assert(sizeof(shard_rec_hdr_t) == 16, "shard_rec_hdr_t must be packed into 16 bytes.");
+
+CONST static inline size_t shard_payload_size(uint32_t l)
+{
+    return ((l + 3) >> 2) + ((l + 7) >> 3) + l;
+}
+
+/*
+ * @func shard_write_header
+ * Writes the file header. Call once, before any records, on each binary shard.
+ */
+static inline void shard_write_header(kstring_t *ks)
+{
+    static const char header[SHARD_HEADER_SIZE]{'B', 'M', 'F', 'S', 'H', 'D', SHARD_VERSION, 0};
+    kputsn(header, SHARD_HEADER_SIZE, ks);
+}
+
+static inline void shard_write_header(BgzfWriter *handle) {shard_write_header(handle->buf());}
+
+/*
+ * @func shard_write
+ * Appends one binary record to ks.
+ * :param: seq [const char *] Bases.
+ * :param: qual [const char *] Quality characters.
+ * :param: l [uint32_t] Read length.
+ * :param: pass_fail [int] 1 for pass, 0 for fail.
+ * :param: barcode [const char *] Null-terminated barcode, without the strand character.
+ * :param: strand [char] 'F', 'R', or 'Z'.
+ */
+static inline void shard_write(kstring_t *ks, const char *seq, const char *qual, uint32_t l,
+                               int pass_fail, const char *barcode, char strand)
+{
+    bc_key_t key;
+    if(UNLIKELY(bc_pack(barcode, &key)))
+        LOG_EXIT("Barcode %s is longer than the maximum of %i for binary shards. Use --text-shards.\n",
+                 barcode, MAX_PACKED_BARCODE_LENGTH);
+    if(UNLIKELY(l > UINT16_MAX)) LOG_EXIT("Read length %u is too long for binary shards. Use --text-shards.\n", l);
+    const shard_rec_hdr_t hdr{key.packed, key.nmask, (uint16_t)l, (uint8_t)key.len,
+                              (uint8_t)((pass_fail != 0) | (strand == 'F' ? 0: strand == 'R' ? 2: 4))};
+    const size_t n_bases((l + 3) >> 2), n_mask((l + 7) >> 3);
+    ks_resize(ks, ks->l + sizeof(hdr) + shard_payload_size(l));
+    memcpy(ks->s + ks->l, &hdr, sizeof(hdr));
+    uint8_t *const bases((uint8_t *)ks->s + ks->l + sizeof(hdr)), *const mask(bases + n_bases);
+    memset(bases, 0, n_bases + n_mask);
+    for(uint32_t i(0); i < l; ++i) {
+        const int code(nuc2num(seq[i]));
+        if(code > 3) mask[i >> 3] |= 1 << (i & 7);
+        else bases[i >> 2] |= code << ((i & 3) << 1);
+    }
+    memcpy(mask + n_mask, qual, l);
+    ks->l += sizeof(hdr) + shard_payload_size(l);
+}
+
+static inline void shard_write(BgzfWriter *handle, const char *seq, const char *qual, uint32_t l,
+                               int pass_fail, const char *barcode, char strand)
+{
+    shard_write(handle->buf(), seq, qual, l, pass_fail, barcode, strand);
+    handle->check();
+}
+
+/*
+ * @func mseq2shard
+ * Appends a marked read to ks in the binary shard format, or as a marked fastq record if text is set.
+ */
+static inline void mseq2shard(kstring_t *ks, mseq_t *mvar, int pass_fail, char *barcode, char prefix, int text)
+{
+    if(text) mseq2fq_stranded(ks, mvar, pass_fail, barcode, prefix);
+    else shard_write(ks, mvar->seq, mvar->qual, mvar->l, pass_fail, barcode, prefix);
+}
+
+/*
+ * One shard record, as needed by hashdmp.
+ * Pointers are valid until the next call to ShardReader::next.
+ */
+struct shard_rec_t {
+    bc_key_t key;
+    const char *bs; // Strand character followed by the barcode.
+    int bs_len; // Length of bs, including the strand character.
+    char pass_fail; // '0' or '1'
+    const char *seq;
+    const char *qual;
+    uint32_t l;
+};
+
+/*
+ * Reads binary or text shards, (possibly) compressed, detecting the format from the first byte.
+ * Buckets of a ShardStore are read the same way, but must hold binary shards.
+ */
+class ShardReader {
+    gzFile fp;
+    ShardStoreReader *bucket; // Set instead of fp for a ShardStore bucket.
+    kseq_t *seq; // Text shards only.
+    kstring_t raw; // Binary record payload.
+    kstring_t bases; // Decoded bases.
+    char bs[MAX_PACKED_BARCODE_LENGTH + 2];
+    const char *path;
+    int next_binary();
+    int next_text();
+    int read(void *buf, unsigned l);
+    void check_header(int c);
+public:
+    shard_rec_t rec;
+    /*
+     * :param: path [const char *] Path to shard. If null or "-", reads stdin.
+     */
+    ShardReader(const char *path);
+    /*
+     * :param: store [const ShardStore &] Closed store.
+     * :param: bucket [uint32_t] Bucket to read.
+     */
+    ShardReader(const ShardStore &store, uint32_t bucket);
+    ShardReader(const ShardReader &other) = delete;
+    ~ShardReader();
+    /*
+     * @func next
+     * :returns: [int] 1 if rec was filled, 0 at end of file.
+     */
+    int next() {return seq ? next_text(): next_binary();}
+    int is_binary() const {return seq == nullptr;}
+};
+
+} /* namespace bmf */
+
+#endif /* SHARDFMT_H */
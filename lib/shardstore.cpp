@@ -0,0 +1,227 @@
+#include "lib/shardstore.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "dlib/logging_util.h"
+
+namespace bmf {
+
+static void pwrite_all(int fd, const void *buf, size_t l, uint64_t offset, const char *path)
+{
+    const char *s((const char *)buf);
+    while(l) {
+        const ssize_t n(pwrite(fd, s, l, offset));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            LOG_EXIT("Failed to write %lu bytes to %s: %s. Abort!\n", l, path, strerror(errno));
+        }
+        s += n, l -= n, offset += n;
+    }
+}
+
+static void pread_all(int fd, void *buf, size_t l, uint64_t offset, const char *path)
+{
+    char *s((char *)buf);
+    while(l) {
+        const ssize_t n(pread(fd, s, l, offset));
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) continue;
+            LOG_EXIT("Failed to read %lu bytes from %s: %s. Abort!\n", l, path, n ? strerror(errno): "truncated");
+        }
+        s += n, l -= n, offset += n;
+    }
+}
+
+ShardStore::ShardStore(const char *prefix, uint32_t n_buckets, int level, int n_threads):
+    file_ends(new std::atomic<uint64_t>[std::min(n_buckets, (uint32_t)SHARD_STORE_FILES)]),
+    bufs(n_buckets, kstring_t{0, 0, nullptr}),
+    index(n_buckets),
+    bucket_sizes(n_buckets),
+    block_size(std::max((size_t)SHARD_STORE_MIN_BLOCK,
+                        std::min((size_t)SHARD_STORE_MAX_BLOCK, (size_t)(SHARD_STORE_MEM / n_buckets)))),
+    level(level > 9 ? 9: level),
+    closing(false),
+    closed(false)
+{
+    if(!n_buckets) LOG_EXIT("A shard store needs at least one bucket. Abort!\n");
+    kstring_t ks{0, 0, nullptr};
+    for(uint32_t i(0); i < std::min(n_buckets, (uint32_t)SHARD_STORE_FILES); ++i) {
+        ks.l = 0;
+        ksprintf(&ks, "%s.%u.shards", prefix, i);
+        const int fd(open(ks.s, O_RDWR | O_CREAT | O_TRUNC, 0644));
+        if(fd < 0) LOG_EXIT("Could not open %s for writing: %s. Abort!\n", ks.s, strerror(errno));
+        paths.emplace_back(ks.s);
+        fds.push_back(fd);
+        file_ends[i] = 0;
+    }
+    free(ks.s);
+    if(n_threads > 1)
+        for(int i(0); i < n_threads; ++i)
+            workers.emplace_back(&ShardStore::work, this);
+}
+
+/*
+ * Hands the bucket's pending bytes to a worker (or stores them directly, without workers)
+ * and starts a new buffer for the bucket.
+ * Index entries are appended here, in write order, and filled in by whichever thread stores the block.
+ */
+void ShardStore::flush(uint32_t bucket)
+{
+    kstring_t &ks(bufs[bucket]);
+    if(!ks.l) return;
+    if(ks.l > UINT32_MAX) LOG_EXIT("Block of %lu bytes is too large for a shard store. Abort!\n", ks.l);
+    bucket_sizes[bucket] += ks.l;
+    index[bucket].push_back(shard_block_t{0, 0, 0, 0});
+    job_t job{bucket, ks, &index[bucket].back()};
+    ks = kstring_t{0, 0, nullptr};
+    if(workers.empty()) {
+        kstring_t tmp{0, 0, nullptr};
+        z_stream zs{};
+        if(level >= 0 && deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            LOG_EXIT("Could not initialize zlib. Abort!\n");
+        store(job, &zs, &tmp);
+        if(level >= 0) deflateEnd(&zs);
+        free(tmp.s);
+        return;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    jobs_taken.wait(guard, [this]() {return jobs.size() < 2 * workers.size();});
+    jobs.push_back(job);
+    guard.unlock();
+    jobs_ready.notify_one();
+}
+
+void ShardStore::store(job_t &job, z_stream *zs, kstring_t *tmp)
+{
+    const uint32_t ulen(job.data.l);
+    const char *payload(job.data.s);
+    uint32_t clen(ulen);
+    if(level >= 0) {
+        deflateReset(zs);
+        ks_resize(tmp, deflateBound(zs, ulen));
+        zs->next_in = (Bytef *)job.data.s, zs->avail_in = ulen;
+        zs->next_out = (Bytef *)tmp->s, zs->avail_out = tmp->m;
+        if(deflate(zs, Z_FINISH) != Z_STREAM_END) LOG_EXIT("Failed to compress a shard block. Abort!\n");
+        // Incompressible blocks are stored as they are, which the reader detects by clen == ulen.
+        if(zs->total_out < ulen) payload = tmp->s, clen = zs->total_out;
+    }
+    const shard_block_tag_t tag{job.bucket, clen, ulen, (uint32_t)crc32(0, (Bytef *)job.data.s, ulen)};
+    const size_t f(job.bucket % fds.size());
+    const uint64_t offset(file_ends[f].fetch_add(sizeof(tag) + clen));
+    pwrite_all(fds[f], &tag, sizeof(tag), offset, paths[f].c_str());
+    pwrite_all(fds[f], payload, clen, offset + sizeof(tag), paths[f].c_str());
+    *job.block = shard_block_t{offset + sizeof(tag), clen, ulen, tag.crc};
+    free(job.data.s);
+}
+
+void ShardStore::work()
+{
+    kstring_t tmp{0, 0, nullptr};
+    z_stream zs{};
+    if(level >= 0 && deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        LOG_EXIT("Could not initialize zlib. Abort!\n");
+    for(;;) {
+        std::unique_lock<std::mutex> guard(lock);
+        jobs_ready.wait(guard, [this]() {return closing || !jobs.empty();});
+        if(jobs.empty()) break;
+        job_t job(jobs.front());
+        jobs.pop_front();
+        guard.unlock();
+        jobs_taken.notify_one();
+        store(job, &zs, &tmp);
+    }
+    if(level >= 0) deflateEnd(&zs);
+    free(tmp.s);
+}
+
+void ShardStore::close()
+{
+    if(closed) return;
+    for(uint32_t i(0); i < bufs.size(); ++i) flush(i);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+    }
+    jobs_ready.notify_all();
+    for(auto &worker: workers) worker.join();
+    workers.clear();
+    closed = true;
+}
+
+void ShardStore::close_files()
+{
+    for(int &fd: fds) {
+        if(fd >= 0 && ::close(fd)) LOG_WARNING("Could not close shard store file: %s.\n", strerror(errno));
+        fd = -1;
+    }
+}
+
+void ShardStore::remove_files()
+{
+    close_files();
+    for(const auto &path: paths)
+        if(remove(path.c_str()))
+            LOG_WARNING("Could not remove temporary file %s.\n", path.c_str());
+}
+
+ShardStoreReader::ShardStoreReader(const ShardStore &store, uint32_t bucket):
+    store(store),
+    bucket(bucket),
+    next_block(0),
+    raw{0, 0, nullptr},
+    block{0, 0, nullptr},
+    pos(0),
+    zs{}
+{
+    if(inflateInit2(&zs, -15) != Z_OK) LOG_EXIT("Could not initialize zlib. Abort!\n");
+}
+
+ShardStoreReader::~ShardStoreReader()
+{
+    inflateEnd(&zs);
+    free(raw.s), free(block.s);
+}
+
+/*
+ * Reads and decompresses the next block of the bucket into block.
+ * :returns: [int] 1 if a block was loaded, 0 at the end of the bucket.
+ */
+int ShardStoreReader::load()
+{
+    const auto &blocks(store.blocks(bucket));
+    if(next_block == blocks.size()) return 0;
+    const shard_block_t &b(blocks[next_block++]);
+    ks_resize(&block, b.ulen);
+    if(b.clen == b.ulen) {
+        pread_all(store.fd(bucket), block.s, b.ulen, b.offset, store.path(bucket));
+    } else {
+        ks_resize(&raw, b.clen);
+        pread_all(store.fd(bucket), raw.s, b.clen, b.offset, store.path(bucket));
+        inflateReset(&zs);
+        zs.next_in = (Bytef *)raw.s, zs.avail_in = b.clen;
+        zs.next_out = (Bytef *)block.s, zs.avail_out = b.ulen;
+        if(inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != b.ulen)
+            LOG_EXIT("Corrupted block at offset %lu in %s. Abort!\n", b.offset, store.path(bucket));
+    }
+    if(crc32(0, (Bytef *)block.s, b.ulen) != b.crc)
+        LOG_EXIT("Checksum mismatch for block at offset %lu in %s. Abort!\n", b.offset, store.path(bucket));
+    block.l = b.ulen, pos = 0;
+    return 1;
+}
+
+size_t ShardStoreReader::read(void *buf, size_t l)
+{
+    size_t ret(0);
+    while(ret < l) {
+        if(pos == block.l && !load()) break;
+        const size_t n(std::min(l - ret, block.l - pos));
+        memcpy((char *)buf + ret, block.s + pos, n);
+        pos += n, ret += n;
+    }
+    return ret;
+}
+
+} /* namespace bmf */
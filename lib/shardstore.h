@@ -0,0 +1,137 @@
+#ifndef SHARDSTORE_H
+#define SHARDSTORE_H
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include "htslib/kstring.h"
+
+#define SHARD_STORE_FILES 8 // Spill files per store, however many buckets it holds.
+#define SHARD_STORE_MEM (64uL << 20) // Bytes buffered across all buckets, which sets the block size.
+#define SHARD_STORE_MIN_BLOCK (1 << 12)
+#define SHARD_STORE_MAX_BLOCK (1 << 16)
+
+namespace bmf {
+
+/*
+ * Precedes each block in a spill file, so that a spill file can be read back without the index.
+ */
+struct shard_block_tag_t {
+    uint32_t bucket;
+    uint32_t clen; // Stored length of the payload. Equal to ulen if the block is stored uncompressed.
+    uint32_t ulen; // Uncompressed length of the payload.
+    uint32_t crc; // crc32 of the uncompressed payload.
+};
+static_assert(sizeof(shard_block_tag_t) == 16, "shard_block_tag_t must be packed into 16 bytes.");
+
+struct shard_block_t {
+    uint64_t offset; // Offset of the payload in its bucket's spill file, just past its tag.
+    uint32_t clen;
+    uint32_t ulen;
+    uint32_t crc;
+};
+
+/*
+ * Temporary storage for mark/split shards that holds any number of buckets in SHARD_STORE_FILES files.
+ * Writes to a bucket accumulate in memory until a block's worth is buffered.
+ * The block is then compressed (on a pool of threads, if there is one), tagged with its bucket,
+ * and appended to spill file bucket % SHARD_STORE_FILES. The index of each bucket's blocks is kept in memory.
+ * A bucket reads back, through ShardStoreReader, as exactly the bytes written to it.
+ * Unlike one file per shard, this needs no more file descriptors or zlib streams for more shards.
+ */
+class ShardStore {
+    struct job_t {
+        uint32_t bucket;
+        kstring_t data;
+        shard_block_t *block; // Filled in once the block is written.
+    };
+    std::vector<std::string> paths;
+    std::vector<int> fds;
+    std::unique_ptr<std::atomic<uint64_t>[]> file_ends;
+    std::vector<kstring_t> bufs; // Pending bytes per bucket.
+    std::vector<std::deque<shard_block_t>> index; // Blocks per bucket, in write order.
+    std::vector<uint64_t> bucket_sizes; // Uncompressed bytes per bucket.
+    const size_t block_size;
+    const int level;
+    std::vector<std::thread> workers;
+    std::deque<job_t> jobs;
+    std::mutex lock;
+    std::condition_variable jobs_ready, jobs_taken;
+    bool closing; // Set once every bucket has been flushed, to stop the workers.
+    bool closed;
+
+    void flush(uint32_t bucket);
+    void store(job_t &job, z_stream *zs, kstring_t *tmp);
+    void work();
+public:
+    /*
+     * :param: prefix [const char *] Spill files are named <prefix>.<i>.shards.
+     * :param: n_buckets [uint32_t] Number of buckets.
+     * :param: level [int] zlib compression level, or -1 to store blocks uncompressed.
+     * :param: n_threads [int] Number of compression threads. With <= 1, blocks are compressed on the writing thread.
+     */
+    ShardStore(const char *prefix, uint32_t n_buckets, int level, int n_threads);
+    ShardStore(const ShardStore &other) = delete;
+    ~ShardStore() {close(), close_files();}
+    /*
+     * @func buf
+     * :returns: [kstring_t *] Buffer to append a bucket's bytes to. Call check(bucket) afterwards.
+     * Only one thread may write to a store.
+     */
+    kstring_t *buf(uint32_t bucket) {return &bufs[bucket];}
+    void check(uint32_t bucket) {if(bufs[bucket].l >= block_size) flush(bucket);}
+    void write(uint32_t bucket, const char *s, size_t l) {
+        kputsn(s, l, &bufs[bucket]);
+        check(bucket);
+    }
+    /*
+     * @func close
+     * Flushes every bucket and waits for all blocks to be written. Call before reading back.
+     */
+    void close();
+    /*
+     * @func remove_files
+     * Closes and deletes the spill files.
+     */
+    void remove_files();
+    void close_files();
+    uint32_t n_buckets() const {return bufs.size();}
+    uint64_t bucket_size(uint32_t bucket) const {return bucket_sizes[bucket];}
+    const std::deque<shard_block_t> &blocks(uint32_t bucket) const {return index[bucket];}
+    int fd(uint32_t bucket) const {return fds[bucket % fds.size()];}
+    const char *path(uint32_t bucket) const {return paths[bucket % paths.size()].c_str();}
+};
+
+/*
+ * Streams one bucket of a closed ShardStore, one block at a time.
+ * Any number of readers may read from a store at once.
+ */
+class ShardStoreReader {
+    const ShardStore &store;
+    const uint32_t bucket;
+    size_t next_block;
+    kstring_t raw; // Compressed block
+    kstring_t block; // Current block
+    size_t pos; // Position in block
+    z_stream zs;
+    int load();
+public:
+    ShardStoreReader(const ShardStore &store, uint32_t bucket);
+    ShardStoreReader(const ShardStoreReader &other) = delete;
+    ~ShardStoreReader();
+    /*
+     * @func read
+     * :returns: [size_t] Number of bytes read into buf: l, unless the bucket ends first.
+     */
+    size_t read(void *buf, size_t l);
+};
+
+} /* namespace bmf */
+
+#endif /* SHARDSTORE_H */
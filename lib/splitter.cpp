@@ -6,6 +6,8 @@
 #include "dlib/compiler_util.h"
 #include "dlib/misc_util.h"
 #include "lib/binner.h"
+#include "lib/shardfmt.h"
+#include "lib/shardstore.h"
 
 namespace bmf {
 
@@ -34,10 +36,11 @@ void free_marksplit_settings(marksplit_settings_t settings)
     cond_free(settings.input_r1_path);
     cond_free(settings.input_r2_path);
     cond_free(settings.index_fq_path);
-    cond_free(settings.rescaler);
+    delete settings.rescaler;
     cond_free(settings.rescaler_path);
     cond_free(settings.homing_sequence);
     cond_free(settings.ffq_prefix);
+    cond_free(settings.shard_report_path);
 }
 
 splitterhash_params_t *init_splitterhash(marksplit_settings_t *settings, mark_splitter_t *splitter_ptr)
@@ -56,6 +59,7 @@ splitterhash_params_t *init_splitterhash(marksplit_settings_t *settings, mark_sp
     kstring_t ks{0, 0, nullptr};
     splitterhash_params_t *ret((splitterhash_params_t *)calloc(1, sizeof(splitterhash_params_t)));
     ret->n = splitter_ptr->n_handles;
+    ret->store = splitter_ptr->store;
     if(settings->is_se) {
         ret->outfnames_r1 = (char **)malloc(ret->n * sizeof(char *));
         ret->infnames_r1 = (char **)malloc(ret->n * sizeof(char *));
@@ -86,6 +90,21 @@ splitterhash_params_t *init_splitterhash(marksplit_settings_t *settings, mark_sp
 }
 
 
+void splitter_close(mark_splitter_t *var)
+{
+    for(int i(0); i < var->n_handles; ++i) {
+        if(var->tmp_out_handles_r1) {
+            delete var->tmp_out_handles_r1[i];
+            var->tmp_out_handles_r1[i] = nullptr;
+        }
+        if(var->tmp_out_handles_r2) {
+            delete var->tmp_out_handles_r2[i];
+            var->tmp_out_handles_r2[i] = nullptr;
+        }
+    }
+    if(var->store) var->store->close();
+}
+
 void splitter_destroy(mark_splitter_t *var)
 {
     for(int i(0); i < var->n_handles; i++)
@@ -96,18 +115,21 @@ void splitter_destroy(mark_splitter_t *var)
 
     cond_free(var->tmp_out_handles_r1);
     cond_free(var->tmp_out_handles_r2);
+    delete var->store;
+    var->store = nullptr;
 }
 
 
 mark_splitter_t init_splitter_pe(marksplit_settings_t* settings)
 {
     mark_splitter_t ret {
-        (gzFile *)calloc(settings->n_handles, sizeof(gzFile)), // tmp_out_handles_r1
-        (gzFile *)calloc(settings->n_handles, sizeof(gzFile)), // tmp_out_handles_r2
+        (BgzfWriter **)calloc(settings->n_handles, sizeof(BgzfWriter *)), // tmp_out_handles_r1
+        (BgzfWriter **)calloc(settings->n_handles, sizeof(BgzfWriter *)), // tmp_out_handles_r2
         settings->n_nucs, // n_nucs
         (int)dlib::ipow(4, settings->n_nucs), // n_handles
         (char **)calloc(ret.n_handles, sizeof(char *)), // infnames_r1
-        (char **)calloc(ret.n_handles, sizeof(char *))  // infnames_r2
+        (char **)calloc(ret.n_handles, sizeof(char *)), // infnames_r2
+        nullptr // store
     };
     kstring_t ks {0, 0, nullptr};
     for (int i(0); i < ret.n_handles; i++) {
@@ -118,8 +140,12 @@ mark_splitter_t init_splitter_pe(marksplit_settings_t* settings)
         ks.l = 0;
         ksprintf(&ks, "%s.tmp.%i.R2.fastq", settings->tmp_basename, i);
         ret.fnames_r2[i] = dlib::kstrdup(&ks);
-        ret.tmp_out_handles_r1[i] = gzopen(ret.fnames_r1[i], settings->mode);
-        ret.tmp_out_handles_r2[i] = gzopen(ret.fnames_r2[i], settings->mode);
+        ret.tmp_out_handles_r1[i] = new BgzfWriter(ret.fnames_r1[i], zmode_level(settings->mode));
+        ret.tmp_out_handles_r2[i] = new BgzfWriter(ret.fnames_r2[i], zmode_level(settings->mode));
+        if(!settings->text_shards) {
+            shard_write_header(ret.tmp_out_handles_r1[i]);
+            shard_write_header(ret.tmp_out_handles_r2[i]);
+        }
     }
     return ret;
 }
@@ -127,19 +153,52 @@ mark_splitter_t init_splitter_pe(marksplit_settings_t* settings)
 mark_splitter_t init_splitter_se(marksplit_settings_t* settings)
 {
     mark_splitter_t ret {
-        (gzFile *)calloc(settings->n_handles, sizeof(gzFile)), // tmp_out_handles_r1
+        (BgzfWriter **)calloc(settings->n_handles, sizeof(BgzfWriter *)), // tmp_out_handles_r1
         nullptr, // tmp_out_handles_r2
         settings->n_nucs, // n_nucs
         (int)dlib::ipow(4, settings->n_nucs), // n_handles
         (char **)calloc(ret.n_handles, sizeof(char *)), // infnames_r1
-        nullptr  // infnames_r2
+        nullptr, // infnames_r2
+        nullptr // store
     };
     kstring_t ks {0, 0, nullptr};
     for (int i(0); i < ret.n_handles; i++) {
         ks.l = 0;
         ksprintf(&ks, "%s.tmp.%i.fastq", settings->tmp_basename, i);
         ret.fnames_r1[i] = dlib::kstrdup(&ks);
-        ret.tmp_out_handles_r1[i] = gzopen(ret.fnames_r1[i], settings->mode);
+        ret.tmp_out_handles_r1[i] = new BgzfWriter(ret.fnames_r1[i], zmode_level(settings->mode));
+        if(!settings->text_shards) shard_write_header(ret.tmp_out_handles_r1[i]);
+    }
+    free(ks.s);
+    return ret;
+}
+
+/*
+ * Splits into the buckets of one ShardStore, so that the number of open files and zlib streams
+ * stays at SHARD_STORE_FILES (and the number of compression threads) however large n_nucs is.
+ * Each bucket starts with a binary shard header, like a shard file.
+ */
+mark_splitter_t init_splitter_store(marksplit_settings_t* settings)
+{
+    const int n_handles((int)dlib::ipow(4, settings->n_nucs));
+    mark_splitter_t ret {
+        nullptr, // tmp_out_handles_r1
+        nullptr, // tmp_out_handles_r2
+        settings->n_nucs, // n_nucs
+        n_handles, // n_handles
+        (char **)calloc(n_handles, sizeof(char *)), // infnames_r1
+        settings->is_se ? nullptr: (char **)calloc(n_handles, sizeof(char *)), // infnames_r2
+        nullptr // store
+    };
+    kstring_t ks {0, 0, nullptr};
+    ksprintf(&ks, "%s.tmp", settings->tmp_basename);
+    ret.store = new ShardStore(ks.s, (settings->is_se ? 1: 2) * n_handles, zmode_level(settings->mode), settings->threads);
+    LOG_DEBUG("Splitting into %u buckets of shard store %s.*.shards.\n", ret.store->n_buckets(), ks.s);
+    for(uint32_t bucket(0); bucket < ret.store->n_buckets(); ++bucket) {
+        shard_write_header(ret.store->buf(bucket));
+        ks.l = 0;
+        ksprintf(&ks, "%s[%u]", ret.store->path(bucket), bucket);
+        (bucket < (uint32_t)n_handles ? ret.fnames_r1[bucket]: ret.fnames_r2[bucket - n_handles]) = dlib::kstrdup(&ks);
     }
     free(ks.s);
     return ret;
@@ -147,6 +206,7 @@ mark_splitter_t init_splitter_se(marksplit_settings_t* settings)
 
 mark_splitter_t init_splitter(marksplit_settings_t* settings)
 {
+    if(settings->shard_store) return init_splitter_store(settings);
     return settings->is_se ? init_splitter_se(settings)
                            : init_splitter_pe(settings);
 }
@@ -2,9 +2,13 @@
 #define SPLITTER_H
 #include <cstdint>
 #include <zlib.h>
+#include "lib/bgzfwriter.h"
 
 namespace bmf {
 
+class Rescaler;
+class ShardStore;
+
 struct marksplit_settings_t {
     uint32_t blen:16;
     uint32_t blen1_2:16;
@@ -27,25 +31,46 @@ struct marksplit_settings_t {
     uint32_t gzip_output:1;
     uint32_t gzip_compression:4;
     uint32_t hp_threshold:5;
+    uint32_t in_memory_shards:1; // Collapse shards in memory instead of through temporary split files.
+    uint32_t text_shards:1; // Write temporary shards as marked fastq text instead of the binary shard format.
+    uint32_t shard_store:1; // Write temporary shards into a ShardStore instead of one file per shard.
+    uint32_t interleaved:1; // Read 1 and read 2 alternate in input_r1_path. input_r2_path is unset.
     char *tmp_basename;
-    char *rescaler; // Four-dimensional rescaler array. Size: [readlen, NQSCORES, 4] (length of reads, number of original quality scores, number of bases)
+    Rescaler *rescaler; // Compiled quality rescaler, if rescaler_path is set.
     char *rescaler_path; // Path to rescaler for
+    char *shard_report_path; // If set, per-shard collapse times are written here.
     int threads;
+    uint64_t max_mem; // Memory budget for in-memory shards before spilling to disk. 0 for unlimited.
     char mode[4];
 };
 
 void free_marksplit_settings(marksplit_settings_t settings);
 
 struct mark_splitter_t {
-    gzFile *tmp_out_handles_r1;
-    gzFile *tmp_out_handles_r2;
+    BgzfWriter **tmp_out_handles_r1;
+    BgzfWriter **tmp_out_handles_r2;
     uint32_t n_nucs;
     int n_handles;
-    char **fnames_r1;
+    char **fnames_r1; // Shard labels, not files, with a store.
     char **fnames_r2;
+    ShardStore *store; // If set, shards are buckets of this store instead of files.
 };
 
+/*
+ * @func splitter_bucket
+ * :returns: [uint32_t] The store bucket holding shard bin of read 1 (mate 0) or read 2 (mate 1).
+ */
+static inline uint32_t splitter_bucket(const mark_splitter_t *splitter, uint64_t bin, int mate)
+{
+    return mate * splitter->n_handles + bin;
+}
+
 mark_splitter_t init_splitter(marksplit_settings_t* settings_ptr);
+/*
+ * @func splitter_close
+ * Closes the temporary shard handles (or store) once splitting is complete, so that the shards can be read back.
+ */
+void splitter_close(mark_splitter_t *var);
 void splitter_destroy(mark_splitter_t *var);
 
 struct splitterhash_params_t {
@@ -55,6 +80,7 @@ struct splitterhash_params_t {
     char **outfnames_r2;
     int n; // Number of infnames and outfnames
     int paired; // 1 if paired, 0 if single-end
+    ShardStore *store; // Owned by the mark_splitter_t. If set, infnames label its buckets.
 };
 
 void splitterhash_destroy(splitterhash_params_t *params);
@@ -0,0 +1,75 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "dlib/compiler_util.h"
+
+namespace bmf {
+
+/*
+ * Bounded, lock-free single-producer/single-consumer ring buffer.
+ * Exactly one thread may push and exactly one thread may pop.
+ * The producer calls close() once it is done so that the consumer's pop can return false once drained.
+ */
+template<typename T>
+class SpscQueue {
+    std::vector<T> buf;
+    const size_t mask;
+    char pad0[64];
+    std::atomic<size_t> head; // Next slot to pop. Written only by the consumer.
+    char pad1[64];
+    std::atomic<size_t> tail; // Next slot to push. Written only by the producer.
+    char pad2[64];
+    std::atomic<bool> closed;
+
+    static size_t roundup(size_t n) {
+        size_t ret(2);
+        while(ret < n) ret <<= 1;
+        return ret;
+    }
+    // Spin briefly, then back off so that idle threads do not monopolize a core.
+    static void backoff(unsigned &tries) {
+        if(++tries < 64) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+public:
+    SpscQueue(size_t capacity=1 << 10): buf(roundup(capacity)), mask(buf.size() - 1), head(0), tail(0), closed(false) {}
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    bool try_push(const T &val) {
+        const size_t t(tail.load(std::memory_order_relaxed));
+        if(t - head.load(std::memory_order_acquire) > mask) return false; // Full
+        buf[t & mask] = val;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    bool try_pop(T &val) {
+        const size_t h(head.load(std::memory_order_relaxed));
+        if(h == tail.load(std::memory_order_acquire)) return false; // Empty
+        val = buf[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    void push(const T &val) {
+        for(unsigned tries(0); !try_push(val); backoff(tries));
+    }
+    /*
+     * @func pop
+     * Blocks until a value is available or the queue is closed and drained.
+     * :returns: [bool] false if the queue is closed and empty.
+     */
+    bool pop(T &val) {
+        for(unsigned tries(0);; backoff(tries)) {
+            if(try_pop(val)) return true;
+            if(closed.load(std::memory_order_acquire)) return try_pop(val);
+        }
+    }
+    void close() {closed.store(true, std::memory_order_release);}
+};
+
+} /* namespace bmf */
+
+#endif /* SPSC_QUEUE_H */
@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <numeric>
 #include "include/igamc_cephes.h"
+#include "lib/pvtable.h"
 #include "dlib/misc_util.h"
 
 namespace bmf {
@@ -202,7 +203,7 @@ void UniqueObservation::add_obs(const bam_pileup1_t& plp, stack_aux_t *aux) {
     if(base2 == base1) {
         discordant = 0;
         agreed += ((uint32_t *)dlib::array_tag(plp.b, "FA"))[cycle2];
-        quality = agreed_pvalues(quality, ((uint32_t *)dlib::array_tag(plp.b, "PV"))[cycle2]);
+        quality = pv_table().agreed(quality, ((uint32_t *)dlib::array_tag(plp.b, "PV"))[cycle2]);
         pvalue = std::pow(10, -0.1 * quality);
     } else if(base1 == 'N') {
         discordant = 0;
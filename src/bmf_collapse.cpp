@@ -1,11 +1,24 @@
 #include "bmf_collapse.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <getopt.h>
+#include <memory>
 #include <omp.h>
+#include <sys/stat.h>
+#include <vector>
 #include <zlib.h>
 #include "dlib/nix_util.h"
+#include "lib/bgzfwriter.h"
 #include "lib/binner.h"
+#include "lib/famtable.h"
+#include "lib/fqcat.h"
+#include "lib/fqreader.h"
+#include "lib/memshard.h"
+#include "lib/pvtable.h"
 #include "lib/mseq.h"
+#include "lib/shardfmt.h"
+#include "lib/shardstore.h"
 
 namespace bmf {
 
@@ -21,8 +34,10 @@ void idmp_usage()
 {
         fprintf(stderr,
                         "Collapses inline barcoded fastq data.\n"
-                        "Usage: bmftools collapse inline <options> <r1.fq> <r2.fq>"
-                        "\nFlags:\n"
+                        "Usage: bmftools collapse inline <options> <r1.fq> <r2.fq>\n"
+                        "       bmftools collapse inline -I <options> <interleaved.fq>\n"
+                        "Inputs may be FIFOs, or - for stdin.\n"
+                        "Flags:\n"
                         "-S: Run in single-end mode. (Ignores read 2)\n"
                         "-=: Emit interleaved final output to stdout.\n"
                         "-l: Number of nucleotides at the beginning of each read to "
@@ -34,7 +49,7 @@ void idmp_usage()
                         "Default: 10.\n"
                         "-n: Number of nucleotides at the beginning of the barcode to use to split the output. Default: %i.\n"
                         "-m: Mask first n nucleotides in read for barcode. Default: 0.\n"
-                        "-p: Number of threads to use if running uthash_dmp. Default: %i.\n"
+                        "-p: Number of threads for marking and splitting (and BGZF decompression of the input), and for uthash_dmp. Default: %i.\n"
                         "-D: Use this flag to only mark/split and avoid final demultiplexing/consolidation.\n"
                         "-f: If running hash_dmp, this sets the Final Fastq Prefix. \n"
                         "The Final Fastq files will be named '<ffq_prefix>.R1.fq' and '<ffq_prefix>.R2.fq'.\n"
@@ -46,8 +61,24 @@ void idmp_usage()
                         "-g: Gzip compression ratio if writing gzipped. Default (if writing compressed): 1 (mostly to reduce I/O).\n"
                         "-u: Set notification/update interval for split. Default: 1000000.\n"
                         "-w: Set flag to leave temporary files. Primarily for debugging.\n"
+                        "-M/--in-memory-shards: Collapse in a single pass, holding shards in memory "
+                        "instead of writing, re-reading and concatenating temporary split files.\n"
+                        "-x/--max-mem: Memory budget for --in-memory-shards. Shards beyond this are spilled to temporary files. "
+                        "Accepts K/M/G suffixes. 0 for unlimited. Default: %lluG.\n"
+                        "-P/--pv-cache: Path to a cache of consensus quality lookup tables. Built and written if absent or stale.\n"
+                        "-R/--shard-report: Write per-shard collapse bytes and wall time, slowest first, to this path.\n"
+                        "-k/--text-shards: Write temporary shards as marked fastq text instead of the compact binary format. "
+                        "Primarily for debugging.\n"
+                        "-e/--merge-neighbors: Within each shard, merge each family into the largest family whose barcode "
+                        "differs from it by one substitution and which has at least max(n + 1, 2n - 1) reads, "
+                        "where n is its own size. Corrects barcode sequencing errors before consensus.\n"
+                        "-I/--interleaved: Read read 1 and read 2 alternately from one fastq.\n"
+                        "--stream: Collapse interleaved input from stdin (or the one path given) to interleaved stdout "
+                        "in a single in-memory pass. Equivalent to -M -= -I.\n"
+                        "-B/--shard-store: Write temporary shards as blocks in %i shared spill files instead of one file per shard. "
+                        "Allows large -n values without raising the open file limit.\n"
                         "-h: Print usage.\n"
-                    , DEFAULT_N_NUCS, DEFAULT_N_THREADS);
+                    , DEFAULT_N_NUCS, DEFAULT_N_THREADS, DEFAULT_SHARD_MEM >> 30, SHARD_STORE_FILES);
 
 }
 
@@ -97,79 +128,125 @@ void make_outfname(marksplit_settings_t *settings)
 void cleanup_hashdmp(marksplit_settings_t *settings, splitterhash_params_t *params)
 {
     if(!settings->cleanup) return;
-    #pragma omp parallel for
     for(int i = 0; i < params->n; ++i) {
-        kstring_t ks{0, 0, nullptr};
-        ksprintf(&ks, "rm %s %s", params->outfnames_r1[i], settings->is_se ? "": params->outfnames_r2[i]);
-        dlib::check_call(ks.s);
-        free(ks.s);
+        if(remove(params->outfnames_r1[i]))
+            LOG_WARNING("Could not remove temporary file %s.\n", params->outfnames_r1[i]);
+        if(!settings->is_se && remove(params->outfnames_r2[i]))
+            LOG_WARNING("Could not remove temporary file %s.\n", params->outfnames_r2[i]);
     }
 }
 
 /*
- * Executes hash_dmp_fn on each of the temporary files in the splitterhash
- * and cleans up if not disabled.
+ * One shard to collapse: its input file (or store bucket), output file, size and time taken.
+ */
+struct dmp_task_t {
+    char *infname;
+    char *outfname;
+    off_t bytes;
+    double seconds;
+    int bucket; // ShardStore bucket, or -1 if infname is a file.
+};
+
+/*
+ * Writes one line per shard (input, bytes, seconds), slowest first, to settings->shard_report_path,
+ * and summarizes the tail on stderr.
+ */
+static void report_shard_times(marksplit_settings_t *settings, std::vector<dmp_task_t> &tasks, double wall)
+{
+    std::sort(tasks.begin(), tasks.end(), [](const dmp_task_t &a, const dmp_task_t &b) {
+        return a.seconds > b.seconds;
+    });
+    double total(0.);
+    for(const auto &task: tasks) total += task.seconds;
+    LOG_INFO("Collapsed %zu shards in %0.2fs wall, %0.2fs summed. Slowest: %s (%lld bytes, %0.2fs).\n",
+             tasks.size(), wall, total, tasks[0].infname, (long long)tasks[0].bytes, tasks[0].seconds);
+    if(!settings->shard_report_path) return;
+    FILE *fp(fopen(settings->shard_report_path, "w"));
+    if(!fp) {
+        LOG_WARNING("Could not open shard report %s for writing.\n", settings->shard_report_path);
+        return;
+    }
+    fputs("#Shard\tBytes\tSeconds\n", fp);
+    for(const auto &task: tasks)
+        fprintf(fp, "%s\t%lld\t%0.4f\n", task.infname, (long long)task.bytes, task.seconds);
+    fclose(fp);
+}
+
+/*
+ * Executes hash_dmp_fn on each of the temporary files (or store buckets) in the splitterhash,
+ * R1 and R2 alike, in one pool, and cleans up if not disabled.
+ * Shard sizes are heavily skewed (low-complexity barcode prefixes are large),
+ * so shards are dispatched largest first to keep the biggest ones off the tail.
  */
 void parallel_hash_dmp_core(marksplit_settings_t *settings, splitterhash_params_t *params, hash_dmp_fn func)
 {
-    #pragma omp parallel for schedule(dynamic, 1)
+    ShardStore *const store(params->store);
+    std::vector<dmp_task_t> tasks;
     for(int i = 0; i < settings->n_handles; ++i) {
-        LOG_DEBUG("Now running hash dmp core on input filename %s and output filename %s.\n",
-                 params->infnames_r1[i], params->outfnames_r1[i]);
-        func(params->infnames_r1[i], params->outfnames_r1[i], settings->gzip_compression);
-        if(settings->cleanup) {
-            kstring_t ks{0, 0, nullptr};
-            ksprintf(&ks, "rm %s", params->infnames_r1[i]);
-            dlib::check_call(ks.s);
-            free(ks.s);
-        }
-    }
-    if(settings->is_se) {
-        LOG_DEBUG("Only dmp'ing single end.\n");
-        return; // Don't dmp imaginary files....
-    }
+        tasks.push_back(dmp_task_t{params->infnames_r1[i], params->outfnames_r1[i], 0, 0., store ? i: -1});
+        if(!settings->is_se)
+            tasks.push_back(dmp_task_t{params->infnames_r2[i], params->outfnames_r2[i], 0, 0.,
+                                       store ? settings->n_handles + i: -1});
+    }
+    struct stat st;
+    for(auto &task: tasks)
+        task.bytes = store ? store->bucket_size(task.bucket): stat(task.infname, &st) ? 0: st.st_size;
+    std::stable_sort(tasks.begin(), tasks.end(), [](const dmp_task_t &a, const dmp_task_t &b) {
+        return a.bytes > b.bytes;
+    });
+    const double start(omp_get_wtime());
     #pragma omp parallel for schedule(dynamic, 1)
-    for(int i = 0; i < settings->n_handles; ++i) {
+    for(unsigned i = 0; i < tasks.size(); ++i) {
         LOG_DEBUG("Now running hash dmp core on input filename %s and output filename %s.\n",
-                  params->infnames_r2[i], params->outfnames_r2[i]);
-        func(params->infnames_r2[i], params->outfnames_r2[i], settings->gzip_compression);
-        if(settings->cleanup) {
-            kstring_t ks{0, 0, nullptr};
-            ksprintf(&ks, "rm %s", params->infnames_r2[i]);
-            dlib::check_call(ks.s);
-            free(ks.s);
+                 tasks[i].infname, tasks[i].outfname);
+        const double task_start(omp_get_wtime());
+        {
+            std::unique_ptr<ShardReader> reader(store ? new ShardReader(*store, tasks[i].bucket)
+                                                      : new ShardReader(tasks[i].infname));
+            func(*reader, tasks[i].infname, tasks[i].outfname, settings->gzip_compression);
         }
+        tasks[i].seconds = omp_get_wtime() - task_start;
+        // Delete in-process so that cleanup overlaps with other threads' shards.
+        if(settings->cleanup && !store && remove(tasks[i].infname))
+            LOG_WARNING("Could not remove temporary file %s.\n", tasks[i].infname);
     }
+    if(settings->cleanup && store) store->remove_files();
+    if(tasks.size()) report_shard_times(settings, tasks, omp_get_wtime() - start);
 }
 
 
 void cat_fastqs_se(marksplit_settings_t *settings, splitterhash_params_t *params, char *ffq_r1)
 {
     kstring_t ks{0, 0, nullptr};
-    // Clear output files.
-    ksprintf(&ks, settings->gzip_output ? "> %s.gz" : "> %s", ffq_r1);
-    dlib::check_call(ks.s);
-    ks.l = 0;
-    ksprintf(&ks, "/bin/cat ");
-    for(int i(0); i < settings->n_handles; ++i) {
+    kputs(ffq_r1, &ks);
+    if(settings->gzip_output) kputsnl(".gz", &ks);
+    for(int i(0); i < settings->n_handles; ++i)
         if(!dlib::isfile(params->outfnames_r1[i]))
             LOG_EXIT("Output filename is not a file. Abort! ('%s').\n", params->outfnames_r1[i]);
-        ksprintf(&ks, " %s", params->outfnames_r1[i]);
-    }
-    ksprintf(&ks, " > %s", ffq_r1);
-    if(settings->gzip_output) kputsnl(".gz", &ks);
-    dlib::check_popen(ks.s);
+    if(fq_cat(ks.s, params->outfnames_r1, settings->n_handles))
+        LOG_EXIT("Failed to concatenate shards into %s: %s. Abort!\n", ks.s, strerror(errno));
     free(ks.s);
 }
 /*
- * Make sure that no rescaler values are invalid
+ * Make sure that the rescaler covers every cycle of the reads.
+ * (Its values are validated when it is compiled.)
  */
-void check_rescaler(marksplit_settings_t *settings, int arr_size)
+void check_rescaler(marksplit_settings_t *settings, int readlen)
 {
-    if(settings->rescaler)
-        for(int i(0); i < arr_size; ++i)
-            if(settings->rescaler[i] <= 0)
-                LOG_EXIT("Invalid value in rescaler %i at index %i.\n", settings->rescaler[i], i);
+    if(settings->rescaler && (uint32_t)readlen > settings->rescaler->cycles())
+        LOG_EXIT("Read length %i is longer than the rescaler's %u cycles.\n", readlen, settings->rescaler->cycles());
+}
+/*
+ * Input fastqs are only ever read sequentially (see FqReader), so besides regular files,
+ * "-" (stdin), FIFOs and other character devices are accepted.
+ */
+void check_input_path(const char *path)
+{
+    struct stat st;
+    if(strcmp(path, "-") == 0) return;
+    if(stat(path, &st)) LOG_EXIT("Could not open read path %s: %s. Abort!\n", path, strerror(errno));
+    if(!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode) && !S_ISCHR(st.st_mode))
+        LOG_EXIT("Read path %s is not a file, FIFO, or character device. Abort!\n", path);
 }
 /*
  * Emits final results to stdout
@@ -177,25 +254,7 @@ void check_rescaler(marksplit_settings_t *settings, int arr_size)
 
 void call_stdout(marksplit_settings_t *settings, splitterhash_params_t *params, char *ffq_r1, char *ffq_r2)
 {
-    kstring_t str1{0, 0, nullptr}, str2{0, 0, nullptr};
-    kstring_t final{0, 0, nullptr};
-    kputs((settings->gzip_output)? "zcat": "cat", &str1);
-    ks_resize(&str1, 1 << 10);
-    for(int i(0); i < settings->n_handles; ++i)
-        ksprintf(&str1, " %s", params->outfnames_r1[i]);
-    kputsnl(" | paste -d'~' - - - - ", &str1);
-    str2.s = dlib::kstrdup(&str1); // strdup the string.
-    for(uint32_t i(0); i < str2.l; ++i) {
-        LOG_DEBUG("Current str.s + i: %s.\n", str2.s + i);
-        if(memcmp(str2.s + i, "R1", 2) == 0)
-            str2.s[i + 1] = '2';
-    }
-
-    const char final_template[]{"pr -mts'~' <(%s) <(%s) | tr '~' '\\n'"};
-    ksprintf(&final, final_template, str1.s, str2.s);
-    dlib::bash_system(final.s);
-    free(str1.s), free(str2.s);
-    free(final.s);
+    fq_interleave(stdout, params->outfnames_r1, settings->is_se ? nullptr: params->outfnames_r2, settings->n_handles);
 }
 
 void cat_fastqs(marksplit_settings_t *settings, splitterhash_params_t *params, char *ffq_r1, char *ffq_r2)
@@ -206,17 +265,12 @@ void cat_fastqs(marksplit_settings_t *settings, splitterhash_params_t *params, c
 
 void cat_fastqs_pe(marksplit_settings_t *settings, splitterhash_params_t *params, char *ffq_r1, char *ffq_r2)
 {
-    kstring_t ks1{0, 0, nullptr};
-    kputsnl("> ", &ks1), kputs(ffq_r1, &ks1);
-    if(settings->gzip_output) kputsnl(".gz", &ks1);
-    // Clear output files.
-    //ksprintf(&ks1, settings->gzip_output ? "> %s.gz" : "> %s", ffq_r1);
-    dlib::check_call(ks1.s); ks1.l = 0;
-    ksprintf(&ks1, settings->gzip_output ? "> %s.gz" : "> %s", ffq_r2);
-    dlib::check_call(ks1.s); ks1.l = 0;
-    kputsnl("/bin/cat ", &ks1);
-    kstring_t ks2{0};
-    ksprintf(&ks2, ks1.s);
+    kstring_t ks1{0, 0, nullptr}, ks2{0, 0, nullptr};
+    kputs(ffq_r1, &ks1), kputs(ffq_r2, &ks2);
+    if(settings->gzip_output) {
+        kputsnl(".gz", &ks1);
+        kputsnl(".gz", &ks2);
+    }
     for(int i(0); i < settings->n_handles; ++i) {
         if(!dlib::isfile(params->outfnames_r1[i])) {
             LOG_EXIT("Output filename is not a file. Abort! ('%s').\n", params->outfnames_r1[i]);
@@ -224,19 +278,17 @@ void cat_fastqs_pe(marksplit_settings_t *settings, splitterhash_params_t *params
         if(!dlib::isfile(params->outfnames_r2[i])) {
             LOG_EXIT("Output filename is not a file. Abort! ('%s').\n", params->outfnames_r2[i]);
         }
-        ksprintf(&ks1, "%s ", params->outfnames_r1[i]);
-        ksprintf(&ks2, "%s ", params->outfnames_r2[i]);
     }
-    ksprintf(&ks1, " > %s", ffq_r1);
-    ksprintf(&ks2, " > %s", ffq_r2);
-    if(settings->gzip_output) {
-        kputsnl(".gz", &ks1);
-        kputsnl(".gz", &ks2);
+    int ret1(0), ret2(0);
+    #pragma omp parallel sections
+    {
+        #pragma omp section
+        ret1 = fq_cat(ks1.s, params->outfnames_r1, settings->n_handles);
+        #pragma omp section
+        ret2 = fq_cat(ks2.s, params->outfnames_r2, settings->n_handles);
     }
-    FILE *c1_popen(popen(ks1.s, "w"));
-    FILE *c2_popen(popen(ks2.s, "w"));
-    if(pclose(c2_popen) || pclose(c1_popen)) {
-        LOG_EXIT("Background cat command failed. ('%s' or '%s').\n", ks1.s, ks2.s);
+    if(ret1 || ret2) {
+        LOG_EXIT("Failed to concatenate shards. ('%s' or '%s').\n", ks1.s, ks2.s);
     }
     free(ks1.s), free(ks2.s);
 }
@@ -260,66 +312,157 @@ void clean_homing_sequence(char *sequence) {
 }
 
 
+/*
+ * A shard store holds binary shards, and its spill files are only readable through the in-memory index.
+ */
+static void check_shard_store(marksplit_settings_t *settings)
+{
+    if(!settings->shard_store) return;
+    if(settings->text_shards)
+        LOG_EXIT("--shard-store holds binary shards only, so it cannot be combined with --text-shards.\n");
+    if(!settings->run_hash_dmp)
+        LOG_EXIT("--shard-store spill files cannot be read back after exiting, so it cannot be combined with -D.\n");
+}
+
+/*
+ * Shard records marked from one batch of input, in input order.
+ */
+struct marked_batch_t {
+    struct rec_t {
+        uint64_t bin;
+        uint32_t r1_end, r2_end; // Ends of the read 1 and read 2 shard records in data.
+    };
+    kstring_t data;
+    std::vector<rec_t> recs;
+    marked_batch_t(): data{0, 0, nullptr} {}
+    marked_batch_t(const marked_batch_t &other) = delete;
+    ~marked_batch_t() {free(data.s);}
+};
+
+/*
+ * @func split_batches
+ * Marks the records of up to three fastqs, read in lockstep, and writes them to their shards.
+ * The fastqs are read and parsed by FqReaders, and groups of batches are marked on settings->threads threads.
+ * Each batch's records are written in input order, so the shards are identical to those of a single-threaded pass.
+ * Stops at the end of the shortest fastq.
+ * If settings->interleaved is set, the single fastq holds read 1 and read 2 alternately, and is treated as two.
+ * Batches hold an even number of records, so pairs never straddle them.
+ * :param: paths [const std::vector<const char *> &] Paths to the fastqs.
+ * :param: mark [Marker] Called as mark(seqs, rseqs, out, &r1_end), with seqs holding one record from each fastq
+ * and rseqs two zeroed mseq_t buffers kept per batch. Appends read 1's shard record (and then read 2's, if paired)
+ * to out, sets r1_end to the end of read 1's, and returns the bin.
+ * :returns: [uint64_t] Number of records (or pairs, etc.) marked.
+ */
+template<typename Marker>
+static uint64_t split_batches(marksplit_settings_t *settings, mark_splitter_t *splitter,
+                              const std::vector<const char *> &paths, Marker mark)
+{
+    const int n_threads(std::max(settings->threads, 1));
+    const size_t n_files(paths.size());
+    const size_t stride(settings->interleaved ? 2: 1); // Records per file per marked record.
+    static_assert(FQ_BATCH_RECORDS % 2 == 0, "Interleaved pairs must not straddle batches.");
+    assert(n_files && n_files * stride <= 3);
+    std::vector<std::unique_ptr<FqReader>> readers;
+    for(const char *path: paths) readers.emplace_back(new FqReader(path, std::max(1, n_threads / (int)n_files)));
+    std::vector<std::vector<fq_batch_t *>> in(n_files, std::vector<fq_batch_t *>(2 * n_threads));
+    std::vector<marked_batch_t> out(2 * n_threads);
+    uint64_t count(0);
+    for(int eof(0); !eof;) {
+        size_t n(0), f;
+        while(n < out.size() && !eof) {
+            for(f = 0; f < n_files && (in[f][n] = readers[f]->next()) != nullptr; ++f);
+            if(f < n_files) {
+                while(f--) delete in[f][n];
+                eof = 1;
+            } else {
+                for(f = 0; f < n_files; ++f) if(in[f][n]->size() < FQ_BATCH_RECORDS) eof = 1;
+                ++n;
+            }
+        }
+        if(UNLIKELY(!count)) {
+            if(!n) LOG_EXIT("Could not read input fastqs. Abort mission!\n");
+            kseq_t first{};
+            in[0][0]->view(0, &first);
+            LOG_DEBUG("Read length (inferred): %lu.\n", first.seq.l);
+            check_rescaler(settings, first.seq.l);
+        }
+        #pragma omp parallel for ordered schedule(dynamic, 1) num_threads(n_threads)
+        for(size_t i = 0; i < n; ++i) {
+            marked_batch_t &batch(out[i]);
+            batch.data.l = 0, batch.recs.clear();
+            size_t n_recs(in[0][i]->size());
+            for(size_t f(1); f < n_files; ++f) n_recs = std::min(n_recs, in[f][i]->size());
+            if(UNLIKELY(n_recs % stride))
+                LOG_EXIT("Interleaved input %s ends with an unpaired record. Abort!\n", paths[0]);
+            n_recs /= stride;
+            kseq_t seqs[3]{};
+            mseq_t rseqs[2]{};
+            for(size_t j(0); j < n_recs; ++j) {
+                for(size_t f(0); f < n_files; ++f)
+                    for(size_t k(0); k < stride; ++k)
+                        in[f][i]->view(j * stride + k, seqs + f * stride + k);
+                marked_batch_t::rec_t rec;
+                rec.bin = mark(seqs, rseqs, &batch.data, &rec.r1_end);
+                assert(rec.bin < (uint64_t)settings->n_handles);
+                rec.r2_end = batch.data.l;
+                batch.recs.push_back(rec);
+            }
+            #pragma omp ordered
+            {
+                uint32_t start(0);
+                for(const auto &rec: batch.recs) {
+                    if(UNLIKELY(++count % settings->notification_interval == 0))
+                        LOG_INFO("Number of records processed: %lu.\n", count);
+                    if(splitter->store) {
+                        splitter->store->write(splitter_bucket(splitter, rec.bin, 0), batch.data.s + start,
+                                               rec.r1_end - start);
+                        if(rec.r2_end != rec.r1_end)
+                            splitter->store->write(splitter_bucket(splitter, rec.bin, 1), batch.data.s + rec.r1_end,
+                                                   rec.r2_end - rec.r1_end);
+                    } else {
+                        splitter->tmp_out_handles_r1[rec.bin]->write(batch.data.s + start, rec.r1_end - start);
+                        if(rec.r2_end != rec.r1_end)
+                            splitter->tmp_out_handles_r2[rec.bin]->write(batch.data.s + rec.r1_end,
+                                                                         rec.r2_end - rec.r1_end);
+                    }
+                    start = rec.r2_end;
+                }
+            }
+            for(size_t f(0); f < n_files; ++f) delete in[f][i];
+        }
+    }
+    return count;
+}
+
 /*
  * Pre-processes (pp) and splits fastqs with inline barcodes.
  */
 mark_splitter_t pp_split_inline_se(marksplit_settings_t *settings)
 {
-    uint64_t bin(0), count(1); // Initialze count to 1 because of the read used to get read length.
     const int default_nlen(settings->blen + settings->offset + settings->homing_sequence_length);
     LOG_DEBUG("Opening fastq file %s.\n", settings->input_r1_path);
-    if(!dlib::isfile(settings->input_r1_path))
-        LOG_EXIT("Could not open read paths: at least one is not a file.\n");
+    check_input_path(settings->input_r1_path);
     if(settings->rescaler_path)
-        settings->rescaler = parse_1d_rescaler(settings->rescaler_path);
+        settings->rescaler = new Rescaler(settings->rescaler_path);
     mark_splitter_t splitter(init_splitter(settings));
-    gzFile fp(gzopen(settings->input_r1_path, "r"));
-    kseq_t *seq(kseq_init(fp));
-    // Manually process the first pair of reads so that we have the read length.
-    int pass_fail = 1;
-    if(kseq_read(seq) < 0) {
-            free_marksplit_settings(*settings);
-            splitter_destroy(&splitter);
-            LOG_EXIT("Could not open fastqs for reading. Abort!\n");
-    }
-    LOG_DEBUG("Read length (inferred): %lu.\n", seq->seq.l);
-    check_rescaler(settings, seq->seq.l * 4 * 2 * NQSCORES);
-    tmp_mseq_t *tmp(init_tm_ptr(seq->seq.l, settings->blen));
-    int n_len(nlen_homing_se(seq, settings, default_nlen, &pass_fail));
-    mseq_t *rseq(mseq_rescale_init(seq, settings->rescaler, tmp, 0));
-    rseq->barcode[settings->blen] = '\0';
-    memcpy(rseq->barcode, seq->seq.s + settings->offset, settings->blen);
-    pass_fail &= test_hp(rseq->barcode, settings->hp_threshold);
-    // Get first barcode.
-    update_mseq(rseq, seq, settings->rescaler, tmp, n_len, 0);
-    bin = get_binner_type(rseq->barcode, settings->n_nucs, uint64_t);
-    assert(bin < (uint64_t)settings->n_handles);
-    mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq, pass_fail, rseq->barcode, 'F');
-    while(LIKELY(kseq_read(seq) >= 0)) {
-        if(UNLIKELY(++count % settings->notification_interval == 0))
-            LOG_INFO("Number of records processed: %lu.\n", count);
+    const uint64_t count(split_batches(settings, &splitter, {settings->input_r1_path},
+                                       [settings, default_nlen](kseq_t *seq, mseq_t *rseq, kstring_t *out,
+                                                                uint32_t *r1_end) {
+        int pass_fail;
+        uint64_t bin;
         // Sets pass_fail and gets n_len
-        n_len = nlen_homing_se(seq, settings, default_nlen, &pass_fail);
-        // Update mseq
-        update_mseq(rseq, seq, settings->rescaler, tmp, n_len, 0);
-        // Update barcode
+        const int n_len(nlen_homing_se(seq, settings, default_nlen, &pass_fail));
+        update_mseq(rseq, seq, settings->rescaler, nullptr, n_len, 0);
         memcpy(rseq->barcode, seq->seq.s + settings->offset, settings->blen);
-        // Update QC Fail
-        pass_fail &= test_hp(rseq->barcode, settings->hp_threshold);
-        // Get bin
-        bin = bmf::get_binner_type(rseq->barcode, settings->n_nucs, uint64_t);
-        assert(bin < (uint64_t)settings->n_handles);
-        // Write the processed read to the bin
-        mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq, pass_fail, rseq->barcode, 'F');
-    }
+        // Update QC Fail and get bin
+        pass_fail &= barcode_scan(rseq->barcode, settings->blen, settings->hp_threshold, settings->n_nucs, &bin);
+        mseq2shard(out, rseq, pass_fail, rseq->barcode, 'F', settings->text_shards);
+        *r1_end = out->l;
+        return bin;
+    }));
     LOG_INFO("Collapsing %lu initial reads....\n", count);
     LOG_DEBUG("Cleaning up.\n");
-    for(int i(0); i < splitter.n_handles; ++i)
-        gzclose(splitter.tmp_out_handles_r1[i]);
-    tm_destroy(tmp);
-    mseq_destroy(rseq);
-    kseq_destroy(seq);
-    gzclose(fp);
+    splitter_close(&splitter);
     return splitter;
 }
 
@@ -329,96 +472,45 @@ mark_splitter_t pp_split_inline_se(marksplit_settings_t *settings)
  */
 mark_splitter_t pp_split_inline(marksplit_settings_t *settings)
 {
-    LOG_DEBUG("Opening fastq files %s and %s.\n", settings->input_r1_path, settings->input_r2_path);
-    if(!(strcmp(settings->input_r1_path, settings->input_r2_path))) {
-        LOG_EXIT("Hey, it looks like you're trying to use the same path for both r1 and r2. "
-                "At least try to fool me by making a symbolic link.\n");
-    }
-    if(!dlib::isfile(settings->input_r1_path) || !dlib::isfile(settings->input_r2_path)) {
-        LOG_EXIT("Could not open read paths: at least one is not a file.\n");
+    std::vector<const char *> paths{settings->input_r1_path};
+    if(settings->interleaved) {
+        LOG_DEBUG("Opening interleaved fastq file %s.\n", settings->input_r1_path);
+    } else {
+        LOG_DEBUG("Opening fastq files %s and %s.\n", settings->input_r1_path, settings->input_r2_path);
+        if(!(strcmp(settings->input_r1_path, settings->input_r2_path))) {
+            LOG_EXIT("Hey, it looks like you're trying to use the same path for both r1 and r2. "
+                    "At least try to fool me by making a symbolic link.\n");
+        }
+        paths.push_back(settings->input_r2_path);
     }
-    if(settings->rescaler_path) settings->rescaler = parse_1d_rescaler(settings->rescaler_path);
+    for(const char *path: paths) check_input_path(path);
+    if(settings->rescaler_path) settings->rescaler = new Rescaler(settings->rescaler_path);
     mark_splitter_t splitter(init_splitter(settings));
-    gzFile fp1(gzopen(settings->input_r1_path, "r"));
-    gzFile fp2(gzopen(settings->input_r2_path, "r"));
-    kseq_t *seq1(kseq_init(fp1));
-    kseq_t *seq2(kseq_init(fp2));
-    // Manually process the first pair of reads so that we have the read length.
-    int pass_fail(1);
-    if(kseq_read(seq1) < 0 || kseq_read(seq2) < 0) {
-            free_marksplit_settings(*settings);
-            splitter_destroy(&splitter);
-            LOG_EXIT("Could not open fastqs for reading. Abort!\n");
-    }
-    LOG_DEBUG("Read length (inferred): %lu.\n", seq1->seq.l);
-    check_rescaler(settings, seq1->seq.l * 4 * 2 * NQSCORES);
-    tmp_mseq_t *tmp(init_tm_ptr(seq1->seq.l, settings->blen));
-    int switch_reads(switch_test(seq1, seq2, settings->offset));
     const int default_nlen(settings->blen1_2 + settings->offset + settings->homing_sequence_length);
-    int n_len(nlen_homing_default(seq1, seq2, settings, default_nlen, &pass_fail));
-    mseq_t *rseq1(mseq_rescale_init(seq1, settings->rescaler, tmp, 0));
-    mseq_t *rseq2(mseq_rescale_init(seq2, settings->rescaler, tmp, 1));
-    if(switch_reads) {
-        memcpy(rseq1->barcode, seq2->seq.s + settings->offset, settings->blen1_2);
-        memcpy(rseq1->barcode + settings->blen1_2, seq1->seq.s + settings->offset, settings->blen1_2);
-    } else {
-        memcpy(rseq1->barcode, seq1->seq.s + settings->offset, settings->blen1_2);
-        memcpy(rseq1->barcode + settings->blen1_2, seq2->seq.s + settings->offset, settings->blen1_2);
-    }
-    pass_fail &= test_hp(rseq1->barcode, settings->hp_threshold);
-    // Get first barcode.
-    update_mseq(rseq1, seq1, settings->rescaler, tmp, n_len, 0);
-    update_mseq(rseq2, seq2, settings->rescaler, tmp, n_len, 1);
-    uint64_t bin(get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t));
-    assert(bin < (uint64_t)settings->n_handles);
-    if(switch_reads) {
-        mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq2, pass_fail, rseq1->barcode, 'R');
-        mseq2fq_stranded(splitter.tmp_out_handles_r2[bin], rseq1, pass_fail, rseq1->barcode, 'R');
-    } else {
-        mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq1, pass_fail, rseq1->barcode, 'F');
-        mseq2fq_stranded(splitter.tmp_out_handles_r2[bin], rseq2, pass_fail, rseq1->barcode, 'F');
-    }
-    uint64_t count(1uL);
-    while(LIKELY(kseq_read(seq1) >= 0 && kseq_read(seq2) >= 0)) {
-        if(UNLIKELY(++count % settings->notification_interval == 0))
-            LOG_INFO("Number of records processed: %lu.\n", count);
+    const uint64_t count(split_batches(settings, &splitter, paths,
+                                       [settings, default_nlen](kseq_t *seq, mseq_t *rseq, kstring_t *out,
+                                                                uint32_t *r1_end) {
+        int pass_fail;
+        uint64_t bin;
         // Sets pass_fail
-        n_len = nlen_homing_default(seq1, seq2, settings, default_nlen, &pass_fail);
-        // Update mseqs
-        update_mseq(rseq1, seq1, settings->rescaler, tmp, n_len, 0);
-        update_mseq(rseq2, seq2, settings->rescaler, tmp, n_len, 1);
-
-        if(switch_test(seq1, seq2, settings->offset)) {
-            // Copy barcode over
-            memcpy(rseq1->barcode, seq2->seq.s + settings->offset, settings->blen1_2);
-            memcpy(rseq1->barcode + settings->blen1_2, seq1->seq.s + settings->offset, settings->blen1_2);
-            // Test for homopolymer failure
-            pass_fail &= test_hp(rseq1->barcode, settings->hp_threshold);
-            bin = get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t);
-            assert(bin < (uint64_t)settings->n_handles);
-            // Write out
-            mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq2, pass_fail, rseq1->barcode, 'R');
-            mseq2fq_stranded(splitter.tmp_out_handles_r2[bin], rseq1, pass_fail, rseq1->barcode, 'R');
-        } else {
-            memcpy(rseq1->barcode, seq1->seq.s + settings->offset, settings->blen1_2);
-            memcpy(rseq1->barcode + settings->blen1_2, seq2->seq.s + settings->offset, settings->blen1_2);
-            pass_fail &= test_hp(rseq1->barcode, settings->hp_threshold);
-            bin = bmf::get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t);
-            assert(bin < (uint64_t)settings->n_handles);
-            mseq2fq_stranded(splitter.tmp_out_handles_r1[bin], rseq1, pass_fail, rseq1->barcode, 'F');
-            mseq2fq_stranded(splitter.tmp_out_handles_r2[bin], rseq2, pass_fail, rseq1->barcode, 'F');
-        }
-    }
+        const int n_len(nlen_homing_default(seq, seq + 1, settings, default_nlen, &pass_fail));
+        update_mseq(rseq, seq, settings->rescaler, nullptr, n_len, 0);
+        update_mseq(rseq + 1, seq + 1, settings->rescaler, nullptr, n_len, 1);
+        // The read with the lower barcode is written as read 1, marked 'R' if that is read 2.
+        const int switched(switch_test(seq, seq + 1, settings->offset));
+        memcpy(rseq->barcode, seq[switched].seq.s + settings->offset, settings->blen1_2);
+        memcpy(rseq->barcode + settings->blen1_2, seq[!switched].seq.s + settings->offset, settings->blen1_2);
+        // Test for homopolymer failure and get bin
+        pass_fail &= barcode_scan(rseq->barcode, settings->blen, settings->hp_threshold, settings->n_nucs, &bin);
+        const char strand(switched ? 'R': 'F');
+        mseq2shard(out, rseq + switched, pass_fail, rseq->barcode, strand, settings->text_shards);
+        *r1_end = out->l;
+        mseq2shard(out, rseq + !switched, pass_fail, rseq->barcode, strand, settings->text_shards);
+        return bin;
+    }));
     LOG_INFO("Collapsing %lu initial read pairs....\n", count);
     LOG_DEBUG("Cleaning up.\n");
-    for(int i(0); i < splitter.n_handles; ++i) {
-        gzclose(splitter.tmp_out_handles_r1[i]);
-        gzclose(splitter.tmp_out_handles_r2[i]);
-    }
-    tm_destroy(tmp);
-    mseq_destroy(rseq1), mseq_destroy(rseq2);
-    kseq_destroy(seq1), kseq_destroy(seq2);
-    gzclose(fp1), gzclose(fp2);
+    splitter_close(&splitter);
     return splitter;
 }
 
@@ -460,9 +552,23 @@ int idmp_main(int argc, char *argv[])
     sprintf(settings.mode, "wT");
 #endif
 
+    settings.max_mem = DEFAULT_SHARD_MEM;
+
     //omp_set_dynamic(0); // Tell omp that I want to set my number of threads 4realz
     int c;
-    while ((c = getopt(argc, argv, "T:t:o:n:s:l:m:r:p:f:v:u:g:i:zwcdDh?S=")) > -1) {
+    static const struct option lopts[] = {
+        {"in-memory-shards", no_argument, nullptr, 'M'},
+        {"max-mem", required_argument, nullptr, 'x'},
+        {"pv-cache", required_argument, nullptr, 'P'},
+        {"shard-report", required_argument, nullptr, 'R'},
+        {"text-shards", no_argument, nullptr, 'k'},
+        {"shard-store", no_argument, nullptr, 'B'},
+        {"interleaved", no_argument, nullptr, 'I'},
+        {"stream", no_argument, nullptr, 1},
+        {"merge-neighbors", no_argument, nullptr, 'e'},
+        {0, 0, 0, 0}
+    };
+    while ((c = getopt_long(argc, argv, "T:t:o:n:s:l:m:r:p:f:v:u:g:i:x:P:R:zwcdekBDIMh?S=", lopts, nullptr)) > -1) {
         switch(c) {
             case 'c': LOG_WARNING("Deprecated option -c.\n"); break;
             case 'd': LOG_WARNING("Deprecated option -d.\n"); break;
@@ -487,6 +593,15 @@ int idmp_main(int argc, char *argv[])
             case 'T': sprintf(settings.mode, "wb%i", atoi(optarg) % 10); break;
             case 'S': settings.is_se = 1; break;
             case '=': settings.to_stdout = 1; break;
+            case 'M': settings.in_memory_shards = 1; break;
+            case 'k': settings.text_shards = 1; break;
+            case 'B': settings.shard_store = 1; break;
+            case 'e': set_neighbor_merging(1); break;
+            case 'I': settings.interleaved = 1; break;
+            case 1: settings.in_memory_shards = settings.to_stdout = settings.interleaved = 1; break;
+            case 'P': pv_table().use_cache(optarg); break;
+            case 'R': settings.shard_report_path = strdup(optarg); break;
+            case 'x': settings.max_mem = parse_mem_size(optarg); break;
             case '?': case 'h': idmp_usage(); exit(EXIT_SUCCESS);
         }
     }
@@ -494,7 +609,20 @@ int idmp_main(int argc, char *argv[])
     if(!settings.gzip_output) settings.gzip_compression = 0;
 
     // Check for proper command-line usage.
-    if(settings.is_se) {
+    if(settings.interleaved) {
+        if(settings.is_se) LOG_EXIT("Interleaved input is paired, so it cannot be combined with -S.\n");
+        if(argc > optind + 1) {
+            fprintf(stderr, "[E:%s] Interleaved input takes at most one fastq. See usage.\n", __func__);
+            idmp_usage();
+            return EXIT_FAILURE;
+        }
+        settings.n_handles = dlib::ipow(4, settings.n_nucs);
+        if(!settings.shard_store && !settings.in_memory_shards && settings.n_handles * 4 > dlib::get_fileno_limit()) {
+            LOG_INFO("Increasing nofile limit from %i to %i.\n", dlib::get_fileno_limit(), settings.n_handles * 4);
+            dlib::increase_nofile_limit(settings.n_handles * 4);
+        }
+        settings.input_r1_path = strdup(argc == optind + 1 ? argv[optind]: "-");
+    } else if(settings.is_se) {
         if(argc < 4) {
             idmp_usage();
             exit(EXIT_FAILURE);
@@ -507,7 +635,7 @@ int idmp_main(int argc, char *argv[])
         }
         // Number of file handles
         settings.n_handles = dlib::ipow(4, settings.n_nucs);
-        if(settings.n_handles * 2 > dlib::get_fileno_limit()) {
+        if(!settings.shard_store && settings.n_handles * 2 > dlib::get_fileno_limit()) {
             LOG_INFO("Increasing nofile limit from %i to %i.\n", dlib::get_fileno_limit(), settings.n_handles * 2);
             dlib::increase_nofile_limit(settings.n_handles * 2);
         }
@@ -522,7 +650,7 @@ int idmp_main(int argc, char *argv[])
         }
         // Number of file handles
         settings.n_handles = dlib::ipow(4, settings.n_nucs);
-        if(settings.n_handles * 4 > dlib::get_fileno_limit()) {
+        if(!settings.shard_store && settings.n_handles * 4 > dlib::get_fileno_limit()) {
             LOG_INFO("Increasing nofile limit from %i to %i.\n", dlib::get_fileno_limit(), settings.n_handles * 4);
             dlib::increase_nofile_limit(settings.n_handles * 4);
         }
@@ -534,9 +662,13 @@ int idmp_main(int argc, char *argv[])
     if(settings.ffq_prefix && !settings.run_hash_dmp)
         LOG_EXIT("Final fastq prefix option provided but run_hash_dmp not selected."
                 "Either eliminate the -f flag or add the -d flag.\n");
+    if(settings.in_memory_shards && !settings.run_hash_dmp)
+        LOG_EXIT("--in-memory-shards never writes split files, so it cannot be combined with -D.\n");
+    check_shard_store(&settings);
 
     // Handle number of threads
     omp_set_num_threads(settings.threads);
+    set_write_threads(settings.threads);
 
     // Handle homing sequence
     if(!settings.homing_sequence)
@@ -564,12 +696,23 @@ int idmp_main(int argc, char *argv[])
 
     if(!settings.tmp_basename) {
         // If tmp_basename unset, create a random temporary file prefix.
-        kstring_t rs(salted_rand_string(settings.input_r1_path, RANDSTR_SIZE));
+        char stdin_name[] = "stdin";
+        kstring_t rs(salted_rand_string(strcmp(settings.input_r1_path, "-") ? settings.input_r1_path: stdin_name,
+                                        RANDSTR_SIZE));
         settings.tmp_basename = ks_release(&rs);
         LOG_INFO("Temporary basename not provided. Defaulting to random: %s.\n",
                   settings.tmp_basename);
     }
 
+    if(settings.in_memory_shards) {
+        if(!settings.ffq_prefix) make_outfname(&settings);
+        memshard_collapse(&settings);
+        free_marksplit_settings(settings);
+        destroy_write_pool();
+        LOG_INFO("Successfully completed bmftools collapse inline!\n");
+        return EXIT_SUCCESS;
+    }
+
     // Run core
     mark_splitter_t splitter(settings.is_se ? pp_split_inline_se(&settings)
                                             : pp_split_inline(&settings));
@@ -597,6 +740,7 @@ int idmp_main(int argc, char *argv[])
     cleanup:
     free_marksplit_settings(settings);
     splitter_destroy(&splitter);
+    destroy_write_pool();
     LOG_INFO("Successfully completed bmftools collapse inline!\n");
     return EXIT_SUCCESS;
 } /* idmp_main */
@@ -618,79 +762,50 @@ void sdmp_usage(char *argv[])
                         "-s: Number of bases from reads 1 and 2 with which to salt the barcode. Default: 0.\n"
                         "-m: Number of bases in the start of reads to skip when salting. Default: 0.\n"
                         "-D: Use this flag to only mark/split and avoid final demultiplexing/consolidation.\n"
-                        "-p: Number of threads to use if running hash_dmp. Default: %i.\n"
+                        "-p: Number of threads for marking and splitting (and BGZF decompression of the input), and for hash_dmp. Default: %i.\n"
                         "-v: Set notification interval for split. Default: 1000000.\n"
                         "-r: Path to flat text file with rescaled quality scores. If not provided, it will not be used.\n"
                         "-w: Flag to leave temporary files instead of deleting them, as in default behavior.\n"
                         "-f: If running hash_dmp, this sets the Final Fastq Prefix. \n"
                         "-S: Single-end mode. Ignores read 2.\n"
                         "-=: Emit final fastqs to stdout in interleaved form. Ignores -f.\n"
-                , DEFAULT_N_NUCS, DEFAULT_N_THREADS);
+                        "-P: Path to a cache of consensus quality lookup tables. Built and written if absent or stale.\n"
+                        "-R: Write per-shard collapse bytes and wall time, slowest first, to this path.\n"
+                        "-k/--text-shards: Write temporary shards as marked fastq text instead of the compact binary format.\n"
+                        "-B/--shard-store: Write temporary shards as blocks in %i shared spill files instead of one file per shard.\n"
+                        "-e/--merge-neighbors: Within each shard, merge families into larger families whose barcodes differ by "
+                        "one substitution before consensus.\n"
+                , DEFAULT_N_NUCS, DEFAULT_N_THREADS, SHARD_STORE_FILES);
 }
 
 static mark_splitter_t splitmark_core_rescale(marksplit_settings_t *settings)
 {
     LOG_DEBUG("Path to index fq: %s.\n", settings->index_fq_path);
-    gzFile fp_read1, fp_read2, fp_index;
-    kseq_t *seq1(nullptr), *seq2(nullptr), *seq_index(nullptr);
-    int l1, l2, l_index;
     mark_splitter_t splitter(init_splitter(settings));
     for(auto path: {settings->input_r1_path, settings->input_r2_path, settings->index_fq_path})
         if(!dlib::isfile(path))
             LOG_EXIT("%s is not a file. Abort!\n", path);
-    // Open fastqs
     LOG_DEBUG("Splitter now opening files R1 ('%s'), R2 ('%s'), index ('%s').\n",
               settings->input_r1_path, settings->input_r2_path, settings->index_fq_path);
-    fp_read1 = gzopen(settings->input_r1_path, "r"), fp_read2 = gzopen(settings->input_r2_path, "r");
-    seq1 = kseq_init(fp_read1), seq2 = kseq_init(fp_read2);
-    l1 = kseq_read(seq1), l2 = kseq_read(seq2);
-
-    fp_index = gzopen(settings->index_fq_path, "r");
-    seq_index = kseq_init(fp_index),
-    l_index = kseq_read(seq_index);
-
-    uint64_t bin(0);
-    int pass_fail(1);
-    tmp_mseq_t *tmp(init_tm_ptr(seq1->seq.l, seq_index->seq.l + 2 * settings->salt));
-    if(l1 < 0 || l2 < 0 || l_index < 0)
-        LOG_EXIT("Could not read input fastqs. Abort mission!\n");
-    check_rescaler(settings, NQSCORES * 2 * 4 * seq1->seq.l);
-    mseq_t *rseq1(mseq_init(seq1, settings->rescaler, 0)); // rseq1 is initialized
-    mseq_t *rseq2(mseq_init(seq2, settings->rescaler, 1)); // rseq2 is initialized
-    memcpy(rseq1->barcode, seq1->seq.s + settings->offset, settings->salt); // Copy in the appropriate nucleotides.
-    memcpy(rseq1->barcode + settings->salt, seq_index->seq.s, seq_index->seq.l); // Copy in the barcode
-    memcpy(rseq1->barcode + settings->salt + seq_index->seq.l, seq2->seq.s + settings->offset, settings->salt);
-    rseq1->barcode[settings->salt * 2 + seq_index->seq.l] = '\0';
-    update_mseq(rseq1, seq1, settings->rescaler, tmp, 0, 0);
-    update_mseq(rseq2, seq2, settings->rescaler, tmp, 0, 1);
-    pass_fail = test_hp(rseq1->barcode, settings->hp_threshold);
-    bin = get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t);
-    mseq2fq(splitter.tmp_out_handles_r1[bin], rseq1, pass_fail, rseq1->barcode);
-    mseq2fq(splitter.tmp_out_handles_r2[bin], rseq2, pass_fail, rseq1->barcode);
-    uint64_t count(1uL);
-    while(LIKELY((l1 = kseq_read(seq1)) >= 0 && (l2 = kseq_read(seq2) >= 0))
-            && (l_index = kseq_read(seq_index)) >= 0) {
-        if(UNLIKELY(++count % settings->notification_interval == 0))
-            LOG_INFO("Number of records processed: %lu.\n", count);
-        memcpy(rseq1->barcode, seq1->seq.s + settings->offset, settings->salt); // Copy in the appropriate nucleotides.
-        memcpy(rseq1->barcode + settings->salt, seq_index->seq.s, seq_index->seq.l); // Copy in the barcode
-        memcpy(rseq1->barcode + settings->salt + seq_index->seq.l, seq2->seq.s + settings->offset, settings->salt);
-        update_mseq(rseq1, seq1, settings->rescaler, tmp, 0, 0);
-        update_mseq(rseq2, seq2, settings->rescaler, tmp, 0, 1);
-        pass_fail = test_hp(rseq1->barcode, settings->hp_threshold);
-        bin = get_binner_type(rseq1->barcode, settings->n_nucs, uint64_t);
-        mseq2fq(splitter.tmp_out_handles_r1[bin], rseq1, pass_fail, rseq1->barcode);
-        mseq2fq(splitter.tmp_out_handles_r2[bin], rseq2, pass_fail, rseq1->barcode);
-    }
-    tm_destroy(tmp);
-    mseq_destroy(rseq1); mseq_destroy(rseq2);
-    kseq_destroy(seq1); kseq_destroy(seq2); kseq_destroy(seq_index);
-    gzclose(fp_read1); gzclose(fp_read2); gzclose(fp_index);
-    for(int j(0); j < settings->n_handles; ++j) {
-        gzclose(splitter.tmp_out_handles_r1[j]);
-        gzclose(splitter.tmp_out_handles_r2[j]);
-        splitter.tmp_out_handles_r1[j] = splitter.tmp_out_handles_r2[j] = nullptr;
-    }
+    const uint64_t count(split_batches(settings, &splitter,
+                                       {settings->input_r1_path, settings->input_r2_path, settings->index_fq_path},
+                                       [settings](kseq_t *seq, mseq_t *rseq, kstring_t *out, uint32_t *r1_end) {
+        const kseq_t &index(seq[2]);
+        const int blen(settings->salt * 2 + index.seq.l);
+        uint64_t bin;
+        memcpy(rseq->barcode, seq[0].seq.s + settings->offset, settings->salt); // Copy in the appropriate nucleotides.
+        memcpy(rseq->barcode + settings->salt, index.seq.s, index.seq.l); // Copy in the barcode
+        memcpy(rseq->barcode + settings->salt + index.seq.l, seq[1].seq.s + settings->offset, settings->salt);
+        rseq->barcode[blen] = '\0';
+        update_mseq(rseq, seq, settings->rescaler, nullptr, 0, 0);
+        update_mseq(rseq + 1, seq + 1, settings->rescaler, nullptr, 0, 1);
+        const int pass_fail(barcode_scan(rseq->barcode, blen, settings->hp_threshold, settings->n_nucs, &bin));
+        mseq2shard(out, rseq, pass_fail, rseq->barcode, 'Z', settings->text_shards);
+        *r1_end = out->l;
+        mseq2shard(out, rseq + 1, pass_fail, rseq->barcode, 'Z', settings->text_shards);
+        return bin;
+    }));
+    splitter_close(&splitter);
     LOG_INFO("Collapsing %lu initial read pairs....\n", count);
     return splitter;
 }
@@ -703,42 +818,22 @@ static mark_splitter_t splitmark_core_rescale_se(marksplit_settings_t *settings)
         LOG_EXIT("At least one input path ('%s', '%s') is not a file. Abort!\n",
                  settings->input_r1_path, settings->index_fq_path);
     }
-    // Open fastqs
-    gzFile fp(gzopen(settings->input_r1_path, "r")), fp_index(gzopen(settings->index_fq_path, "r"));
-    kseq_t *seq(kseq_init(fp)), *seq_index(kseq_init(fp_index));
-    int l(kseq_read(seq));
-    int l_index(kseq_read(seq_index));
-
-    tmp_mseq_t *tmp(init_tm_ptr(seq->seq.l, seq_index->seq.l + settings->salt));
-    if(l < 0 || l_index < 0)
-        LOG_EXIT("Could not read input fastqs. Abort mission!\n");
-    mseq_t *rseq(mseq_init(seq, settings->rescaler, 0));
-    memcpy(rseq->barcode, seq->seq.s + settings->offset, settings->salt); // Copy in the appropriate nucleotides.
-    memcpy(rseq->barcode + settings->salt, seq_index->seq.s, seq_index->seq.l); // Copy in the barcode
-    rseq->barcode[settings->salt + seq_index->seq.l] = '\0';
-    update_mseq(rseq, seq, settings->rescaler, tmp, 0, 0);
-    mseq2fq(splitter.tmp_out_handles_r1[get_binner_type(rseq->barcode, settings->n_nucs, uint64_t)],
-            rseq, test_hp(rseq->barcode, settings->hp_threshold), rseq->barcode);
-    uint64_t count(1uL);
-    while (LIKELY((l = kseq_read(seq)) >= 0 && (l_index = kseq_read(seq_index)) >= 0)) {
-        if(UNLIKELY(++count % settings->notification_interval == 0))
-            fprintf(stderr, "[%s] Number of records processed: %lu.\n", __func__, count);
+    const uint64_t count(split_batches(settings, &splitter, {settings->input_r1_path, settings->index_fq_path},
+                                       [settings](kseq_t *seq, mseq_t *rseq, kstring_t *out, uint32_t *r1_end) {
+        const kseq_t &index(seq[1]);
+        const int blen(settings->salt + index.seq.l);
+        uint64_t bin;
         memcpy(rseq->barcode, seq->seq.s + settings->offset, settings->salt); // Copy in the appropriate nucleotides.
-        memcpy(rseq->barcode + settings->salt, seq_index->seq.s, seq_index->seq.l); // Copy in the barcode
-        update_mseq(rseq, seq, settings->rescaler, tmp, 0, 0);
-        mseq2fq(splitter.tmp_out_handles_r1[get_binner_type(rseq->barcode, settings->n_nucs, uint64_t)],
-                rseq, test_hp(rseq->barcode, settings->hp_threshold), rseq->barcode);
-    }
-    tm_destroy(tmp);
-    mseq_destroy(rseq);
-    kseq_destroy(seq); kseq_destroy(seq_index);
-    gzclose(fp); gzclose(fp_index);
-    for(int j(0); j < settings->n_handles; ++j) {
-        gzclose(splitter.tmp_out_handles_r1[j]);
-        splitter.tmp_out_handles_r1[j] = nullptr;
-    }
+        memcpy(rseq->barcode + settings->salt, index.seq.s, index.seq.l); // Copy in the barcode
+        rseq->barcode[blen] = '\0';
+        update_mseq(rseq, seq, settings->rescaler, nullptr, 0, 0);
+        const int pass_fail(barcode_scan(rseq->barcode, blen, settings->hp_threshold, settings->n_nucs, &bin));
+        mseq2shard(out, rseq, pass_fail, rseq->barcode, 'Z', settings->text_shards);
+        *r1_end = out->l;
+        return bin;
+    }));
+    splitter_close(&splitter);
     LOG_INFO("Collapsing %lu initial reads....\n", count);
-    // Set out handles to nullptr.
     return splitter;
 }
 
@@ -765,7 +860,13 @@ int sdmp_main(int argc, char *argv[])
 #endif
 
     int c;
-    while ((c = getopt(argc, argv, "t:o:i:n:m:s:f:u:p:g:v:r:T:hdDczw?S=")) > -1) {
+    static const struct option lopts[] = {
+        {"text-shards", no_argument, nullptr, 'k'},
+        {"shard-store", no_argument, nullptr, 'B'},
+        {"merge-neighbors", no_argument, nullptr, 'e'},
+        {0, 0, 0, 0}
+    };
+    while ((c = getopt_long(argc, argv, "t:o:i:n:m:s:f:u:p:g:v:r:T:P:R:hdDBekczw?S=", lopts, nullptr)) > -1) {
         switch(c) {
             case 'd': LOG_WARNING("Deprecated option -d.\n"); break;
             case 'D': settings.run_hash_dmp = 0; break;
@@ -784,19 +885,26 @@ int sdmp_main(int argc, char *argv[])
             case 'w': settings.cleanup = 0; break;
             case 'r':
                 settings.rescaler_path = strdup(optarg);
-                settings.rescaler = parse_1d_rescaler(settings.rescaler_path);
+                settings.rescaler = new Rescaler(settings.rescaler_path);
                 break;
             case 'S': settings.is_se = 1; break;
             case '=': settings.to_stdout = 1; break;
+            case 'P': pv_table().use_cache(optarg); break;
+            case 'R': settings.shard_report_path = strdup(optarg); break;
+            case 'k': settings.text_shards = 1; break;
+            case 'B': settings.shard_store = 1; break;
+            case 'e': set_neighbor_merging(1); break;
             case '?': case 'h': sdmp_usage(argv); return EXIT_SUCCESS;
         }
     }
 
     dlib::increase_nofile_limit(settings.threads);
     omp_set_num_threads(settings.threads);
+    set_write_threads(settings.threads);
 
+    check_shard_store(&settings);
     settings.n_handles = dlib::ipow(4, settings.n_nucs);
-    if(settings.n_handles * 3 > dlib::get_fileno_limit()) {
+    if(!settings.shard_store && settings.n_handles * 3 > dlib::get_fileno_limit()) {
         const int o_fnl(dlib::get_fileno_limit());
         dlib::increase_nofile_limit(kroundup32(settings.n_handles));
         fprintf(stderr, "Increased nofile limit from %i to %i.\n", o_fnl,
@@ -864,6 +972,7 @@ int sdmp_main(int argc, char *argv[])
     cleanup:
     splitter_destroy(&splitter);
     free_marksplit_settings(settings);
+    destroy_write_pool();
     LOG_INFO("Successfully completed bmftools collapse secondary!\n");
     return EXIT_SUCCESS;
 } /* sdmp_main */
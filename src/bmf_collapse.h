@@ -2,9 +2,10 @@
 #define BMF_DMP_H
 
 #include "lib/kingfisher.h"
+#include "lib/barcode.h"
 #include "lib/hashdmp.h"
 
-typedef void (*hash_dmp_fn)(char *, char *, int);
+typedef void (*hash_dmp_fn)(bmf::ShardReader &, const char *, char *, int);
 
 #define RANDSTR_SIZE 20
 #define DEFAULT_N_NUCS 4
@@ -21,9 +22,27 @@ void cat_fastqs_se(marksplit_settings_t *settings, splitterhash_params_t *params
 void parallel_hash_dmp_core(marksplit_settings_t *settings, splitterhash_params_t *params, hash_dmp_fn func);
 void make_outfname(marksplit_settings_t *settings);
 void cleanup_hashdmp(marksplit_settings_t *settings, splitterhash_params_t *params);
-void check_rescaler(marksplit_settings_t *settings, int arr_size);
+void check_rescaler(marksplit_settings_t *settings, int readlen);
+void check_input_path(const char *path);
 char *make_salted_fname(char *base);
 
+/*
+ * @func parse_mem_size
+ * :param: arg [const char *] Number of bytes, with an optional K, M, or G suffix.
+ * :returns: [uint64_t] Number of bytes.
+ */
+static inline uint64_t parse_mem_size(const char *arg)
+{
+    char *q;
+    uint64_t ret(strtoull(arg, &q, 0));
+    switch(*q) {
+        case 'g': case 'G': ret <<= 10; /* fall-through */
+        case 'm': case 'M': ret <<= 10; /* fall-through */
+        case 'k': case 'K': ret <<= 10;
+    }
+    return ret;
+}
+
 /*
  * Returns 0 if a barcode is failed.
  * A barcode is failed by a homopolymer run >= threshold
@@ -46,52 +65,20 @@ CONST static inline int test_hp(char *barcode, int threshold)
 }
 
 
-/*
- * :param: settings [crms_settings_t, marksplit_settings_t] Settings struct in which to free the rescaler.
- * :return: void
- * This function supersedes free_rescaler_array by being type-generic.
- */
-
-#define cfree_rescaler(settings) \
-    do {\
-        if(settings.rescaler) {\
-            int readlen##_settings = dlib::count_lines(settings.rescaler_path);\
-            for(int i(0); i < 2; ++i) {\
-                for(int j(0); j < readlen##_settings; ++j) {\
-                    for(int k (0); k < NQSCORES; ++k) {\
-                        cond_free(settings.rescaler[i][j][k]);\
-                    }\
-                    cond_free(settings.rescaler[i][j]);\
-                }\
-                cond_free(settings.rescaler[i]);\
-            }\
-            cond_free(settings.rescaler);\
-        }\
-    } while(0)
-
-
 static inline int nlen_homing_se(kseq_t *seq, marksplit_settings_t *settings_ptr, int default_len, int *pass_fail)
 {
-    for(int i(settings_ptr->blen + settings_ptr->offset); i <= settings_ptr->max_blen; ++i) {
-        if(memcmp(seq->seq.s + i, settings_ptr->homing_sequence, settings_ptr->homing_sequence_length) == 0) {
-            *pass_fail = 1;
-            return i + settings_ptr->homing_sequence_length;
-        }
-    }
-    *pass_fail = 0;
-    return default_len;
+    const int i(homing_find(seq->seq.s, seq->seq.l, settings_ptr->homing_sequence,
+                            settings_ptr->homing_sequence_length,
+                            settings_ptr->blen + settings_ptr->offset, settings_ptr->max_blen));
+    return (*pass_fail = i >= 0) ? i + settings_ptr->homing_sequence_length: default_len;
 }
 
 static inline int nlen_homing_default(kseq_t *seq1, kseq_t *seq2, marksplit_settings_t *settings_ptr, int default_len, int *pass_fail)
 {
-    for(int i(settings_ptr->blen1_2 + settings_ptr->offset); i <= settings_ptr->max_blen; ++i) {
-        if(!memcmp(seq1->seq.s + i, settings_ptr->homing_sequence, settings_ptr->homing_sequence_length)) {
-            *pass_fail = 1;
-            return i + settings_ptr->homing_sequence_length;
-        }
-    }
-    *pass_fail = 0;
-    return default_len;
+    const int i(homing_find(seq1->seq.s, seq1->seq.l, settings_ptr->homing_sequence,
+                            settings_ptr->homing_sequence_length,
+                            settings_ptr->blen1_2 + settings_ptr->offset, settings_ptr->max_blen));
+    return (*pass_fail = i >= 0) ? i + settings_ptr->homing_sequence_length: default_len;
 }
 
 } /* namespace bmf */
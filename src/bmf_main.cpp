@@ -14,6 +14,7 @@ static int bmftools_usage(int rc)
                     //"inmem:                   Performs dmp fully in memory. RAM-hungry but fast!\n"
                     //"hashdmp:                 Demultiplex inline barcoded experiments that have already been marked.\n"
                     "mark:                    Add tags including unclipped start positions.\n"
+                    "postproc:                Run mark, sort and rsq in one process.\n"
                     "rsq:                     Rescue reads with using positional inference to collapse to unique observations in spite of errors in the barcode sequence.\n"
                     "sort:                    Sort for bam rescue.\n"
                     "stack:                   A maximally-permissive yet statistically-thorough variant caller using molecular barcode metadata.\n"
@@ -40,6 +41,7 @@ int main(int argc, char *argv[])
     if(strcmp(argv[1], "vet") == 0) return bmf::vet_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "err") == 0) return bmf::err_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "mark") == 0) return bmf::mark_main(argc - 1, argv + 1);
+    if(strcmp(argv[1], "postproc") == 0) return bmf::postproc_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "cap") == 0) return bmf::cap_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "target") == 0) return bmf::target_main(argc - 1, argv + 1);
     if(strcmp(argv[1], "depth") == 0) return bmf::depth_main(argc - 1, argv + 1);
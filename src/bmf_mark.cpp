@@ -1,3 +1,4 @@
+#include "bmf_mark.h"
 #include <assert.h>
 #include <getopt.h>
 #include "dlib/bam_util.h"
@@ -5,24 +6,6 @@
 
 namespace bmf {
 
-namespace {
-struct mark_settings_t {
-    // I might add more options later, hence the use of the bitfield.
-    uint32_t add_unclipped_start:1;
-    uint32_t remove_qcfail:1;
-    uint32_t min_insert_length:8;
-    double min_frac_unambiguous;
-    mark_settings_t() :
-        remove_qcfail(0),
-        min_insert_length(0),
-        min_frac_unambiguous(0.0)
-    {
-    }
-};
-
-}
-
-
 static int add_se_tags(bam1_t *b1, void *data)
 {
     int ret(0);
@@ -40,7 +23,7 @@ static int add_se_tags(bam1_t *b1, void *data)
     return ret;
 }
 
-static int add_pe_tags(bam1_t *b1, bam1_t *b2, void *data)
+int add_pe_tags(bam1_t *b1, bam1_t *b2, void *data)
 {
     if(UNLIKELY(strcmp(bam_get_qname(b1), bam_get_qname(b2))))
         LOG_EXIT("Is this bam namesorted? These reads have different names.\n");
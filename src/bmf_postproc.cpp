@@ -0,0 +1,280 @@
+#include <getopt.h>
+#include <omp.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "htslib/kstring.h"
+#include "dlib/bam_util.h"
+#include "dlib/cstr_util.h"
+#include "lib/spsc_queue.h"
+#include "bmf_mark.h"
+#include "bmf_rsq.h"
+#include "bmf_sort.h"
+
+namespace bmf {
+
+#define POSTPROC_BATCH_SIZE (1 << 12) // Records per batch passed between stages.
+#define POSTPROC_BATCHES 8 // Batches circulating between each pair of stages.
+
+/*
+ * Decoded records passed from one stage to the next. Record buffers are kept between uses.
+ */
+struct BamBatch {
+    std::vector<bam1_t> recs;
+    unsigned n;
+    BamBatch(): n(0) {}
+    BamBatch(const BamBatch &other) = delete;
+    ~BamBatch() {for(bam1_t &b: recs) free(b.data);}
+    bam1_t *next() {
+        if(n == recs.size()) recs.emplace_back(bam1_t{});
+        return &recs[n++];
+    }
+};
+
+/*
+ * Bounded queue of batches from one stage to the next.
+ * A fixed set of batches circulates between the two stages,
+ * so a producer which runs ahead waits once all of them are full.
+ */
+class BamPipe {
+    std::vector<BamBatch> batches;
+    SpscQueue<BamBatch *> full, empty;
+    BamBatch *cur; // Batch being consumed.
+    unsigned pos;
+public:
+    BamPipe(): batches(POSTPROC_BATCHES), full(POSTPROC_BATCHES), empty(POSTPROC_BATCHES), cur(nullptr), pos(0) {
+        for(BamBatch &batch: batches) empty.push(&batch);
+    }
+    // Producer side.
+    BamBatch *get() {
+        BamBatch *ret;
+        empty.pop(ret);
+        ret->n = 0;
+        return ret;
+    }
+    void put(BamBatch *batch) {full.push(batch);}
+    void close() {full.close();}
+    // Consumer side.
+    /*
+     * @func next
+     * :returns: [bam1_t *] The next record, which the consumer may modify or swap out until its next call,
+     * or nullptr once the pipe is closed and drained.
+     */
+    bam1_t *next() {
+        while(!cur || pos == cur->n) {
+            if(cur) empty.push(cur), cur = nullptr;
+            if(!full.pop(cur)) return nullptr;
+            pos = 0;
+        }
+        return &cur->recs[pos++];
+    }
+};
+
+struct postproc_aux_t {
+    samFile *in;
+    bam_hdr_t *hdr;
+    mark_settings_t mark;
+    BamPipe marked; // mark -> sort
+    BamPipe sorted; // sort -> rsq
+    BamBatch *sorting; // Batch of sorted records being filled.
+};
+
+/*
+ * Pairs up reads from the name-sorted input and adds their mate tags as bmftools mark does.
+ * Secondary and supplementary alignments are dropped here rather than in rescue.
+ */
+static void mark_stage(postproc_aux_t *aux)
+{
+    BamBatch *batch(aux->marked.get());
+    int has_read1(0), ret; // has_read1: the batch's last record is a read 1 awaiting its mate.
+    uint64_t count(0);
+    for(;;) {
+        bam1_t *b(batch->next());
+        if((ret = sam_read1(aux->in, aux->hdr, b)) < 0) {
+            if(ret < -1) LOG_EXIT("Failed to read input bam. Is it truncated? Abort!\n");
+            --batch->n;
+            break;
+        }
+        if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
+        if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) {
+            --batch->n;
+            continue;
+        }
+        if(b->core.flag & BAM_FREAD1) {
+            // A read 1 without a mate is replaced by the next one.
+            if(has_read1) std::swap(batch->recs[batch->n - 2], *b), --batch->n;
+            has_read1 = 1;
+            continue;
+        }
+        if(!has_read1) LOG_EXIT("Read %s has no read 1 before it. Is this bam namesorted?\n", bam_get_qname(b));
+        has_read1 = 0;
+        if(add_pe_tags(&batch->recs[batch->n - 2], b, &aux->mark)) batch->n -= 2;
+        else if(batch->n >= POSTPROC_BATCH_SIZE) aux->marked.put(batch), batch = aux->marked.get();
+    }
+    if(has_read1) --batch->n;
+    aux->marked.put(batch);
+    aux->marked.close();
+}
+
+static int marked_read(void *data, bam1_t **b)
+{
+    return (*b = ((postproc_aux_t *)data)->marked.next()) ? 0: -1;
+}
+
+static int sorted_write(void *data, const bam1_t *b)
+{
+    postproc_aux_t *aux((postproc_aux_t *)data);
+    if(!aux->sorting) aux->sorting = aux->sorted.get();
+    if(!bam_copy1(aux->sorting->next(), b)) return -1;
+    if(aux->sorting->n == POSTPROC_BATCH_SIZE) aux->sorted.put(aux->sorting), aux->sorting = nullptr;
+    return 0;
+}
+
+static int sorted_read(void *data, bam1_t *b)
+{
+    bam1_t *next(((BamPipe *)data)->next());
+    if(!next) return -1;
+    std::swap(*b, *next); // The pipe reuses b's old buffer.
+    return 0;
+}
+
+static int postproc_usage(int retcode)
+{
+    fprintf(stderr,
+                    "Adds mate tags to, sorts and rescues a name-sorted paired-end bam in one process.\n"
+                    "Equivalent to bmftools mark | bmftools sort | bmftools rsq, but records are passed between steps\n"
+                    "without being encoded, and are only written to disk when sort needs to spill.\n"
+                    "Secondary and supplementary alignments are dropped, as rsq would drop them.\n"
+                    "Usage: bmftools postproc <opts> -f <realign.fq> <input.namesrt.bam> <output.bam>\n\n"
+                    "Flags:\n"
+                    "-f      Path for the fastq for reads that need to be realigned. REQUIRED.\n"
+                    "-l      Set bam compression level. Valid: 0-9. (0 == uncompresed)\n"
+                    "-p      Number of threads for sorting, compression and rescue. Default: 1.\n"
+                    "Marking:\n"
+                    "-q      Skip read pairs which fail.\n"
+                    "-i      Skip read pairs whose insert size is less than <INT>.\n"
+                    "-u      Skip read pairs where both reads have a fraction of unambiguous base calls >= <FLOAT>\n"
+                    "-U      Add unclipped start tags.\n"
+                    "Sorting:\n"
+                    "-m      Maximum memory for sort blocks. Suffix K/M/G recognized. Default: 768M.\n"
+                    "-T      Prefix for temporary files. Default: <output.bam>.tmp\n"
+                    "Rescue:\n"
+                    "-s      Flag to write reads with supplementary alignments. Default: False.\n"
+                    "-t      Mismatch limit. Default: 2\n"
+                    "-e      Compare every pair of barcodes in a stack instead of indexing them. Slow; for validation.\n"
+                    "--trust-unmasked\n"
+                    "        Trust unmasked bases if reads being collapsed disagree but one is unmasked. Default: mask anyways.\n"
+                    "--accept-unbalanced\n"
+                    "        Ignore unbalanced pairs. Only use if you know what you're doing.\n"
+            );
+    return retcode;
+}
+
+int postproc_main(int argc, char *argv[])
+{
+    int c;
+    char wmode[4]{"wb"};
+    size_t max_mem(768 << 20);
+    char *fqname(nullptr), *q;
+    kstring_t prefix{0, 0, nullptr};
+    postproc_aux_t aux{};
+    rsq_aux_t settings{0};
+    settings.mmlim = 2;
+    settings.threads = 1;
+
+    static const struct option lopts[] = {
+        {"trust-unmasked", no_argument, nullptr, 1},
+        {"accept-unbalanced", no_argument, nullptr, 2},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    if(argc < 3) return postproc_usage(EXIT_FAILURE);
+
+    while ((c = getopt_long(argc, argv, "f:l:p:i:u:m:T:t:qUseh?", lopts, nullptr)) >= 0) {
+        switch (c) {
+        case 'f': fqname = optarg; break;
+        case 'l': wmode[2] = atoi(optarg)%10 + '0'; break;
+        case 'p': settings.threads = atoi(optarg); break;
+        case 'q': aux.mark.remove_qcfail = 1; break;
+        case 'i': aux.mark.min_insert_length = (uint32_t)atoi(optarg); break;
+        case 'u': aux.mark.min_frac_unambiguous = atof(optarg); break;
+        case 'U': aux.mark.add_unclipped_start = 1; break;
+        case 'm':
+            max_mem = strtol(optarg, &q, 0);
+            switch(*q) {
+                case 'g': case 'G': max_mem <<= 10; // fall-through
+                case 'm': case 'M': max_mem <<= 10; // fall-through
+                case 'k': case 'K': max_mem <<= 10;
+            }
+            break;
+        case 'T': prefix.l = 0; kputs(optarg, &prefix); break;
+        case 's': settings.write_supp = 1; break;
+        case 't': settings.mmlim = atoi(optarg); break;
+        case 'e': settings.exhaustive = 1; break;
+        case 1: settings.trust_unmasked = 1; break;
+        case 2: settings.accept_unbalanced = 1; break;
+        case '?': case 'h': return postproc_usage(EXIT_SUCCESS);
+        }
+    }
+    if (optind + 2 > argc)
+        return postproc_usage(EXIT_FAILURE);
+
+    if(!fqname) {
+        fprintf(stderr, "Fastq path for rescued reads required. Abort!\n");
+        return postproc_usage(EXIT_FAILURE);
+    }
+    const char *in(argv[optind]), *out(argv[optind + 1]);
+    if(prefix.l == 0) {
+        if(strcmp(out, "-") && strcmp(out, "stdout")) ksprintf(&prefix, "%s.tmp", out);
+        else ksprintf(&prefix, "postproc.%d.tmp", (int)getpid());
+    }
+
+    if((settings.fqh = fopen(fqname, "w")) == nullptr)
+        LOG_EXIT("Failed to open output fastq for writing. Abort!\n");
+    // Checking tags reads the start of the file, which stdin cannot rewind.
+    if(strcmp(in, "-") && strcmp(in, "stdin"))
+        for(const char *tag: {"FM", "FA", "PV", "FP"})
+            dlib::check_bam_tag_exit(in, tag);
+    if((aux.in = sam_open(in, "r")) == nullptr)
+        LOG_EXIT("Could not open %s for reading. Abort!\n", in);
+    aux.hdr = sam_hdr_read(aux.in);
+    if (aux.hdr == nullptr || aux.hdr->n_targets == 0)
+        LOG_EXIT("input SAM does not have header. Abort!\n");
+    dlib::add_pg_line(aux.hdr, argc, argv, "bmftools postproc", BMF_VERSION, "bmftools",
+            "Adds mate tags, sorts and uses positional information to rescue reads with errors in the barcode.");
+    bam_sort_set_SO(aux.hdr);
+    settings.hdr = aux.hdr;
+    if((settings.out = sam_open(out, wmode)) == nullptr)
+        LOG_EXIT("Could not open %s for writing. Abort!\n", out);
+    sam_hdr_write(settings.out, settings.hdr);
+    if(settings.threads > 1) {
+        hts_set_threads(aux.in, settings.threads);
+        hts_set_threads(settings.out, settings.threads);
+    }
+    settings.read = &sorted_read;
+    settings.read_data = &aux.sorted;
+
+    // Marking and rescue run on their own threads, and sorting on this one.
+    std::thread marker(mark_stage, &aux);
+    std::thread rescuer([&settings]() {
+        if(settings.threads > 1) omp_set_num_threads(settings.threads); // Team sizes are set per thread.
+        bam_rsq_bookends(&settings);
+    });
+    if(bam_sort_stream(&marked_read, &aux, aux.hdr, prefix.s, &sorted_write, &aux,
+                       max_mem, settings.threads, 0, 0) < 0)
+        LOG_EXIT("Failed to sort records. Abort!\n");
+    if(aux.sorting) aux.sorted.put(aux.sorting);
+    aux.sorted.close();
+    marker.join();
+    rescuer.join();
+
+    bam_hdr_destroy(aux.hdr);
+    sam_close(aux.in);
+    if(sam_close(settings.out)) LOG_EXIT("Failed to close %s. Abort!\n", out);
+    fclose(settings.fqh);
+    free(prefix.s);
+    LOG_INFO("Successfully completed bmftools postproc.\n");
+    return EXIT_SUCCESS;
+}
+
+} /* namespace bmf */
@@ -1,8 +1,13 @@
 #include "bmf_rsq.h"
 #include <cstring>
 #include <getopt.h>
+#include <omp.h>
+#include "htslib/khash.h"
 #include "dlib/cstr_util.h"
 #include "include/igamc_cephes.h" /// for igamc
+#include "lib/intfmt.h"
+#include "lib/pvtable.h"
+#include "lib/rsqindex.h"
 #include <algorithm>
 
 namespace bmf {
@@ -11,44 +16,212 @@ static const char SO_STR[]{"positional_rescue"};
 
 static const int sp(1);
 
-struct rsq_aux_t {
-    FILE *fqh;
-    samFile *in;
-    samFile *out;
-    uint32_t mmlim:6;
-    uint32_t is_se:1;
-    uint32_t write_supp:1; // Write reads with supplementary alignments
-    uint32_t infer:1; // Use inference instead of barcodes.
-    uint32_t trust_unmasked:1;
-    uint32_t accept_unbalanced:1;
-    bam_hdr_t *hdr; // BAM header
-    std::unordered_map<std::string, std::string> realign_pairs;
-};
-
 inline void bam2ffq(bam1_t *b, FILE *fp, const int is_supp=0);
 inline void add_dummy_tags(bam1_t *b);
 
+KHASH_MAP_INIT_INT64(mate, uint32_t)
+
+/*
+ * Holds the first-seen read of each pair bound for realignment until its mate arrives.
+ * Records are copied raw into pooled bam1_t slots, whose data buffers are reused once the pair is written,
+ * and are found by a hash of the qname confirmed against the stored name.
+ */
+class RealignBuffer {
+    static const uint32_t NONE = UINT32_MAX;
+    std::vector<bam1_t> slots;
+    std::vector<uint32_t> next; // Next slot with the same qname hash, or the next free slot.
+    uint32_t free_head;
+    size_t n;
+    khash_t(mate) *h;
+    static uint64_t qname_hash(const char *qname) {
+        uint64_t ret(0xcbf29ce484222325uLL);
+        while(*qname) ret = (ret ^ (uint8_t)*qname++) * 0x100000001b3uLL;
+        return ret;
+    }
+public:
+    RealignBuffer(): free_head(NONE), n(0), h(kh_init(mate)) {}
+    RealignBuffer(const RealignBuffer &other) = delete;
+    ~RealignBuffer() {
+        for(bam1_t &b: slots) free(b.data);
+        kh_destroy(mate, h);
+    }
+    /*
+     * @func take
+     * :param: qname [const char *] Read name.
+     * :returns: [bam1_t *] The buffered mate, removed from the buffer and valid until the next put,
+     * or nullptr if no read with this name is buffered.
+     */
+    bam1_t *take(const char *qname) {
+        khiter_t k(kh_get(mate, h, qname_hash(qname)));
+        if(k == kh_end(h)) return nullptr;
+        for(uint32_t prev(NONE), i(kh_val(h, k)); i != NONE; prev = i, i = next[i]) {
+            if(strcmp(bam_get_qname(&slots[i]), qname)) continue;
+            if(prev != NONE) next[prev] = next[i];
+            else if(next[i] != NONE) kh_val(h, k) = next[i];
+            else kh_del(mate, h, k);
+            next[i] = free_head, free_head = i;
+            --n;
+            return &slots[i];
+        }
+        return nullptr;
+    }
+    void put(const bam1_t *b) {
+        uint32_t i(free_head);
+        if(i != NONE) free_head = next[i];
+        else {
+            i = slots.size();
+            slots.emplace_back(bam1_t{});
+            next.push_back(NONE);
+        }
+        bam_copy1(&slots[i], b);
+        int khr;
+        khiter_t k(kh_put(mate, h, qname_hash(bam_get_qname(b)), &khr));
+        next[i] = khr ? NONE: kh_val(h, k);
+        kh_val(h, k) = i;
+        ++n;
+    }
+    size_t size() const {return n;}
+    /*
+     * @func write_all
+     * Writes every buffered read to fp as fastq. For reporting orphans.
+     */
+    void write_all(FILE *fp) {
+        for(khiter_t k(kh_begin(h)); k != kh_end(h); ++k)
+            if(kh_exist(h, k))
+                for(uint32_t i(kh_val(h, k)); i != NONE; i = next[i])
+                    bam2ffq(&slots[i], fp);
+    }
+};
+
 void update_bam1(bam1_t *p, bam1_t *b);
 void update_bam1_unmasked(bam1_t *p, bam1_t *b);
 
+/*
+ * Destination for rsq output. Stacks write through a sink so that they can be flattened
+ * on worker threads and written out in input order afterwards.
+ */
+class RsqSink {
+public:
+    virtual ~RsqSink() {}
+    virtual void write(bam1_t *b) = 0; // Output bam record.
+    virtual void fastq(bam1_t *b, int is_supp) = 0; // Single-end read for realignment.
+    virtual void realign(bam1_t *b, int is_supp) = 0; // Paired-end read for realignment, written once its mate arrives.
+};
+
+/*
+ * Writes straight to the output files.
+ */
+class RsqWriter: public RsqSink {
+    rsq_aux_t *settings;
+public:
+    RealignBuffer realign_pairs;
+    RsqWriter(rsq_aux_t *settings): settings(settings) {}
+    void write(bam1_t *b) {sam_write1(settings->out, settings->hdr, b);}
+    void fastq(bam1_t *b, int is_supp) {bam2ffq(b, settings->fqh, is_supp);}
+    void realign(bam1_t *b, int is_supp) {
+        bam1_t *mate(realign_pairs.take(bam_get_qname(b)));
+        if(!mate) realign_pairs.put(b);
+        // Write read 1 out first.
+        else if(b->core.flag & BAM_FREAD2) bam2ffq(mate, settings->fqh), bam2ffq(b, settings->fqh, is_supp);
+        else bam2ffq(b, settings->fqh, is_supp), bam2ffq(mate, settings->fqh);
+    }
+};
+
+#define RSQ_BATCH_SIZE (1 << 12) // Default minimum records per parallel batch. Batches end on stack boundaries.
+#define RSQ_BATCHES_PER_THREAD 4
+
+/*
+ * A run of input records starting and ending on stack boundaries, and the output it produced.
+ * Record buffers are kept between uses.
+ */
+class RsqBatch: public RsqSink {
+    enum {WRITE, FASTQ, FASTQ_SUPP, REALIGN, REALIGN_SUPP};
+    std::vector<bam1_t> out;
+    std::vector<uint8_t> kind; // The call which produced each output record.
+    unsigned n_out;
+    void push(bam1_t *b, uint8_t k) {
+        if(n_out == out.size()) out.emplace_back(bam1_t{}), kind.push_back(0);
+        bam_copy1(&out[n_out], b);
+        kind[n_out++] = k;
+    }
+public:
+    std::vector<bam1_t> in;
+    unsigned n_in;
+    RsqBatch(): n_out(0), n_in(0) {}
+    RsqBatch(const RsqBatch &other) = delete;
+    ~RsqBatch() {
+        for(bam1_t &b: in) free(b.data);
+        for(bam1_t &b: out) free(b.data);
+    }
+    bam1_t *next_in() {
+        if(n_in == in.size()) in.emplace_back(bam1_t{});
+        return &in[n_in++];
+    }
+    void reset() {n_in = n_out = 0;}
+    void write(bam1_t *b) {push(b, WRITE);}
+    void fastq(bam1_t *b, int is_supp) {push(b, is_supp ? FASTQ_SUPP: FASTQ);}
+    void realign(bam1_t *b, int is_supp) {push(b, is_supp ? REALIGN_SUPP: REALIGN);}
+    /*
+     * @func replay
+     * Repeats this batch's output, in order, into dest.
+     */
+    void replay(RsqSink &dest) {
+        for(unsigned i(0); i < n_out; ++i) {
+            switch(kind[i]) {
+                case WRITE: dest.write(&out[i]); break;
+                case FASTQ: case FASTQ_SUPP: dest.fastq(&out[i], kind[i] == FASTQ_SUPP); break;
+                case REALIGN: case REALIGN_SUPP: dest.realign(&out[i], kind[i] == REALIGN_SUPP); break;
+            }
+        }
+    }
+};
+
+static inline int rsq_read(rsq_aux_t *settings, bam1_t *b)
+{
+    return settings->read ? settings->read(settings->read_data, b): sam_read1(settings->in, settings->hdr, b);
+}
+
+enum {RSQ_SKIP, RSQ_PASS, RSQ_STACK};
+
+/*
+ * @func rsq_class
+ * :returns: [int] RSQ_SKIP for reads which are dropped, RSQ_PASS for reads which are written unchanged,
+ * and RSQ_STACK for reads which are rescued.
+ */
+static inline int rsq_class(const bam1_t *b, const rsq_aux_t *settings)
+{
+    const int secondary(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)),
+              unmapped(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP));
+    // Single-end barcoded rescue has always passed unmapped secondary reads through.
+    if(settings->is_se && !settings->infer) return unmapped ? RSQ_PASS: secondary ? RSQ_SKIP: RSQ_STACK;
+    return secondary ? RSQ_SKIP: unmapped ? RSQ_PASS: RSQ_STACK;
+}
+
 template<int (*fn)(bam1_t *, bam1_t *)>
 struct Stack {
     uint16_t mmlim:8;
     uint16_t trust_unmasked:1;
     uint16_t infer:1;
+    uint16_t exhaustive:1;
     unsigned n; // Number used
     unsigned m; // Maximum allocated
-    bam1_t *a; // Array
+    bam1_t *a; // Array. Slots keep their data buffers between stacks, so bam_copy1 reuses their capacity.
     bam1_t **stack; // Pointers to reads.
+    std::vector<uint8_t> merged; // 1 if a read has been merged into another in the current stack.
+    RescueIndex index;
+    std::vector<unsigned> order; // Stack positions grouped by qname length.
 
     Stack(rsq_aux_t *settings, unsigned _m=0):
             mmlim(settings->mmlim),
             trust_unmasked(settings->trust_unmasked),
             infer(settings->infer),
+            exhaustive(settings->exhaustive),
             n(0),
             m(_m),
             a((bam1_t *)calloc(m, sizeof(bam1_t))),
-            stack((bam1_t **)malloc(m * sizeof(bam1_t *)))
+            stack((bam1_t **)malloc(m * sizeof(bam1_t *))),
+            merged(m),
+            index(settings->mmlim)
     {
         for(unsigned i(0); i < m; ++i) stack[i] = a + i;
     }
@@ -62,176 +235,46 @@ struct Stack {
     }
     void add(const bam1_t *b) {
         if(n + 1 >= m) {
+            const unsigned old_m(m);
             m <<= 1;
             LOG_DEBUG("Max increased to %lu.\n", m);
             a = (bam1_t *)realloc(a, sizeof(bam1_t) * m); //
             stack = (bam1_t **)realloc(stack, sizeof(bam1_t *) * m); //
-            memset(a + n, 0, (m - n) * sizeof(bam1_t)); // Zero-initialize later records.
+            memset(a + old_m, 0, (m - old_m) * sizeof(bam1_t)); // Zero-initialize new slots, keeping old slots' buffers.
             for(unsigned i(n); i < m; ++i) stack[i] = a + i;
+            merged.resize(m);
             LOG_DEBUG("Finished adding.\n");
         }
         bam_copy1(a + n++, b);
     }
     void clear() {
-        for(unsigned i(0); i < n; ++i) free((a + i)->data);
-        memset(a, 0, n * sizeof(bam1_t));
+        memset(merged.data(), 0, n);
         n = 0;
     }
-    void write_stack_pe(rsq_aux_t *settings);
-    void write_stack_se(rsq_aux_t *settings);
+    void write_stack_pe(rsq_aux_t *settings, RsqSink &out);
+    void write_stack_se(rsq_aux_t *settings, RsqSink &out);
     void flatten();
     inline void flatten_infer();
-    void pe_core(rsq_aux_t *settings);
-    void pe_core_infer(rsq_aux_t *settings);
-    void se_core(rsq_aux_t *settings);
-    void se_core_infer(rsq_aux_t *settings);
-};
-
-template<int (*fn)(bam1_t *, bam1_t *)>
-void Stack<fn>::se_core_infer(rsq_aux_t *settings) {
-    // This selects the proper function to use for deciding if reads belong in the same stack.
-    // It chooses the single-end or paired-end based on is_se and the bmf or pos based on cmpkey.
-    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
-        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
-                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
-    bam1_t *b(bam_init1());
-    uint64_t count(0);
-    while (LIKELY(sam_read1(settings->in, settings->hdr, b) >= 0)) {
-        if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
-        add_dummy_tags(b);
-        if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
-        if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
-            sam_write1(settings->out, settings->hdr, b); continue;
-        }
-        //LOG_DEBUG("Read a read!\n");
-        if(fn(b, a) == 0) write_stack_se(settings); // Flattens and clears stack.
-        add(b);
-    }
-    write_stack_se(settings);
-    bam_destroy1(b);
-    // Handle any unpaired reads, though there shouldn't be any in real datasets.
-    if(settings->realign_pairs.size()) {
-#if !NDEBUG
-        for(auto& pair: settings->realign_pairs)
-            fputs(pair.second.c_str(), stdout);
-#endif
-        if(settings->accept_unbalanced == 0)
-            LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", settings->realign_pairs.size());
-    }
-}
-
-template<int (*fn)(bam1_t *, bam1_t *)>
-void Stack<fn>::se_core(rsq_aux_t *settings) {
-    // This selects the proper function to use for deciding if reads belong in the same stack.
-    // It chooses the single-end or paired-end based on is_se and the bmf or pos based on cmpkey.
-    if(infer) return se_core_infer(settings);
-    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
-        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
-                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
-    bam1_t *b(bam_init1());
-    uint64_t count(0);
-    while (LIKELY(sam_read1(settings->in, settings->hdr, b) >= 0)) {
-        if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
-        if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
-            sam_write1(settings->out, settings->hdr, b);
-            continue;
-        }
-        if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
-        //LOG_DEBUG("Read a read!\n");
-        if(fn(b, a) == 0) write_stack_se(settings); // Flattens and clears stack.
-        add(b);
-    }
-    write_stack_se(settings);
-    bam_destroy1(b);
-    // Handle any unpaired reads, though there shouldn't be any in real datasets.
-    LOG_DEBUG("Number of orphan reads: %lu.\n", settings->realign_pairs.size());
-    if(settings->realign_pairs.size()) {
-#if !NDEBUG
-        for(auto pair: settings->realign_pairs)
-            puts(pair.second.c_str());
-#endif
-        if(settings->accept_unbalanced == 0)
-            LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", settings->realign_pairs.size());
-    }
-}
-
-template<int (*fn)(bam1_t *, bam1_t *)>
-void Stack<fn>::pe_core_infer(rsq_aux_t *settings)
-{
-    // This selects the proper function to use for deciding if reads belong in the same stack.
-    // It chooses the single-end or paired-end based on is_se and the bmf or pos based on cmpkey.
-    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
-        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
-                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
-    bam1_t *b(bam_init1());
-    uint64_t count(0);
-    while (LIKELY(sam_read1(settings->in, settings->hdr, b) >= 0)) {
-        if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
-        add_dummy_tags(b);
-        if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
-            sam_write1(settings->out, settings->hdr, b);
-            continue;
-        }
-        if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))
-            continue;
-        if(n == 0 || fn(b, a) == 0)
-            write_stack_pe(settings); // Flattens and clears stack.
-        add(b);
-    }
-    write_stack_pe(settings);
-    bam_destroy1(b);
-    // Handle any unpaired reads, though there shouldn't be any in real datasets.
-    LOG_DEBUG("Number of orphan reads: %lu.\n", settings->realign_pairs.size());
-    if(settings->realign_pairs.size()) {
-#if !NDEBUG
-        for(auto pair: settings->realign_pairs)
-            puts(pair.second.c_str());
-#endif
-        if(settings->accept_unbalanced == 0)
-            LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", settings->realign_pairs.size());
-    }
-}
-
-template<int (*fn)(bam1_t *, bam1_t *)>
-void Stack<fn>::pe_core(rsq_aux_t *settings)
-{
-    // This selects the proper function to use for deciding if reads belong in the same stack.
-    // It chooses the single-end or paired-end based on is_se and the bmf or pos based on cmpkey.
-    LOG_DEBUG("Core!\n");
-    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
-        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
-                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
-    bam1_t *b(bam_init1());
-    uint64_t count(0);
-    while (LIKELY(sam_read1(settings->in, settings->hdr, b) >= 0)) {
-        if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
-        if(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) continue;
-        if(b->core.flag & (BAM_FUNMAP | BAM_FMUNMAP)) {
-            sam_write1(settings->out, settings->hdr, b);
-            continue;
-        }
-        //LOG_DEBUG("Read a read!\n");
-        if(fn(b, a) == 0) write_stack_pe(settings); // Flattens and clears stack.
-#if !NDEBUG
-        else {
-            assert(bam_is_r1(b) == bam_is_r1(a));
+    void flatten_group(const unsigned *group, unsigned n_group);
+    void merge(bam1_t *p, bam1_t *b) {
+        if(trust_unmasked) update_bam1_unmasked(p, b);
+        else update_bam1(p, b);
+        merged[b - a] = 1;
+    }
+    /*
+     * @func step
+     * Passes one input record through rescue, writing out the current stack first if b starts a new one.
+     */
+    void step(bam1_t *b, rsq_aux_t *settings, RsqSink &out) {
+        if(infer && settings->is_se) add_dummy_tags(b);
+        switch(rsq_class(b, settings)) {
+            case RSQ_SKIP: return;
+            case RSQ_PASS: out.write(b); return;
         }
-#endif
+        if(n == 0 || fn(b, a) == 0) write_stack_pe(settings, out); // Flattens and clears stack.
         add(b);
     }
-    write_stack_pe(settings);
-    bam_destroy1(b);
-    // Handle any unpaired reads, though there shouldn't be any in real datasets.
-    LOG_DEBUG("Number of orphan reads: %lu.\n", settings->realign_pairs.size());
-    if(settings->realign_pairs.size()) {
-#if !NDEBUG
-        for(auto pair: settings->realign_pairs)
-            puts(pair.second.c_str());
-#endif
-        if(settings->accept_unbalanced == 0)
-            LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", settings->realign_pairs.size());
-    }
-}
+};
 
 template<int (*fn)(bam1_t *, bam1_t *)>
 inline void Stack<fn>::flatten_infer()
@@ -251,9 +294,7 @@ inline void Stack<fn>::flatten_infer()
                stack[i]->core.l_qname != stack[j]->core.l_qname)
                 continue;
             //LOG_DEBUG("Flattening %s into %s.\n", bam_get_qname(a[i]), bam_get_qname(a[j]));
-            if(trust_unmasked) update_bam1_unmasked(a + j, a + i);
-            else update_bam1(a + j, a + i);
-            (a + i)->data = nullptr;
+            merge(a + j, a + i);
             break;
             // "break" in case there are multiple within hamming distance.
             // Otherwise, I'll end up having memory mistakes.
@@ -262,43 +303,70 @@ inline void Stack<fn>::flatten_infer()
     }
 }
 
+/*
+ * Greedily merges each read into the first later read in its stack with the same read and qname lengths
+ * whose barcode is within mmlim mismatches. Reads can only merge within a qname length,
+ * so each length is handled as an independent group.
+ */
 template<int (*fn)(bam1_t *, bam1_t *)>
 void Stack<fn>::flatten()
 {
     if(infer) return flatten_infer();
-    unsigned i, j;
+    unsigned i;
     for(i = 0; i < n; ++i) stack[i] = a + i;
     std::sort(stack, stack + n, [](const bam1_t *a, const bam1_t *b) {
             return a ? (b ? 0: 1): b ? strcmp(bam_get_qname(a), bam_get_qname(b)): 0;
     });
-    for(i = 0; i < n; ++i) {
-        for(j = i + 1; j < n; ++j) {
-            //assert(key == ucs_sort_core_key(stack->a[j]));
-            //assert(ucs == dlib::get_unclipped_start(stack->a[j]));
-            //assert(tid == stack->a[j]->core.tid);
-            //assert(mucs == bam_itag(stack->a[j], "MU"));
-            if(stack[i]->core.l_qseq != stack[j]->core.l_qseq)
-                continue;
-            if(stack[i]->core.l_qname != stack[j]->core.l_qname)
-                continue;
-            if(dlib::stringhd(bam_get_qname(stack[i]), bam_get_qname(stack[j])) <= mmlim) {
-                assert(dlib::stringhd(bam_get_qname(stack[i]), bam_get_qname(stack[j])) <= mmlim);
-                //LOG_DEBUG("Flattening %s into %s.\n", bam_get_qname(stack[i]), bam_get_qname(stack[j]));
-                if(trust_unmasked) update_bam1_unmasked(stack[j], stack[i]);
-                else update_bam1(stack[j], stack[i]);
-                free(stack[i]->data);
-                stack[i]->data = nullptr;
-                break;
-                // "break" in case there are multiple within hamming distance.
-                // Otherwise, I'll end up having memory mistakes.
-                // Besides, that read set will get merged into the later read in the set.
+    order.resize(n);
+    for(i = 0; i < n; ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [this](unsigned x, unsigned y) {
+        return stack[x]->core.l_qname < stack[y]->core.l_qname;
+    });
+    for(unsigned start(0), end; start < n; start = end) {
+        for(end = start + 1; end < n && stack[order[end]]->core.l_qname == stack[order[start]]->core.l_qname; ++end);
+        flatten_group(order.data() + start, end - start);
+    }
+}
+
+template<int (*fn)(bam1_t *, bam1_t *)>
+void Stack<fn>::flatten_group(const unsigned *group, unsigned n_group)
+{
+    const size_t len(strlen(bam_get_qname(stack[group[0]])));
+    int use_index(!exhaustive && n_group >= RSQ_INDEX_MIN_STACK);
+    for(unsigned i(1); use_index && i < n_group; ++i)
+        if(strlen(bam_get_qname(stack[group[i]])) != len) use_index = 0; // Differing padding: keep stringhd's semantics.
+    if(!use_index) {
+        for(unsigned i(0); i < n_group; ++i) {
+            bam1_t *const b(stack[group[i]]);
+            for(unsigned j(i + 1); j < n_group; ++j) {
+                bam1_t *const p(stack[group[j]]);
+                if(b->core.l_qseq != p->core.l_qseq) continue;
+                if(dlib::stringhd(bam_get_qname(b), bam_get_qname(p)) <= mmlim) {
+                    merge(p, b);
+                    break;
+                    // "break" in case there are multiple within hamming distance.
+                    // Besides, that read set will get merged into the later read in the set.
+                }
             }
         }
+        return;
+    }
+    index.reset(len);
+    for(unsigned i(0); i < n_group; ++i) index.add(bam_get_qname(stack[group[i]]));
+    for(unsigned i(0); i < n_group; ++i) {
+        bam1_t *const b(stack[group[i]]);
+        const unsigned j(index.next_match(i, [&](unsigned j) {
+            return stack[group[j]]->core.l_qseq == b->core.l_qseq;
+        }));
+        if(j == n_group) continue;
+        bam1_t *const p(stack[group[j]]);
+        merge(p, b);
+        index.rename(j, bam_get_qname(p)); // The merged read may have taken b's name.
     }
 }
 
 template<int (*fn)(bam1_t *, bam1_t *)>
-void Stack<fn>::write_stack_se(rsq_aux_t *settings)
+void Stack<fn>::write_stack_se(rsq_aux_t *settings, RsqSink &out)
 {
     LOG_DEBUG("Writing stack se.\n");
     flatten();
@@ -309,73 +377,40 @@ void Stack<fn>::write_stack_se(rsq_aux_t *settings)
     }
 #endif
     for(unsigned i(0); i < n; ++i) {
-        if((a + i)->data) {
+        if(!merged[i]) {
             if((data = bam_aux_get((a + i), "NC")))
-                bam2ffq((a + i), settings->fqh);
+                out.fastq(a + i, 0);
             else
-                sam_write1(settings->out, settings->hdr, (a + i));
+                out.write(a + i);
         }
     }
     clear();
 }
 
 template<int (*fn)(bam1_t *, bam1_t *)>
-void Stack<fn>::write_stack_pe(rsq_aux_t *settings)
+void Stack<fn>::write_stack_pe(rsq_aux_t *settings, RsqSink &out)
 {
+    if(settings->is_se) return write_stack_se(settings, out);
     flatten();
-    if(settings->is_se) return write_stack_se(settings);
     //size_t n = 0;
     //LOG_DEBUG("Starting to write stack\n");
     uint8_t *data;
-    std::string qname;
     for(unsigned i(0); i < n; ++i) {
-        if(a[i].data) {
+        if(!merged[i]) {
             if((data = bam_aux_get(a + i, "NC"))) {
                 //LOG_DEBUG("Trying to write.\n");
-                qname = bam_get_qname(a + i);
-                if(settings->realign_pairs.find(qname) == settings->realign_pairs.end()) {
-                    settings->realign_pairs.emplace(qname, dlib::bam2cppstr(a + i));
-                } else {
-                    // Write read 1 out first.
-                    if((a + i)->core.flag & BAM_FREAD2) {
-                        fputs(settings->realign_pairs[qname].c_str(), settings->fqh);
-                        bam2ffq((a + i), settings->fqh);
-                    } else {
-                        bam2ffq((a + i), settings->fqh);
-                        fputs(settings->realign_pairs[qname].c_str(), settings->fqh);
-                    }
-                    // Clear entry, as there can only be two.
-                    settings->realign_pairs.erase(qname);
-                }
+                out.realign(a + i, 0);
             } else if(settings->write_supp & (bam_aux_get((a + i), "SA") || bam_aux_get((a + i), "ms"))) {
                 assert(((a + i)->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) == 0);
                 //LOG_DEBUG("Trying to write write supp or stuff.\n");
                 // Has an SA or ms tag, meaning that the read or its mate had a supplementary alignment
-                qname = bam_get_qname((a + i));
                 bam_aux_append(a + i, "SP", 'i', sizeof(int), const_cast<uint8_t *>(reinterpret_cast<const uint8_t*>(&sp)));
-                if(settings->realign_pairs.find(qname) == settings->realign_pairs.end()) {
-                    settings->realign_pairs[qname] = dlib::bam2cppstr((a + i));
-                } else {
-                    // Make sure the read names/barcodes match.
-                    //assert(memcmp(settings->realign_pairs[qname].c_str() + 1, qname.c_str(), qname.size() - 1) == 0);
-                    // Write read 1 out first.
-                    if((a + i)->core.flag & BAM_FREAD2) {
-                        fputs(settings->realign_pairs[qname].c_str(), settings->fqh);
-                        //bam2ffq((a + i), settings->fqh, qname);
-                        bam2ffq((a + i), settings->fqh, 1);
-                    } else {
-                        //bam2ffq((a + i), settings->fqh, qname);
-                        bam2ffq((a + i), settings->fqh, 1);
-                        fputs(settings->realign_pairs[qname].c_str(), settings->fqh);
-                    }
-                    // Clear entry, as there can only be two.
-                    settings->realign_pairs.erase(qname);
-                }
+                out.realign(a + i, 1);
             } else {
                 for(const char *tag: {"MU", "ms", "LM"})
                     if((data = bam_aux_get((a + i), tag)))
                         bam_aux_del((a + i), data);
-                sam_write1(settings->out, settings->hdr, (a + i));
+                out.write(a + i);
             }
         }
     }
@@ -392,9 +427,9 @@ inline void bam2ffq(bam1_t *b, FILE *fp, const int is_supp)
     kputsnl(" PV:B:I", &ks);
     auto fa((uint32_t *)dlib::array_tag(b, "FA"));
     auto pv((uint32_t *)dlib::array_tag(b, "PV"));
-    for(i = 0; i < b->core.l_qseq; ++i) ksprintf(&ks, ",%u", pv[i]);
+    kput_u32_array(pv, b->core.l_qseq, &ks);
     kputsnl("\tFA:B:I", &ks);
-    for(i = 0; i < b->core.l_qseq; ++i) ksprintf(&ks, ",%u", fa[i]);
+    kput_u32_array(fa, b->core.l_qseq, &ks);
     ksprintf(&ks, "\tFM:i:%i\tFP:i:%i", bam_itag(b, "FM"), bam_itag(b, "FP"));
     write_if_found(rvdata, b, "RV", ks);
     write_if_found(rvdata, b, "NC", ks);
@@ -501,7 +536,7 @@ void update_bam1_unmasked(bam1_t *p, bam1_t *b)
             ps = bam_seqi(pSeq, qleni1);
             bs = bam_seqi(bSeq, qleni1);
             if(ps == bs) {
-                if((pPV[i] = agreed_pvalues(pPV[i], bPV[i])) < 3) {
+                if((pPV[i] = pv_table().agreed(pPV[i], bPV[i])) < 3) {
                     pFA[i] = 0;
                     pPV[i] = 0;
                     pQual[qleni1] = 2;
@@ -549,7 +584,7 @@ void update_bam1_unmasked(bam1_t *p, bam1_t *b)
             ps = bam_seqi(pSeq, i);
             bs = bam_seqi(bSeq, i);
             if(ps == bs) {
-                if((pPV[i] = agreed_pvalues(pPV[i], bPV[i])) > 2) {
+                if((pPV[i] = pv_table().agreed(pPV[i], bPV[i])) > 2) {
                     pFA[i] += bFA[i];
                     if(bQual[i] > pQual[i]) pQual[i] = bQual[i];
                 } else {
@@ -665,7 +700,7 @@ void update_bam1(bam1_t *p, bam1_t *b)
             ps = bam_seqi(pSeq, qleni1);
             bs = bam_seqi(bSeq, qleni1);
             if(ps == bs) {
-                if((pPV[i] = agreed_pvalues(pPV[i], bPV[i])) < 3) {
+                if((pPV[i] = pv_table().agreed(pPV[i], bPV[i])) < 3) {
                     pFA[i] = 0;
                     pPV[i] = 0;
                     pQual[qleni1] = 2;
@@ -686,7 +721,7 @@ void update_bam1(bam1_t *p, bam1_t *b)
             ps = bam_seqi(pSeq, i);
             bs = bam_seqi(bSeq, i);
             if(ps == bs) {
-                if((pPV[i] = agreed_pvalues(pPV[i], bPV[i])) > 2) {
+                if((pPV[i] = pv_table().agreed(pPV[i], bPV[i])) > 2) {
                     pFA[i] += bFA[i];
                     if(bQual[i] > pQual[i]) pQual[i] = bQual[i];
                 } else {
@@ -737,17 +772,104 @@ inline void add_dummy_tags(bam1_t *b)
 }
 
 
-void bam_rsq_bookends(rsq_aux_t *settings)
+/*
+ * Reads the input in batches which never split a stack.
+ * A batch is cut at the first stack to start after settings->batch_size records.
+ */
+template<int (*fn)(bam1_t *, bam1_t *)>
+class RsqReader {
+    rsq_aux_t *settings;
+    bam1_t *pending; // First record of the next batch.
+    int has_pending, eof;
+    uint64_t count;
+    const unsigned batch_size;
+public:
+    RsqReader(rsq_aux_t *settings): settings(settings), pending(bam_init1()), has_pending(0), eof(0), count(0),
+        batch_size(settings->batch_size ? settings->batch_size: RSQ_BATCH_SIZE) {}
+    ~RsqReader() {bam_destroy1(pending);}
+    /*
+     * @func fill
+     * :returns: [unsigned] Number of records read into batch. 0 at end of input.
+     */
+    unsigned fill(RsqBatch &batch) {
+        batch.reset();
+        int first(-1); // Index of the first record of the last stack in the batch.
+        if(has_pending) std::swap(*batch.next_in(), *pending), has_pending = 0, first = 0;
+        while(!eof) {
+            bam1_t *b(batch.next_in());
+            if(rsq_read(settings, b) < 0) {
+                --batch.n_in, eof = 1;
+                break;
+            }
+            if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
+            if(rsq_class(b, settings) != RSQ_STACK) continue;
+            if(first < 0 || fn(b, &batch.in[first]) == 0) {
+                if(batch.n_in > batch_size) {
+                    std::swap(*b, *pending), has_pending = 1, --batch.n_in;
+                    break;
+                }
+                first = batch.n_in - 1;
+            }
+        }
+        return batch.n_in;
+    }
+};
+
+template<int (*fn)(bam1_t *, bam1_t *)>
+void rsq_core(rsq_aux_t *settings)
 {
-    if(settings->is_se) {
-        Stack<same_stack_pos_se> stack(settings, 1 << 8);
-        stack.se_core(settings);
+    if(strcmp(dlib::get_SO(settings->hdr).c_str(), SO_STR))
+        LOG_EXIT("Sort order (%s) is not expected %s for rescue mode. Abort!\n",
+                 dlib::get_SO(settings->hdr).c_str(), SO_STR);
+    RsqWriter writer(settings);
+    if(settings->threads > 1) {
+        // Batches are flattened in parallel, then their output is written in input order.
+        // Realignment pairs are matched while writing, so pairs split across batches are reconciled as before.
+        std::vector<Stack<fn> *> stacks;
+        for(int i(0); i < settings->threads; ++i) stacks.push_back(new Stack<fn>(settings, 1 << 8));
+        std::vector<RsqBatch> batches(settings->threads * RSQ_BATCHES_PER_THREAD);
+        RsqReader<fn> reader(settings);
+        int n_batches;
+        do {
+            for(n_batches = 0; n_batches < (int)batches.size() && reader.fill(batches[n_batches]); ++n_batches);
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int i = 0; i < n_batches; ++i) {
+                Stack<fn> &stack(*stacks[omp_get_thread_num()]);
+                RsqBatch &batch(batches[i]);
+                for(unsigned j(0); j < batch.n_in; ++j) stack.step(&batch.in[j], settings, batch);
+                stack.write_stack_pe(settings, batch);
+            }
+            for(int i(0); i < n_batches; ++i) batches[i].replay(writer);
+        } while(n_batches == (int)batches.size());
+        for(auto stack: stacks) delete stack;
     } else {
-        Stack<same_stack_pos> stack(settings, 1 << 8);
-        stack.pe_core(settings);
+        Stack<fn> stack(settings, 1 << 8);
+        bam1_t *b(bam_init1());
+        uint64_t count(0);
+        while (LIKELY(rsq_read(settings, b) >= 0)) {
+            if(UNLIKELY(++count % 1000000 == 0)) LOG_INFO("Records read: %lu.\n", count);
+            stack.step(b, settings, writer);
+        }
+        stack.write_stack_pe(settings, writer);
+        bam_destroy1(b);
+    }
+    // Handle any unpaired reads, though there shouldn't be any in real datasets.
+    LOG_DEBUG("Number of orphan reads: %lu.\n", writer.realign_pairs.size());
+    if(writer.realign_pairs.size()) {
+#if !NDEBUG
+        writer.realign_pairs.write_all(stdout);
+#endif
+        if(settings->accept_unbalanced == 0)
+            LOG_EXIT("There shouldn't be orphan reads in real datasets. Number found: %lu\n", writer.realign_pairs.size());
     }
 }
 
+void bam_rsq_bookends(rsq_aux_t *settings)
+{
+    if(settings->is_se) rsq_core<same_stack_pos_se>(settings);
+    else rsq_core<same_stack_pos>(settings);
+}
+
 
 int rsq_usage(int retcode)
 {
@@ -765,6 +887,9 @@ int rsq_usage(int retcode)
                     "-l      Set bam compression level. Valid: 0-9. (0 == uncompresed)\n"
                     "-m      Trust unmasked bases if reads being collapsed disagree but one is unmasked. Default: mask anyways.\n"
                     "-i      Flag to ignore barcodes and infer solely by positional information.\n"
+                    "-p      Number of threads. Default: 1.\n"
+                    "-b      Minimum records per batch with -p. Default: 4096.\n"
+                    "-e      Compare every pair of barcodes in a stack instead of indexing them. Slow; for validation.\n"
                     "-u      Ignore unbalanced pairs. Typically, unbalanced pairs means the bam is corrupted or unsorted.\n"
                     "        Use this flag to still return a zero exit status, but only use if you know what you're doing.\n"
                     "This flag adds artificial auxiliary tags to treat unbarcoded reads as if they were singletons.\n"
@@ -780,13 +905,14 @@ int rsq_main(int argc, char *argv[])
 
     rsq_aux_t settings{0};
     settings.mmlim = 2;
+    settings.threads = 1;
     assert(!settings.is_se);
 
     char *fqname(nullptr);
 
     if(argc < 3) return rsq_usage(EXIT_FAILURE);
 
-    while ((c = getopt(argc, argv, "l:f:t:miSHsh?")) >= 0) {
+    while ((c = getopt(argc, argv, "l:f:t:p:b:meiSHsh?")) >= 0) {
         switch (c) {
         case 's': settings.write_supp = 1; break;
         case 'S': settings.is_se = 1; break;
@@ -796,6 +922,9 @@ int rsq_main(int argc, char *argv[])
         case 'f': fqname = optarg; break;
         case 'l': wmode[2] = atoi(optarg)%10 + '0';break;
         case 'i': settings.infer = 1; break;
+        case 'e': settings.exhaustive = 1; break;
+        case 'p': settings.threads = atoi(optarg); break;
+        case 'b': settings.batch_size = strtoul(optarg, nullptr, 0); break;
         case '?': case 'h': case 'H': return rsq_usage(EXIT_SUCCESS);
         }
     }
@@ -829,6 +958,11 @@ int rsq_main(int argc, char *argv[])
     if (settings.in == 0 || settings.out == 0)
         LOG_EXIT("fail to read/write input files\n");
     sam_hdr_write(settings.out, settings.hdr);
+    if(settings.threads > 1) {
+        omp_set_num_threads(settings.threads);
+        hts_set_threads(settings.in, settings.threads);
+        hts_set_threads(settings.out, settings.threads);
+    }
 
     bam_rsq_bookends(&settings);
     bam_hdr_destroy(settings.hdr);
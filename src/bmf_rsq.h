@@ -14,6 +14,32 @@ enum cmpkey {
     UNCLIPPED
 };
 
+struct rsq_aux_t {
+    FILE *fqh;
+    samFile *in;
+    samFile *out;
+    uint32_t mmlim:6;
+    uint32_t is_se:1;
+    uint32_t write_supp:1; // Write reads with supplementary alignments
+    uint32_t infer:1; // Use inference instead of barcodes.
+    uint32_t trust_unmasked:1;
+    uint32_t accept_unbalanced:1;
+    uint32_t exhaustive:1; // Compare every pair of barcodes instead of using the rescue index.
+    int threads;
+    unsigned batch_size; // Minimum records per parallel batch. 0 for the default.
+    bam_hdr_t *hdr; // BAM header
+    // Record source replacing in, for rescue as a stage of bmftools postproc. Returns < 0 at the end of input, as sam_read1.
+    int (*read)(void *data, bam1_t *b);
+    void *read_data;
+};
+
+/*
+ * @func bam_rsq_bookends
+ * Rescues reads from settings->in (or settings->read), which must be in bmftools sort order,
+ * writing to settings->out and settings->fqh.
+ */
+void bam_rsq_bookends(rsq_aux_t *settings);
+
 CONST static inline int same_stack_pos_se(bam1_t *b, bam1_t *p)
 {
     return (bmfsort_se_key(b) == bmfsort_se_key(p) &&
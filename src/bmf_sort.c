@@ -42,6 +42,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include "htslib/klist.h"
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
+#include "htslib/thread_pool.h"
 #include "sam_opts.h"
 #include "bmf_sort.h"
 
@@ -72,6 +73,7 @@ KLIST_INIT(hdrln, char*, hdrln_free_char)
 
 static int g_cmpkey = POS;
 static int is_se = 0;
+static int generic_merge = 0; // Merge temporary files with bam_merge_core2 even when their headers match.
 
 
 static int strnum_cmp(const char *_a, const char *_b)
@@ -109,10 +111,11 @@ typedef struct {
 #define __pos_cmp(a, b) ((a).pos > (b).pos || ((a).pos == (b).pos && ((a).i > (b).i || ((a).i == (b).i && (a).idx > (b).idx))))
 
 // Function to compare reads in the heap and determine which one is < the other
+// Records with equal keys come out by file and then in the order they were read, as from merge_tmp_files.
 static inline int heap_lt(const heap1_t a, const heap1_t b)
 {
-    return (a.b && b.b) ? !bam1_lt_bmf(a.b, b.b)
-                        : __pos_cmp(a, b);
+    if (!a.b || !b.b) return __pos_cmp(a, b);
+    return bam1_lt_bmf(b.b, a.b) || (!bam1_lt_bmf(a.b, b.b) && (a.i > b.i || (a.i == b.i && a.idx > b.idx)));
 }
 
 KSORT_INIT(heap, heap1_t, heap_lt)
@@ -1622,30 +1625,124 @@ static inline int bam1_lt_bmf(const bam1_p a, const bam1_p b)
                             : sort_rlen_key(a) < sort_rlen_key(b);
 }
 
+/*
+ * Index entry for a record in a sort block.
+ * The sort key is extracted once when the record is read rather than in every comparison:
+ * bmfsort_core_key in hi and bmfsort_mate_key in lo, or bmfsort_se_key in hi for single-end data.
+ * Ordering by (hi, lo) is the ordering of bam1_lt_bmf.
+ * offset locates the record's bam1_core_t in the block, followed by its l_data bytes of data.
+ */
+typedef struct {
+    uint64_t hi, lo;
+    size_t offset;
+    uint32_t l_data;
+} sort_key_t;
+
+static inline void sort_key_set(sort_key_t *key, const bam1_t *b)
+{
+    if(is_se) key->hi = bmfsort_se_key(b), key->lo = 0;
+    else key->hi = bmfsort_core_key(b), key->lo = bmfsort_mate_key(b);
+}
+
+/*
+ * Bytes a record occupies in a sort block, padded so that the next record's core stays aligned.
+ */
+static inline size_t sort_rec_size(const bam1_t *b)
+{
+    return (sizeof(bam1_core_t) + b->l_data + 7) & ~(size_t)7;
+}
+
+/*
+ * Points view at a record stored in a sort block, for writing. view does not own its data.
+ */
+static inline void sort_rec_view(bam1_t *view, const uint8_t *block, const sort_key_t *key)
+{
+    memcpy(&view->core, block + key->offset, sizeof(bam1_core_t));
+    view->data = (uint8_t*)block + key->offset + sizeof(bam1_core_t);
+    view->l_data = view->m_data = key->l_data;
+}
+
+#define sort_key_lt(a, b) ((a).hi < (b).hi || ((a).hi == (b).hi && (a).lo < (b).lo))
+
+KSORT_INIT(sort, sort_key_t, sort_key_lt)
 
-KSORT_INIT(sort, bam1_p, bam1_lt_bmf)
+#define RADIX_MIN_RECORDS 256
+
+/*
+ * Stable LSD radix sort of keys by (hi, lo), one byte per pass, into the same order ks_mergesort gives.
+ * Byte histograms do not change between passes, so all 16 are counted in one scan,
+ * and bytes on which every key agrees (most of them, for a block spanning a narrow range of positions) are skipped.
+ * Small blocks are merge sorted instead.
+ * tmp must hold n keys.
+ */
+static void radix_sort_keys(size_t n, sort_key_t *keys, sort_key_t *tmp)
+{
+    size_t (*counts)[256], i, j, sum, t;
+    sort_key_t *src = keys, *dst = tmp, *swap;
+    uint64_t v;
+    int d, shift;
+    if (n < RADIX_MIN_RECORDS) {
+        ks_mergesort(sort, n, keys, tmp);
+        return;
+    }
+    counts = (size_t (*)[256])calloc(16, sizeof(*counts));
+    for (i = 0; i < n; ++i) {
+        for (d = 0; d < 8; ++d) {
+            ++counts[d][keys[i].lo >> (d * 8) & 0xFF];
+            ++counts[d + 8][keys[i].hi >> (d * 8) & 0xFF];
+        }
+    }
+    for (d = 0; d < 16; ++d) {
+        shift = (d & 7) * 8;
+        v = d < 8 ? src[0].lo : src[0].hi;
+        if (counts[d][v >> shift & 0xFF] == n) continue;
+        for (j = sum = 0; j < 256; ++j) t = counts[d][j], counts[d][j] = sum, sum += t;
+        for (i = 0; i < n; ++i) {
+            v = d < 8 ? src[i].lo : src[i].hi;
+            dst[counts[d][v >> shift & 0xFF]++] = src[i];
+        }
+        swap = src, src = dst, dst = swap;
+    }
+    if (src != keys) memcpy(keys, src, n * sizeof(*keys));
+    free(counts);
+}
+
+/*
+ * Codecs for temporary files, by --tmp-codec name. All are read back as BAM.
+ * bgzf1: BGZF at level 1, compressed by a thread pool shared by all temporary files.
+ * bgzf0: BGZF without compression.
+ * raw: BAM records without BGZF framing.
+ */
+static const char *const tmp_codec_names[] = {"bgzf1", "bgzf0", "raw"};
+static const char *const tmp_codec_modes[] = {"wbx1", "wbx0", "wbxu"};
 
 typedef struct {
     size_t buf_len;
-    const char *prefix;
-    bam1_p *buf;
+    const char *prefix, *mode;
+    sort_key_t *buf, *tmp;
+    const uint8_t *block;
     const bam_hdr_t *h;
+    htsThreadPool *pool;
     int index;
     int error;
 } worker_t;
 
 // Returns 0 for success
 //        -1 for failure
-static int write_buffer(const char *fn, const char *mode, size_t l, bam1_p *buf, const bam_hdr_t *h, int n_threads, const htsFormat *fmt)
+static int write_buffer(const char *fn, const char *mode, size_t l, const sort_key_t *buf, const uint8_t *block, const bam_hdr_t *h, int n_threads, htsThreadPool *pool, const htsFormat *fmt)
 {
     size_t i;
     samFile* fp;
+    bam1_t view;
+    memset(&view, 0, sizeof(view));
     fp = sam_open_format(fn, mode, fmt);
     if (fp == NULL) return -1;
+    if (pool) hts_set_opt(fp, HTS_OPT_THREAD_POOL, pool);
+    else if (n_threads > 1) hts_set_threads(fp, n_threads);
     if (sam_hdr_write(fp, h) != 0) goto fail;
-    if (n_threads > 1) hts_set_threads(fp, n_threads);
     for (i = 0; i < l; ++i) {
-        if (sam_write1(fp, h, buf[i]) < 0) goto fail;
+        sort_rec_view(&view, block, &buf[i]);
+        if (sam_write1(fp, h, &view) < 0) goto fail;
     }
     if (sam_close(fp) < 0) return -1;
     return 0;
@@ -1659,11 +1756,11 @@ static void *worker(void *data)
     worker_t *w = (worker_t*)data;
     char *name;
     w->error = 0;
-    ks_mergesort(sort, w->buf_len, w->buf, 0);
+    radix_sort_keys(w->buf_len, w->buf, w->tmp);
     name = (char*)calloc(strlen(w->prefix) + 20, 1);
     if (!name) { w->error = errno; return 0; }
     sprintf(name, "%s.%.4d.bam", w->prefix, w->index);
-    if (write_buffer(name, "wbx1", w->buf_len, w->buf, w->h, 0, NULL) < 0)
+    if (write_buffer(name, w->mode, w->buf_len, w->buf, w->block, w->h, 0, w->pool, NULL) < 0)
         w->error = errno;
 
 // Consider using CRAM temporary files if the final output is CRAM.
@@ -1680,11 +1777,34 @@ static void *worker(void *data)
     return 0;
 }
 
-static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, const bam_hdr_t *h, int n_threads)
+/*
+ * A sort block is one allocation of max_mem bytes.
+ * Records are packed upwards from the start and index entries are added downwards from the end,
+ * leaving room below the index for the radix sort's scratch copy of it, so that the block is full exactly
+ * when its records, index and scratch space would exceed max_mem.
+ */
+static inline int block_fits(size_t used, size_t k, size_t rec_size, size_t max_mem)
+{
+    return used + rec_size + 2 * (k + 1) * sizeof(sort_key_t) <= max_mem;
+}
+
+/*
+ * :returns: The block's index, in the order its records were read.
+ */
+static sort_key_t *block_index(uint8_t *block, size_t max_mem, size_t k)
+{
+    sort_key_t *index = (sort_key_t*)(block + max_mem) - k, swap;
+    size_t i;
+    for (i = 0; i < k / 2; ++i) swap = index[i], index[i] = index[k - 1 - i], index[k - 1 - i] = swap;
+    return index;
+}
+
+static int sort_blocks(int n_files, size_t k, uint8_t *block, size_t max_mem, const char *prefix, const bam_hdr_t *h,
+                       int n_threads, const char *mode, htsThreadPool *pool)
 {
     int i;
     size_t rest;
-    bam1_p *b;
+    sort_key_t *b = block_index(block, max_mem, k), *tmp = b - k;
     pthread_t *tid;
     pthread_attr_t attr;
     worker_t *w;
@@ -1696,14 +1816,18 @@ static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, c
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
     w = (worker_t*)calloc(n_threads, sizeof(worker_t));
     tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
-    b = buf; rest = k;
+    rest = k;
     for (i = 0; i < n_threads; ++i) {
         w[i].buf_len = rest / (n_threads - i);
         w[i].buf = b;
+        w[i].tmp = tmp;
+        w[i].block = block;
         w[i].prefix = prefix;
+        w[i].mode = mode;
+        w[i].pool = pool;
         w[i].h = h;
         w[i].index = n_files + i;
-        b += w[i].buf_len; rest -= w[i].buf_len;
+        b += w[i].buf_len; tmp += w[i].buf_len; rest -= w[i].buf_len;
         pthread_create(&tid[i], &attr, worker, &w[i]);
     }
     for (i = 0; i < n_threads; ++i) {
@@ -1717,83 +1841,394 @@ static int sort_blocks(int n_files, size_t k, bam1_p *buf, const char *prefix, c
     return (n_failed == 0)? n_files + n_threads : -1;
 }
 
-/*!
-  @abstract Sort an unsorted BAM file based on the chromosome order
-  and the leftmost position of an alignment
+/*
+ * A full block being sorted and written to temporary files in the background while the next is read.
+ */
+typedef struct {
+    uint8_t *block;
+    size_t k, max_mem;
+    int n_files, n_threads;
+    const char *prefix, *mode;
+    const bam_hdr_t *h;
+    htsThreadPool *pool;
+    pthread_t tid;
+    int running;
+} spill_t;
 
-  @param  l_cmpkey whether to sort by query name
-  @param  fn       name of the file to be sorted
-  @param  prefix   prefix of the temporary files (prefix.NNNN.bam are written)
-  @param  fnout    name of the final output file to be written
-  @param  modeout  sam_open() mode to be used to create the final output file
-  @param  max_mem  approxiate maximum memory (very inaccurate)
-  @param  in_fmt   input file format options
-  @param  out_fmt  output file format and options
-  @return 0 for successful sorting, negative on errors
+static void *spill_worker(void *data)
+{
+    spill_t *s = (spill_t*)data;
+    s->n_files = sort_blocks(s->n_files, s->k, s->block, s->max_mem, s->prefix, s->h, s->n_threads, s->mode, s->pool);
+    return 0;
+}
 
-  @discussion It may create multiple temporary subalignment files
-  and then merge them by calling bam_merge_core2(). This function is
-  NOT thread safe.
+/*
+ * Waits for the running spill, if any.
+ * :returns: Number of temporary files written so far, or -1 if a spill failed.
  */
+static int spill_wait(spill_t *s)
+{
+    if (s->running) pthread_join(s->tid, NULL), s->running = 0;
+    return s->n_files;
+}
 
-#define SORT_KEY "positional_rescue"
-
-int bam_sort_core_ext(int l_cmpkey, const char *fn, const char *prefix,
-                      const char *fnout, const char *modeout,
-                      size_t _max_mem, int n_threads,
-                      const htsFormat *in_fmt, const htsFormat *out_fmt)
+/*
+ * Starts spilling block, once the previous spill is done.
+ * :returns: 0 on success, -1 if the previous spill failed.
+ */
+static int spill_start(spill_t *s, uint8_t *block, size_t k)
 {
-    int ret = -1, i, n_files = 0;
-    size_t mem, max_k, k, max_mem;
-    bam_hdr_t *header = NULL;
+    int rc;
+    if (spill_wait(s) < 0) return -1;
+    s->block = block, s->k = k;
+    if ((rc = pthread_create(&s->tid, NULL, spill_worker, s)) != 0) {
+        fprintf(stderr, "[bam_sort_core] failed to start a spill thread: %s\n", strerror(rc));
+        return -1;
+    }
+    s->running = 1;
+    return 0;
+}
+
+/*
+ * Merging temporary files
+ *
+ * Sort's temporary files all carry the sort's header, so records need no
+ * translation, and each file is already in key order. Each file gets a
+ * reader thread, which decodes it into two batches in turn, filling one
+ * while the merge consumes the other, and extracts each record's sort key
+ * as it decodes it. The batches of all files share the smaller of
+ * MERGE_READAHEAD_MEM and the sort's memory limit. The merge picks the
+ * next record with a loser tree over those keys, breaking ties by file
+ * number, which keeps records with equal keys in the order they were read.
+ */
+
+#define MERGE_READAHEAD_MEM (64 << 20)
+#define MERGE_MIN_BATCH_BYTES (4 << 10)
+
+/*
+ * Decoded records laid out as in a sort block, with their keys in file order.
+ */
+typedef struct {
+    uint8_t *data;
+    size_t used, m_data;
+    sort_key_t *keys;
+    size_t n, m_keys;
+} merge_batch_t;
+
+typedef struct {
     samFile *fp;
-    bam1_t *b, **buf;
+    bam_hdr_t *h;
+    size_t batch_bytes;
+    merge_batch_t batches[2];
+    int filled[2];          // Set by the reader thread, cleared by the merge once consumed.
+    int done, error, stop;  // done: the reader has filled its last batch.
+    int cur;                // Batch being consumed.
+    size_t pos;             // Record being consumed in it.
+    const sort_key_t *key;  // Its key, or NULL once the file is exhausted.
+    pthread_t tid;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} merge_reader_t;
+
+static int merge_batch_add(merge_batch_t *batch, const bam1_t *b)
+{
+    size_t rec_size = sort_rec_size(b), m;
+    sort_key_t *key;
+    if (batch->used + rec_size > batch->m_data) {
+        uint8_t *data;
+        for (m = batch->m_data ? batch->m_data : MERGE_MIN_BATCH_BYTES; m < batch->used + rec_size; m <<= 1);
+        if ((data = (uint8_t*)realloc(batch->data, m)) == NULL) return -1;
+        batch->data = data, batch->m_data = m;
+    }
+    if (batch->n == batch->m_keys) {
+        sort_key_t *keys;
+        m = batch->m_keys ? batch->m_keys << 1 : 256;
+        if ((keys = (sort_key_t*)realloc(batch->keys, m * sizeof(sort_key_t))) == NULL) return -1;
+        batch->keys = keys, batch->m_keys = m;
+    }
+    memcpy(batch->data + batch->used, &b->core, sizeof(bam1_core_t));
+    memcpy(batch->data + batch->used + sizeof(bam1_core_t), b->data, b->l_data);
+    key = batch->keys + batch->n++;
+    sort_key_set(key, b);
+    key->offset = batch->used, key->l_data = b->l_data;
+    batch->used += rec_size;
+    return 0;
+}
 
-    if (n_threads < 2) n_threads = 1;
-    g_cmpkey = l_cmpkey;
-    max_k = k = 0; mem = 0;
-    max_mem = _max_mem * n_threads;
-    buf = NULL;
-    fp = sam_open_format(fn, "r", in_fmt);
-    if (fp == NULL) {
-        const char *message = strerror(errno);
-        fprintf(stderr, "[bam_sort_core] fail to open '%s': %s\n", fn, message);
-        return -2;
+static void *merge_read_worker(void *data)
+{
+    merge_reader_t *r = (merge_reader_t*)data;
+    merge_batch_t *batch;
+    bam1_t *b = bam_init1();
+    int i, ret = b ? 0 : -4;
+    for (i = 0; ret >= 0; i ^= 1) {
+        pthread_mutex_lock(&r->lock);
+        while (r->filled[i] && !r->stop) pthread_cond_wait(&r->cond, &r->lock);
+        pthread_mutex_unlock(&r->lock);
+        if (r->stop) break;
+        batch = r->batches + i;
+        batch->used = batch->n = 0;
+        while (batch->used < r->batch_bytes) {
+            if ((ret = sam_read1(r->fp, r->h, b)) < 0) break;
+            if (merge_batch_add(batch, b) < 0) { ret = -4; break; }
+        }
+        pthread_mutex_lock(&r->lock);
+        r->filled[i] = 1;
+        r->done = ret < 0;
+        r->error = ret < -1;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
     }
-    header = sam_hdr_read(fp);
-    if (header == NULL) {
-        fprintf(stderr, "[bam_sort_core] failed to read header for '%s'\n", fn);
+    if (!b) {
+        // Still wake the merge, which reports the failure.
+        pthread_mutex_lock(&r->lock);
+        r->done = r->error = 1;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+    bam_destroy1(b);
+    return 0;
+}
+
+/*
+ * Moves r on to its next record, or to its first before any has been read,
+ * waiting for its reader thread if the current batch is used up.
+ * :returns: 0 on success, -1 on a read error. r->key is NULL once the file is exhausted.
+ */
+static int merge_reader_next(merge_reader_t *r)
+{
+    merge_batch_t *batch = r->batches + r->cur;
+    int ret;
+    if (r->key && r->pos + 1 < batch->n) {
+        r->key = batch->keys + ++r->pos;
+        return 0;
+    }
+    pthread_mutex_lock(&r->lock);
+    if (r->key) {
+        // Hand the used batch back to the reader.
+        r->filled[r->cur] = 0;
+        pthread_cond_signal(&r->cond);
+        r->cur ^= 1;
+    }
+    r->pos = 0;
+    while (!r->filled[r->cur] && !r->done) pthread_cond_wait(&r->cond, &r->lock);
+    batch = r->batches + r->cur;
+    r->key = r->filled[r->cur] && batch->n ? batch->keys : NULL;
+    ret = r->error ? -1 : 0;
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
+
+static void merge_readers_destroy(merge_reader_t *r, int n)
+{
+    int i, j;
+    for (i = 0; i < n; ++i) {
+        if (r[i].running) {
+            pthread_mutex_lock(&r[i].lock);
+            r[i].stop = 1;
+            pthread_cond_signal(&r[i].cond);
+            pthread_mutex_unlock(&r[i].lock);
+            pthread_join(r[i].tid, NULL);
+        }
+        pthread_mutex_destroy(&r[i].lock);
+        pthread_cond_destroy(&r[i].cond);
+        for (j = 0; j < 2; ++j) free(r[i].batches[j].data), free(r[i].batches[j].keys);
+        if (r[i].h) bam_hdr_destroy(r[i].h);
+        if (r[i].fp) sam_close(r[i].fp);
+    }
+    free(r);
+}
+
+/*
+ * Whether input a's record goes before input b's. Exhausted inputs go last.
+ */
+static inline int merge_lt(const merge_reader_t *r, int a, int b)
+{
+    if (!r[a].key || !r[b].key) return r[a].key != NULL;
+    return sort_key_lt(*r[a].key, *r[b].key) || (!sort_key_lt(*r[b].key, *r[a].key) && a < b);
+}
+
+/*
+ * Merges sort's n temporary files, written with header h, into write, reading ahead at most max_mem bytes.
+ * :returns: 0 on success, -1 on failure, or 1, having written nothing, if a file's header differs from h,
+ * in which case the files need bam_merge_core2 to translate their records.
+ */
+static int merge_tmp_files(int n, char * const *fn, const bam_hdr_t *h, size_t max_mem, sort_write_f write, void *data)
+{
+    merge_reader_t *readers, *r;
+    int *tree = NULL, *winners = NULL, i, node, w, t, ret = -1;
+    size_t batch_bytes = (max_mem < MERGE_READAHEAD_MEM ? max_mem : MERGE_READAHEAD_MEM) / (2 * (size_t)n);
+    bam1_t view;
+
+    if (batch_bytes < MERGE_MIN_BATCH_BYTES) batch_bytes = MERGE_MIN_BATCH_BYTES;
+    memset(&view, 0, sizeof(view));
+    if ((readers = (merge_reader_t*)calloc(n, sizeof(merge_reader_t))) == NULL) goto mem_fail;
+    for (i = 0; i < n; ++i) {
+        r = readers + i;
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->cond, NULL);
+        r->batch_bytes = batch_bytes;
+    }
+    for (i = 0; i < n; ++i) {
+        r = readers + i;
+        if ((r->fp = sam_open(fn[i], "r")) == NULL) {
+            fprintf(stderr, "[%s] fail to open file %s\n", __func__, fn[i]);
+            goto end;
+        }
+        if ((r->h = sam_hdr_read(r->fp)) == NULL) {
+            fprintf(stderr, "[%s] failed to read header for '%s'\n", __func__, fn[i]);
+            goto end;
+        }
+        if (generic_merge || r->h->n_targets != h->n_targets || r->h->l_text != h->l_text ||
+            memcmp(r->h->text, h->text, h->l_text)) {
+            ret = 1;
+            goto end;
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        r = readers + i;
+        if ((t = pthread_create(&r->tid, NULL, merge_read_worker, r)) != 0) {
+            fprintf(stderr, "[%s] failed to start a reader thread: %s\n", __func__, strerror(t));
+            goto end;
+        }
+        r->running = 1;
+    }
+    for (i = 0; i < n; ++i) {
+        if (merge_reader_next(readers + i) < 0) {
+            fprintf(stderr, "[%s] failed to read first record from %s\n", __func__, fn[i]);
+            goto end;
+        }
+    }
+
+    // Build the tree: leaf i is node n + i, tree[node] holds the loser of the match at node and tree[0] the winner.
+    tree = (int*)malloc(n * sizeof(int));
+    winners = (int*)malloc(2 * n * sizeof(int));
+    if (!tree || !winners) goto mem_fail;
+    for (i = 0; i < n; ++i) winners[n + i] = i;
+    for (node = n - 1; node > 0; --node) {
+        int a = winners[2 * node], b = winners[2 * node + 1];
+        if (merge_lt(readers, b, a)) t = a, a = b, b = t;
+        winners[node] = a, tree[node] = b;
+    }
+    tree[0] = winners[1];
+
+    while (readers[w = tree[0]].key) {
+        r = readers + w;
+        sort_rec_view(&view, r->batches[r->cur].data, r->key);
+        if (write(data, &view) < 0) {
+            fprintf(stderr, "[%s] failed to write to output file.\n", __func__);
+            goto end;
+        }
+        if (merge_reader_next(r) < 0) {
+            fprintf(stderr, "[%s] error: '%s' is truncated.\n", __func__, fn[w]);
+            goto end;
+        }
+        // Replay w's matches on the way up to the root.
+        for (node = (n + w) >> 1; node > 0; node >>= 1)
+            if (merge_lt(readers, tree[node], w)) t = tree[node], tree[node] = w, w = t;
+        tree[0] = w;
+    }
+    ret = 0;
+    goto end;
+
+ mem_fail:
+    fprintf(stderr, "[%s] Out of memory\n", __func__);
+ end:
+    if (readers) merge_readers_destroy(readers, n);
+    free(tree), free(winners);
+    return ret;
+}
+
+/*
+ * Names of sort's n temporary files, prefix.NNNN.bam.
+ */
+static char **tmp_file_names(const char *prefix, int n)
+{
+    char **fns = (char**)calloc(n, sizeof(char*));
+    int i;
+    for (i = 0; i < n; ++i) {
+        fns[i] = (char*)calloc(strlen(prefix) + 20, 1);
+        sprintf(fns[i], "%s.%.4d.bam", prefix, i);
+    }
+    return fns;
+}
+
+static void tmp_file_names_destroy(char **fns, int n, int remove_files)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (remove_files) unlink(fns[i]);
+        free(fns[i]);
+    }
+    free(fns);
+}
+
+#define SORT_KEY "positional_rescue"
+
+/*
+ * Sorts the records read returns into write.
+ * Records are read into one block while the other is sorted and spilled to temporary files by a background
+ * thread, and the files are merged at the end. Input which fits in one block is written without spilling.
+ * :returns: 0 on success, -1 on failure, or 1, having written nothing, if the temporary files need
+ * bam_merge_core2, in which case they are kept and *n_files is set to their number.
+ */
+static int sort_records(sort_read_f read, void *rdata, const bam_hdr_t *header, const char *prefix,
+                        size_t _max_mem, int n_threads, int tmp_codec, sort_write_f write, void *wdata, int *n_files)
+{
+    int ret = -1, i;
+    size_t used, k, j, max_mem, rec_size;
+    bam1_t *b, view;
+    uint8_t *blocks[2] = {NULL, NULL}, *block;
+    sort_key_t *key;
+    htsThreadPool pool = {NULL, 0};
+    spill_t spill;
+
+    k = used = 0;
+    *n_files = 0;
+    // Each of the two blocks gets half the budget.
+    max_mem = (_max_mem / 2) & ~(size_t)7;
+    memset(&spill, 0, sizeof(spill));
+    memset(&view, 0, sizeof(view));
+    // Untouched pages of the blocks are never made resident, so small inputs cost little of them.
+    for (i = 0; i < 2; ++i) {
+        if ((blocks[i] = (uint8_t*)malloc(max_mem)) == NULL) {
+            fprintf(stderr, "[bam_sort_core] failed to allocate a %zu byte sort block: %s\n", max_mem, strerror(errno));
+            goto err;
+        }
+    }
+    block = blocks[0];
+    if (tmp_codec == 0 && n_threads > 1 && (pool.pool = hts_tpool_init(n_threads)) == NULL) {
+        fprintf(stderr, "[bam_sort_core] failed to create a thread pool\n");
         goto err;
     }
-    change_SO(header, SORT_KEY);
-    uint64_t count = 0;
+    spill.max_mem = max_mem, spill.n_threads = n_threads;
+    spill.prefix = prefix, spill.mode = tmp_codec_modes[tmp_codec], spill.h = header;
+    spill.pool = pool.pool ? &pool : NULL;
     // write sub files
     for (;;) {
-        if (k == max_k) {
-            size_t kk, old_max = max_k;
-            max_k = max_k? max_k<<1 : 0x10000;
-            buf = (bam1_t**)realloc(buf, max_k * sizeof(bam1_t*));
-            for (kk = old_max; kk < max_k; ++kk) buf[kk] = NULL;
-        }
-        if (buf[k] == NULL) buf[k] = bam_init1();
-        b = buf[k];
-        if(++count % 1000000 == 0) LOG_INFO("%lu records read.\n", count);
-        if ((ret = sam_read1(fp, header, b)) < 0) break;
-        if (b->l_data < b->m_data>>2) { // shrink
-            b->m_data = b->l_data;
-            kroundup32(b->m_data);
-            b->data = (uint8_t*)realloc(b->data, b->m_data);
-        }
-        mem += sizeof(bam1_t) + b->m_data + sizeof(void*) + sizeof(void*); // two sizeof(void*) for the data allocated to pointer arrays
-        ++k;
-        if (mem >= max_mem) {
-            n_files = sort_blocks(n_files, k, buf, prefix, header, n_threads);
-            if (n_files < 0) {
+        if ((ret = read(rdata, &b)) < 0) break;
+        rec_size = sort_rec_size(b);
+        if (!block_fits(used, k, rec_size, max_mem)) {
+            if (k == 0) {
+                fprintf(stderr, "[bam_sort_core] a %zu byte record does not fit in a %zu byte sort block. Increase -m.\n",
+                        rec_size, max_mem);
                 ret = -1;
                 goto err;
             }
-            mem = k = 0;
+            if (spill_start(&spill, block, k) < 0) {
+                ret = -1;
+                goto err;
+            }
+            block = block == blocks[0] ? blocks[1] : blocks[0];
+            used = k = 0;
         }
+        memcpy(block + used, &b->core, sizeof(bam1_core_t));
+        memcpy(block + used + sizeof(bam1_core_t), b->data, b->l_data);
+        key = (sort_key_t*)(block + max_mem) - ++k;
+        sort_key_set(key, b);
+        key->offset = used, key->l_data = b->l_data;
+        used += rec_size;
     }
     if (ret != -1) {
         fprintf(stderr, "[bam_sort_core] truncated file. Aborting.\n");
@@ -1802,59 +2237,197 @@ int bam_sort_core_ext(int l_cmpkey, const char *fn, const char *prefix,
     }
 
     // write the final output
-    if (n_files == 0) { // a single block
-        ks_mergesort(sort, k, buf, 0);
-        if (write_buffer(fnout, modeout, k, buf, header, n_threads, out_fmt) != 0) {
-            fprintf(stderr, "[bam_sort_core] failed to create \"%s\": %s\n", fnout, strerror(errno));
-            ret = -1;
-            goto err;
+    if (!spill.running && spill.n_files == 0) { // a single block, never spilled
+        key = block_index(block, max_mem, k);
+        radix_sort_keys(k, key, key - k);
+        for (j = 0; j < k; ++j) {
+            sort_rec_view(&view, block, key + j);
+            if (write(wdata, &view) < 0) {
+                fprintf(stderr, "[bam_sort_core] failed to write to output file.\n");
+                ret = -1;
+                goto err;
+            }
         }
     } else { // then merge
         char **fns;
-        n_files = sort_blocks(n_files, k, buf, prefix, header, n_threads);
-        if (n_files == -1) {
+        if (spill_start(&spill, block, k) < 0 || (*n_files = spill_wait(&spill)) < 0) {
             ret = -1;
             goto err;
         }
-        fprintf(stderr, "[bam_sort_core] merging from %d files...\n", n_files);
-        fns = (char**)calloc(n_files, sizeof(char*));
-        for (i = 0; i < n_files; ++i) {
-            fns[i] = (char*)calloc(strlen(prefix) + 20, 1);
-            sprintf(fns[i], "%s.%.4d.bam", prefix, i);
-        }
-        assert(l_cmpkey == g_cmpkey);
-        if (bam_merge_core2(l_cmpkey, fnout, modeout, NULL, n_files, fns,
-                            MERGE_COMBINE_RG|MERGE_COMBINE_PG|MERGE_FIRST_CO,
-                            NULL, n_threads, in_fmt, out_fmt) < 0) {
-            // Propagate bam_merge_core2() failure; it has already emitted a
-            // message explaining the failure, so no further message is needed.
-            goto err;
-        }
-        for (i = 0; i < n_files; ++i) {
-            unlink(fns[i]);
-            free(fns[i]);
-        }
-        free(fns);
+        fprintf(stderr, "[bam_sort_core] merging from %d files...\n", *n_files);
+        // The blocks are done with, so the merge's readahead gets their memory.
+        free(blocks[0]), free(blocks[1]);
+        blocks[0] = blocks[1] = NULL;
+        fns = tmp_file_names(prefix, *n_files);
+        ret = merge_tmp_files(*n_files, fns, header, _max_mem, write, wdata);
+        // Files are kept for bam_merge_core2, or for inspection after a failure.
+        tmp_file_names_destroy(fns, *n_files, ret == 0);
+        if (ret != 0) goto err;
     }
 
     ret = 0;
 
  err:
-    // free
-    for (k = 0; k < max_k; ++k) bam_destroy1(buf[k]);
-    free(buf);
-    bam_hdr_destroy(header);
-    sam_close(fp);
+    if (spill_wait(&spill) < 0) ret = -1;
+    if (pool.pool) hts_tpool_destroy(pool.pool);
+    free(blocks[0]), free(blocks[1]);
     return ret;
 }
 
+/*
+ * Input file for bam_sort_core_ext.
+ */
+typedef struct {
+    samFile *fp;
+    bam_hdr_t *h;
+    bam1_t *b;
+    uint64_t count;
+} sort_in_t;
+
+static int sort_in_read(void *data, bam1_t **b)
+{
+    sort_in_t *in = (sort_in_t*)data;
+    if (++in->count % 1000000 == 0) LOG_INFO("%lu records read.\n", in->count);
+    *b = in->b;
+    return sam_read1(in->fp, in->h, in->b);
+}
+
+/*
+ * Output file for bam_sort_core_ext, created on the first write,
+ * so that nothing has been written to it if the sort falls back to bam_merge_core2.
+ */
+typedef struct {
+    const char *fn, *mode;
+    const htsFormat *fmt;
+    const bam_hdr_t *h;
+    int n_threads;
+    samFile *fp;
+} sort_out_t;
+
+static int sort_out_open(sort_out_t *out)
+{
+    if ((out->fp = sam_open_format(out->fn, out->mode, out->fmt)) == NULL) {
+        fprintf(stderr, "[bam_sort_core] failed to create \"%s\": %s\n", out->fn, strerror(errno));
+        return -1;
+    }
+    if (out->n_threads > 1) hts_set_threads(out->fp, out->n_threads);
+    if (sam_hdr_write(out->fp, out->h) != 0) {
+        fprintf(stderr, "[bam_sort_core] failed to write header.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int sort_out_write(void *data, const bam1_t *b)
+{
+    sort_out_t *out = (sort_out_t*)data;
+    if (out->fp == NULL && sort_out_open(out) < 0) return -1;
+    return sam_write1(out->fp, out->h, b);
+}
+
+/*!
+  @abstract Sort an unsorted BAM file based on the chromosome order
+  and the leftmost position of an alignment
+
+  @param  l_cmpkey whether to sort by query name
+  @param  fn       name of the file to be sorted
+  @param  prefix   prefix of the temporary files (prefix.NNNN.bam are written)
+  @param  fnout    name of the final output file to be written
+  @param  modeout  sam_open() mode to be used to create the final output file
+  @param  max_mem  maximum bytes held by the two sort blocks: their records, index and the sort's scratch space,
+                   and by the merge's readahead
+  @param  tmp_codec  index into tmp_codec_modes of the codec for temporary files
+  @param  in_fmt   input file format options
+  @param  out_fmt  output file format and options
+  @return 0 for successful sorting, negative on errors
+
+  @discussion It may create multiple temporary subalignment files
+  and then merge them with merge_tmp_files(). Records are read
+  into one block while the other is sorted and spilled by a background
+  thread. This function is NOT thread safe.
+ */
+int bam_sort_core_ext(int l_cmpkey, const char *fn, const char *prefix,
+                      const char *fnout, const char *modeout,
+                      size_t max_mem, int n_threads, int tmp_codec,
+                      const htsFormat *in_fmt, const htsFormat *out_fmt)
+{
+    int ret = -1, n_files = 0;
+    sort_in_t in;
+    sort_out_t out;
+
+    if (n_threads < 2) n_threads = 1;
+    g_cmpkey = l_cmpkey;
+    memset(&in, 0, sizeof(in));
+    memset(&out, 0, sizeof(out));
+    in.fp = sam_open_format(fn, "r", in_fmt);
+    if (in.fp == NULL) {
+        const char *message = strerror(errno);
+        fprintf(stderr, "[bam_sort_core] fail to open '%s': %s\n", fn, message);
+        return -2;
+    }
+    in.h = sam_hdr_read(in.fp);
+    if (in.h == NULL) {
+        fprintf(stderr, "[bam_sort_core] failed to read header for '%s'\n", fn);
+        goto err;
+    }
+    change_SO(in.h, SORT_KEY);
+    in.b = bam_init1();
+    out.fn = fnout, out.mode = modeout, out.fmt = out_fmt, out.h = in.h, out.n_threads = n_threads;
+    ret = sort_records(sort_in_read, &in, in.h, prefix, max_mem, n_threads, tmp_codec, sort_out_write, &out, &n_files);
+    if (ret == 1) {
+        char **fns = tmp_file_names(prefix, n_files);
+        assert(l_cmpkey == g_cmpkey);
+        // bam_merge_core2() explains its own failures.
+        ret = bam_merge_core2(l_cmpkey, fnout, modeout, NULL, n_files, fns,
+                              MERGE_COMBINE_RG|MERGE_COMBINE_PG|MERGE_FIRST_CO,
+                              NULL, n_threads, in_fmt, out_fmt);
+        tmp_file_names_destroy(fns, n_files, ret >= 0);
+    } else if (ret == 0 && out.fp == NULL) {
+        ret = sort_out_open(&out); // Empty input still gets a header.
+    }
+
+ err:
+    if (out.fp && sam_close(out.fp) < 0 && ret >= 0) {
+        fprintf(stderr, "[bam_sort_core] error closing output file\n");
+        ret = -1;
+    }
+    if (in.b) bam_destroy1(in.b);
+    if (in.h) bam_hdr_destroy(in.h);
+    sam_close(in.fp);
+    return ret;
+}
+
+/*
+ * Sorts records from another stage of the same process, for bmftools postproc. See bmf_sort.h.
+ * Like bam_sort_core_ext, this is NOT thread safe.
+ */
+int bam_sort_stream(sort_read_f read, void *rdata, const bam_hdr_t *h, const char *prefix,
+                    sort_write_f write, void *wdata, size_t max_mem, int n_threads, int tmp_codec, int se)
+{
+    int ret, n_files;
+    if (n_threads < 2) n_threads = 1;
+    is_se = se;
+    if ((ret = sort_records(read, rdata, h, prefix, max_mem, n_threads, tmp_codec, write, wdata, &n_files)) == 1) {
+        // Only possible if something else rewrote the temporary files.
+        fprintf(stderr, "[bam_sort_stream] temporary files no longer carry the sort's header.\n");
+        tmp_file_names_destroy(tmp_file_names(prefix, n_files), n_files, 1);
+        ret = -1;
+    }
+    return ret;
+}
+
+int bam_sort_set_SO(bam_hdr_t *h)
+{
+    return change_SO(h, SORT_KEY);
+}
+
 // Unused here but may be used by legacy samtools-using third-party code
 int bam_sort_core(int l_cmpkey, const char *fn, const char *prefix, size_t max_mem)
 {
     int ret;
     char *fnout = calloc(strlen(prefix) + 4 + 1, 1);
     sprintf(fnout, "%s.bam", prefix);
-    ret = bam_sort_core_ext(l_cmpkey, fn, prefix, fnout, "wb", max_mem, 0, NULL, NULL);
+    ret = bam_sort_core_ext(l_cmpkey, fn, prefix, fnout, "wb", max_mem, 0, 0, NULL, NULL);
     free(fnout);
     return ret;
 }
@@ -1865,9 +2438,17 @@ static void sort_usage(FILE *fp)
 "Usage: bmftools sort [options...] [in.bam]\n"
 "Options:\n"
 "  -l INT     Set compression level, from 0 (uncompressed) to 9 (best)\n"
-"  -m INT     Set maximum memory per thread; suffix K/M/G recognized [768M]\n"
+"  -m INT     Set maximum memory for in-memory sort blocks, shared by all threads;\n"
+"             one half is filled while the other is sorted and spilled;\n"
+"             also bounds how far temporary files are read ahead when merging;\n"
+"             suffix K/M/G recognized [768M]\n"
 "  -o FILE    Write final output to FILE rather than standard output\n"
 "  -T PREFIX  Write temporary files to PREFIX.nnnn.bam\n"
+"  --tmp-dir DIR\n"
+"             Write temporary files to DIR, named after the last component of -T if given\n"
+"  --tmp-codec bgzf1|bgzf0|raw\n"
+"             Temporary file codec: BGZF at level 1 compressed by the sorting threads,\n"
+"             uncompressed BGZF, or raw BAM records [bgzf1]\n"
 "  -@, --threads INT\n"
 "             Set number of sorting and compression threads [1]\n"
 "   -S        Single-end mode.\n");
@@ -1876,9 +2457,10 @@ static void sort_usage(FILE *fp)
 
 int sort_main(int argc, char *argv[])
 {
-    size_t max_mem = 768<<20; // 512MB
+    size_t max_mem = 768<<20; // 768MB
     int c, nargs, l_cmpkey = 0, ret, o_seen = 0, n_threads = 0, level = -1;
-    char *fnout = "-", modeout[12];
+    char *fnout = "-", modeout[12], *tmpdir = NULL;
+    int tmp_codec = 0;
     kstring_t tmpprefix = { 0, 0, NULL };
     struct stat st;
     sam_global_args ga = SAM_GLOBAL_ARGS_INIT;
@@ -1887,6 +2469,10 @@ int sort_main(int argc, char *argv[])
         SAM_OPT_GLOBAL_OPTIONS('-', 0, 'O', 0, 0),
         { "threads", required_argument, NULL, '@' },
         { "single-end", no_argument, NULL, 'S' },
+        { "tmp-codec", required_argument, NULL, 1 },
+        { "tmp-dir", required_argument, NULL, 2 },
+        // Undocumented: takes the bam_merge_core2 path for temporary files, for testing.
+        { "generic-merge", no_argument, NULL, 3 },
         { NULL, 0, NULL, 0 }
     };
 
@@ -1910,6 +2496,17 @@ int sort_main(int argc, char *argv[])
         case 'T': kputs(optarg, &tmpprefix); break;
         case '@': n_threads = atoi(optarg); break;
         case 'l': level = atoi(optarg); break;
+        case 1:
+            for (tmp_codec = COUNT_OF(tmp_codec_names) - 1; tmp_codec >= 0; --tmp_codec)
+                if (strcmp(optarg, tmp_codec_names[tmp_codec]) == 0) break;
+            if (tmp_codec < 0) {
+                fprintf(stderr, "[bam_sort] unknown temporary file codec '%s'\n", optarg);
+                ret = EXIT_FAILURE;
+                goto sort_end;
+            }
+            break;
+        case 2: tmpdir = optarg; break;
+        case 3: generic_merge = 1; break;
         default:  if (parse_sam_global_opt(c, optarg, lopts, &ga) == 0) break;
                   /* else fall-through */
         case 'h': case '?': sort_usage(stderr); ret = EXIT_FAILURE; goto sort_end;
@@ -1941,6 +2538,22 @@ int sort_main(int argc, char *argv[])
     sam_open_mode(modeout+1, fnout, NULL);
     if (level >= 0) sprintf(strchr(modeout, '\0'), "%d", level < 9? level : 9);
 
+    if (tmpdir) {
+        kstring_t dir = { 0, 0, NULL };
+        if (stat(tmpdir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "[bam_sort] --tmp-dir '%s' is not a directory\n", tmpdir);
+            ret = EXIT_FAILURE;
+            goto sort_end;
+        }
+        kputs(tmpdir, &dir);
+        if (dir.s[dir.l-1] != '/') kputc('/', &dir);
+        if (tmpprefix.l) {
+            const char *base = strrchr(tmpprefix.s, '/');
+            kputs(base ? base + 1 : tmpprefix.s, &dir);
+        }
+        free(tmpprefix.s);
+        tmpprefix = dir; // A bare directory gets a unique name below.
+    }
     if (tmpprefix.l == 0) {
         if (strcmp(fnout, "-") != 0) ksprintf(&tmpprefix, "%s.tmp", fnout);
         else kputc('.', &tmpprefix);
@@ -1952,7 +2565,7 @@ int sort_main(int argc, char *argv[])
     }
 
     ret = bam_sort_core_ext(l_cmpkey, (nargs > 0)? argv[optind] : "-",
-                            tmpprefix.s, fnout, modeout, max_mem, n_threads,
+                            tmpprefix.s, fnout, modeout, max_mem, n_threads, tmp_codec,
                             &ga.in, &ga.out);
     if (ret >= 0)
         ret = EXIT_SUCCESS;
@@ -25,6 +25,28 @@ static inline int bam1_lt_bmf(const bam1_p a, const bam1_p b);
 extern "C" {
 #endif
     int sort_main(int argc, char **argv);
+
+    /*
+     * Record source for bam_sort_stream, returning as sam_read1: >= 0 on success, -1 at the end of input
+     * and < -1 on error. Points *b at the next record, which need only stay valid until the next call.
+     */
+    typedef int (*sort_read_f)(void *data, bam1_t **b);
+    /*
+     * Record sink for bam_sort_stream, called in sorted order. Returns < 0 on error. b is not owned by the sink.
+     */
+    typedef int (*sort_write_f)(void *data, const bam1_t *b);
+    /*
+     * Sorts records from read into write in bmftools sort's order without encoding them,
+     * except to spill to temporary files prefix.NNNN.bam when they do not fit in max_mem.
+     * h must already carry the sort order (see bam_sort_set_SO). se selects single-end keys.
+     * Returns 0 on success and negative on failure.
+     */
+    int bam_sort_stream(sort_read_f read, void *rdata, const bam_hdr_t *h, const char *prefix,
+                        sort_write_f write, void *wdata, size_t max_mem, int n_threads, int tmp_codec, int se);
+    /*
+     * Sets the header's sort order to the one bmftools sort writes and bmftools rsq expects.
+     */
+    int bam_sort_set_SO(bam_hdr_t *h);
 #ifdef __cplusplus
 }
 #endif
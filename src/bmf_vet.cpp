@@ -8,6 +8,7 @@
 #include "dlib/bam_util.h"
 #include "dlib/vcf_util.h"
 #include "include/igamc_cephes.h"
+#include "lib/pvtable.h"
 #include "htslib/tbx.h"
 
 namespace bmf {
@@ -162,7 +163,7 @@ void bmf_var_tests(bcf1_t *vrec, const bam_pileup1_t *plp, int n_plp, vetter_aux
             const int32_t arr_qpos1(dlib::arr_qpos(kh_val(hash, k)));
             const int32_t arr_qpos2(dlib::arr_qpos(&plp[i]));
             if(s == s2) {
-                PV1[arr_qpos1] = agreed_pvalues(PV1[arr_qpos1], PV2[arr_qpos2]);
+                PV1[arr_qpos1] = pv_table().agreed(PV1[arr_qpos1], PV2[arr_qpos2]);
                 FA1[arr_qpos1] = FA1[arr_qpos1] + FA2[arr_qpos2];
             } else if(s == dlib::htseq::HTS_N) {
                 set_base(seq, seq_nt16_str[bam_seqi(seq2, plp[i].qpos)], kh_val(hash, k)->qpos);
@@ -0,0 +1,76 @@
+/*
+ * Checks the barcode kernels at every level the CPU supports against the per-offset memcmp search,
+ * test_hp, and the ipow-weighted bin they replace, including homing sequences near the end of the read,
+ * search windows wider than a vector, and barcodes longer than the vector checks handle.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "lib/barcode.h"
+#include "lib/kfsimd.h"
+
+using namespace bmf;
+
+static int expected_homing(const std::string &seq, const std::string &homing, int start, int last)
+{
+    // The old search ran past the end of the read, where it met kseq's terminating null and then whatever followed.
+    const std::string padded(seq + std::string(last > 0 ? last + homing.size() + 1: 1, '\0'));
+    for(int i(start); i <= last; ++i)
+        if(memcmp(padded.c_str() + i, homing.c_str(), homing.size()) == 0)
+            return i;
+    return -1;
+}
+
+// test_hp, from src/bmf_collapse.h
+static int expected_hp(const char *barcode, int threshold)
+{
+    int run(0);
+    char last('\0');
+    while(*barcode) {
+        if(*barcode == 'N') return 0;
+        if(*barcode == last) {
+            if(++run == threshold) return 0;
+        } else last = *barcode, run = 0;
+        ++barcode;
+    }
+    return 1;
+}
+
+static uint64_t expected_bin(const char *barcode, int n_nucs)
+{
+    uint64_t bin(0);
+    barcode += n_nucs;
+    while(n_nucs--) bin += dlib::ipow(4, n_nucs) * nuc2num_acgt(*--barcode);
+    return bin;
+}
+
+int main(int argc, char **argv)
+{
+    const kf_simd_t levels[] {KF_SCALAR, KF_SSE41, KF_AVX2};
+    srand(16);
+    for(int trial(0); trial < 200000; ++trial) {
+        // Few distinct bases make homing matches and homopolymers common.
+        const char *const alphabet(trial & 1 ? "AC": "ACGTN");
+        const int alen(strlen(alphabet));
+        std::string seq(1 + rand() % 160, 'A'), homing(rand() % 7, 'A'), barcode(1 + rand() % 80, 'A');
+        for(char &c: seq) c = alphabet[rand() % alen];
+        for(char &c: homing) c = alphabet[rand() % alen];
+        for(char &c: barcode) c = alphabet[rand() % (trial & 2 ? 2: alen)];
+        const int start(rand() % (seq.size() + 2)), last(start + rand() % 70 - 5);
+        const int threshold(rand() % 12), n_nucs(1 + rand() % 8 % barcode.size());
+        const int homing_exp(expected_homing(seq, homing, start, last));
+        const int hp_exp(expected_hp(barcode.c_str(), threshold));
+        const uint64_t bin_exp(expected_bin(barcode.c_str(), n_nucs));
+        for(const kf_simd_t level: levels) {
+            if(kf_set_simd(level)) continue;
+            assert(homing_find(seq.data(), seq.size(), homing.data(), homing.size(), start, last) == homing_exp);
+            uint64_t bin;
+            assert(barcode_scan(barcode.data(), barcode.size(), threshold, n_nucs, &bin) == hp_exp);
+            assert(bin == bin_exp);
+        }
+    }
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
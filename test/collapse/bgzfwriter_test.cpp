@@ -0,0 +1,62 @@
+/*
+ * Round-trips records through BgzfWriter, plain and compressed, with and without the write pool,
+ * mixing buffered records with writes larger than a block, and checks that shards concatenate with fq_cat.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "lib/bgzfwriter.h"
+#include "lib/fqcat.h"
+
+using namespace bmf;
+
+static std::string gunzip(const char *path)
+{
+    std::string ret;
+    gzFile fp(gzopen(path, "rb"));
+    char buf[4096];
+    int n;
+    while((n = gzread(fp, buf, sizeof(buf))) > 0) ret.append(buf, n);
+    gzclose(fp);
+    return ret;
+}
+
+static std::string write_records(const char *path, int level, int shard)
+{
+    std::string expected;
+    BgzfWriter writer(path, level, shard == 0); // One pooled shard and one compressed on this thread.
+    for(int i(0); i < 30000; ++i) {
+        if(i % 9973 == 0) {
+            // Larger than a block: bypasses the buffer, so buffered records must be flushed first.
+            const std::string big(3 * BGZF_WRITER_BUFSIZE + i, "ACGT"[i & 3]);
+            writer.write(big.data(), big.size());
+            expected += big;
+        }
+        kstring_t *ks(writer.buf());
+        const size_t start(ks->l);
+        ksprintf(ks, "@shard%i.%i\n%s\n+\n%s\n", shard, i, "ACGTACGTNN" + (i % 10), "IIIIIIII##" + (i % 10));
+        expected.append(ks->s + start, ks->l - start);
+        writer.check();
+    }
+    return expected;
+}
+
+int main(int argc, char **argv)
+{
+    for(int threads(1); threads <= 4; threads += 3) {
+        set_write_threads(threads);
+        for(int level(-1); level <= 6; level += 7) {
+            char *paths[2]{strdup("bgzfwriter_test.0.fq"), strdup("bgzfwriter_test.1.fq")};
+            const std::string expected(write_records(paths[0], level, 0) + write_records(paths[1], level, 1));
+            assert(fq_cat("bgzfwriter_test.out", paths, 2) == 0);
+            assert(gunzip("bgzfwriter_test.out") == expected);
+            for(char *path: paths) remove(path), free(path);
+        }
+        destroy_write_pool();
+    }
+    remove("bgzfwriter_test.out");
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+/*
+ * Checks that lazily promoted families write exactly what fully accumulated families do:
+ * singletons on either strand, duplex pairs of singletons, reads shorter and longer than the family,
+ * Ns, and qualities at and below '#'.
+ * Also checks that merge_neighbors folds reads with a one-substitution barcode error into their family,
+ * writing what the table would have written had those barcodes been read correctly.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "lib/famtable.h"
+
+using namespace bmf;
+
+struct test_rec_t {
+    bc_key_t key;
+    std::string bs, seq, qual;
+    char pass_fail;
+};
+
+static std::vector<test_rec_t> make_records(unsigned n, int readlen, unsigned seed)
+{
+    std::vector<test_rec_t> ret;
+    srand(seed);
+    std::vector<std::string> barcodes(n / 2);
+    for(std::string &bc: barcodes) {
+        bc.resize(12);
+        for(char &c: bc) c = "ACGTN"[rand() % (rand() % 16 ? 4: 5)];
+    }
+    for(unsigned i(0); i < n; ++i) {
+        test_rec_t rec;
+        // Skew towards low indices so that most families are singletons, with a few large ones.
+        const unsigned r(rand() % barcodes.size());
+        const std::string &bc(barcodes[rand() & 1 ? r: r / 16]);
+        rec.bs = std::string(1, "FRZ"[rand() % 3]) + bc;
+        bc_pack(bc.c_str(), &rec.key);
+        const int l(readlen + (rand() % 8 ? 0: rand() % 7 - 3));
+        rec.seq.resize(l > 0 ? l: 1);
+        rec.qual.resize(rec.seq.size());
+        for(char &c: rec.seq) c = "ACGTN"[rand() % (rand() % 16 ? 4: 5)];
+        for(char &c: rec.qual) c = rand() % 8 ? '#' + rand() % 40: '!' + rand() % 3;
+        rec.pass_fail = '0' + (rand() % 4 != 0);
+        ret.push_back(rec);
+    }
+    return ret;
+}
+
+static void add_all(FamilyTable &table, const std::vector<test_rec_t> &recs, int lazy)
+{
+    for(const test_rec_t &rec: recs) {
+        const int is_rev(rec.bs[0] != 'F');
+        if(lazy) {
+            table.add(rec.key, is_rev, rec.seq.data(), rec.qual.data(), rec.seq.size(), rec.pass_fail,
+                      rec.bs.data(), rec.bs.size());
+        } else {
+            pushback_raw(table.get(rec.key, is_rev), rec.seq.data(), rec.qual.data(), rec.seq.size(), rec.pass_fail,
+                         rec.bs.data(), rec.bs.size());
+        }
+    }
+}
+
+static std::string collapse(const std::vector<test_rec_t> &recs, int readlen, int lazy, int stranded, size_t *bytes)
+{
+    FamilyTable table(readlen);
+    tmpbuffers_t bufs;
+    kstring_t ks{0, 0, nullptr};
+    add_all(table, recs, lazy);
+    *bytes = table.bytes();
+    if(stranded) {
+        write_stranded_families(table, &ks, &bufs);
+    } else {
+        // As hash_dmp_core, which ignores strand.
+        for(const uint32_t idx: table.forward_order()) table.write(table.entry(idx).fwd, &ks, &bufs, -1);
+        for(const uint32_t idx: table.reverse_order()) table.write(table.entry(idx).rev, &ks, &bufs, -1);
+    }
+    std::string ret(ks.s ? ks.s: "");
+    free(ks.s);
+    return ret;
+}
+
+static test_rec_t make_read(const std::string &bs, int readlen)
+{
+    test_rec_t rec;
+    rec.bs = bs;
+    bc_pack(bs.c_str() + 1, &rec.key);
+    rec.seq.resize(readlen), rec.qual.resize(readlen);
+    for(char &c: rec.seq) c = "ACGT"[rand() & 3];
+    for(char &c: rec.qual) c = '#' + rand() % 40;
+    rec.pass_fail = '1';
+    return rec;
+}
+
+static std::string write_all(FamilyTable &table)
+{
+    tmpbuffers_t bufs;
+    kstring_t ks{0, 0, nullptr};
+    write_stranded_families(table, &ks, &bufs);
+    std::string ret(ks.s ? ks.s: "");
+    free(ks.s);
+    return ret;
+}
+
+static void check_merging(int readlen)
+{
+    srand(readlen);
+    std::vector<test_rec_t> recs, corrected, errors;
+    uint64_t n_error_families(0);
+    for(int i(0); i < 300; ++i) {
+        std::string bs(1, "FR"[rand() & 1]);
+        for(int j(0); j < 16; ++j) bs += "ACGT"[rand() & 3];
+        for(int j(0); j < 6; ++j) recs.push_back(make_read(bs, readlen));
+        // Up to two erroneous copies, which may share a substitution.
+        std::string last;
+        for(int j(rand() % 3); j--;) {
+            std::string err(bs);
+            const int pos(1 + rand() % 16);
+            err[pos] = "ACGT"[(strchr("ACGT", err[pos]) - "ACGT" + 1 + rand() % 3) & 3];
+            n_error_families += err != last;
+            errors.push_back(make_read(err, readlen));
+            last = err;
+            // As it would have been read without the error.
+            test_rec_t fixed(errors.back());
+            fixed.bs = bs, fixed.key = recs.back().key;
+            corrected.push_back(fixed);
+        }
+    }
+    // Errors follow their families, so first-observation order is the same either way.
+    std::vector<test_rec_t> observed(recs), expected(recs);
+    observed.insert(observed.end(), errors.begin(), errors.end());
+    expected.insert(expected.end(), corrected.begin(), corrected.end());
+    FamilyTable merged(readlen), reference(readlen);
+    add_all(merged, observed, 1);
+    add_all(reference, expected, 1);
+    assert(merged.merge_neighbors() == n_error_families);
+    assert(write_all(merged) == write_all(reference));
+    // Neighbors of 3 and 4 reads are too close in size to be errors of one another.
+    FamilyTable close(readlen);
+    std::vector<test_rec_t> pair;
+    for(int j(0); j < 3; ++j) pair.push_back(make_read("FACGTACGTACGTACGT", readlen));
+    for(int j(0); j < 4; ++j) pair.push_back(make_read("FACGTACGTACGTACGA", readlen));
+    add_all(close, pair, 1);
+    assert(close.merge_neighbors() == 0);
+    // A larger neighbor of another read length is passed over for the next largest.
+    FamilyTable mixed(0);
+    std::vector<test_rec_t> trio{make_read("FACGTACGTACGTACGT", readlen)};
+    for(int j(0); j < 5; ++j) trio.push_back(make_read("FACGTACGTACGTACGA", readlen + 1));
+    for(int j(0); j < 3; ++j) trio.push_back(make_read("FACGTACGTACGTACGC", readlen));
+    add_all(mixed, trio, 1);
+    assert(mixed.merge_neighbors() == 1);
+}
+
+int main(int argc, char **argv)
+{
+    for(int readlen: {1, 100}) check_merging(readlen);
+    for(int readlen: {1, 17, 100, 151}) {
+        const std::vector<test_rec_t> recs(make_records(4000, readlen, readlen));
+        for(int stranded(0); stranded < 2; ++stranded) {
+            size_t full_bytes, lazy_bytes;
+            const std::string expected(collapse(recs, readlen, 0, stranded, &full_bytes));
+            assert(expected.size());
+            assert(collapse(recs, readlen, 1, stranded, &lazy_bytes) == expected);
+            if(readlen >= 100) assert(lazy_bytes * 2 < full_bytes);
+        }
+    }
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+/*
+ * Checks the in-process shard concatenation and interleaving against what cat, zcat and paste produce:
+ * plain and gzipped shards concatenate byte-for-byte, BGZF shards lose only their inner EOF markers,
+ * and interleaving alternates whole records across shards of different sizes and compression.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "lib/fqcat.h"
+
+using namespace bmf;
+
+static const char BGZF_EOF[] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+
+static std::string slurp(const char *path)
+{
+    std::string ret;
+    FILE *fp(fopen(path, "rb"));
+    char buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), fp))) ret.append(buf, n);
+    fclose(fp);
+    return ret;
+}
+
+static std::string gunzip(const char *path)
+{
+    std::string ret;
+    gzFile fp(gzopen(path, "rb"));
+    char buf[4096];
+    int n;
+    while((n = gzread(fp, buf, sizeof(buf))) > 0) ret.append(buf, n);
+    gzclose(fp);
+    return ret;
+}
+
+static std::string make_records(int shard, int mate, int n)
+{
+    std::string ret;
+    char line[256];
+    for(int i(0); i < n; ++i) {
+        // Vary record lengths so that records straddle buffer refills.
+        std::string seq(1 + (i * 37 + shard) % 180, "ACGT"[(i + mate) & 3]);
+        snprintf(line, sizeof(line), "@shard%i.%i FP:i:%i\n", shard, i, mate);
+        ret += line + seq + "\n+\n" + std::string(seq.size(), 'I') + "\n";
+    }
+    return ret;
+}
+
+static void write_shard(const char *path, const std::string &data, int compress, int bgzf_eof)
+{
+    if(compress) {
+        gzFile fp(gzopen(path, "wb1"));
+        gzwrite(fp, data.data(), data.size());
+        gzclose(fp);
+        if(bgzf_eof) {
+            FILE *ofp(fopen(path, "ab"));
+            fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF) - 1, ofp);
+            fclose(ofp);
+        }
+    } else {
+        FILE *fp(fopen(path, "wb"));
+        fwrite(data.data(), 1, data.size(), fp);
+        fclose(fp);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const int n(5), counts[n] {3, 0, 20000, 1, 777};
+    char *r1[n], *r2[n];
+    std::string expected_r1, expected_interleaved;
+    for(int compress(0); compress < 2; ++compress) {
+        expected_r1.clear(), expected_interleaved.clear();
+        std::string raw_r1;
+        for(int i(0); i < n; ++i) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "fqcat_test.%i.R1.fq", i), r1[i] = strdup(buf);
+            snprintf(buf, sizeof(buf), "fqcat_test.%i.R2.fq", i), r2[i] = strdup(buf);
+            const std::string s1(make_records(i, 1, counts[i])), s2(make_records(i, 2, counts[i]));
+            write_shard(r1[i], s1, compress, compress);
+            write_shard(r2[i], s2, compress, 0);
+            expected_r1 += s1;
+            raw_r1 += slurp(r1[i]);
+            // Interleaved, as the paste/pr pipeline produced.
+            for(size_t p1(0), p2(0); p1 < s1.size();) {
+                size_t e1(p1), e2(p2);
+                for(int line(0); line < 4; ++line) e1 = s1.find('\n', e1) + 1, e2 = s2.find('\n', e2) + 1;
+                expected_interleaved += s1.substr(p1, e1 - p1) + s2.substr(p2, e2 - p2);
+                p1 = e1, p2 = e2;
+            }
+        }
+        assert(fq_cat("fqcat_test.out", r1, n) == 0);
+        if(compress) {
+            // Only the final BGZF EOF marker survives.
+            const std::string out(slurp("fqcat_test.out"));
+            assert(out.size() == raw_r1.size() - (n - 1) * (sizeof(BGZF_EOF) - 1));
+            assert(out.compare(out.size() - (sizeof(BGZF_EOF) - 1), std::string::npos, BGZF_EOF, sizeof(BGZF_EOF) - 1) == 0);
+            assert(gunzip("fqcat_test.out") == expected_r1);
+        } else assert(slurp("fqcat_test.out") == expected_r1);
+
+        FILE *fp(fopen("fqcat_test.out", "wb"));
+        fq_interleave(fp, r1, r2, n);
+        fclose(fp);
+        assert(slurp("fqcat_test.out") == expected_interleaved);
+        fp = fopen("fqcat_test.out", "wb");
+        fq_interleave(fp, r1, nullptr, n);
+        fclose(fp);
+        assert(slurp("fqcat_test.out") == expected_r1);
+
+        for(int i(0); i < n; ++i) remove(r1[i]), remove(r2[i]), free(r1[i]), free(r2[i]);
+    }
+    remove("fqcat_test.out");
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
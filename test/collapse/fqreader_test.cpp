@@ -0,0 +1,142 @@
+/*
+ * Writes random fastqs as plain text, gzip, multi-member gzip and BGZF, each several chunks long,
+ * and checks that FqReader returns every record in order with one and several inflate threads,
+ * including records split across chunks, CRLF line endings, blank lines between records,
+ * a missing final newline, and a reader destroyed before the end of its input.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "lib/fqreader.h"
+
+using namespace bmf;
+
+struct test_rec_t {
+    std::string name, comment, seq, qual;
+};
+
+static std::vector<test_rec_t> make_records(size_t n)
+{
+    std::vector<test_rec_t> ret(n);
+    for(size_t i(0); i < n; ++i) {
+        test_rec_t &rec(ret[i]);
+        rec.name = "read" + std::to_string(i);
+        if(rand() & 1) rec.comment = (rand() & 1 ? " ": "\t") + std::string("1:N:0:") + std::to_string(rand());
+        rec.seq.resize(1 + rand() % 250), rec.qual.resize(rec.seq.size());
+        for(char &c: rec.seq) c = "ACGTN"[rand() % 5];
+        for(char &c: rec.qual) c = '!' + rand() % 41;
+    }
+    return ret;
+}
+
+static std::string format(const std::vector<test_rec_t> &recs)
+{
+    std::string ret;
+    for(size_t i(0); i < recs.size(); ++i) {
+        const test_rec_t &rec(recs[i]);
+        const char *const eol(i % 7 == 3 ? "\r\n": "\n");
+        if(i % 101 == 50) ret += "\n";
+        ret += "@" + rec.name + rec.comment + eol + rec.seq + eol + "+" + eol + rec.qual;
+        if(i + 1 < recs.size()) ret += eol; // No final newline
+    }
+    return ret;
+}
+
+static void write_raw(const char *path, const std::string &data)
+{
+    FILE *fp(fopen(path, "wb"));
+    fwrite(data.data(), 1, data.size(), fp);
+    fclose(fp);
+}
+
+static void write_gz(const char *path, const std::string &data, size_t member_size)
+{
+    FILE *fp(fopen(path, "wb"));
+    for(size_t i(0); i < data.size(); i += member_size) {
+        const size_t l(std::min(member_size, data.size() - i));
+        uLongf cl(compressBound(l) + 32);
+        std::vector<Bytef> out(cl);
+        z_stream zs{};
+        deflateInit2(&zs, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+        zs.next_in = (Bytef *)data.data() + i, zs.avail_in = l;
+        zs.next_out = out.data(), zs.avail_out = cl;
+        assert(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+        fwrite(out.data(), 1, zs.total_out, fp);
+        deflateEnd(&zs);
+    }
+    fclose(fp);
+}
+
+static void put_le(std::string &s, uint32_t v, int n)
+{
+    for(int i(0); i < n; ++i) s += (char)(v >> (8 * i));
+}
+
+// BGZF blocks of at most 0xff00 bytes, as bgzip writes them, followed by the EOF block.
+static void write_bgzf(const char *path, const std::string &data)
+{
+    FILE *fp(fopen(path, "wb"));
+    for(size_t i(0);; i += 0xff00) {
+        const size_t l(i < data.size() ? std::min((size_t)0xff00, data.size() - i): 0);
+        std::vector<Bytef> out(compressBound(l) + 32);
+        z_stream zs{};
+        deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        zs.next_in = (Bytef *)data.data() + i, zs.avail_in = l;
+        zs.next_out = out.data(), zs.avail_out = out.size();
+        assert(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+        std::string block("\x1f\x8b\x08\x04\0\0\0\0\0\xff\x06\0BC\x02\0", 16);
+        put_le(block, zs.total_out + 25, 2);
+        block.append((const char *)out.data(), zs.total_out);
+        put_le(block, crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data.data() + i, l), 4);
+        put_le(block, l, 4);
+        assert(bgzf_block_size((const uint8_t *)block.data(), block.size()) == block.size());
+        fwrite(block.data(), 1, block.size(), fp);
+        deflateEnd(&zs);
+        if(!l) break;
+    }
+    fclose(fp);
+}
+
+static void check(const char *path, const std::vector<test_rec_t> &recs, int n_threads)
+{
+    FqReader reader(path, n_threads);
+    size_t i(0);
+    kseq_t seq{};
+    for(fq_batch_t *batch; (batch = reader.next()) != nullptr; delete batch) {
+        assert(batch->size() == FQ_BATCH_RECORDS || i + batch->size() == recs.size());
+        for(size_t j(0); j < batch->size(); ++j, ++i) {
+            batch->view(j, &seq);
+            assert(i < recs.size());
+            assert(recs[i].name == std::string(seq.name.s, seq.name.l) && seq.name.s[seq.name.l] == '\0');
+            assert(recs[i].seq == std::string(seq.seq.s, seq.seq.l) && seq.seq.s[seq.seq.l] == '\0');
+            assert(recs[i].qual == std::string(seq.qual.s, seq.qual.l) && seq.qual.s[seq.qual.l] == '\0');
+        }
+    }
+    assert(i == recs.size());
+    // Stopping early must not hang.
+    FqReader partial(path, n_threads);
+    delete partial.next();
+}
+
+int main(int argc, char **argv)
+{
+    srand(17);
+    const std::vector<test_rec_t> recs(make_records(60000));
+    const std::string data(format(recs));
+    assert(data.size() > 8 * FQ_CHUNK_BYTES);
+    write_raw("fqreader_test.fq", data);
+    write_gz("fqreader_test.fq.gz", data, data.size());
+    write_gz("fqreader_test.mm.fq.gz", data, 100003);
+    write_bgzf("fqreader_test.bgzf.fq.gz", data);
+    for(const char *path: {"fqreader_test.fq", "fqreader_test.fq.gz", "fqreader_test.mm.fq.gz",
+                           "fqreader_test.bgzf.fq.gz"}) {
+        for(int n_threads: {1, 4}) check(path, recs, n_threads);
+        remove(path);
+    }
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
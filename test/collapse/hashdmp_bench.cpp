@@ -0,0 +1,150 @@
+/*
+ * Benchmarks the packed-key family table against the uthash-based family hashing
+ * previously used by stranded_hash_dmp_core, on a scaled-up copy of hashdmp_test.fq.
+ * Both paths read the same fastq, collapse into the same kstring, and must produce identical output.
+ *
+ * Usage: ./hashdmp_bench [scale] [input.fq]
+ */
+#include <chrono>
+#include "lib/hashdmp.h"
+#include "lib/famtable.h"
+#include "lib/mseq.h"
+
+using namespace bmf;
+
+static const char *SCALED_FQ = "hashdmp_bench.fq";
+static double load_seconds; // Time spent building the family table, excluding consensus/output.
+static size_t family_bytes; // Memory held by families once all records are loaded.
+
+static double seconds_since(const std::chrono::steady_clock::time_point &start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Writes scale copies of each input record, rewriting the first 10 bases of each barcode
+ * so that records are spread across ~scale / 4 families per input barcode.
+ */
+static void write_scaled(const char *in, const char *out, int scale)
+{
+    gzFile ifp(gzopen(in, "r"));
+    if(!ifp) LOG_EXIT("Could not open %s. Abort!\n", in);
+    kseq_t *seq(kseq_init(ifp));
+    FILE *ofp(fopen(out, "w"));
+    const int n_fams(scale > 4 ? scale / 4: 1);
+    uint64_t state(137);
+    while(kseq_read(seq) >= 0) {
+        char *bc(seq->comment.s + HASH_DMP_OFFSET + 1);
+        for(int i(0); i < scale; ++i) {
+            state = state * 6364136223846793005uLL + 1442695040888963407uLL;
+            int fam((state >> 33) % n_fams);
+            for(int j(0); j < 10 && bc[j] && bc[j] != '|'; ++j, fam >>= 2) bc[j] = "ACGT"[fam & 3];
+            fprintf(ofp, "@%s %s\n%s\n+\n%s\n", seq->name.s, seq->comment.s, seq->seq.s, seq->qual.s);
+        }
+    }
+    fclose(ofp);
+    kseq_destroy(seq);
+    gzclose(ifp);
+}
+
+static void uthash_collapse(const char *path, kstring_t *ks)
+{
+    gzFile fp(gzopen(path, "r"));
+    kseq_t *seq(kseq_init(fp));
+    const auto start(std::chrono::steady_clock::now());
+    if(kseq_read(seq) < 0) LOG_EXIT("Empty input.\n");
+    char *bs_ptr(barcode_mem_view(seq));
+    const int blen(infer_barcode_length(bs_ptr));
+    const int readlen(seq->seq.l);
+    char key[MAX_BARCODE_LENGTH + 1];
+    tmpbuffers_t bufs;
+    kingfisher_hash_t *hfor(nullptr), *hrev(nullptr), *cur, *next;
+    do {
+        cp_view2buf(seq->comment.s + HASH_DMP_OFFSET + 1, key);
+        kingfisher_hash_t *&hash(seq->comment.s[HASH_DMP_OFFSET] == 'F' ? hfor: hrev);
+        HASH_FIND_STR(hash, key, cur);
+        if(!cur) {
+            cur = (kingfisher_hash_t *)malloc(sizeof(kingfisher_hash_t));
+            cur->value = init_kfp(readlen);
+            family_bytes += sizeof(kingfisher_hash_t) + sizeof(kingfisher_t) +
+                            readlen * 5 * (sizeof(uint32_t) + sizeof(uint16_t) + sizeof(char));
+            strcpy(cur->id, key);
+            HASH_ADD_STR(hash, id, cur);
+        }
+        pushback_kseq(cur->value, seq, blen);
+    } while(kseq_read(seq) >= 0);
+    load_seconds = seconds_since(start);
+    kingfisher_hash_t *crev;
+    HASH_ITER(hh, hfor, cur, next) {
+        HASH_FIND_STR(hrev, cur->id, crev);
+        if(crev) {
+            zstranded_process_write(cur->value, crev->value, ks, &bufs);
+            destroy_kf(crev->value);
+            HASH_DEL(hrev, crev);
+            free(crev);
+        } else dmp_process_write(cur->value, ks, &bufs, 0);
+        destroy_kf(cur->value);
+        HASH_DEL(hfor, cur);
+        free(cur);
+    }
+    HASH_ITER(hh, hrev, cur, next) {
+        dmp_process_write(cur->value, ks, &bufs, 1);
+        destroy_kf(cur->value);
+        HASH_DEL(hrev, cur);
+        free(cur);
+    }
+    kseq_destroy(seq);
+    gzclose(fp);
+}
+
+static void famtable_collapse(const char *path, kstring_t *ks)
+{
+    gzFile fp(gzopen(path, "r"));
+    kseq_t *seq(kseq_init(fp));
+    const auto start(std::chrono::steady_clock::now());
+    if(kseq_read(seq) < 0) LOG_EXIT("Empty input.\n");
+    char *bs_ptr(barcode_mem_view(seq));
+    const int blen(infer_barcode_length(bs_ptr));
+    tmpbuffers_t bufs;
+    FamilyTable table(seq->seq.l);
+    bc_key_t key;
+    do {
+        bc_pack(seq->comment.s + HASH_DMP_OFFSET + 1, &key);
+        table.add(key, seq->comment.s[HASH_DMP_OFFSET] != 'F', seq->seq.s, seq->qual.s, seq->seq.l,
+                  seq->comment.s[FP_OFFSET], seq->comment.s + HASH_DMP_OFFSET, blen);
+    } while(kseq_read(seq) >= 0);
+    load_seconds = seconds_since(start);
+    family_bytes = table.bytes();
+    write_stranded_families(table, ks, &bufs);
+    kseq_destroy(seq);
+    gzclose(fp);
+}
+
+template<typename Func>
+double time_collapse(Func fn, kstring_t *ks)
+{
+    const auto start(std::chrono::steady_clock::now());
+    fn(SCALED_FQ, ks);
+    return seconds_since(start);
+}
+
+int main(int argc, char *argv[])
+{
+    const int scale(argc > 1 ? atoi(argv[1]): 20000);
+    write_scaled(argc > 2 ? argv[2]: "hashdmp_test.fq", SCALED_FQ, scale);
+    kstring_t ks1{0, 0, nullptr}, ks2{0, 0, nullptr};
+    const double ut(time_collapse(uthash_collapse, &ks1));
+    const double ut_load(load_seconds);
+    const size_t ut_bytes(family_bytes);
+    const double ft(time_collapse(famtable_collapse, &ks2));
+    const double ft_load(load_seconds);
+    fprintf(stderr, "#path\tscale\tload_s\ttotal_s\tfamily_bytes\n"
+                    "uthash\t%i\t%0.4f\t%0.4f\t%lu\n"
+                    "famtable\t%i\t%0.4f\t%0.4f\t%lu\n",
+            scale, ut_load, ut, ut_bytes, scale, ft_load, ft, family_bytes);
+    if(ks1.l != ks2.l || memcmp(ks1.s, ks2.s, ks1.l))
+        LOG_EXIT("uthash and family table outputs differ. Abort!\n");
+    free(ks1.s), free(ks2.s);
+    remove(SCALED_FQ);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,37 @@
+import sys
+import subprocess
+import shlex
+import filecmp
+
+BASE_CMD = ("../../%s inmem -sTGACT -t12 -l 10 -v 11 -o inmem_test_tmp -1 %s.R1.fq -2 %s.R2.fq %s "
+            "../marksplit/marksplit_test.R1.fq ../marksplit/marksplit_test.R2.fq")
+
+
+def run(ex, prefix, extra=""):
+    subprocess.check_call(shlex.split(BASE_CMD % (ex, prefix, prefix, extra)))
+    return prefix + ".R1.fq", prefix + ".R2.fq"
+
+
+def records(path):
+    lines = open(path).read().split("\n")
+    return sorted("\n".join(lines[i:i + 4]) for i in range(0, len(lines) - 1, 4))
+
+
+def main():
+    for ex in ["bmftools_db", "bmftools", "bmftools_p"]:
+        whole = run(ex, "inmem_test.whole")
+        # Partitioned, first without spilling and then spilling every partition.
+        mem = run(ex, "inmem_test.mem", "--max-mem 100G")
+        spill = run(ex, "inmem_test.spill", "--max-mem 1")
+        for expected, partitioned, spilled in zip(whole, mem, spill):
+            assert filecmp.cmp(partitioned, spilled, shallow=False), (
+                "%s differs from %s" % (spilled, partitioned))
+            # Partitions are written in barcode prefix order, so only the set of records matches.
+            assert records(expected) == records(spilled), "%s differs from %s" % (spilled, expected)
+        subprocess.check_call(shlex.split("rm -f inmem_test.whole.R1.fq inmem_test.whole.R2.fq "
+                                          "inmem_test.mem.R1.fq inmem_test.mem.R2.fq "
+                                          "inmem_test.spill.R1.fq inmem_test.spill.R2.fq"))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
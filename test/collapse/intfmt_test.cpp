@@ -0,0 +1,54 @@
+/*
+ * Checks kput_u32_array against ksprintf(",%u") at every digit-count boundary and on random values,
+ * for both the uint16_t agreement and uint32_t quality arrays, appending to non-empty kstrings.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "lib/intfmt.h"
+
+using namespace bmf;
+
+template<typename T>
+static void check_array(const std::vector<T> &vals)
+{
+    kstring_t expected{0, 0, nullptr}, ks{0, 0, nullptr};
+    kputs("PV:B:I", &expected), kputs("PV:B:I", &ks);
+    for(const T val: vals) ksprintf(&expected, ",%u", (unsigned)val);
+    assert(kput_u32_array(vals.data(), vals.size(), &ks) == 0);
+    assert(ks.l == expected.l);
+    assert(std::string(ks.s) == std::string(expected.s));
+    free(ks.s), free(expected.s);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint32_t> vals32{0, UINT32_MAX};
+    for(uint64_t p(1); p <= UINT32_MAX; p *= 10) {
+        vals32.push_back(p - 1), vals32.push_back(p);
+        if(p + 1 <= UINT32_MAX) vals32.push_back(p + 1);
+    }
+    check_array(vals32);
+    check_array(std::vector<uint32_t>());
+    srand(14);
+    for(int i(0); i < 100; ++i) {
+        std::vector<uint32_t> quals(rand() % 301);
+        std::vector<uint16_t> agrees(quals.size());
+        // Mostly small values, as in real PV/FA arrays, but cover every width.
+        for(uint32_t &q: quals) q = (uint32_t)rand() >> (rand() % 32);
+        for(uint16_t &a: agrees) a = rand() >> (rand() % 16);
+        check_array(quals);
+        check_array(agrees);
+    }
+    char buf[U32_STR_MAX];
+    for(uint32_t val(0); val < 1000000; ++val) {
+        char expected[U32_STR_MAX + 1];
+        const int n(snprintf(expected, sizeof(expected), "%u", val));
+        assert(u32_to_str(val, buf) == n);
+        assert(std::string(buf, n) == expected);
+    }
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,46 @@
+/*
+ * Checks every column kernel the CPU supports against the scalar kernels and arr_max_u32
+ * on random families, including heavy ties and read lengths which aren't a multiple of the vector width.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "lib/kfsimd.h"
+#include "lib/kingfisher.h"
+
+using namespace bmf;
+
+int main(int argc, char **argv)
+{
+    const kf_simd_t levels[] {KF_SCALAR, KF_SSE41, KF_AVX2};
+    uint64_t state(1337);
+    auto next([&state]() {
+        state = state * 6364136223846793005uLL + 1442695040888963407uLL;
+        return (uint32_t)(state >> 33);
+    });
+    for(int readlen(1); readlen <= 301; readlen += 3) {
+        for(int trial(0); trial < 20; ++trial) {
+            // Small ranges make ties common; large ones exercise the full unsigned range.
+            const uint32_t range(trial & 1 ? 4: 1u << 31);
+            std::vector<uint32_t> sums(readlen * 5);
+            std::vector<uint16_t> counts(readlen * 5);
+            for(auto &s: sums) s = next() % range + (trial & 2 ? 1u << 31: 0);
+            for(auto &c: counts) c = next() % (trial & 1 ? 3: 65536);
+            std::vector<uint8_t> expected_am(readlen), am(readlen);
+            std::vector<uint16_t> expected_agrees(readlen), agrees(readlen);
+            for(int i(0); i < readlen; ++i) expected_am[i] = arr_max_u32(sums.data(), i, readlen);
+            kf_set_simd(KF_SCALAR);
+            const uint64_t expected(kf_agree_cols(counts.data(), expected_am.data(), readlen, expected_agrees.data()));
+            for(const kf_simd_t level: levels) {
+                if(kf_set_simd(level)) continue;
+                kf_argmax_cols(sums.data(), readlen, am.data());
+                assert(am == expected_am);
+                assert(kf_agree_cols(counts.data(), am.data(), readlen, agrees.data()) == expected);
+                assert(agrees == expected_agrees);
+            }
+        }
+    }
+    fprintf(stderr, "[%s] Passed with the best kernel level %i.\n", __func__, (int)kf_get_simd());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+import sys
+import subprocess
+import shlex
+import filecmp
+
+BASE_CMD = ("../../%s collapse inline -n2 -sTGACT -t12 -l 10 -v 11 -o memshard_test_tmp -f %s %s "
+            "../marksplit/marksplit_test.R1.fq ../marksplit/marksplit_test.R2.fq")
+
+
+def run(ex, prefix, extra=""):
+    subprocess.check_call(shlex.split(BASE_CMD % (ex, prefix, extra)))
+    return prefix + ".R1.fq", prefix + ".R2.fq"
+
+
+def interleave(paths, out_path):
+    with open(paths[0]) as f1, open(paths[1]) as f2, open(out_path, "w") as out:
+        while True:
+            rec1 = [f1.readline() for i in range(4)]
+            rec2 = [f2.readline() for i in range(4)]
+            if not rec1[0] or not rec2[0]:
+                return
+            out.write("".join(rec1 + rec2))
+
+
+def main():
+    for ex in ["bmftools_db", "bmftools", "bmftools_p"]:
+        split = run(ex, "memshard_test.split")
+        # In-memory shards, in-memory shards forced to spill every shard to disk,
+        # and split shards in a shard store, stored and compressed.
+        for extra, prefix in [("--in-memory-shards", "memshard_test.mem"),
+                              ("--in-memory-shards --max-mem 1", "memshard_test.spill"),
+                              ("--shard-store", "memshard_test.store"),
+                              ("--shard-store -T1", "memshard_test.store")]:
+            out = run(ex, prefix, extra)
+            for expected, observed in zip(split, out):
+                assert filecmp.cmp(expected, observed, shallow=False), (
+                    "%s differs from %s (%s)" % (observed, expected, extra))
+        # Interleaved input, piped through stdin, collapsed to interleaved stdout.
+        interleave(["../marksplit/marksplit_test.R1.fq", "../marksplit/marksplit_test.R2.fq"],
+                   "memshard_test.interleaved.fq")
+        interleave(split, "memshard_test.split.interleaved.fq")
+        with open("memshard_test.interleaved.fq") as f:
+            streamed = subprocess.check_output(shlex.split(
+                "../../%s collapse inline -n2 -sTGACT -t12 -l 10 -v 11 -o memshard_test_tmp --stream" % ex),
+                stdin=f)
+        with open("memshard_test.split.interleaved.fq", "rb") as f:
+            assert streamed == f.read(), "--stream output differs from interleaved split output"
+        subprocess.check_call(shlex.split("rm -f memshard_test.interleaved.fq memshard_test.split.interleaved.fq"))
+        subprocess.check_call(shlex.split("rm -f memshard_test.split.R1.fq memshard_test.split.R2.fq "
+                                          "memshard_test.mem.R1.fq memshard_test.mem.R2.fq "
+                                          "memshard_test.spill.R1.fq memshard_test.spill.R2.fq "
+                                          "memshard_test.store.R1.fq memshard_test.store.R2.fq"))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,50 @@
+/*
+ * Checks that the p-value lookup tables are bit-identical to the igamc path they replace,
+ * for every tabled family size and phred sum, past the edges of the tables,
+ * and after a round trip through the cache file.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include "lib/pvtable.h"
+
+using namespace bmf;
+
+static void check_all(PvTable &table)
+{
+    for(int fm(1); fm <= PVTABLE_MAX_FM + 8; ++fm)
+        for(uint32_t sum(0); sum <= (uint32_t)fm * PVTABLE_MAX_QUAL + 100; ++sum)
+            assert(table.consensus(fm, sum) == pvalue_to_phred(igamc_pvalues(fm, LOG10_TO_CHI2(sum))));
+    for(uint32_t pv1(0); pv1 <= MAX_PV + 10; ++pv1)
+        for(uint32_t pv2(0); pv2 <= MAX_PV + 10; pv2 += 7)
+            assert(table.agreed(pv1, pv2) == agreed_pvalues(pv1, pv2));
+}
+
+int main(int argc, char **argv)
+{
+    const char *cache_path("pvtable_test.cache");
+    remove(cache_path);
+    {
+        PvTable table;
+        check_all(table);
+        assert(table.use_cache(cache_path) == 1); // Built and written.
+    }
+    {
+        PvTable table;
+        assert(table.use_cache(cache_path) == 0); // Loaded.
+        check_all(table);
+    }
+    // Truncated or corrupted caches must be rebuilt, never used.
+    FILE *fp(fopen(cache_path, "r+b"));
+    fseek(fp, 4096, SEEK_SET);
+    fputc(0xff, fp), fputc(0xff, fp);
+    fclose(fp);
+    {
+        PvTable table;
+        assert(table.use_cache(cache_path) == 1);
+        check_all(table);
+    }
+    remove(cache_path);
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,96 @@
+/*
+ * Writes a rescaler in bmftools err's text format and checks that the compiled table
+ * returns each entry for its cycle, read, quality and base, whether compiled from text or mapped from the cache,
+ * and that the cache is rebuilt when the text changes.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "lib/rescaler.h"
+
+using namespace bmf;
+
+#define TEST_PATH "rescaler_test.txt"
+
+// Expected rescaled phred for a cycle, read, quality - 2, and base.
+static int expected_value(unsigned cycle, int readnum, unsigned qnum, int bnum, int seed)
+{
+    return 2 + (cycle * 7 + readnum * 13 + qnum * 3 + bnum * 5 + seed) % 60;
+}
+
+// As write_final in bmf_err.cpp.
+static void write_text(unsigned readlen, int seed)
+{
+    FILE *fp(fopen(TEST_PATH, "w"));
+    for(unsigned cycle(0); cycle < readlen; ++cycle) {
+        for(int readnum(0); readnum < 2; ++readnum) {
+            for(unsigned qn(0); qn < NQSCORES; ++qn) {
+                fprintf(fp, "%i", expected_value(cycle, readnum, qn, 0, seed));
+                for(int bn(1); bn < 4; ++bn) fprintf(fp, ":%i", expected_value(cycle, readnum, qn, bn, seed));
+                if(qn != NQSCORES - 1) fputc(',', fp);
+            }
+            fputc(readnum ? '\n': '|', fp);
+        }
+    }
+    fclose(fp);
+}
+
+static void check(const Rescaler &rescaler, unsigned readlen, int seed)
+{
+    assert(rescaler.cycles() == readlen);
+    for(unsigned cycle(0); cycle < readlen; ++cycle) {
+        for(int readnum(0); readnum < 2; ++readnum) {
+            for(unsigned qn(0); qn < NQSCORES; ++qn)
+                for(int bn(0); bn < 4; ++bn)
+                    assert(rescaler.rescale(readnum, '#' + qn, cycle, "ACGT"[bn]) ==
+                           expected_value(cycle, readnum, qn, bn, seed) + 33);
+            assert(rescaler.rescale(readnum, 'I', cycle, 'N') == '#');
+            // Qualities outside of the table use its nearest entry.
+            assert(rescaler.rescale(readnum, '!', cycle, 'G') == rescaler.rescale(readnum, '#', cycle, 'G'));
+            assert(rescaler.rescale(readnum, '~', cycle, 'T') ==
+                   rescaler.rescale(readnum, '#' + NQSCORES - 1, cycle, 'T'));
+        }
+    }
+    srand(seed);
+    for(int i(0); i < 100; ++i) {
+        std::string seq(readlen, 'A'), qual(readlen, '#'), out(readlen, 0);
+        for(char &c: seq) c = "ACGTN"[rand() % 5];
+        for(char &c: qual) c = '!' + rand() % 94;
+        const int readnum(rand() & 1);
+        const unsigned start(rand() % readlen);
+        rescaler.apply(seq.data(), qual.data(), start, readlen, readnum, &out[0]);
+        for(unsigned j(start); j < readlen; ++j)
+            assert(out[j - start] == rescaler.rescale(readnum, qual[j], j, seq[j]));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    remove(TEST_PATH ".bin");
+    write_text(150, 0);
+    {
+        Rescaler compiled(TEST_PATH);
+        check(compiled, 150, 0);
+    }
+    assert(access(TEST_PATH ".bin", R_OK) == 0);
+    {
+        Rescaler mapped(TEST_PATH);
+        check(mapped, 150, 0);
+    }
+    // A different rescaler at the same path must not be served from the old cache.
+    write_text(101, 17);
+    {
+        Rescaler rebuilt(TEST_PATH);
+        check(rebuilt, 101, 17);
+    }
+    {
+        Rescaler mapped(TEST_PATH);
+        check(mapped, 101, 17);
+    }
+    remove(TEST_PATH), remove(TEST_PATH ".bin");
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
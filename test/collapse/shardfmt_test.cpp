@@ -0,0 +1,91 @@
+/*
+ * Writes the same records as binary and text shards, plain and compressed,
+ * and checks that ShardReader returns identical records from each, including Ns in reads and barcodes.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "lib/shardfmt.h"
+
+using namespace bmf;
+
+struct test_rec_t {
+    std::string seq, qual, barcode;
+    int pass_fail;
+    char strand;
+};
+
+static std::vector<test_rec_t> make_records(unsigned n)
+{
+    std::vector<test_rec_t> ret;
+    srand(13);
+    for(unsigned i(0); i < n; ++i) {
+        test_rec_t rec;
+        rec.seq.resize(1 + rand() % 150), rec.qual.resize(rec.seq.size()), rec.barcode.resize(1 + rand() % 28);
+        for(char &c: rec.seq) c = "ACGTN"[rand() % (rand() % 8 ? 4: 5)];
+        for(char &c: rec.qual) c = '#' + rand() % 40;
+        for(char &c: rec.barcode) c = "ACGTN"[rand() % (rand() % 8 ? 4: 5)];
+        rec.pass_fail = rand() & 1;
+        rec.strand = "FRZ"[rand() % 3];
+        ret.push_back(rec);
+    }
+    return ret;
+}
+
+static void write_shard(const char *path, const std::vector<test_rec_t> &recs, int text, int level)
+{
+    BgzfWriter writer(path, level);
+    if(!text) shard_write_header(&writer);
+    for(size_t i(0); i < recs.size(); ++i) {
+        const test_rec_t &rec(recs[i]);
+        if(text) {
+            ksprintf(writer.buf(), "@read%lu ~#!#~|FP=%i|BS=%c%s\n%s\n+\n%s\n", i, rec.pass_fail, rec.strand,
+                     rec.barcode.c_str(), rec.seq.c_str(), rec.qual.c_str());
+            writer.check();
+        } else {
+            shard_write(&writer, rec.seq.data(), rec.qual.data(), rec.seq.size(), rec.pass_fail,
+                        rec.barcode.c_str(), rec.strand);
+        }
+    }
+}
+
+static void check_shard(const char *path, const std::vector<test_rec_t> &recs, int binary)
+{
+    ShardReader reader(path);
+    const shard_rec_t &rec(reader.rec);
+    bc_key_t key;
+    for(const test_rec_t &expected: recs) {
+        assert(reader.next());
+        assert(reader.is_binary() == binary);
+        assert(rec.l == expected.seq.size());
+        assert(std::string(rec.seq, rec.l) == expected.seq);
+        assert(std::string(rec.qual, rec.l) == expected.qual);
+        assert(rec.pass_fail == '0' + expected.pass_fail);
+        assert(rec.bs_len == (int)expected.barcode.size() + 1);
+        assert(rec.bs[0] == expected.strand);
+        assert(std::string(rec.bs + 1, rec.bs_len - 1) == expected.barcode);
+        bc_pack(expected.barcode.c_str(), &key);
+        assert(bc_key_eq(rec.key, key));
+    }
+    assert(!reader.next());
+}
+
+int main(int argc, char **argv)
+{
+    const std::vector<test_rec_t> recs(make_records(20000));
+    for(int level(-1); level <= 6; level += 7) {
+        for(int text(0); text < 2; ++text) {
+            write_shard("shardfmt_test.shard", recs, text, level);
+            check_shard("shardfmt_test.shard", recs, !text);
+            // Shards which received no reads.
+            write_shard("shardfmt_test.shard", std::vector<test_rec_t>(), text, level);
+            check_shard("shardfmt_test.shard", std::vector<test_rec_t>(), 1);
+        }
+    }
+    remove("shardfmt_test.shard");
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+/*
+ * Writes interleaved chunks to many more buckets than spill files, stored and compressed,
+ * with and without compression threads, and checks that each bucket reads back exactly as written.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "lib/shardstore.h"
+
+using namespace bmf;
+
+static void check_store(uint32_t n_buckets, int level, int n_threads)
+{
+    std::vector<std::string> expected(n_buckets);
+    ShardStore store("shardstore_test", n_buckets, level, n_threads);
+    srand(13);
+    std::string chunk;
+    for(unsigned i(0); i < 100000; ++i) {
+        // Leave the last bucket empty.
+        const uint32_t bucket(rand() % (n_buckets - 1));
+        chunk.resize(rand() % 300);
+        // Low-entropy text, so that most (but not all) blocks compress.
+        for(char &c: chunk) c = rand() % 16 ? "ACGT"[rand() & 3]: rand() & 0xFF;
+        if(i & 1) store.write(bucket, chunk.data(), chunk.size());
+        else kputsn(chunk.data(), chunk.size(), store.buf(bucket)), store.check(bucket);
+        expected[bucket] += chunk;
+    }
+    store.close();
+    std::string observed;
+    char buf[1000];
+    for(uint32_t bucket(0); bucket < n_buckets; ++bucket) {
+        assert(store.bucket_size(bucket) == expected[bucket].size());
+        ShardStoreReader reader(store, bucket);
+        observed.clear();
+        size_t n;
+        while((n = reader.read(buf, 1 + rand() % sizeof(buf))) > 0) observed.append(buf, n);
+        assert(observed == expected[bucket]);
+    }
+    assert(store.blocks(n_buckets - 1).empty());
+    store.remove_files();
+}
+
+int main(int argc, char **argv)
+{
+    for(int level(-1); level <= 1; level += 2)
+        for(int n_threads(1); n_threads <= 4; n_threads += 3)
+            for(uint32_t n_buckets: {2u, 4096u})
+                check_store(n_buckets, level, n_threads);
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
@@ -6,7 +6,77 @@ except ImportError:
     sys.stderr.write("Could not import pysam. Not running tests.\n")
     sys.exit(0)
 correct_string = "@CCATAATAACGCCAGTAT PV:B:I,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,104,98,78,93,104,98,79,104,79,78,91,93,102,91,78,79,93,93,98,79,104,104,104,93,93,79,79,79,93,93,93,104,104,79,79,98,104,104,104,104,98,102,78,79,79,93,79,93,96,79,91,102,98,93,79,93,93,78,91,91,93,98,78,79,91,91,91,78,79,79,104,98,102,93,93,96,91,93,93,98,79,93,79,91,104,76,76,78,104,79,93,93,79,78,91,78,79,91,78,79,93,102,104,104,102,79,91,91,104,61,65,65,67,67,67,67,67,67,67,67,26\tFA:B:I,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3\tFM:i:3\tFP:i:1\tRV:i:1\tNC:i:0\tNP:i:2\tDR:i:1\nNNNNNNNNNNNNNNNNAGCCTTGTGTTTCTGACAATATATTCTTCAACAGCAGCTAGAAAGTTGGTTCAAACCAACTTTTAATATACAGTAGTTCTTTTCATTTACATTTCAAAATATTTAACAAAGTCAAACTTTC\n+\n################IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIGGIIIIIIIIIIIIIIIIIIIIIIIGGIIIIIIIIA"
+
+
+def check_exhaustive_equivalence():
+    """The rescue index must make exactly the merges of the exhaustive pairwise scan."""
+    for mmlim in (0, 2, 4):
+        outputs = []
+        for flag in ("", "-e"):
+            subprocess.check_call("../../bmftools_db rsq %s -t%i -ftmp.eq.fq rsq_test.bam rsq_test.eq.bam 2>> rsq_test.log" %
+                                  (flag, mmlim), shell=True)
+            outputs.append((subprocess.check_output("samtools view rsq_test.eq.bam", shell=True),
+                            open("tmp.eq.fq", "rb").read()))
+        if outputs[0] != outputs[1]:
+            sys.stderr.write("rsq output differs between indexed and exhaustive search at -t%i. TEST FAILED\n" % mmlim)
+            return 1
+    return 0
+
+
+def make_stacks(path, n_copies):
+    """Writes rsq_test.bam's pairs n_copies times in bmftools sort order, three copies to a stack."""
+    inf = pysam.AlignmentFile("rsq_test.bam", "rb")
+    recs = list(inf)
+    orig = [(rec.query_name, rec.reference_start, rec.next_reference_start) for rec in recs]
+    out = pysam.AlignmentFile(path + ".unsorted.bam", "wb", template=inf)
+    for i in range(n_copies):
+        for rec, (name, start, mate_start) in zip(recs, orig):
+            # The copy number is appended to the barcode, so copies in a stack are one mismatch apart.
+            rec.query_name = name + "ACG"[i % 3] + "ACGT"[i // 3 % 4]
+            rec.reference_start = start + i // 3 * 1000
+            rec.next_reference_start = mate_start + i // 3 * 1000
+            out.write(rec)
+    out.close()
+    inf.close()
+    subprocess.check_call("../../bmftools_db sort -o %s %s.unsorted.bam 2>> rsq_test.log" % (path, path), shell=True)
+
+
+def check_parallel_equivalence():
+    """Parallel rescue must write the same records in the same order as serial rescue,
+    with inputs cut into many batches and with the default batch size."""
+    make_stacks("rsq_test.stacks.bam", 1500)  # 6000 records in 500 stacks.
+    for batch_size in (64, 0):
+        outputs = []
+        for threads in (1, 4):
+            subprocess.check_call("../../bmftools_db rsq -p%i -b%i -ftmp.par.fq rsq_test.stacks.bam rsq_test.par.bam "
+                                  "2>> rsq_test.log" % (threads, batch_size), shell=True)
+            outputs.append((subprocess.check_output("samtools view rsq_test.par.bam", shell=True),
+                            open("tmp.par.fq", "rb").read()))
+        if outputs[0] != outputs[1]:
+            sys.stderr.write("rsq output differs between -p1 and -p4 at -b%i. TEST FAILED\n" % batch_size)
+            return 1
+    return 0
+
+
+def check_postproc_equivalence():
+    """bmftools postproc must write the same records as bmftools mark | bmftools sort | bmftools rsq."""
+    subprocess.check_call("samtools sort -n -o rsq_test.ns.bam rsq_test.bam", shell=True)
+    subprocess.check_call("../../bmftools_db mark rsq_test.ns.bam | ../../bmftools_db sort -o rsq_test.pp.srt.bam - 2>> rsq_test.log",
+                          shell=True)
+    subprocess.check_call("../../bmftools_db rsq -ftmp.pp.fq rsq_test.pp.srt.bam rsq_test.pp.bam 2>> rsq_test.log", shell=True)
+    expected = (subprocess.check_output("samtools view rsq_test.pp.bam", shell=True), open("tmp.pp.fq", "rb").read())
+    for threads in (1, 4):
+        subprocess.check_call("../../bmftools_db postproc -p%i -ftmp.pp.fq rsq_test.ns.bam rsq_test.pp.bam 2>> rsq_test.log" %
+                              threads, shell=True)
+        if (subprocess.check_output("samtools view rsq_test.pp.bam", shell=True), open("tmp.pp.fq", "rb").read()) != expected:
+            sys.stderr.write("postproc -p%i output differs from mark | sort | rsq. TEST FAILED\n" % threads)
+            return 1
+    return 0
+
+
 def main():
+    if check_exhaustive_equivalence() or check_parallel_equivalence() or check_postproc_equivalence():
+        return 1
     subprocess.check_call("../../bmftools_db rsq -ftmp.fq rsq_test.bam rsq_test.out.bam 2> rsq_test.log", shell=True)
     try:
         assert(subprocess.check_output("samtools view -c rsq_test.out.bam", shell=True).strip() == "0")
@@ -0,0 +1,74 @@
+/*
+ * Checks that the rescue index chooses exactly the merges of the exhaustive greedy scan in bmftools rsq,
+ * including names with Ns, merged reads taking the other read's name, and read lengths that disagree.
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "lib/rsqindex.h"
+
+using namespace bmf;
+
+static int hd(const std::string &a, const std::string &b)
+{
+    int ret(0);
+    for(size_t i(0); i < a.size(); ++i) ret += a[i] != b[i];
+    return ret;
+}
+
+/*
+ * Mutates a few random positions of a random family barcode so that families have near neighbours.
+ */
+static std::vector<std::string> make_names(unsigned n, unsigned len, unsigned seed)
+{
+    std::vector<std::string> families, ret;
+    srand(seed);
+    for(unsigned i(0); i < 1 + n / 16; ++i) {
+        std::string s(len, 'A');
+        for(char &c: s) c = "ACGT"[rand() & 3];
+        families.push_back(s);
+    }
+    for(unsigned i(0); i < n; ++i) {
+        std::string s(families[rand() % families.size()]);
+        for(int k(rand() % 5); k--;) s[rand() % len] = "ACGTN"[rand() % 5];
+        ret.push_back(s);
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    for(int mmlim(0); mmlim <= 4; ++mmlim) {
+        for(unsigned len: {8u, 31u, 32u, 33u, 70u}) {
+            const unsigned n(600);
+            std::vector<std::string> names(make_names(n, len, mmlim * 100 + len)), brute(names);
+            std::vector<int> lengths(n);
+            for(unsigned i(0); i < n; ++i) lengths[i] = 100 + (rand() % 8 == 0);
+            std::vector<unsigned> expected(n, n), found(n, n);
+            // Exhaustive forward scan, as in bmftools rsq -e.
+            for(unsigned i(0); i < n; ++i) {
+                for(unsigned j(i + 1); j < n; ++j) {
+                    if(lengths[i] != lengths[j] || hd(brute[i], brute[j]) > mmlim) continue;
+                    expected[i] = j;
+                    if((i + j) & 1) brute[j] = brute[i]; // The merged read keeps one of the two names.
+                    break;
+                }
+            }
+            RescueIndex index(mmlim);
+            index.reset(len);
+            for(const std::string &s: names) index.add(s.c_str());
+            for(unsigned i(0); i < n; ++i) {
+                const unsigned j(index.next_match(i, [&](unsigned j) {return lengths[i] == lengths[j];}));
+                if(j == n) continue;
+                found[i] = j;
+                assert(index.hamming(i, j) == hd(names[i], names[j]));
+                if((i + j) & 1) names[j] = names[i], index.rename(j, names[j].c_str());
+            }
+            assert(found == expected);
+        }
+    }
+    fprintf(stderr, "[%s] Passed.\n", __func__);
+    return EXIT_SUCCESS;
+}
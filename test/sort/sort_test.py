@@ -0,0 +1,58 @@
+import re
+import sys
+import subprocess
+try:
+    import pysam
+except ImportError:
+    sys.stderr.write("Could not import pysam. Not running tests.\n")
+    sys.exit(0)
+
+N_COPIES = 1000  # About 6M of records, so that -m 64K spills hundreds of temporary files.
+
+
+def make_input(path):
+    """Copies rsq_test.bam's records many times over a narrow range of positions, so that many keys tie."""
+    inf = pysam.AlignmentFile("../rsq/rsq_test.bam", "rb")
+    recs = list(inf)
+    out = pysam.AlignmentFile(path, "wb", template=inf)
+    state = 1
+    for i in range(N_COPIES):
+        for j, rec in enumerate(recs):
+            state = (state * 1103515245 + 12345) & 0x7fffffff
+            rec.query_name = "read%i.%i" % (i, j >> 1)
+            rec.reference_start = 1000 + state % 64
+            rec.next_reference_start = 1000 + (state >> 8) % 64
+            out.write(rec)
+    out.close()
+    inf.close()
+
+
+def sort(opts, out):
+    log = subprocess.check_output("../../bmftools_db sort %s -o %s sort_test.bam 2>&1" % (opts, out),
+                                  shell=True).decode()
+    match = re.search(r"merging from (\d+) files", log)
+    return subprocess.check_output("samtools view %s" % out, shell=True), int(match.group(1)) if match else 0
+
+
+def main():
+    make_input("sort_test.bam")
+    expected, n_files = sort("-m 1G", "sort_test.mem.bam")
+    assert n_files == 0
+    # Each temporary file holds at most 32K of records, while readahead batches are 4K,
+    # so every file is read in several batches.
+    for codec in ("bgzf1", "bgzf0", "raw"):
+        for extra in ("", "--generic-merge"):
+            opts = "-m 64K -@ 4 --tmp-codec %s %s -T sort_test.%s" % (codec, extra, codec)
+            output, n_files = sort(opts, "sort_test.spill.bam")
+            if n_files < 64:
+                sys.stderr.write("sort %s spilled %i files, expected at least 64. TEST FAILED\n" % (opts, n_files))
+                return 1
+            if output != expected:
+                sys.stderr.write("sort %s output differs from an in-memory sort. TEST FAILED\n" % opts)
+                return 1
+    subprocess.check_call("rm -f sort_test.bam sort_test.mem.bam sort_test.spill.bam", shell=True)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())